@@ -0,0 +1,298 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// dalibench: checks coalescing of DALI level commands in DaliComm against a DALI bridge, usually dalisim:
+//   dalisim -P 2101 -r 0 &
+//   dalibench -a 127.0.0.1:2101
+// - dapc: bursts of direct arc power commands for two devices, interleaved. Frames superseded before being sent
+//   are not sent at all, so fewer frames than commands go to the bus, but each device must end at the last level.
+// - steps: UP commands are relative, so none of them may be dropped
+// - order: DAPC, another command for the same device, DAPC again. The second DAPC must not be moved before the
+//   command in between, so the device must end at the level of the second DAPC.
+// - dimstop: DAPC, then DAPC with MASK (stop fading, as sent when dimming stops). MASK does not set a level, so it
+//   must not replace the DAPC before it, and the device must end at the level of the last real DAPC.
+// Exits with failure if any device does not have the expected level at the end of a run.
+
+#include "application.hpp"
+
+#include "dalicomm.hpp"
+
+#define DEFAULT_DALIPORT 2101
+#define DEFAULT_NUM_COMMANDS 100
+#define DEFAULT_LOGLEVEL LOG_WARNING
+
+#define STEPS_START_LEVEL 100
+
+using namespace p44;
+
+
+class DaliBench : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  // parameters
+  const char *bridge;
+  int numCommands;
+  DaliAddress firstDevice;
+
+  DaliCommPtr daliComm;
+
+  // current run
+  typedef enum {
+    run_dapc,
+    run_steps,
+    run_order,
+    run_dimstop,
+    run_done
+  } RunType;
+  RunType currentRun;
+  MLMicroSeconds start;
+  long commands;
+  long pending;
+  long sent;
+  long superseded;
+  long failed;
+  bool queueing; ///< set while commands of a run are being queued
+  typedef std::map<DaliAddress, int> LevelMap;
+  LevelMap expectedLevels; ///< level expected at the end of the run, -1 if not known in advance
+  LevelMap actualLevels;
+  bool allOK;
+
+public:
+
+  DaliBench() :
+    bridge(NULL),
+    numCommands(DEFAULT_NUM_COMMANDS),
+    firstDevice(0),
+    queueing(false),
+    allOK(true)
+  {
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [options] -a bridge\n", name);
+    fprintf(stderr, "    -a bridge    : DALI bridge serial port device or proxy host[:port] (default port: %d)\n", DEFAULT_DALIPORT);
+    fprintf(stderr, "    -n commands  : number of level commands per device and run (default: %d)\n", DEFAULT_NUM_COMMANDS);
+    fprintf(stderr, "    -d address   : short address of first of the two devices used (default: 0)\n");
+    fprintf(stderr, "    -l loglevel  : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    int c;
+    while ((c = getopt(argc, argv, "ha:n:d:l:")) != -1)
+    {
+      switch (c) {
+        case 'a':
+          bridge = optarg;
+          break;
+        case 'n':
+          numCommands = atoi(optarg);
+          break;
+        case 'd':
+          firstDevice = atoi(optarg);
+          break;
+        case 'l':
+          loglevel = atoi(optarg);
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    if (!bridge || numCommands<1 || firstDevice>=DALI_MAXDEVICES-1) {
+      usage(argv[0]);
+      exit(1);
+    }
+    SETLOGLEVEL(loglevel);
+    SETERRLEVEL(LOG_ERR, true);
+    daliComm = DaliCommPtr(new DaliComm(MainLoop::currentMainLoop()));
+    daliComm->setConnectionSpecification(bridge, DEFAULT_DALIPORT, Never);
+    // app now ready to run
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    printf("%d level commands per device and run\n", numCommands);
+    printf("%-8s %10s %10s %12s %8s %10s %22s\n", "", "commands", "frames", "superseded", "errors", "mS", "final levels");
+    startRun(run_dapc);
+  }
+
+
+  void startRun(RunType aRun)
+  {
+    currentRun = aRun;
+    start = MainLoop::now();
+    commands = 0;
+    pending = 0;
+    sent = 0;
+    superseded = 0;
+    failed = 0;
+    expectedLevels.clear();
+    actualLevels.clear();
+    queueing = true;
+    DaliAddress a = firstDevice;
+    DaliAddress b = firstDevice+1;
+    switch (currentRun) {
+      case run_dapc:
+        // ramps for two devices, interleaved, queued faster than the bus can send them
+        for (int i=0; i<numCommands; i++) {
+          sendDirectPower(a, rampLevel(i, 1));
+          sendDirectPower(b, rampLevel(i, 3));
+        }
+        expectedLevels[a] = rampLevel(numCommands-1, 1);
+        expectedLevels[b] = rampLevel(numCommands-1, 3);
+        break;
+      case run_steps:
+        sendDirectPower(a, STEPS_START_LEVEL);
+        for (int i=0; i<numCommands; i++) {
+          sendCommand(a, DALICMD_UP);
+        }
+        expectedLevels[a] = -1; // depends on the fade rate of the device, but must be above the start level
+        break;
+      case run_order:
+        for (int i=0; i<numCommands; i++) {
+          sendDirectPower(a, rampLevel(i, 1));
+          sendCommand(a, DALICMD_RECALL_MAX_LEVEL);
+          sendDirectPower(a, rampLevel(i, 3));
+        }
+        expectedLevels[a] = rampLevel(numCommands-1, 3);
+        break;
+      case run_dimstop:
+        for (int i=0; i<numCommands; i++) {
+          sendDirectPower(a, rampLevel(i, 1));
+          sendDirectPower(a, DALIVALUE_MASK);
+        }
+        expectedLevels[a] = rampLevel(numCommands-1, 1);
+        break;
+      default:
+        break;
+    }
+    queueing = false;
+    // Note: commands failing right away (e.g. no connection) might have completed already
+    if (pending==0) queryLevels();
+  }
+
+
+  uint8_t rampLevel(int aIndex, int aSpeed)
+  {
+    // levels 1..253, so RECALL_MAX_LEVEL (254) is distinguishable
+    return (aIndex*aSpeed) % 253 + 1;
+  }
+
+
+  void sendDirectPower(DaliAddress aAddress, uint8_t aLevel)
+  {
+    commands++;
+    pending++;
+    daliComm->daliSendDirectPower(aAddress, aLevel, boost::bind(&DaliBench::commandDone, this, _1));
+  }
+
+
+  void sendCommand(DaliAddress aAddress, uint8_t aCommand)
+  {
+    commands++;
+    pending++;
+    daliComm->daliSendCommand(aAddress, aCommand, boost::bind(&DaliBench::commandDone, this, _1));
+  }
+
+
+  void commandDone(ErrorPtr aError)
+  {
+    if (Error::isOK(aError)) sent++;
+    else if (aError->isError(DaliCommError::domain(), DaliCommErrorSuperseded)) superseded++;
+    else {
+      LOG(LOG_ERR, "DALI command failed: %s\n", aError->description().c_str());
+      failed++;
+    }
+    if (--pending==0 && !queueing) queryLevels();
+  }
+
+
+  void queryLevels()
+  {
+    // all commands done, now check levels
+    queueing = true;
+    for (LevelMap::iterator pos = expectedLevels.begin(); pos!=expectedLevels.end(); ++pos) {
+      pending++;
+      daliComm->daliSendQuery(pos->first, DALICMD_QUERY_ACTUAL_LEVEL, boost::bind(&DaliBench::levelQueried, this, pos->first, _1, _2, _3));
+    }
+    queueing = false;
+    if (pending==0) runDone();
+  }
+
+
+  void levelQueried(DaliAddress aAddress, bool aNoOrTimeout, uint8_t aResponse, ErrorPtr aError)
+  {
+    actualLevels[aAddress] = Error::isOK(aError) && !aNoOrTimeout ? aResponse : -1;
+    if (--pending==0 && !queueing) runDone();
+  }
+
+
+  void runDone()
+  {
+    report();
+    if (currentRun+1==run_done) {
+      terminateApp(allOK ? EXIT_SUCCESS : EXIT_FAILURE);
+      return;
+    }
+    startRun((RunType)(currentRun+1));
+  }
+
+
+  void report()
+  {
+    static const char *runNames[] = { "dapc", "steps", "order", "dimstop" };
+    bool ok = failed==0;
+    if (currentRun==run_steps && superseded>0) ok = false; // relative commands must all be sent
+    string levels;
+    for (LevelMap::iterator pos = expectedLevels.begin(); pos!=expectedLevels.end(); ++pos) {
+      int actual = actualLevels[pos->first];
+      if (actual<0 || (pos->second>=0 ? actual!=pos->second : actual<=STEPS_START_LEVEL)) ok = false;
+      if (pos->second>=0) string_format_append(levels, " %d:%d/%d", pos->first, actual, pos->second);
+      else string_format_append(levels, " %d:%d", pos->first, actual);
+    }
+    printf(
+      "%-8s %10ld %10ld %12ld %8ld %10.1f %22s %s\n", runNames[currentRun],
+      commands, sent, superseded, failed, (double)(MainLoop::now()-start)/MilliSecond, levels.c_str(),
+      ok ? "OK" : "FAILED"
+    );
+    fflush(stdout);
+    if (!ok) allOK = false;
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create app with current mainloop
+  static DaliBench application;
+  // pass control
+  return application.main(argc, argv);
+}
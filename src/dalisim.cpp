@@ -0,0 +1,801 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// dalisim: software emulation of a plan44 DALI bridge with a simulated DALI bus
+//
+// Serves the DALI bridge protocol (as used by DaliComm) on a pseudo terminal and/or a TCP port,
+// so vdcd can be run with --dali /dev/pts/N or --dali localhost:port without any DALI hardware.
+// The bus is populated with a configurable number of ballasts (control gear), which implement
+// short/group/broadcast addressing, scenes, groups, DTR based configuration ("send twice" commands),
+// memory banks 0 and 1 (device info) and the random address search used for bus addressing.
+// Bus timing is modelled after DALI frame lengths (1200 baud), and can be accelerated or disabled.
+
+#include "application.hpp"
+
+#include "socketcomm.hpp"
+
+#include "dalidefs.h"
+
+#include <termios.h>
+
+#define DEFAULT_NUM_BALLASTS 16
+#define DEFAULT_REPORT_INTERVAL 10 // seconds
+#define MAINLOOP_CYCLE_TIME_uS 1000 // 1mS, to be able to model DALI frame timing
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+
+// DALI bridge protocol (see dalicomm.cpp)
+#define CMD_CODE_RESET 0
+#define CMD_CODE_SEND16 0x10
+#define CMD_CODE_2SEND16 0x11
+#define CMD_CODE_SEND16_REC8 0x12
+#define CMD_CODE_ECHO_DATA1 0x41
+#define CMD_CODE_ECHO_DATA2 0x42
+#define CMD_CODE_OVLRESET 0x43
+#define CMD_CODE_EDGEADJ 0x44
+
+#define RESP_CODE_ACK 0x2A
+#define RESP_CODE_DATA 0x3D
+
+#define ACK_OK 0x30
+#define ACK_TIMEOUT 0x31
+#define ACK_FRAME_ERR 0x32
+#define ACK_INVALIDCMD 0x39
+
+// DALI timing
+#define DALI_TE 417 // half bit time in uS (1200 baud)
+#define DALI_FORWARD_FRAME (38*DALI_TE) // start bit, 16 data bits, 2 stop bits
+#define DALI_BACKWARD_FRAME (22*DALI_TE) // start bit, 8 data bits, 2 stop bits
+#define DALI_BACKWARD_SETTLING (10*DALI_TE) // time between forward and backward frame (7..22 Te)
+#define DALI_NO_ANSWER_WAIT (22*DALI_TE) // max settling time, after that, there is no answer
+#define DALI_FORWARD_SETTLING (22*DALI_TE) // min time between frames
+#define DALI_DOUBLE_SEND_GAP (10*MilliSecond) // gap between the two frames of a CMD_CODE_2SEND16
+#define DALI_SEND_TWICE_WINDOW (100*MilliSecond) // configuration commands must be repeated within this time
+
+#define DALISIM_NO_ADDRESS 0xFF
+#define MASK 0xFF
+
+using namespace p44;
+
+
+#pragma mark - simulated ballast
+
+class SimBallast
+{
+public:
+  int index;
+  uint8_t shortAddress; ///< 0..63 or DALISIM_NO_ADDRESS
+  uint32_t randomAddress; ///< 24 bit
+  uint16_t groups; ///< group membership bits
+  uint8_t sceneLevels[DALI_MAXSCENES]; ///< MASK = not part of scene
+  uint8_t actualLevel;
+  uint8_t maxLevel;
+  uint8_t minLevel;
+  uint8_t physMinLevel;
+  uint8_t powerOnLevel;
+  uint8_t failureLevel;
+  uint8_t fadeTime;
+  uint8_t fadeRate;
+  uint8_t dtr, dtr1, dtr2;
+  bool resetState;
+  bool writeEnabled;
+  bool initialised; ///< in initialisation state (random address search)
+  bool withdrawn; ///< withdrawn from compare in initialisation state
+  uint8_t bank0[DALIMEM_BANK0_MINBYTES];
+  uint8_t bank1[DALIMEM_BANK1_MINBYTES];
+
+  SimBallast(int aIndex, uint8_t aShortAddress, uint64_t aGtin) :
+    index(aIndex),
+    shortAddress(aShortAddress),
+    groups(0),
+    initialised(false),
+    withdrawn(false)
+  {
+    newRandomAddress();
+    reset();
+    // bank 0: GTIN, firmware version, serial number
+    memset(bank0, 0, sizeof(bank0));
+    bank0[0x00] = DALIMEM_BANK0_MINBYTES-1; // last accessible memory location
+    bank0[0x02] = 1; // last accessible memory bank
+    for (int i=0; i<6; i++) bank0[0x03+i] = (aGtin>>(8*(5-i))) & 0xFF;
+    bank0[0x09] = 1; // firmware major
+    bank0[0x0A] = 0; // firmware minor
+    uint32_t serial = aIndex+1;
+    for (int i=0; i<4; i++) bank0[0x0B+i] = (serial>>(8*(3-i))) & 0xFF;
+    updateChecksum(bank0, sizeof(bank0));
+    // bank 1: OEM data, writable (when unlocked)
+    memset(bank1, 0, sizeof(bank1));
+    bank1[0x00] = DALIMEM_BANK1_MINBYTES-1;
+    updateChecksum(bank1, sizeof(bank1));
+  }
+
+  void newRandomAddress()
+  {
+    randomAddress = ((uint32_t)rand() ^ ((uint32_t)rand()<<12)) & 0xFFFFFF;
+  }
+
+  /// set to reset state (DALI RESET command)
+  void reset()
+  {
+    for (int i=0; i<DALI_MAXSCENES; i++) sceneLevels[i] = MASK;
+    groups = 0;
+    actualLevel = 254;
+    maxLevel = 254;
+    physMinLevel = 1;
+    minLevel = physMinLevel;
+    powerOnLevel = 254;
+    failureLevel = 254;
+    fadeTime = 0;
+    fadeRate = 7;
+    dtr = 0;
+    dtr1 = 0;
+    dtr2 = 0;
+    resetState = true;
+    writeEnabled = false;
+    randomAddress = 0xFFFFFF;
+  }
+
+  static void updateChecksum(uint8_t *aBank, size_t aSize)
+  {
+    // byte 1 is checksum, sum of bytes 1..end must be zero
+    uint8_t sum = 0;
+    for (size_t i=2; i<aSize; i++) sum += aBank[i];
+    aBank[1] = (uint8_t)(0x100-sum);
+  }
+
+  /// @return true if ballast is addressed by given DALI address byte (short, group or broadcast)
+  bool isAddressedBy(uint8_t aDali1)
+  {
+    if ((aDali1 & 0xFE)==0xFE) return true; // broadcast
+    if ((aDali1 & 0x80)==0) return shortAddress==((aDali1>>1) & 0x3F); // short address
+    if ((aDali1 & 0xE0)==0x80) return (groups & (1<<((aDali1>>1) & 0x0F)))!=0; // group
+    return false;
+  }
+
+  void setLevel(uint8_t aLevel)
+  {
+    if (aLevel==MASK) return; // no change
+    if (aLevel==0) actualLevel = 0;
+    else if (aLevel<minLevel) actualLevel = minLevel;
+    else if (aLevel>maxLevel) actualLevel = maxLevel;
+    else actualLevel = aLevel;
+    resetState = false;
+  }
+
+  /// execute a standard command (selector bit set)
+  /// @param aCommand the DALI command (second byte)
+  /// @param aConfirmed set if the command was received twice within DALI_SEND_TWICE_WINDOW
+  /// @param aAnswer will be set to the answer (if any)
+  /// @return true if the ballast answers
+  bool command(uint8_t aCommand, bool aConfirmed, uint8_t &aAnswer)
+  {
+    if (aCommand>=DALICMD_RESET && aCommand<=DALICMD_ENABLE_WRITE_MEMORY && !aConfirmed) {
+      // configuration commands need to be sent twice
+      return false;
+    }
+    aAnswer = DALIANSWER_YES;
+    switch (aCommand) {
+      case DALICMD_OFF: actualLevel = 0; return false;
+      case DALICMD_UP: if (actualLevel>0) setLevel(actualLevel+10>maxLevel ? maxLevel : actualLevel+10); return false;
+      case DALICMD_DOWN: if (actualLevel>0) setLevel(actualLevel<minLevel+10 ? minLevel : actualLevel-10); return false;
+      case DALICMD_STEP_UP: if (actualLevel>0 && actualLevel<maxLevel) actualLevel++; return false;
+      case DALICMD_STEP_DOWN: if (actualLevel>minLevel) actualLevel--; return false;
+      case DALICMD_RECALL_MAX_LEVEL: setLevel(maxLevel); return false;
+      case DALICMD_RECALL_MIN_LEVEL: setLevel(minLevel); return false;
+      case DALICMD_STEP_DOWN_AND_OFF: if (actualLevel<=minLevel) actualLevel = 0; else actualLevel--; return false;
+      case 0x08: /* ON_AND_STEP_UP */ if (actualLevel==0) setLevel(minLevel); else if (actualLevel<maxLevel) actualLevel++; return false;
+      case DALICMD_RESET: reset(); return false;
+      case DALICMD_STORE_ACTUAL_LEVEL_IN_DTR: dtr = actualLevel; return false;
+      case DALICMD_STORE_DTR_AS_MAX_LEVEL: maxLevel = dtr; return false;
+      case DALICMD_STORE_DTR_AS_MIN_LEVEL: minLevel = dtr<physMinLevel ? physMinLevel : dtr; return false;
+      case DALICMD_STORE_DTR_AS_FAILURE_LEVEL: failureLevel = dtr; return false;
+      case DALICMD_STORE_DTR_AS_POWER_ON_LEVEL: powerOnLevel = dtr; return false;
+      case DALICMD_STORE_DTR_AS_FADE_TIME: fadeTime = dtr>15 ? 15 : dtr; return false;
+      case DALICMD_STORE_DTR_AS_FADE_RATE: fadeRate = dtr>15 ? 15 : (dtr<1 ? 1 : dtr); return false;
+      case DALICMD_STORE_DTR_AS_SHORT_ADDRESS: shortAddress = dtr==0xFF ? DALISIM_NO_ADDRESS : (dtr>>1) & 0x3F; return false;
+      case DALICMD_ENABLE_WRITE_MEMORY: writeEnabled = true; return false;
+      // queries
+      case DALICMD_QUERY_STATUS:
+        aAnswer =
+          (actualLevel>0 ? 0x04 : 0) |
+          (resetState ? 0x20 : 0) |
+          (shortAddress==DALISIM_NO_ADDRESS ? 0x40 : 0);
+        return true;
+      case DALICMD_QUERY_CONTROL_GEAR: return true;
+      case DALICMD_QUERY_LAMP_FAILURE: return false;
+      case DALICMD_QUERY_LAMP_POWER_ON: return actualLevel>0;
+      case DALICMD_QUERY_LIMIT_ERROR: return false;
+      case DALICMD_QUERY_RESET_STATE: return resetState;
+      case DALICMD_QUERY_MISSING_SHORT_ADDRESS: return shortAddress==DALISIM_NO_ADDRESS;
+      case DALICMD_QUERY_VERSION_NUMBER: aAnswer = 1; return true;
+      case DALICMD_QUERY_CONTENT_DTR: aAnswer = dtr; return true;
+      case DALICMD_QUERY_DEVICE_TYPE: aAnswer = 6; return true; // LED module
+      case DALICMD_QUERY_PHYSICAL_MINIMUM_LEVEL: aAnswer = physMinLevel; return true;
+      case DALICMD_QUERY_POWER_FAILURE: return false;
+      case DALICMD_QUERY_CONTENT_DTR1: aAnswer = dtr1; return true;
+      case DALICMD_QUERY_CONTENT_DTR2: aAnswer = dtr2; return true;
+      case DALICMD_QUERY_ACTUAL_LEVEL: aAnswer = actualLevel; return true;
+      case DALICMD_QUERY_MAX_LEVEL: aAnswer = maxLevel; return true;
+      case DALICMD_QUERY_MIN_LEVEL: aAnswer = minLevel; return true;
+      case DALICMD_QUERY_POWER_ON_LEVEL: aAnswer = powerOnLevel; return true;
+      case DALICMD_QUERY_FAILURE_LEVEL: aAnswer = failureLevel; return true;
+      case DALICMD_QUERY_FADE_PARAMS: aAnswer = (fadeTime<<4) | fadeRate; return true;
+      case DALICMD_QUERY_GROUPS_0_TO_7: aAnswer = groups & 0xFF; return true;
+      case DALICMD_QUERY_GROUPS_8_TO_15: aAnswer = (groups>>8) & 0xFF; return true;
+      case DALICMD_QUERY_RANDOM_ADDRESS_H: aAnswer = (randomAddress>>16) & 0xFF; return true;
+      case DALICMD_QUERY_RANDOM_ADDRESS_M: aAnswer = (randomAddress>>8) & 0xFF; return true;
+      case DALICMD_QUERY_RANDOM_ADDRESS_L: aAnswer = randomAddress & 0xFF; return true;
+      case DALICMD_READ_MEMORY_LOCATION: {
+        uint8_t *bank = NULL;
+        size_t bankSize = 0;
+        if (dtr1==0) { bank = bank0; bankSize = sizeof(bank0); }
+        else if (dtr1==1) { bank = bank1; bankSize = sizeof(bank1); }
+        if (!bank || dtr>=bankSize) return false; // no such location, no answer
+        aAnswer = bank[dtr];
+        if (dtr<0xFF) dtr++;
+        return true;
+      }
+      default:
+        break;
+    }
+    if ((aCommand & 0xF0)==DALICMD_GO_TO_SCENE) {
+      setLevel(sceneLevels[aCommand & 0x0F]);
+      return false;
+    }
+    if ((aCommand & 0xF0)==DALICMD_STORE_DTR_AS_SCENE) {
+      sceneLevels[aCommand & 0x0F] = dtr;
+      return false;
+    }
+    if ((aCommand & 0xF0)==DALICMD_REMOVE_FROM_SCENE) {
+      sceneLevels[aCommand & 0x0F] = MASK;
+      return false;
+    }
+    if ((aCommand & 0xF0)==DALICMD_ADD_TO_GROUP) {
+      groups |= (1<<(aCommand & 0x0F));
+      return false;
+    }
+    if ((aCommand & 0xF0)==DALICMD_REMOVE_FROM_GROUP) {
+      groups &= ~(1<<(aCommand & 0x0F));
+      return false;
+    }
+    if ((aCommand & 0xF0)==DALICMD_QUERY_SCENE_LEVEL) {
+      aAnswer = sceneLevels[aCommand & 0x0F];
+      return true;
+    }
+    // unknown or unsupported command: no reaction
+    return false;
+  }
+
+};
+
+
+
+#pragma mark - simulated bus and bridge
+
+/// a bridge command waiting to be executed on the bus
+typedef struct {
+  FdCommPtr connection; ///< where the answer must be sent to
+  uint8_t cmd;
+  uint8_t dali1;
+  uint8_t dali2;
+} BridgeCommand;
+
+
+class DaliSim : public Application
+{
+  typedef vector<SimBallast *> BallastVector;
+  BallastVector ballasts;
+
+  // bus state
+  uint32_t searchAddress;
+  uint16_t lastFrame; ///< last forward frame, for detecting repeated configuration commands
+  MLMicroSeconds lastFrameTime;
+
+  // bridge state
+  typedef list<BridgeCommand> CommandList;
+  CommandList commands;
+  bool busBusy;
+  double speedFactor; ///< 1=real time, >1 accelerated, 0=no delays at all
+
+  // connections
+  FdCommPtr ptyComm;
+  int ptySlaveFd;
+  SocketCommPtr tcpServer;
+  typedef map<FdComm *, string> InputMap;
+  InputMap inputBuffers; ///< partial commands, per connection
+
+  // statistics
+  MLMicroSeconds reportInterval;
+  MLMicroSeconds statsStart;
+  long bridgeCommands;
+  long forwardFrames;
+  long backwardFrames;
+  long noAnswers;
+  long collisions;
+  MLMicroSeconds busOccupied;
+
+public:
+
+  DaliSim() :
+    searchAddress(0xFFFFFF),
+    lastFrame(0),
+    lastFrameTime(Never),
+    busBusy(false),
+    speedFactor(1),
+    ptySlaveFd(-1),
+    reportInterval(DEFAULT_REPORT_INTERVAL*Second)
+  {
+    resetStats();
+  }
+
+
+  virtual ~DaliSim()
+  {
+    for (BallastVector::iterator pos = ballasts.begin(); pos!=ballasts.end(); ++pos) {
+      delete *pos;
+    }
+    if (ptySlaveFd>=0) close(ptySlaveFd);
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [options]\n", name);
+    fprintf(stderr, "    -t              : serve bridge protocol on a pseudo terminal (name is printed at startup)\n");
+    fprintf(stderr, "    -P port         : serve bridge protocol on TCP port\n");
+    fprintf(stderr, "    -N              : allow TCP connections from non-local clients\n");
+    fprintf(stderr, "    -n ballasts     : number of simulated ballasts (default=%d, max=%d)\n", DEFAULT_NUM_BALLASTS, DALI_MAXDEVICES);
+    fprintf(stderr, "    -u unaddressed  : number of ballasts without short address (default=0)\n");
+    fprintf(stderr, "    -d duplicates   : number of ballasts sharing a short address with another one (default=0)\n");
+    fprintf(stderr, "    -x factor       : speed up DALI bus timing by factor, 0=no delays (default=1=real time)\n");
+    fprintf(stderr, "    -r seconds      : statistics report interval, 0=none (default=%d)\n", DEFAULT_REPORT_INTERVAL);
+    fprintf(stderr, "    -s seed         : seed for random addresses (default=1)\n");
+    fprintf(stderr, "    -l loglevel     : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    bool usePty = false;
+    const char *tcpPort = NULL;
+    bool nonLocal = false;
+    int numBallasts = DEFAULT_NUM_BALLASTS;
+    int numUnaddressed = 0;
+    int numDuplicates = 0;
+    unsigned int seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "htP:Nn:u:d:x:r:s:l:")) != -1)
+    {
+      switch (c) {
+        case 't': usePty = true; break;
+        case 'P': tcpPort = optarg; break;
+        case 'N': nonLocal = true; break;
+        case 'n': numBallasts = atoi(optarg); break;
+        case 'u': numUnaddressed = atoi(optarg); break;
+        case 'd': numDuplicates = atoi(optarg); break;
+        case 'x': speedFactor = atof(optarg); break;
+        case 'r': reportInterval = atof(optarg)*Second; break;
+        case 's': seed = atoi(optarg); break;
+        case 'l': loglevel = atoi(optarg); break;
+        case 'h':
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    if (!usePty && !tcpPort) {
+      usage(argv[0]);
+      exit(1);
+    }
+    if (numBallasts<0 || numBallasts>DALI_MAXDEVICES) numBallasts = DALI_MAXDEVICES;
+
+    SETLOGLEVEL(loglevel);
+
+    // create the ballasts
+    srand(seed);
+    for (int i=0; i<numBallasts; i++) {
+      uint8_t sa = i;
+      if (i>=numBallasts-numUnaddressed) sa = DALISIM_NO_ADDRESS;
+      else if (i>=numBallasts-numUnaddressed-numDuplicates && i>0) sa = (i-1) % (numBallasts-numUnaddressed-numDuplicates>0 ? numBallasts-numUnaddressed-numDuplicates : 1);
+      SimBallast *b = new SimBallast(i, sa, 0x0000123456789ALL);
+      b->resetState = false;
+      b->actualLevel = 0;
+      b->newRandomAddress();
+      ballasts.push_back(b);
+    }
+    printf("Simulating %d DALI ballasts (%d unaddressed, %d duplicate short addresses)\n", numBallasts, numUnaddressed, numDuplicates);
+
+    // pseudo terminal
+    if (usePty) {
+      ErrorPtr err = openPty();
+      if (!Error::isOK(err)) {
+        fprintf(stderr, "Cannot open pseudo terminal: %s\n", err->description().c_str());
+        exit(1);
+      }
+    }
+    // TCP server
+    if (tcpPort) {
+      tcpServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+      tcpServer->setConnectionParams(NULL, tcpPort, SOCK_STREAM, AF_INET);
+      tcpServer->setAllowNonlocalConnections(nonLocal);
+      tcpServer->startServer(boost::bind(&DaliSim::tcpConnectionHandler, this, _1), 3);
+      printf("DALI bridge listening on TCP port %s\n", tcpPort);
+    }
+    // statistics
+    if (reportInterval>0) {
+      MainLoop::currentMainLoop().executeOnce(boost::bind(&DaliSim::report, this), reportInterval);
+    }
+    // app now ready to run
+    return run();
+  }
+
+
+  #pragma mark - connections
+
+  ErrorPtr openPty()
+  {
+    int masterFd = posix_openpt(O_RDWR|O_NOCTTY);
+    if (masterFd<0 || grantpt(masterFd)<0 || unlockpt(masterFd)<0) {
+      return SysError::errNo("posix_openpt: ");
+    }
+    const char *slaveName = ptsname(masterFd);
+    // keep the slave side open ourselves, so the master does not see a hangup when vdcd closes the port
+    ptySlaveFd = open(slaveName, O_RDWR|O_NOCTTY);
+    if (ptySlaveFd<0) {
+      return SysError::errNo("open pty slave: ");
+    }
+    // raw mode, no echo
+    struct termios tio;
+    tcgetattr(ptySlaveFd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(ptySlaveFd, TCSANOW, &tio);
+    ptyComm = FdCommPtr(new FdComm(MainLoop::currentMainLoop()));
+    ptyComm->setReceiveHandler(boost::bind(&DaliSim::dataReceived, this, ptyComm.get(), _1));
+    ptyComm->setFd(masterFd);
+    ptyComm->makeNonBlocking();
+    printf("DALI bridge available at %s\n", slaveName);
+    return ErrorPtr();
+  }
+
+
+  SocketCommPtr tcpConnectionHandler(SocketCommPtr aServerSocketComm)
+  {
+    SocketCommPtr conn = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    conn->setReceiveHandler(boost::bind(&DaliSim::dataReceived, this, conn.get(), _1));
+    conn->setConnectionStatusHandler(boost::bind(&DaliSim::tcpConnectionStatus, this, _1, _2));
+    LOG(LOG_NOTICE, "Bridge client connected via TCP\n");
+    return conn;
+  }
+
+
+  void tcpConnectionStatus(SocketCommPtr aSocketComm, ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      LOG(LOG_NOTICE, "Bridge client disconnected: %s\n", aError->description().c_str());
+      inputBuffers.erase(aSocketComm.get());
+      // drop commands of this connection that are not yet executed
+      for (CommandList::iterator pos = commands.begin(); pos!=commands.end(); ) {
+        if (pos->connection==aSocketComm) pos = commands.erase(pos);
+        else ++pos;
+      }
+    }
+  }
+
+
+  void dataReceived(FdComm *aConnection, ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) return;
+    string &buf = inputBuffers[aConnection];
+    aConnection->receiveAndAppendToString(buf);
+    // extract complete commands
+    while (buf.size()>0) {
+      uint8_t cmd = buf[0];
+      size_t len = cmd<8 ? 1 : 3;
+      if (buf.size()<len) break;
+      BridgeCommand bc;
+      bc.connection = FdCommPtr(aConnection);
+      bc.cmd = cmd;
+      bc.dali1 = len>1 ? buf[1] : 0;
+      bc.dali2 = len>1 ? buf[2] : 0;
+      buf.erase(0, len);
+      commands.push_back(bc);
+    }
+    processCommands();
+  }
+
+
+  void sendResponse(FdCommPtr aConnection, uint8_t aResp1, uint8_t aResp2)
+  {
+    uint8_t resp[2] = { aResp1, aResp2 };
+    ErrorPtr err;
+    aConnection->transmitBytes(2, resp, err);
+    if (!Error::isOK(err)) {
+      LOG(LOG_WARNING, "Cannot send bridge response: %s\n", err->description().c_str());
+    }
+  }
+
+
+  #pragma mark - bridge command execution
+
+  /// scale a bus time for simulation speed
+  MLMicroSeconds scaled(MLMicroSeconds aTime)
+  {
+    return speedFactor>0 ? aTime/speedFactor : 0;
+  }
+
+
+  void processCommands()
+  {
+    while (!busBusy && !commands.empty()) {
+      BridgeCommand bc = commands.front();
+      commands.pop_front();
+      bridgeCommands++;
+      // determine bus time
+      MLMicroSeconds busTime = 0;
+      switch (bc.cmd) {
+        case CMD_CODE_SEND16:
+          busTime = DALI_FORWARD_FRAME+DALI_FORWARD_SETTLING;
+          break;
+        case CMD_CODE_2SEND16:
+          busTime = 2*DALI_FORWARD_FRAME+DALI_DOUBLE_SEND_GAP+DALI_FORWARD_SETTLING;
+          break;
+        case CMD_CODE_SEND16_REC8:
+          // actual time depends on answer, determined when executing
+          busTime = DALI_FORWARD_FRAME+DALI_BACKWARD_SETTLING+DALI_BACKWARD_FRAME+DALI_FORWARD_SETTLING;
+          break;
+        default:
+          break; // bridge internal commands do not use the bus
+      }
+      busOccupied += busTime;
+      if (scaled(busTime)>0) {
+        // bus is busy until command is complete
+        busBusy = true;
+        MainLoop::currentMainLoop().executeOnce(boost::bind(&DaliSim::commandComplete, this, bc), scaled(busTime));
+        return;
+      }
+      // no delay, execute right now
+      executeCommand(bc);
+    }
+  }
+
+
+  void commandComplete(BridgeCommand aCommand)
+  {
+    busBusy = false;
+    executeCommand(aCommand);
+    processCommands();
+  }
+
+
+  void executeCommand(BridgeCommand &aCommand)
+  {
+    uint8_t answer;
+    switch (aCommand.cmd) {
+      case CMD_CODE_RESET:
+      case CMD_CODE_OVLRESET:
+      case CMD_CODE_EDGEADJ:
+        sendResponse(aCommand.connection, RESP_CODE_ACK, ACK_OK);
+        break;
+      case CMD_CODE_ECHO_DATA1:
+        sendResponse(aCommand.connection, RESP_CODE_DATA, aCommand.dali1);
+        break;
+      case CMD_CODE_ECHO_DATA2:
+        sendResponse(aCommand.connection, RESP_CODE_DATA, aCommand.dali2);
+        break;
+      case CMD_CODE_SEND16:
+        forwardFrame(aCommand.dali1, aCommand.dali2, answer);
+        sendResponse(aCommand.connection, RESP_CODE_ACK, ACK_OK);
+        break;
+      case CMD_CODE_2SEND16:
+        forwardFrame(aCommand.dali1, aCommand.dali2, answer);
+        forwardFrame(aCommand.dali1, aCommand.dali2, answer);
+        sendResponse(aCommand.connection, RESP_CODE_ACK, ACK_OK);
+        break;
+      case CMD_CODE_SEND16_REC8: {
+        int answers = forwardFrame(aCommand.dali1, aCommand.dali2, answer);
+        if (answers==0) {
+          // no answer: bridge waits for max settling time only
+          noAnswers++;
+          busOccupied -= DALI_BACKWARD_SETTLING+DALI_BACKWARD_FRAME-DALI_NO_ANSWER_WAIT;
+          sendResponse(aCommand.connection, RESP_CODE_ACK, ACK_TIMEOUT);
+        }
+        else if (answers<0) {
+          // multiple differing answers: collision
+          backwardFrames++;
+          collisions++;
+          sendResponse(aCommand.connection, RESP_CODE_ACK, ACK_FRAME_ERR);
+        }
+        else {
+          backwardFrames++;
+          sendResponse(aCommand.connection, RESP_CODE_DATA, answer);
+        }
+        break;
+      }
+      default:
+        sendResponse(aCommand.connection, RESP_CODE_ACK, ACK_INVALIDCMD);
+        break;
+    }
+  }
+
+
+  /// put a forward frame on the bus and let all ballasts react
+  /// @param aAnswer set to the answer on the bus, if any
+  /// @return number of ballasts answering (identical answers superimpose), -1 if answers collide
+  int forwardFrame(uint8_t aDali1, uint8_t aDali2, uint8_t &aAnswer)
+  {
+    forwardFrames++;
+    MLMicroSeconds now = MainLoop::now();
+    uint16_t frame = (aDali1<<8) | aDali2;
+    // configuration commands and some special commands only act when repeated within 100mS
+    bool confirmed = frame==lastFrame && now-lastFrameTime<scaled(DALI_SEND_TWICE_WINDOW)+scaled(DALI_FORWARD_FRAME+DALI_DOUBLE_SEND_GAP);
+    if (speedFactor==0) confirmed = frame==lastFrame;
+    // a confirmed frame is consumed, a third identical frame starts a new pair
+    lastFrame = confirmed ? 0 : frame;
+    lastFrameTime = now;
+    int answers = 0;
+    bool collision = false;
+    for (BallastVector::iterator pos = ballasts.begin(); pos!=ballasts.end(); ++pos) {
+      SimBallast *b = *pos;
+      uint8_t a;
+      bool answered = false;
+      if ((aDali1 & 0x01)==0 && (aDali1<0xA0 || aDali1>0xCB)) {
+        // direct arc power control
+        if (b->isAddressedBy(aDali1)) b->setLevel(aDali2);
+      }
+      else if (aDali1>=0xA0 && aDali1<=0xCB) {
+        // special command
+        answered = specialCommand(b, aDali1, aDali2, confirmed, a);
+      }
+      else if (b->isAddressedBy(aDali1)) {
+        answered = b->command(aDali2, confirmed, a);
+      }
+      if (answered) {
+        if (answers>0 && a!=aAnswer) collision = true;
+        aAnswer = a;
+        answers++;
+      }
+    }
+    FOCUSLOG("DALI frame %02X %02X -> %d answers%s\n", aDali1, aDali2, answers, collision ? " (collision)" : "");
+    return collision ? -1 : answers;
+  }
+
+
+  bool specialCommand(SimBallast *b, uint8_t aDali1, uint8_t aDali2, bool aConfirmed, uint8_t &aAnswer)
+  {
+    aAnswer = DALIANSWER_YES;
+    bool selected = b->initialised && b->randomAddress==searchAddress;
+    switch (aDali1) {
+      case DALICMD_TERMINATE:
+        b->initialised = false;
+        b->withdrawn = false;
+        return false;
+      case DALICMD_SET_DTR:
+        b->dtr = aDali2;
+        return false;
+      case DALICMD_INITIALISE:
+        if (aConfirmed) {
+          if (
+            aDali2==0x00 ||
+            (aDali2==0xFF && b->shortAddress==DALISIM_NO_ADDRESS) ||
+            ((aDali2 & 0x81)==0x01 && b->shortAddress==((aDali2>>1) & 0x3F))
+          ) {
+            b->initialised = true;
+            b->withdrawn = false;
+          }
+        }
+        return false;
+      case DALICMD_RANDOMISE:
+        if (aConfirmed && b->initialised) b->newRandomAddress();
+        return false;
+      case DALICMD_COMPARE:
+        return b->initialised && !b->withdrawn && b->randomAddress<=searchAddress;
+      case DALICMD_WITHDRAW:
+        if (selected) b->withdrawn = true;
+        return false;
+      case DALICMD_SEARCHADDRH:
+        searchAddress = (searchAddress & 0x00FFFF) | ((uint32_t)aDali2<<16);
+        return false;
+      case DALICMD_SEARCHADDRM:
+        searchAddress = (searchAddress & 0xFF00FF) | ((uint32_t)aDali2<<8);
+        return false;
+      case DALICMD_SEARCHADDRL:
+        searchAddress = (searchAddress & 0xFFFF00) | aDali2;
+        return false;
+      case DALICMD_PROGRAM_SHORT_ADDRESS:
+        if (selected) b->shortAddress = aDali2==0xFF ? DALISIM_NO_ADDRESS : (aDali2>>1) & 0x3F;
+        return false;
+      case DALICMD_VERIFY_SHORT_ADDRESS:
+        return b->initialised && b->shortAddress==((aDali2>>1) & 0x3F);
+      case DALICMD_QUERY_SHORT_ADDRESS:
+        if (!selected) return false;
+        aAnswer = b->shortAddress==DALISIM_NO_ADDRESS ? 0xFF : (b->shortAddress<<1) | 0x01;
+        return true;
+      case DALICMD_SET_DTR1:
+        b->dtr1 = aDali2;
+        return false;
+      case DALICMD_SET_DTR2:
+        b->dtr2 = aDali2;
+        return false;
+      case DALICMD_WRITE_MEMORY_LOCATION:
+        // only bank 1 (beyond checksum and lock byte) is writable in this simulation
+        if (b->writeEnabled && b->dtr1==1 && b->dtr>=0x03 && b->dtr<DALIMEM_BANK1_MINBYTES) {
+          b->bank1[b->dtr] = aDali2;
+          SimBallast::updateChecksum(b->bank1, DALIMEM_BANK1_MINBYTES);
+          aAnswer = aDali2;
+          if (b->dtr<0xFF) b->dtr++;
+          return true;
+        }
+        return false;
+      default:
+        // physical selection, enable device type etc.: no reaction
+        return false;
+    }
+  }
+
+
+  #pragma mark - statistics
+
+  void resetStats()
+  {
+    statsStart = MainLoop::now();
+    bridgeCommands = 0;
+    forwardFrames = 0;
+    backwardFrames = 0;
+    noAnswers = 0;
+    collisions = 0;
+    busOccupied = 0;
+  }
+
+
+  void report()
+  {
+    double secs = (double)(MainLoop::now()-statsStart)/Second;
+    if (secs>0) {
+      printf(
+        "%6.1f cmds/s, %6.1f forward frames/s, %6.1f answers/s, %ld no answers, %ld collisions, bus utilization %5.1f%%\n",
+        bridgeCommands/secs,
+        forwardFrames/secs,
+        backwardFrames/secs,
+        noAnswers,
+        collisions,
+        // bus time is modelled in real DALI time, scale to wall clock time
+        (double)scaled(busOccupied)/(MainLoop::now()-statsStart)*100
+      );
+      fflush(stdout);
+    }
+    resetStats();
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&DaliSim::report, this), reportInterval);
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create the mainloop
+  MainLoop::currentMainLoop().setLoopCycleTime(MAINLOOP_CYCLE_TIME_uS);
+  // create app with current mainloop
+  static DaliSim application;
+  // pass control
+  return application.main(argc, argv);
+}
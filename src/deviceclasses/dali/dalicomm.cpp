@@ -49,8 +49,18 @@ DaliComm::DaliComm(MainLoop &aMainLoop) :
   expectedBridgeResponses(0),
   responsesInSequence(false),
   sendEdgeAdj(DEFAULT_SENDING_EDGE_ADJUSTMENT),
-  samplePointAdj(DEFAULT_SAMPLING_POINT_ADJUSTMENT)
+  samplePointAdj(DEFAULT_SAMPLING_POINT_ADJUSTMENT),
+  coalescedFrames(0),
+  queueDepth(0),
+  maxQueueDepth(0)
 {
+  traceLabel = "dali";
+  framesMetric = Metrics::counter("vdcd_dali_frames_total", "DALI bridge commands answered by the bridge");
+  timeoutsMetric = Metrics::counter("vdcd_dali_timeouts_total", "DALI commands with no answer from the bus");
+  collisionsMetric = Metrics::counter("vdcd_dali_collisions_total", "DALI frame errors (usually collisions of multiple answers)");
+  errorsMetric = Metrics::counter("vdcd_dali_bridge_errors_total", "DALI bridge communication errors");
+  coalescedMetric = Metrics::counter("vdcd_dali_coalesced_frames_total", "DALI commands dropped because superseded before sending");
+  queueDepthMetric = Metrics::gauge("vdcd_dali_queue_depth", "DALI bridge operations queued");
 }
 
 
@@ -158,9 +168,10 @@ void DaliComm::setConnectionSpecification(const char *aConnectionSpec, uint16_t
 
 void DaliComm::bridgeResponseHandler(DaliBridgeResultCB aBridgeResultHandler, SerialOperationPtr aOperation, OperationQueuePtr aQueueP, ErrorPtr aError)
 {
+  updateQueueDepth();
   if (expectedBridgeResponses>0) expectedBridgeResponses--;
   if (expectedBridgeResponses<BUFFERED_BRIDGE_RESPONSES_LOW) {
-    responsesInSequence = true; // allow buffered sends without waiting for answers
+    responsesInSequence = false; // allow buffered sends without waiting for answers
   }
   SerialOperationReceivePtr ropP = boost::dynamic_pointer_cast<SerialOperationReceive>(aOperation);
   if (ropP) {
@@ -169,6 +180,11 @@ void DaliComm::bridgeResponseHandler(DaliBridgeResultCB aBridgeResultHandler, Se
       uint8_t resp1 = ropP->getDataP()[0];
       uint8_t resp2 = ropP->getDataP()[1];
       FOCUSLOG("DALI bridge response: %s (%02X %02X) - %d pending responses\n", bridgeResponseText(resp1, resp2), resp1, resp2, expectedBridgeResponses);
+      framesMetric->inc();
+      if (resp1==RESP_CODE_ACK) {
+        if (resp2==ACK_TIMEOUT) timeoutsMetric->inc();
+        else if (resp2==ACK_FRAME_ERR) collisionsMetric->inc();
+      }
       if (aBridgeResultHandler)
         aBridgeResultHandler(resp1, resp2, aError);
     }
@@ -176,14 +192,144 @@ void DaliComm::bridgeResponseHandler(DaliBridgeResultCB aBridgeResultHandler, Se
       // error
       if (!aError)
         aError = ErrorPtr(new DaliCommError(DaliCommErrorMissingData));
+      errorsMetric->inc();
       if (aBridgeResultHandler)
         aBridgeResultHandler(0, 0, aError);
     }
   }
+  else if (aError) {
+    // send operation aborted before answer could be received (e.g. superseded)
+    FOCUSLOG("DALI bridge command not sent: %s - %d pending responses\n", aError->description().c_str(), expectedBridgeResponses);
+    if (!aError->isError(DaliCommError::domain(), DaliCommErrorSuperseded)) errorsMetric->inc();
+    if (aBridgeResultHandler)
+      aBridgeResultHandler(0, 0, aError);
+  }
+}
+
+
+// bridge command which can be superseded by a newer one for the same target while still queued
+class DaliBridgeOperation : public SerialOperationSendAndReceive
+{
+  typedef SerialOperationSendAndReceive inherited;
+public:
+  uint16_t coalesceKey; ///< 0 if not coalescable, otherwise identifies target address and command class
+
+  DaliBridgeOperation(size_t aNumBytes, uint8_t *aBytes, SerialOperationFinalizeCB aCallback) :
+    inherited(aNumBytes, aBytes, 2, aCallback),
+    coalesceKey(0)
+  {
+  };
+};
+typedef boost::intrusive_ptr<DaliBridgeOperation> DaliBridgeOperationPtr;
+
+
+// coalescing command classes
+#define COALESCE_ARCPOWER 0x100 // direct arc power (DAPC)
+#define COALESCE_SINGLE_DEVICE(k) (((k)&0x80)==0) // key is for a short address (not group or broadcast)
+
+static uint16_t coalesceKeyFor(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2)
+{
+  if (aCmd!=CMD_CODE_SEND16) return 0; // only simple sends can be level setting commands
+  // address byte: 0AAAAAAS = short address, 100AAAAS = group, 1111111S = broadcast, everything else are special commands
+  if (!((aDali1 & 0x80)==0 || (aDali1 & 0xE0)==0x80 || (aDali1 & 0xFE)==0xFE)) return 0; // special command
+  if ((aDali1 & 0x01)==0) {
+    // direct arc power: absolute level, only the latest one matters
+    // - except MASK, which stops fading at the current level, but does not set one (so must not replace a queued level)
+    if (aDali2==DALIVALUE_MASK) return 0;
+    return COALESCE_ARCPOWER + (aDali1 & 0xFE);
+  }
+  // Note: relative commands (such as UP/DOWN steps) must not be coalesced, each of them changes the result
+  return 0; // other command, strict ordering
+}
+
+
+void DaliComm::queueCoalescing(SerialOperationPtr aOperation, uint16_t aCoalesceKey)
+{
+  OperationList::iterator pos = operationQueue.end();
+  DaliBridgeOperationPtr superseded;
+  if (aCoalesceKey) {
+    // look back for a not yet sent command for the same target
+    while (pos!=operationQueue.begin()) {
+      --pos;
+      DaliBridgeOperationPtr op = boost::dynamic_pointer_cast<DaliBridgeOperation>(*pos);
+      if (!op || op->isInitiated()) break;
+      if (op->coalesceKey==aCoalesceKey) {
+        superseded = op;
+        break;
+      }
+      // only look past level commands for other single devices, which cannot affect the target
+      if (!op->coalesceKey || !COALESCE_SINGLE_DEVICE(op->coalesceKey) || !COALESCE_SINGLE_DEVICE(aCoalesceKey)) break;
+    }
+  }
+  queueSerialOperation(aOperation);
+  if (superseded) {
+    // not yet sent, and newer command for same target: replace it in place. Only commands for other devices can
+    // be queued in between, so this does not change the order of commands for the target
+    operationQueue.pop_back();
+    *pos = aOperation;
+    long coalesced = __sync_add_and_fetch(&coalescedFrames, 1);
+    coalescedMetric->inc();
+    FOCUSLOG("DALI bridge command superseded before sending (key 0x%03X) - %ld frames coalesced so far\n", aCoalesceKey, coalesced);
+    superseded->abortOperation(ErrorPtr(new DaliCommError(DaliCommErrorSuperseded)));
+  }
+}
+
+
+void DaliComm::updateQueueDepth()
+{
+  size_t depth = operationQueue.size();
+  __sync_lock_test_and_set(&queueDepth, depth);
+  size_t maxDepth = __sync_add_and_fetch(&maxQueueDepth, 0);
+  while (depth>maxDepth) {
+    if (__sync_bool_compare_and_swap(&maxQueueDepth, maxDepth, depth)) break;
+    maxDepth = __sync_add_and_fetch(&maxQueueDepth, 0);
+  }
+  queueDepthMetric->set(depth);
 }
 
 
 void DaliComm::sendBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, DaliBridgeResultCB aResultCB, int aWithDelay)
+{
+  if (!runsOnOwnThread()) {
+    queueBridgeCommand(aCmd, aDali1, aDali2, aResultCB, aWithDelay);
+    return;
+  }
+  // Pass the command to the communication thread. The result callback usually holds references to objects
+  // of the calling thread, so it is never copied or destroyed on the communication thread, but passed
+  // as a plain pointer and deleted again on the calling thread in deliverBridgeResult().
+  DaliBridgeResultCB *cbP = aResultCB ? new DaliBridgeResultCB(aResultCB) : NULL;
+  callOnQueueThread(boost::bind(&DaliComm::threadedBridgeCommand, this, aCmd, aDali1, aDali2, cbP, aWithDelay, Trace::current()));
+}
+
+
+// runs on the communication thread
+void DaliComm::threadedBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, DaliBridgeResultCB *aResultCBP, int aWithDelay, TraceId aTraceId)
+{
+  TraceContext tc(aTraceId);
+  queueBridgeCommand(aCmd, aDali1, aDali2, boost::bind(&DaliComm::threadedBridgeResult, this, aResultCBP, aTraceId, _1, _2, _3), aWithDelay);
+}
+
+
+// runs on the communication thread
+void DaliComm::threadedBridgeResult(DaliBridgeResultCB *aResultCBP, TraceId aTraceId, uint8_t aResp1, uint8_t aResp2, ErrorPtr aError)
+{
+  callOnOwnerThread(boost::bind(&DaliComm::deliverBridgeResult, this, aResultCBP, aTraceId, aResp1, aResp2, aError));
+}
+
+
+// runs on the thread that created the DaliComm
+void DaliComm::deliverBridgeResult(DaliBridgeResultCB *aResultCBP, TraceId aTraceId, uint8_t aResp1, uint8_t aResp2, ErrorPtr aError)
+{
+  if (aResultCBP) {
+    TraceContext tc(aTraceId);
+    DaliBridgeResultCB cb = *aResultCBP;
+    delete aResultCBP;
+    cb(aResp1, aResp2, aError);
+  }
+}
+
+
+void DaliComm::queueBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, DaliBridgeResultCB aResultCB, int aWithDelay)
 {
   FOCUSLOG("DALI bridge command:  %s (%02X)  %02X %02X (%d pending responses)\n", bridgeCmdName(aCmd), aCmd, aDali1, aDali2, expectedBridgeResponses);
   // reset connection closing timeout
@@ -192,10 +338,10 @@ void DaliComm::sendBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, D
     connectionTimeoutTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&DaliComm::connectionTimeout, this), closeAfterIdleTime);
   }
   // deliver unhandled error
-  SerialOperationSendAndReceive *opP = NULL;
+  DaliBridgeOperation *opP = NULL;
   if (aCmd<8) {
     // single byte command
-    opP = new SerialOperationSendAndReceive(1, &aCmd, 2, boost::bind(&DaliComm::bridgeResponseHandler, this, aResultCB, _1, _2, _3));
+    opP = new DaliBridgeOperation(1, &aCmd, boost::bind(&DaliComm::bridgeResponseHandler, this, aResultCB, _1, _2, _3));
   }
   else {
     // 3 byte command
@@ -203,15 +349,19 @@ void DaliComm::sendBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, D
     cmd3[0] = aCmd;
     cmd3[1] = aDali1;
     cmd3[2] = aDali2;
-    opP = new SerialOperationSendAndReceive(3, cmd3, 2, boost::bind(&DaliComm::bridgeResponseHandler, this, aResultCB, _1, _2, _3));
+    opP = new DaliBridgeOperation(3, cmd3, boost::bind(&DaliComm::bridgeResponseHandler, this, aResultCB, _1, _2, _3));
   }
   if (opP) {
-    expectedBridgeResponses++;
     if (aWithDelay>0) {
       // delayed sends must always be in sequence
       opP->setInitiationDelay(aWithDelay);
     }
     else {
+      // level setting commands replace not yet sent ones for the same target
+      opP->coalesceKey = coalesceKeyFor(aCmd, aDali1, aDali2);
+    }
+    expectedBridgeResponses++;
+    if (aWithDelay<=0) {
       // non-elayed sends may be sent before answer of previous commands have arrived as long as Rx buf in bridge does not overflow
       if (expectedBridgeResponses>BUFFERED_BRIDGE_RESPONSES_HIGH) {
         responsesInSequence = true; // prevent further sends without answers
@@ -220,7 +370,8 @@ void DaliComm::sendBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, D
     }
     opP->receiveTimeoout = 20*Second; // large timeout, because it can really take time until all expected answers are received
     SerialOperationPtr op(opP);
-    queueSerialOperation(op);
+    queueCoalescing(op, opP->coalesceKey);
+    updateQueueDepth();
   }
   // process operations
   processOperations();
@@ -438,15 +589,35 @@ DaliAddress DaliComm::addressFromDaliResponse(uint8_t aResponse)
 #pragma mark - DALI bus scanning
 
 // Scan bus for active devices (returns list of short addresses)
+// Note: queries are not sent one by one, but pipelined up to what the bridge can buffer in responses
+
+#define SCAN_PIPELINE_DEPTH (BUFFERED_BRIDGE_RESPONSES_HIGH-BUFFERED_BRIDGE_RESPONSES_LOW) // leave some room for other traffic
 
 class DaliBusScanner : public P44Obj
 {
-  DaliComm &daliComm;
+  typedef enum {
+    dqs_controlgear,
+    dqs_random_h,
+    dqs_random_m,
+    dqs_random_l
+  } DeviceQueryState;
+
+  typedef struct {
+    DaliAddress shortAddress;
+    DeviceQueryState queryState;
+  } ScanQuery;
+  typedef std::list<ScanQuery> ScanQueryList;
+
   DaliComm::DaliBusScanCB callback;
-  DaliAddress shortAddress;
-  DaliComm::ShortAddressListPtr activeDevicesPtr;
+  DaliComm &daliComm;
   bool probablyCollision;
   bool unconfiguredDevices;
+  int queriesInFlight; ///< queries sent, but not yet answered
+  DaliComm::ShortAddressListPtr activeDevicesPtr;
+  ScanQueryList queriesToSend; ///< queries not yet sent
+  ErrorPtr scanError; ///< first error that occurred
+  bool present[DALI_MAXDEVICES];
+  bool collision[DALI_MAXDEVICES];
 public:
   static void scanBus(DaliComm &aDaliComm, DaliComm::DaliBusScanCB aResultCB)
   {
@@ -459,8 +630,13 @@ private:
     daliComm(aDaliComm),
     probablyCollision(false),
     unconfiguredDevices(false),
+    queriesInFlight(0),
     activeDevicesPtr(new std::list<DaliAddress>)
   {
+    for (DaliAddress a=0; a<DALI_MAXDEVICES; a++) {
+      present[a] = false;
+      collision[a] = false;
+    }
     daliComm.startProcedure();
     LOG(LOG_INFO, "DaliComm: starting quick bus scan (short address poll)\n");
     // reset the bus first
@@ -481,86 +657,107 @@ private:
   }
 
 
-  typedef enum {
-    dqs_controlgear,
-    dqs_random_h,
-    dqs_random_m,
-    dqs_random_l
-  } DeviceQueryState;
-
-
   void handleMissingShortAddressResponse(bool aNoOrTimeout, uint8_t aResponse, ErrorPtr aError)
   {
     if (DaliComm::isYes(aNoOrTimeout, aResponse, aError, true)) {
       // we have devices without short addresses
       unconfiguredDevices = true;
     }
-    // start the scan
-    shortAddress = 0;
-    queryNext(dqs_controlgear);
+    // start the scan: query presence of all short addresses
+    for (DaliAddress a=0; a<DALI_MAXDEVICES; a++) {
+      queueQuery(a, dqs_controlgear);
+    }
+    sendQueries();
   };
 
 
+  void queueQuery(DaliAddress aShortAddress, DeviceQueryState aQueryState)
+  {
+    ScanQuery q;
+    q.shortAddress = aShortAddress;
+    q.queryState = aQueryState;
+    queriesToSend.push_back(q);
+  }
+
+
+  // send as many queued queries as the bridge can buffer answers for
+  void sendQueries()
+  {
+    while (queriesInFlight<SCAN_PIPELINE_DEPTH && !queriesToSend.empty()) {
+      ScanQuery q = queriesToSend.front();
+      queriesToSend.pop_front();
+      uint8_t cmd;
+      switch (q.queryState) {
+        default: cmd = DALICMD_QUERY_CONTROL_GEAR; break;
+        case dqs_random_h: cmd = DALICMD_QUERY_RANDOM_ADDRESS_H; break;
+        case dqs_random_m: cmd = DALICMD_QUERY_RANDOM_ADDRESS_M; break;
+        case dqs_random_l: cmd = DALICMD_QUERY_RANDOM_ADDRESS_L; break;
+      }
+      queriesInFlight++;
+      daliComm.daliSendQuery(q.shortAddress, cmd, boost::bind(&DaliBusScanner::handleScanResponse, this, q.shortAddress, q.queryState, _1, _2, _3));
+    }
+    if (queriesInFlight==0) {
+      // nothing sent, nothing pending -> scan complete
+      completed(scanError);
+    }
+  }
+
+
   // handle scan result
-  void handleScanResponse(DeviceQueryState aQueryState, bool aNoOrTimeout, uint8_t aResponse, ErrorPtr aError)
+  void handleScanResponse(DaliAddress aShortAddress, DeviceQueryState aQueryState, bool aNoOrTimeout, uint8_t aResponse, ErrorPtr aError)
   {
-    bool isYes = false;
+    queriesInFlight--;
     if (aError && aError->isError(DaliCommError::domain(), DaliCommErrorDALIFrame)) {
       // framing error, indicates that we might have duplicates
-      LOG(LOG_INFO, "Detected framing error for %d-th response from short address %d - probably short address collision\n", (int)aQueryState, shortAddress);
+      if (!collision[aShortAddress]) {
+        LOG(LOG_INFO, "Detected framing error for %d-th response from short address %d - probably short address collision\n", (int)aQueryState, aShortAddress);
+      }
       probablyCollision = true;
-      isYes = true; // still count as YES
-      aError.reset(); // do not count as error aborting the search
-      aQueryState=dqs_random_l; // one error is enough, no need to check other bytes
+      collision[aShortAddress] = true; // one error is enough, no need to check other bytes
+      present[aShortAddress] = true; // still count as YES
     }
-    else if (!aError && !aNoOrTimeout) {
-      // no error, no timeout
-      isYes = true;
-      if (aQueryState==dqs_controlgear && aResponse!=DALIANSWER_YES) {
-        // not entirely correct answer, also indicates collision
-        LOG(LOG_INFO, "Detected incorrect YES answer 0x%02X from short address %d - probably short address collision\n", aResponse, shortAddress);
-        probablyCollision = true;
-      }
+    else if (aError) {
+      // other error, remember first one, scan will be aborted
+      if (!scanError) scanError = aError;
     }
-    if (aQueryState==dqs_random_l || aNoOrTimeout) {
-      // collision already detected, or last byte of existing device checked, or timeout -> query complete for this short address
-      if (isYes) {
-        activeDevicesPtr->push_back(shortAddress);
-        LOG(LOG_INFO, "- detected DALI device at short address %d\n", shortAddress);
-      }
-      shortAddress++;
-      if (shortAddress<DALI_MAXDEVICES && !aError) {
-        // more devices to scan
-        queryNext(dqs_controlgear);
-      }
-      else {
-        return completed(aError);
+    else if (aQueryState==dqs_controlgear) {
+      if (!aNoOrTimeout) {
+        present[aShortAddress] = true;
+        if (aResponse!=DALIANSWER_YES) {
+          // not entirely correct answer, also indicates collision
+          LOG(LOG_INFO, "Detected incorrect YES answer 0x%02X from short address %d - probably short address collision\n", aResponse, aShortAddress);
+          probablyCollision = true;
+          collision[aShortAddress] = true;
+        }
+        else if (!scanError) {
+          // check random address bytes to detect collisions
+          queueQuery(aShortAddress, dqs_random_h);
+          queueQuery(aShortAddress, dqs_random_m);
+          queueQuery(aShortAddress, dqs_random_l);
+        }
       }
     }
-    else {
-      // more to check from same device
-      queryNext((DeviceQueryState)((int)aQueryState+1));
+    else if (!collision[aShortAddress] && aNoOrTimeout) {
+      // device did not answer random address query -> not considered present
+      present[aShortAddress] = false;
     }
-  };
-
-
-  // query next device
-  void queryNext(DeviceQueryState aQueryState)
-  {
-    uint8_t q;
-    switch (aQueryState) {
-      default: q = DALICMD_QUERY_CONTROL_GEAR; break;
-      case dqs_random_h: q = DALICMD_QUERY_RANDOM_ADDRESS_H; break;
-      case dqs_random_m: q = DALICMD_QUERY_RANDOM_ADDRESS_M; break;
-      case dqs_random_l: q = DALICMD_QUERY_RANDOM_ADDRESS_L; break;
+    if (scanError) {
+      // do not send any more queries, but wait for those in flight
+      queriesToSend.clear();
     }
-    daliComm.daliSendQuery(shortAddress, q, boost::bind(&DaliBusScanner::handleScanResponse, this, aQueryState, _1, _2, _3));
-  }
-
+    sendQueries();
+  };
 
 
   void completed(ErrorPtr aError)
   {
+    // collect results
+    for (DaliAddress a=0; a<DALI_MAXDEVICES; a++) {
+      if (present[a]) {
+        activeDevicesPtr->push_back(a);
+        LOG(LOG_INFO, "- detected DALI device at short address %d\n", a);
+      }
+    }
     // scan done or error, return list to callback
     if (probablyCollision || unconfiguredDevices) {
       if (!Error::isOK(aError)) {
@@ -1223,6 +1420,39 @@ void DaliComm::daliReadDeviceInfo(DaliDeviceInfoCB aResultCB, DaliAddress aAddre
 }
 
 
+// GTIN (0x03..0x08), firmware version (0x09..0x0A) and serial number (0x0B..0x0E) in bank 0
+#define DALIMEM_DEVICEID_OFFSET 0x03
+#define DALIMEM_DEVICEID_BYTES 12
+
+void DaliComm::daliReadDeviceId(DaliDeviceInfoCB aResultCB, DaliAddress aAddress)
+{
+  if (isBusy()) { aResultCB(DaliDeviceInfoPtr(), DaliComm::busyError()); return; }
+  DaliMemoryReader::readMemory(*this, boost::bind(&DaliComm::deviceIdReceived, this, aResultCB, aAddress, _1, _2), aAddress, 0, DALIMEM_DEVICEID_OFFSET, DALIMEM_DEVICEID_BYTES);
+}
+
+
+void DaliComm::deviceIdReceived(DaliDeviceInfoCB aResultCB, DaliAddress aAddress, MemoryVectorPtr aData, ErrorPtr aError)
+{
+  DaliDeviceInfoPtr deviceInfo = DaliDeviceInfoPtr(new DaliDeviceInfo);
+  deviceInfo->shortAddress = aAddress;
+  if (Error::isOK(aError)) {
+    if (aData->size()!=DALIMEM_DEVICEID_BYTES) {
+      aError = ErrorPtr(new DaliCommError(DaliCommErrorMissingData,string_format("Not enough bytes read from bank0 at shortAddress %d", aAddress)));
+    }
+    else {
+      // same layout as in full device info, see DaliDeviceInfoReader
+      #define BANK0_BYTE(n) ((*aData)[(n)-DALIMEM_DEVICEID_OFFSET])
+      for (int i=0x03; i<=0x08; i++) deviceInfo->gtin = (deviceInfo->gtin << 8) + BANK0_BYTE(i);
+      deviceInfo->fw_version_major = BANK0_BYTE(0x09);
+      deviceInfo->fw_version_minor = BANK0_BYTE(0x0A);
+      for (int i=0x0B; i<=0x0E; i++) deviceInfo->serialNo = (deviceInfo->serialNo << 8) + BANK0_BYTE(i);
+      #undef BANK0_BYTE
+    }
+  }
+  aResultCB(deviceInfo, aError);
+}
+
+
 #pragma mark - DALI device info
 
 
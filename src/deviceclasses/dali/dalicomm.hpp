@@ -26,6 +26,7 @@
 #include "vdcd_common.hpp"
 
 #include "serialqueue.hpp"
+#include "metrics.hpp"
 
 #include "dalidefs.h"
 
@@ -55,7 +56,8 @@ namespace p44 {
     DaliCommErrorNeedFullScan,
     DaliCommErrorDeviceSearch,
     DaliCommErrorSetShortAddress,
-    DaliCommErrorBusOverload
+    DaliCommErrorBusOverload,
+    DaliCommErrorSuperseded
   } DaliCommErrors;
 
   class DaliCommError : public Error
@@ -130,6 +132,18 @@ namespace p44 {
     uint8_t sendEdgeAdj; ///< adjustment for sending rising edge - first param to CMD_CODE_EDGEADJ
     uint8_t samplePointAdj; ///< adjustment for sampling point - second param to CMD_CODE_EDGEADJ
 
+    long coalescedFrames; ///< number of queued frames dropped because superseded by a newer one for the same target
+    size_t queueDepth; ///< current number of operations in the queue (copy readable from other threads)
+    size_t maxQueueDepth; ///< highest number of operations seen in the queue
+
+    // metrics
+    MetricCounterPtr framesMetric;
+    MetricCounterPtr timeoutsMetric;
+    MetricCounterPtr collisionsMetric;
+    MetricCounterPtr errorsMetric;
+    MetricCounterPtr coalescedMetric;
+    MetricGaugePtr queueDepthMetric;
+
   public:
 
     DaliComm(MainLoop &aMainLoop);
@@ -154,6 +168,16 @@ namespace p44 {
     /// @param how much (in 1/256th DALI bit time units) to delay or advance the sample point when receiving DALI data
     void setDaliSampleAdj(int8_t aSamplePointDelay) { samplePointAdj = (uint8_t)aSamplePointDelay; };
 
+    /// @return number of queued frames that were dropped because a newer frame for the same target
+    ///   (direct arc power for the same address) was queued before they were sent
+    long getCoalescedFrames() { return __sync_add_and_fetch(&coalescedFrames, 0); };
+
+    /// @return current number of operations (sends and pending answers) in the queue
+    size_t getQueueDepth() { return __sync_add_and_fetch(&queueDepth, 0); };
+
+    /// @return highest number of operations seen in the queue so far
+    size_t getMaxQueueDepth() { return __sync_add_and_fetch(&maxQueueDepth, 0); };
+
 
     /// callback function for sendBridgeCommand
     typedef boost::function<void (uint8_t aResp1, uint8_t aResp2, ErrorPtr aError)> DaliBridgeResultCB;
@@ -164,6 +188,13 @@ namespace p44 {
     /// @param aDali2 second DALI byte
     /// @param aResultCB callback executed when bridge response arrives
     /// @param aWithDelay if>0, time (in microseconds) to delay BEFORE sending the command
+    /// @note direct arc power commands without delay replace a not yet sent direct arc power command for the same
+    ///   address (in its place in the queue), unless other commands that might affect that address were queued in
+    ///   between. The replaced command's aResultCB gets a DaliCommErrorSuperseded error.
+    ///   All other commands, including relative ones like UP/DOWN, are sent in strict order.
+    /// @note when the DaliComm runs on its own thread (see OperationQueue::runsOnOwnThread()), this must be called
+    ///   from the thread that created the DaliComm. The command is passed to the communication thread, and aResultCB
+    ///   is called back on the calling thread.
     void sendBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, DaliBridgeResultCB aResultCB, int aWithDelay = -1);
 
 
@@ -262,6 +293,7 @@ namespace p44 {
 
     /// Scan the bus for active devices (short address)
     /// @param aResultCB callback receiving a list<int> of available short addresses on the bus
+    /// @note queries are pipelined up to what the bridge can buffer in responses
     void daliBusScan(DaliBusScanCB aResultCB);
 
     /// Scan the bus for devices by random address search
@@ -297,14 +329,28 @@ namespace p44 {
     /// @param aAddress short address of device to read device info from
     void daliReadDeviceInfo(DaliDeviceInfoCB aResultCB, DaliAddress aAddress);
 
+    /// Read only GTIN, firmware version and serial number of a DALI device
+    /// @param aResultCB callback receiving a device info record with only gtin, fw_version_xxx and serialNo set
+    /// @param aAddress short address of device to read from
+    /// @note much faster than daliReadDeviceInfo(), as only 12 bytes of memory bank 0 are read. Bank 0 checksum
+    ///   is not verified, so the result is only suitable to recognize a device already known by its full device info.
+    void daliReadDeviceId(DaliDeviceInfoCB aResultCB, DaliAddress aAddress);
+
     /// @}
 
   private:
 
+    void queueBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, DaliBridgeResultCB aResultCB, int aWithDelay);
+    void threadedBridgeCommand(uint8_t aCmd, uint8_t aDali1, uint8_t aDali2, DaliBridgeResultCB *aResultCBP, int aWithDelay, TraceId aTraceId);
+    void threadedBridgeResult(DaliBridgeResultCB *aResultCBP, TraceId aTraceId, uint8_t aResp1, uint8_t aResp2, ErrorPtr aError);
+    void deliverBridgeResult(DaliBridgeResultCB *aResultCBP, TraceId aTraceId, uint8_t aResp1, uint8_t aResp2, ErrorPtr aError);
+    void updateQueueDepth();
     void bridgeResponseHandler(DaliBridgeResultCB aBridgeResultHandler, SerialOperationPtr aOperation, OperationQueuePtr aQueueP, ErrorPtr aError);
     void daliCommandStatusHandler(DaliCommandStatusCB aResultCB, uint8_t aResp1, uint8_t aResp2, ErrorPtr aError);
     void daliQueryResponseHandler(DaliQueryResultCB aResultCB, uint8_t aResp1, uint8_t aResp2, ErrorPtr aError);
     void connectionTimeout();
+    void queueCoalescing(SerialOperationPtr aOperation, uint16_t aCoalesceKey);
+    void deviceIdReceived(DaliDeviceInfoCB aResultCB, DaliAddress aAddress, MemoryVectorPtr aData, ErrorPtr aError);
 
   };
 
@@ -29,7 +29,13 @@ using namespace p44;
 DaliDeviceContainer::DaliDeviceContainer(int aInstanceNumber, DeviceContainer *aDeviceContainerP, int aTag) :
   DeviceClassContainer(aInstanceNumber, aDeviceContainerP, aTag)
 {
-  daliComm = DaliCommPtr(new 	DaliComm(MainLoop::currentMainLoop()));
+  daliComm = DaliCommPtr(new DaliComm(commMainLoop()));
+}
+
+
+DaliDeviceContainer::~DaliDeviceContainer()
+{
+  stopCommThread();
 }
 
 
@@ -50,13 +56,96 @@ bool DaliDeviceContainer::getDeviceIcon(string &aIcon, bool aWithData, const cha
 }
 
 
+#pragma mark - property access
+
+
+enum {
+  coalescedFrames_key,
+  queueDepth_key,
+  maxQueueDepth_key,
+  numProperties
+};
+
+static char daliDeviceContainer_key;
+
+
+int DaliDeviceContainer::numProps(int aDomain, PropertyDescriptorPtr aParentDescriptor)
+{
+  // Note: only add my own count when accessing root level properties!!
+  if (!aParentDescriptor) {
+    // Accessing properties at the vdc (root) level, add mine
+    return inherited::numProps(aDomain, aParentDescriptor)+numProperties;
+  }
+  // just return base class' count
+  return inherited::numProps(aDomain, aParentDescriptor);
+}
+
+
+PropertyDescriptorPtr DaliDeviceContainer::getDescriptorByIndex(int aPropIndex, int aDomain, PropertyDescriptorPtr aParentDescriptor)
+{
+  static const PropertyDescription properties[numProperties] = {
+    { "x-p44-coalescedFrames", apivalue_uint64, coalescedFrames_key, OKEY(daliDeviceContainer_key) },
+    { "x-p44-queueDepth", apivalue_uint64, queueDepth_key, OKEY(daliDeviceContainer_key) },
+    { "x-p44-maxQueueDepth", apivalue_uint64, maxQueueDepth_key, OKEY(daliDeviceContainer_key) },
+  };
+  if (!aParentDescriptor) {
+    // root level - accessing properties on the vdc level
+    int n = inherited::numProps(aDomain, aParentDescriptor);
+    if (aPropIndex<n)
+      return inherited::getDescriptorByIndex(aPropIndex, aDomain, aParentDescriptor); // base class' property
+    aPropIndex -= n; // rebase to 0 for my own first property
+    return PropertyDescriptorPtr(new StaticPropertyDescriptor(&properties[aPropIndex], aParentDescriptor));
+  }
+  else {
+    // other level
+    return inherited::getDescriptorByIndex(aPropIndex, aDomain, aParentDescriptor); // base class' property
+  }
+}
+
+
+// access to all fields
+bool DaliDeviceContainer::accessField(PropertyAccessMode aMode, ApiValuePtr aPropValue, PropertyDescriptorPtr aPropertyDescriptor)
+{
+  if (aPropertyDescriptor->hasObjectKey(daliDeviceContainer_key)) {
+    if (aMode==access_read) {
+      // read properties
+      switch (aPropertyDescriptor->fieldKey()) {
+        case coalescedFrames_key:
+          aPropValue->setUint64Value(daliComm->getCoalescedFrames()); return true;
+        case queueDepth_key:
+          aPropValue->setUint64Value(daliComm->getQueueDepth()); return true;
+        case maxQueueDepth_key:
+          aPropValue->setUint64Value(daliComm->getMaxQueueDepth()); return true;
+      }
+    }
+  }
+  // not my field, let base class handle it
+  return inherited::accessField(aMode, aPropValue, aPropertyDescriptor);
+}
+
+
+
 #pragma mark - DB and initialisation
 
 // Version history
 //  1 : first version
 //  2 : added groupNo (0..15) for DALI groups
+//  3 : added busDeviceCache for bus topology and device info caching
+//  4 : busDeviceCache keyed by GTIN/serial instead of short address
 #define DALI_SCHEMA_MIN_VERSION 1 // minimally supported version, anything older will be deleted
-#define DALI_SCHEMA_VERSION 2 // current version
+#define DALI_SCHEMA_VERSION 4 // current version
+
+#define BUS_DEVICE_CACHE_TABLE_SQL \
+  "CREATE TABLE busDeviceCache (" \
+  " gtin INTEGER," \
+  " serialNo INTEGER," \
+  " fwVersionMajor INTEGER," \
+  " fwVersionMinor INTEGER," \
+  " oemGtin INTEGER," \
+  " oemSerialNo INTEGER," \
+  " devInfStatus INTEGER," \
+  " PRIMARY KEY (gtin, serialNo)" \
+  ");"
 
 string DaliPersistence::dbSchemaUpgradeSQL(int aFromVersion, int &aToVersion)
 {
@@ -74,6 +163,7 @@ string DaliPersistence::dbSchemaUpgradeSQL(int aFromVersion, int &aToVersion)
       " groupNo INTEGER," // DALI group Number (0..15), valid for dimmerType "GRP" only
       " PRIMARY KEY (dimmerUID)"
       ");"
+      BUS_DEVICE_CACHE_TABLE_SQL
     );
     // reached final version in one step
     aToVersion = DALI_SCHEMA_VERSION;
@@ -85,6 +175,18 @@ string DaliPersistence::dbSchemaUpgradeSQL(int aFromVersion, int &aToVersion)
     // reached version 2
     aToVersion = 2;
   }
+  else if (aFromVersion==2) {
+    // V2->V4: bus device cache added
+    sql = BUS_DEVICE_CACHE_TABLE_SQL;
+    // reached version 4
+    aToVersion = 4;
+  }
+  else if (aFromVersion==3) {
+    // V3->V4: bus device cache keyed by GTIN/serial, old cache contents are useless
+    sql = "DROP TABLE busDeviceCache;" BUS_DEVICE_CACHE_TABLE_SQL;
+    // reached version 4
+    aToVersion = 4;
+  }
   return sql;
 }
 
@@ -116,15 +218,85 @@ void DaliDeviceContainer::collectDevices(CompletedCB aCompletedCB, bool aIncreme
     removeDevices(aClearSettings);
   }
   // start collecting, allow quick scan when not exhaustively collecting (will still use full scan when bus collisions are detected)
-  daliComm->daliFullBusScan(boost::bind(&DaliDeviceContainer::deviceListReceived, this, aCompletedCB, _1, _2), !aExhaustive);
+  // - unless collecting exhaustively, device info is only read from devices not recognized by GTIN/serial from the cache
+  daliComm->daliFullBusScan(boost::bind(&DaliDeviceContainer::deviceListReceived, this, aCompletedCB, !aExhaustive && hasBusDeviceCache(), _1, _2), !aExhaustive);
 }
 
 
-void DaliDeviceContainer::deviceListReceived(CompletedCB aCompletedCB, DaliComm::ShortAddressListPtr aDeviceListPtr, ErrorPtr aError)
+#pragma mark - bus device cache
+
+
+bool DaliDeviceContainer::hasBusDeviceCache()
+{
+  sqlite3pp::query qry(db);
+  if (qry.prepare("SELECT count(*) FROM busDeviceCache")==SQLITE_OK) {
+    sqlite3pp::query::iterator i = qry.begin();
+    if (i!=qry.end()) {
+      return i->get<int>(0)>0;
+    }
+  }
+  return false;
+}
+
+
+bool DaliDeviceContainer::cachedDeviceInfo(DaliDeviceInfo &aDeviceInfo)
+{
+  if (aDeviceInfo.gtin==0 || aDeviceInfo.serialNo==0) return false; // cannot identify device
+  sqlite3pp::query qry(db);
+  string sql = string_format(
+    "SELECT oemGtin, oemSerialNo, devInfStatus FROM busDeviceCache "
+    "WHERE gtin=%lld AND serialNo=%lld AND fwVersionMajor=%d AND fwVersionMinor=%d",
+    aDeviceInfo.gtin, aDeviceInfo.serialNo, aDeviceInfo.fw_version_major, aDeviceInfo.fw_version_minor
+  );
+  if (qry.prepare(sql.c_str())==SQLITE_OK) {
+    sqlite3pp::query::iterator i = qry.begin();
+    if (i!=qry.end()) {
+      // same device, same firmware -> use cached info
+      aDeviceInfo.oem_gtin = i->get<long long>(0);
+      aDeviceInfo.oem_serialNo = i->get<long long>(1);
+      aDeviceInfo.devInfStatus = (DaliDeviceInfo::DaliDevInfStatus)i->get<int>(2);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void DaliDeviceContainer::saveBusDeviceCache(DaliBusDeviceListPtr aBusDevices)
+{
+  // rewrite the cache in one transaction (one disk sync only, and never a partially written cache)
+  if (db.executef("BEGIN")!=SQLITE_OK) return;
+  bool ok = db.executef("DELETE FROM busDeviceCache")==SQLITE_OK;
+  for (DaliBusDeviceList::iterator pos = aBusDevices->begin(); ok && pos!=aBusDevices->end(); ++pos) {
+    DaliDeviceInfo &info = (*pos)->deviceInfo;
+    // only devices with valid GTIN/serial can be recognized later
+    if (info.devInfStatus==DaliDeviceInfo::devinf_none || info.gtin==0 || info.serialNo==0) continue;
+    ok = db.executef(
+      "INSERT OR REPLACE INTO busDeviceCache (gtin, serialNo, fwVersionMajor, fwVersionMinor, oemGtin, oemSerialNo, devInfStatus) "
+      "VALUES (%lld, %lld, %d, %d, %lld, %lld, %d)",
+      info.gtin, info.serialNo,
+      info.fw_version_major, info.fw_version_minor,
+      info.oem_gtin, info.oem_serialNo,
+      (int)info.devInfStatus
+    )==SQLITE_OK;
+  }
+  if (!ok || db.executef("COMMIT")!=SQLITE_OK) {
+    LOG(LOG_ERR, "DALI bus device cache could not be saved: %s\n", db.error()->description().c_str());
+    db.executef("ROLLBACK");
+  }
+}
+
+
+#pragma mark - device info collection
+
+
+void DaliDeviceContainer::deviceListReceived(CompletedCB aCompletedCB, bool aUseCache, DaliComm::ShortAddressListPtr aDeviceListPtr, ErrorPtr aError)
 {
   // check if any devices
-  if (aError || aDeviceListPtr->size()==0)
+  if (aError || aDeviceListPtr->size()==0) {
+    if (Error::isOK(aError)) db.execute("DELETE FROM busDeviceCache"); // no devices, nothing to cache
     return aCompletedCB(aError); // no devices to query, completed
+  }
   // create a Dali bus device for every detected device
   DaliBusDeviceListPtr busDevices(new DaliBusDeviceList);
   for (DaliComm::ShortAddressList::iterator pos = aDeviceListPtr->begin(); pos!=aDeviceListPtr->end(); ++pos) {
@@ -138,18 +310,25 @@ void DaliDeviceContainer::deviceListReceived(CompletedCB aCompletedCB, DaliComm:
     busDevices->push_back(busDevice);
   }
   // now start collecting full device info for each device
-  queryNextDev(busDevices, busDevices->begin(), aCompletedCB, ErrorPtr());
+  queryNextDev(busDevices, busDevices->begin(), aCompletedCB, aUseCache, ErrorPtr());
 }
 
 
-void DaliDeviceContainer::queryNextDev(DaliBusDeviceListPtr aBusDevices, DaliBusDeviceList::iterator aNextDev, CompletedCB aCompletedCB, ErrorPtr aError)
+void DaliDeviceContainer::queryNextDev(DaliBusDeviceListPtr aBusDevices, DaliBusDeviceList::iterator aNextDev, CompletedCB aCompletedCB, bool aUseCache, ErrorPtr aError)
 {
   if (Error::isOK(aError)) {
     if (aNextDev != aBusDevices->end()) {
       DaliAddress addr = (*aNextDev)->deviceInfo.shortAddress;
-      daliComm->daliReadDeviceInfo(boost::bind(&DaliDeviceContainer::deviceInfoReceived, this, aBusDevices, aNextDev, aCompletedCB, _1, _2), addr);
+      if (aUseCache) {
+        // only read GTIN/serial first, full device info is needed only for devices not in the cache
+        daliComm->daliReadDeviceId(boost::bind(&DaliDeviceContainer::deviceIdReceived, this, aBusDevices, aNextDev, aCompletedCB, _1, _2), addr);
+        return;
+      }
+      daliComm->daliReadDeviceInfo(boost::bind(&DaliDeviceContainer::deviceInfoReceived, this, aBusDevices, aNextDev, aCompletedCB, aUseCache, _1, _2), addr);
       return;
     }
+    // - update the cache
+    saveBusDeviceCache(aBusDevices);
     // all done successfully, complete bus info now available in aBusDevices
     // - look for dimmers that are to be addressed as a group
     DaliBusDeviceListPtr dimmerDevices = DaliBusDeviceListPtr(new DaliBusDeviceList());
@@ -314,7 +493,24 @@ void DaliDeviceContainer::createDsDevices(DaliBusDeviceListPtr aDimmerDevices, C
 }
 
 
-void DaliDeviceContainer::deviceInfoReceived(DaliBusDeviceListPtr aBusDevices, DaliBusDeviceList::iterator aNextDev, CompletedCB aCompletedCB, DaliComm::DaliDeviceInfoPtr aDaliDeviceInfoPtr, ErrorPtr aError)
+void DaliDeviceContainer::deviceIdReceived(DaliBusDeviceListPtr aBusDevices, DaliBusDeviceList::iterator aNextDev, CompletedCB aCompletedCB, DaliComm::DaliDeviceInfoPtr aDaliDeviceInfoPtr, ErrorPtr aError)
+{
+  DaliAddress addr = (*aNextDev)->deviceInfo.shortAddress;
+  if (Error::isOK(aError) && cachedDeviceInfo(*aDaliDeviceInfoPtr)) {
+    // known device, no need to read full device info
+    LOG(LOG_INFO, "DALI device at short address %d found in cache: %s\n", addr, aDaliDeviceInfoPtr->description().c_str());
+    (*aNextDev)->setDeviceInfo(*aDaliDeviceInfoPtr);
+    ++aNextDev;
+    queryNextDev(aBusDevices, aNextDev, aCompletedCB, true, ErrorPtr());
+    return;
+  }
+  // new or replaced device, or changed firmware -> read full device info
+  LOG(LOG_NOTICE, "DALI device at short address %d not found in cache -> reading device info\n", addr);
+  daliComm->daliReadDeviceInfo(boost::bind(&DaliDeviceContainer::deviceInfoReceived, this, aBusDevices, aNextDev, aCompletedCB, true, _1, _2), addr);
+}
+
+
+void DaliDeviceContainer::deviceInfoReceived(DaliBusDeviceListPtr aBusDevices, DaliBusDeviceList::iterator aNextDev, CompletedCB aCompletedCB, bool aUseCache, DaliComm::DaliDeviceInfoPtr aDaliDeviceInfoPtr, ErrorPtr aError)
 {
   bool missingData = aError && aError->isError(DaliCommError::domain(), DaliCommErrorMissingData);
   bool badData =
@@ -333,7 +529,7 @@ void DaliDeviceContainer::deviceInfoReceived(DaliBusDeviceListPtr aBusDevices, D
   }
   // check next
   ++aNextDev;
-  queryNextDev(aBusDevices, aNextDev, aCompletedCB, ErrorPtr());
+  queryNextDev(aBusDevices, aNextDev, aCompletedCB, aUseCache, ErrorPtr());
 }
 
 
@@ -76,6 +76,20 @@ void Enocean4BSDevice::sendTeachInResponse()
 }
 
 
+void Enocean4BSDevice::dispatchToChannels(Esp3PacketPtr aEsp3PacketPtr)
+{
+  // check and extract data only once, not for every channel
+  if (aEsp3PacketPtr->eepRorg()==rorg_4BS && aEsp3PacketPtr->radioUserDataLength()==4 && !aEsp3PacketPtr->eepHasTeachInfo()) {
+    // only look at non-teach-in 4BS packets of correct length
+    uint32_t data = aEsp3PacketPtr->get4BSdata();
+    for (EnoceanChannelHandlerVector::iterator pos = channels.begin(); pos!=channels.end(); ++pos) {
+      // Note: 4BS devices are only created by Enocean4bsHandler factories, so all channels are Enocean4bsHandlers
+      static_cast<Enocean4bsHandler *>(pos->get())->handle4BSdata(data);
+    }
+  }
+}
+
+
 
 #pragma mark - Enocean4BSHandler
 
@@ -121,6 +135,15 @@ void Enocean4bsHandler::prepare4BSpacket(Esp3PacketPtr &aOutgoingPacket, uint32_
 }
 
 
+void Enocean4bsHandler::handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr)
+{
+  if (aEsp3PacketPtr->eepRorg()==rorg_4BS && aEsp3PacketPtr->radioUserDataLength()==4 && !aEsp3PacketPtr->eepHasTeachInfo()) {
+    // only look at non-teach-in 4BS packets of correct length
+    handle4BSdata(aEsp3PacketPtr->get4BSdata());
+  }
+}
+
+
 
 #pragma mark - generic table driven sensor handler
 
@@ -133,8 +156,9 @@ namespace p44 {
 
   /// decoder function
   /// @param aDescriptor descriptor for data to extract
+  /// @param aBehaviour the behaviour to update, must be of the descriptor's behaviourType
   /// @param a4BSdata the 4BS data as 32-bit value, MSB=enocean DB_3, LSB=enocean DB_0
-  typedef void (*BitFieldHandlerFunc)(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, DsBehaviourPtr aBehaviour, bool aForSend, uint32_t &a4BSdata);
+  typedef void (*BitFieldHandlerFunc)(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, const DsBehaviourPtr &aBehaviour, bool aForSend, uint32_t &a4BSdata);
 
 
   /// enocean sensor value descriptor
@@ -163,24 +187,30 @@ namespace p44 {
 
 #pragma mark - bit field handlers for Enocean4bsSensorHandler
 
+// Note: the bit field handlers are called for every telegram, so they avoid dynamic casts and smart pointer copies.
+//   Behaviours are always created by Enocean4bsSensorHandler::newSensorBehaviour() according to the descriptor's
+//   behaviourType, so a handler can rely on getting the behaviour class it is made for.
+
+/// extract the bit field described by the descriptor's msBit/lsBit
+static inline uint32_t bitFieldValue(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, uint32_t a4BSdata)
+{
+  return (a4BSdata>>aSensorDescriptor.lsBit) & (0xFFFFFFFF>>(31-aSensorDescriptor.msBit+aSensorDescriptor.lsBit));
+}
+
+
 /// standard bitfield extractor function for sensor behaviours (read only)
-static void stdSensorHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, DsBehaviourPtr aBehaviour, bool aForSend, uint32_t &a4BSdata)
+static void stdSensorHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, const DsBehaviourPtr &aBehaviour, bool aForSend, uint32_t &a4BSdata)
 {
   if (!aForSend) {
-    uint32_t value = a4BSdata>>aSensorDescriptor.lsBit;
-    int numBits = aSensorDescriptor.msBit-aSensorDescriptor.lsBit+1;
-    long mask = (1l<<numBits)-1;
-    value &= mask;
-    // now pass to behaviour
-    SensorBehaviourPtr sb = boost::dynamic_pointer_cast<SensorBehaviour>(aBehaviour);
+    SensorBehaviour *sb = static_cast<SensorBehaviour *>(aBehaviour.get());
     if (sb) {
-      sb->updateEngineeringValue(value);
+      sb->updateEngineeringValue(bitFieldValue(aSensorDescriptor, a4BSdata));
     }
   }
 }
 
 /// inverted bitfield extractor function
-static void invSensorHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, DsBehaviourPtr aBehaviour, bool aForSend, uint32_t &a4BSdata)
+static void invSensorHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, const DsBehaviourPtr &aBehaviour, bool aForSend, uint32_t &a4BSdata)
 {
   if (!aForSend) {
     uint32_t data = ~a4BSdata;
@@ -190,7 +220,7 @@ static void invSensorHandler(const struct Enocean4BSSensorDescriptor &aSensorDes
 
 
 /// two-range illumination handler, as used in A5-06-01 and A5-06-02
-static void illumHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, DsBehaviourPtr aBehaviour, bool aForSend, uint32_t &a4BSdata)
+static void illumHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, const DsBehaviourPtr &aBehaviour, bool aForSend, uint32_t &a4BSdata)
 {
   uint32_t data = 0;
   if (!aForSend) {
@@ -211,7 +241,7 @@ static void illumHandler(const struct Enocean4BSSensorDescriptor &aSensorDescrip
 }
 
 
-static void powerMeterHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, DsBehaviourPtr aBehaviour, bool aForSend, uint32_t &a4BSdata)
+static void powerMeterHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, const DsBehaviourPtr &aBehaviour, bool aForSend, uint32_t &a4BSdata)
 {
   if (!aForSend) {
     // raw value is in DB3.7..DB1.0 (upper 24 bits)
@@ -223,7 +253,7 @@ static void powerMeterHandler(const struct Enocean4BSSensorDescriptor &aSensorDe
       case 2: divisor = 100; break; // value scale is 0.01kWh or 0.01W per LSB
       case 3: divisor = 1000; break; // value scale is 0.001kWh (1Wh) or 0.001W (1mW) per LSB
     }
-    SensorBehaviourPtr sb = boost::dynamic_pointer_cast<SensorBehaviour>(aBehaviour);
+    SensorBehaviour *sb = static_cast<SensorBehaviour *>(aBehaviour.get());
     if (sb) {
       // DB0.2 signals which value it is: 0=cumulative (energy), 1=current value (power)
       if (a4BSdata & 0x04) {
@@ -247,7 +277,7 @@ static void powerMeterHandler(const struct Enocean4BSSensorDescriptor &aSensorDe
 
 
 /// standard binary input handler
-static void stdInputHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, DsBehaviourPtr aBehaviour, bool aForSend, uint32_t &a4BSdata)
+static void stdInputHandler(const struct Enocean4BSSensorDescriptor &aSensorDescriptor, const DsBehaviourPtr &aBehaviour, bool aForSend, uint32_t &a4BSdata)
 {
   // read only
   if (!aForSend) {
@@ -258,7 +288,7 @@ static void stdInputHandler(const struct Enocean4BSSensorDescriptor &aSensorDesc
     else
       newState = (bool)aSensorDescriptor.min; // false: report value for min
     // now pass to behaviour
-    BinaryInputBehaviourPtr bb = boost::dynamic_pointer_cast<BinaryInputBehaviour>(aBehaviour);
+    BinaryInputBehaviour *bb = static_cast<BinaryInputBehaviour *>(aBehaviour.get());
     if (bb) {
       bb->updateInputState(newState);
     }
@@ -291,6 +321,7 @@ static const char *dayNightText = "Day/Night";
 
 
 
+// Note: all descriptors of a profile must be in consecutive entries, see enocean4BSprofileIndex
 static const p44::Enocean4BSSensorDescriptor enocean4BSdescriptors[] = {
   // func,type, SD,primarygroup,       channelGroup,                  behaviourType,          behaviourParam,        usage,              min,  max,  MSB,  LSB,  updateIv, aliveSignIv, handler,      typeText, unitText, flags
   // A5-02-xx: Temperature sensors
@@ -378,6 +409,72 @@ static const p44::Enocean4BSSensorDescriptor enocean4BSdescriptors[] = {
 };
 
 
+#pragma mark - profile index for enocean4BSdescriptors
+
+namespace {
+
+  /// index entry for the descriptors of one profile in enocean4BSdescriptors
+  typedef struct {
+    uint16_t funcType; ///< FUNC in the MSByte, TYPE in the LSByte
+    uint8_t first; ///< index of the first descriptor of the profile
+    uint8_t count; ///< number of descriptors of the profile
+  } ProfileIndexEntry;
+
+  typedef vector<ProfileIndexEntry> ProfileIndex;
+
+  bool operator<(const ProfileIndexEntry &aEntry, uint16_t aFuncType) { return aEntry.funcType<aFuncType; }
+  bool operator<(const ProfileIndexEntry &aEntry1, const ProfileIndexEntry &aEntry2) { return aEntry1.funcType<aEntry2.funcType; }
+
+} // namespace
+
+
+/// sorted index of the profiles in enocean4BSdescriptors, built once at first use
+/// @note the descriptor table is constant, so the index never needs to be rebuilt
+static const ProfileIndex &enocean4BSprofileIndex()
+{
+  static ProfileIndex profileIndex;
+  if (profileIndex.empty()) {
+    for (int i=0; enocean4BSdescriptors[i].bitFieldHandler!=NULL; i++) {
+      uint16_t funcType = (enocean4BSdescriptors[i].func<<8) + enocean4BSdescriptors[i].type;
+      if (!profileIndex.empty() && profileIndex.back().funcType==funcType) {
+        // another descriptor of the same profile
+        profileIndex.back().count++;
+      }
+      else {
+        // first descriptor of a new profile
+        ProfileIndexEntry e;
+        e.funcType = funcType;
+        e.first = i;
+        e.count = 1;
+        profileIndex.push_back(e);
+      }
+    }
+    sort(profileIndex.begin(), profileIndex.end());
+  }
+  return profileIndex;
+}
+
+
+/// find the descriptors for a profile
+/// @param aFunc the function code from the EEP signature
+/// @param aType the type code from the EEP signature
+/// @param aNumDescriptors will be set to the number of descriptors found (0 if none)
+/// @return first descriptor for the profile, NULL if none
+static const Enocean4BSSensorDescriptor *profileDescriptors(EepFunc aFunc, EepType aType, int &aNumDescriptors)
+{
+  const ProfileIndex &profileIndex = enocean4BSprofileIndex();
+  uint16_t funcType = (aFunc<<8) + aType;
+  ProfileIndex::const_iterator pos = lower_bound(profileIndex.begin(), profileIndex.end(), funcType);
+  if (pos==profileIndex.end() || pos->funcType!=funcType) {
+    aNumDescriptors = 0;
+    return NULL;
+  }
+  aNumDescriptors = pos->count;
+  return &enocean4BSdescriptors[pos->first];
+}
+
+
+
 
 
 Enocean4bsSensorHandler::Enocean4bsSensorHandler(EnoceanDevice &aDevice) :
@@ -417,18 +514,18 @@ EnoceanDevicePtr Enocean4bsSensorHandler::newDevice(
 
   // create device from matching with sensor table
   int numDescriptors = 0; // number of descriptors
-  // Search descriptors for this EEP and for the start of channels for this aSubDeviceIndex (in case sensors in one physical devices are split into multiple vdSDs)
+  // Search descriptors of this EEP for the start of channels for this aSubDeviceIndex (in case sensors in one physical devices are split into multiple vdSDs)
   const Enocean4BSSensorDescriptor *subdeviceDescP = NULL;
-  const Enocean4BSSensorDescriptor *descP = enocean4BSdescriptors;
-  while (descP->bitFieldHandler!=NULL) {
-    if (descP->func==func && descP->type==type) {
-      // remember if this is the subdevice we are looking for
-      if (descP->subDevice==aSubDeviceIndex) {
-        if (!subdeviceDescP) subdeviceDescP = descP; // remember the first descriptor of this subdevice as starting point for creating handlers below
-        numDescriptors++; // count descriptors for this subdevice as a limit for creating handlers below
-      }
+  int numProfileDescriptors;
+  const Enocean4BSSensorDescriptor *descP = profileDescriptors(func, type, numProfileDescriptors);
+  while (numProfileDescriptors>0) {
+    // remember if this is the subdevice we are looking for
+    if (descP->subDevice==aSubDeviceIndex) {
+      if (!subdeviceDescP) subdeviceDescP = descP; // remember the first descriptor of this subdevice as starting point for creating handlers below
+      numDescriptors++; // count descriptors for this subdevice as a limit for creating handlers below
     }
     descP++;
+    numProfileDescriptors--;
   }
   // Create device and channels
   bool needsTeachInResponse = false;
@@ -532,19 +629,11 @@ DsBehaviourPtr Enocean4bsSensorHandler::newSensorBehaviour(const Enocean4BSSenso
 
 
 // handle incoming data from device and extract data for this channel
-void Enocean4bsSensorHandler::handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr)
+void Enocean4bsSensorHandler::handle4BSdata(uint32_t a4BSdata)
 {
-  if (!aEsp3PacketPtr->eepHasTeachInfo()) {
-    // only look at non-teach-in packets
-    if (aEsp3PacketPtr->eepRorg()==rorg_4BS && aEsp3PacketPtr->radioUserDataLength()==4) {
-      // only look at 4BS packets of correct length
-      if (sensorChannelDescriptorP && sensorChannelDescriptorP->bitFieldHandler) {
-        // create 32bit data word
-        uint32_t data = aEsp3PacketPtr->get4BSdata();
-        // call bit field handler, will pass result to behaviour
-        sensorChannelDescriptorP->bitFieldHandler(*sensorChannelDescriptorP, behaviour, false, data);
-      }
-    }
+  if (sensorChannelDescriptorP && sensorChannelDescriptorP->bitFieldHandler) {
+    // call bit field handler, will pass result to behaviour
+    sensorChannelDescriptorP->bitFieldHandler(*sensorChannelDescriptorP, behaviour, false, a4BSdata);
   }
 }
 
@@ -630,39 +719,31 @@ EnoceanDevicePtr EnoceanA52001Handler::newDevice(
 
 
 // handle incoming data from device and extract data for this channel
-void EnoceanA52001Handler::handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr)
+void EnoceanA52001Handler::handle4BSdata(uint32_t a4BSdata)
 {
-  if (!aEsp3PacketPtr->eepHasTeachInfo()) {
-    // only look at non-teach-in packets
-    if (aEsp3PacketPtr->eepRorg()==rorg_4BS && aEsp3PacketPtr->radioUserDataLength()==4) {
-      // only look at 4BS packets of correct length
-      // sensor inputs will be checked by separate handlers, check error bits only, most fatal first
-      // - check actuator obstructed
-      uint32_t data = aEsp3PacketPtr->get4BSdata();
-      if ((data & DBMASK(2,0))!=0) {
-        LOG(LOG_ERR, "EnOcean valve %s error: actuator obstructed\n", shortDesc().c_str());
-        behaviour->setHardwareError(hardwareError_overload);
-      }
-      else if ((data & DBMASK(2,4))==0 && (data & DBMASK(2,5))==0) {
-        LOG(LOG_ERR, "EnOcean valve %s error: energy storage AND battery are low\n", shortDesc().c_str());
-        behaviour->setHardwareError(hardwareError_lowBattery);
-      }
-      // show general status if not fully ok
-      LOG(LOG_INFO,
-        "EnOcean valve %s status: Service %s, Energy input %s, Energy storage %scharged, Battery %s, Cover %s, Sensor %s, Detected window %s, Actuator %s\n",
-        shortDesc().c_str(),
-        data & DBMASK(2,7) ? "ON" : "off",
-        data & DBMASK(2,6) ? "enabled" : "disabled",
-        data & DBMASK(2,5) ? "" : "NOT ",
-        data & DBMASK(2,4) ? "ok" : "LOW",
-        data & DBMASK(2,3) ? "closed" : "OPEN",
-        data & DBMASK(2,2) ? "FAILURE" : "ok",
-        data & DBMASK(2,2) ? "open" : "closed",
-        data & DBMASK(2,2) ? "OBSTRUCTED" : "ok"
-      );
-
-    }
+  // sensor inputs will be checked by separate handlers, check error bits only, most fatal first
+  // - check actuator obstructed
+  if ((a4BSdata & DBMASK(2,0))!=0) {
+    LOG(LOG_ERR, "EnOcean valve %s error: actuator obstructed\n", shortDesc().c_str());
+    behaviour->setHardwareError(hardwareError_overload);
   }
+  else if ((a4BSdata & DBMASK(2,4))==0 && (a4BSdata & DBMASK(2,5))==0) {
+    LOG(LOG_ERR, "EnOcean valve %s error: energy storage AND battery are low\n", shortDesc().c_str());
+    behaviour->setHardwareError(hardwareError_lowBattery);
+  }
+  // show general status if not fully ok
+  LOG(LOG_INFO,
+    "EnOcean valve %s status: Service %s, Energy input %s, Energy storage %scharged, Battery %s, Cover %s, Sensor %s, Detected window %s, Actuator %s\n",
+    shortDesc().c_str(),
+    a4BSdata & DBMASK(2,7) ? "ON" : "off",
+    a4BSdata & DBMASK(2,6) ? "enabled" : "disabled",
+    a4BSdata & DBMASK(2,5) ? "" : "NOT ",
+    a4BSdata & DBMASK(2,4) ? "ok" : "LOW",
+    a4BSdata & DBMASK(2,3) ? "closed" : "OPEN",
+    a4BSdata & DBMASK(2,2) ? "FAILURE" : "ok",
+    a4BSdata & DBMASK(2,2) ? "open" : "closed",
+    a4BSdata & DBMASK(2,2) ? "OBSTRUCTED" : "ok"
+  );
 }
 
 
@@ -819,35 +900,28 @@ EnoceanDevicePtr EnoceanA5130XHandler::newDevice(
 
 
 // handle incoming data from device and extract data for this channel
-void EnoceanA5130XHandler::handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr)
+void EnoceanA5130XHandler::handle4BSdata(uint32_t a4BSdata)
 {
-  if (!aEsp3PacketPtr->eepHasTeachInfo()) {
-    // only look at non-teach-in packets
-    if (aEsp3PacketPtr->eepRorg()==rorg_4BS && aEsp3PacketPtr->radioUserDataLength()==4) {
-      // only look at 4BS packets of correct length
-      // - check identifier to see what info we got
-      uint32_t data = aEsp3PacketPtr->get4BSdata();
-      uint8_t identifier = (data>>4) & 0x0F;
-      switch (identifier) {
-        case 1:
-          // A5-13-01
-          A513dawnSensor.bitFieldHandler(A513dawnSensor, behaviour, false, data);
-          A513dawnSensor.bitFieldHandler(A513outdoorTemp, outdoorTemp, false, data);
-          A513dawnSensor.bitFieldHandler(A513windSpeed, windSpeed, false, data);
-          A513dawnSensor.bitFieldHandler(A513dayIndicator, dayIndicator, false, data);
-          A513dawnSensor.bitFieldHandler(A513rainIndicator, rainIndicator, false, data);
-          break;
-        case 2:
-          // A5-13-02
-          A513sunWest.bitFieldHandler(A513sunWest, sunWest, false, data);
-          A513sunSouth.bitFieldHandler(A513sunSouth, sunSouth, false, data);
-          A513sunEast.bitFieldHandler(A513sunEast, sunEast, false, data);
-          break;
-        default:
-          // A5-13-03..06 are not supported
-          break;
-      }
-    }
+  // - check identifier to see what info we got
+  uint8_t identifier = (a4BSdata>>4) & 0x0F;
+  switch (identifier) {
+    case 1:
+      // A5-13-01
+      A513dawnSensor.bitFieldHandler(A513dawnSensor, behaviour, false, a4BSdata);
+      A513outdoorTemp.bitFieldHandler(A513outdoorTemp, outdoorTemp, false, a4BSdata);
+      A513windSpeed.bitFieldHandler(A513windSpeed, windSpeed, false, a4BSdata);
+      A513dayIndicator.bitFieldHandler(A513dayIndicator, dayIndicator, false, a4BSdata);
+      A513rainIndicator.bitFieldHandler(A513rainIndicator, rainIndicator, false, a4BSdata);
+      break;
+    case 2:
+      // A5-13-02
+      A513sunWest.bitFieldHandler(A513sunWest, sunWest, false, a4BSdata);
+      A513sunSouth.bitFieldHandler(A513sunSouth, sunSouth, false, a4BSdata);
+      A513sunEast.bitFieldHandler(A513sunEast, sunEast, false, a4BSdata);
+      break;
+    default:
+      // A5-13-03..06 are not supported
+      break;
   }
 }
 
@@ -65,6 +65,16 @@ namespace p44 {
     /// @param a4BSdata will be set to already collected 4BS data (from already consulted channels or device global bits like LRN)
     void prepare4BSpacket(Esp3PacketPtr &aOutgoingPacket, uint32_t &a4BSdata);
 
+    /// handle radio packet related to this channel
+    /// @param aEsp3PacketPtr the radio packet to analyze and extract channel related information
+    /// @note only passes 4BS data telegrams on to handle4BSdata()
+    virtual void handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr);
+
+    /// handle 4BS data telegram related to this channel
+    /// @param a4BSdata the 4BS data as 32-bit value, MSB=enocean DB_3, LSB=enocean DB_0
+    /// @note Enocean4BSDevice checks the telegram and extracts the data only once for all of its channels
+    virtual void handle4BSdata(uint32_t a4BSdata) = 0;
+
   };
   typedef boost::intrusive_ptr<Enocean4bsHandler> Enocean4bsHandlerPtr;
 
@@ -87,6 +97,12 @@ namespace p44 {
     /// @note will be called from newDevice() when created device needs a teach-in response
     virtual void sendTeachInResponse();
 
+  protected:
+
+    /// pass 4BS data telegrams to the channels
+    /// @param aEsp3PacketPtr the radio packet
+    virtual void dispatchToChannels(Esp3PacketPtr aEsp3PacketPtr);
+
   };
 
 
@@ -142,9 +158,9 @@ namespace p44 {
     /// utility: get description string from sensor descriptor info
     static string sensorDesc(const Enocean4BSSensorDescriptor &aSensorDescriptor);
 
-    /// handle radio packet related to this channel
-    /// @param aEsp3PacketPtr the radio packet to analyze and extract channel related information
-    virtual void handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr);
+    /// handle 4BS data telegram related to this channel
+    /// @param a4BSdata the 4BS data as 32-bit value, MSB=enocean DB_3, LSB=enocean DB_0
+    virtual void handle4BSdata(uint32_t a4BSdata);
 
     /// check if channel is alive = has received life sign within timeout window
     virtual bool isAlive();
@@ -191,9 +207,9 @@ namespace p44 {
       bool aSendTeachInResponse
     );
 
-    /// handle radio packet related to this channel
-    /// @param aEsp3PacketPtr the radio packet to analyze and extract channel related information
-    virtual void handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr);
+    /// handle 4BS data telegram related to this channel
+    /// @param a4BSdata the 4BS data as 32-bit value, MSB=enocean DB_3, LSB=enocean DB_0
+    virtual void handle4BSdata(uint32_t a4BSdata);
 
     /// collect data for outgoing message from this channel
     /// @param aEsp3PacketPtr must be set to a suitable packet if it is empty, or packet data must be augmented with
@@ -243,9 +259,9 @@ namespace p44 {
       bool aSendTeachInResponse
     );
 
-    /// handle radio packet related to this channel
-    /// @param aEsp3PacketPtr the radio packet to analyze and extract channel related information
-    virtual void handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr);
+    /// handle 4BS data telegram related to this channel
+    /// @param a4BSdata the 4BS data as 32-bit value, MSB=enocean DB_3, LSB=enocean DB_0
+    virtual void handle4BSdata(uint32_t a4BSdata);
 
     /// short (text without LFs!) description of object, mainly for referencing it in log messages
     /// @return textual description of object
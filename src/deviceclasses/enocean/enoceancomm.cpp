@@ -38,8 +38,50 @@ using namespace p44;
 // enoceansender hex up:
 // 55 00 07 07 01 7A F6 30 00 86 B8 1A 30 03 FF FF FF FF FF 00 C0
 
+
+// pool of recycled packet objects
+// Note: packets can be created and released on different threads (see EnoceanComm), so the pool is locked
+#define ESP3_PACKET_POOL_MAX 64 // max number of unused packet objects kept
+
+static pthread_mutex_t packetPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static void *packetPool = NULL; // linked via first word of each unused block
+static size_t packetPoolSize = 0;
+
+
+void *Esp3Packet::operator new(size_t aSize)
+{
+  if (aSize==sizeof(Esp3Packet)) {
+    pthread_mutex_lock(&packetPoolMutex);
+    void *p = packetPool;
+    if (p) {
+      packetPool = *(void **)p;
+      packetPoolSize--;
+    }
+    pthread_mutex_unlock(&packetPoolMutex);
+    if (p) return p;
+  }
+  return ::operator new(aSize);
+}
+
+
+void Esp3Packet::operator delete(void *aPtr, size_t aSize)
+{
+  if (!aPtr) return;
+  pthread_mutex_lock(&packetPoolMutex);
+  if (aSize==sizeof(Esp3Packet) && packetPoolSize<ESP3_PACKET_POOL_MAX) {
+    *(void **)aPtr = packetPool;
+    packetPool = aPtr;
+    packetPoolSize++;
+    aPtr = NULL;
+  }
+  pthread_mutex_unlock(&packetPoolMutex);
+  if (aPtr) ::operator delete(aPtr);
+}
+
+
 Esp3Packet::Esp3Packet() :
-  payloadP(NULL)
+  payloadP(NULL),
+  crcErrors(0)
 {
   clear();
 }
@@ -62,7 +104,7 @@ void Esp3Packet::clear()
 void Esp3Packet::clearData()
 {
   if (payloadP) {
-    if (payloadP) delete [] payloadP;
+    if (payloadP!=inlinePayload) delete [] payloadP;
     payloadP = NULL;
   }
   payloadSize = 0;
@@ -79,6 +121,7 @@ void Esp3Packet::clearData()
 //  5 : CRC over bytes 1..4
 
 #define ESP3_HEADERBYTES 6
+#define ESP3_MAX_PAYLOADBYTES 300 // data, optdata and CRC, larger packets are not accepted (see Esp3Packet::data())
 
 
 
@@ -176,9 +219,10 @@ size_t Esp3Packet::acceptBytes(size_t aNumBytes, uint8_t *aBytes)
         ++dataIndex;
         if (dataIndex==ESP3_HEADERBYTES) {
           // header including CRC received
-          // - check header CRC now
-          if (header[ESP3_HEADERBYTES-1]!=headerCRC()) {
-            // CRC mismatch
+          // - check header CRC now, and make sure we have a buffer according to dataLength() and optDataLength()
+          if (header[ESP3_HEADERBYTES-1]!=headerCRC() || !data()) {
+            // CRC mismatch, or payload too large to store (header with correct CRC by chance)
+            crcErrors++;
             // - replay from byte 1 (which could be a sync byte again)
             replayP = header+1; // consider 2nd byte of already received and stored header as potential start
             replayBytes = ESP3_HEADERBYTES-1;
@@ -186,9 +230,7 @@ size_t Esp3Packet::acceptBytes(size_t aNumBytes, uint8_t *aBytes)
             state = ps_syncwait;
           }
           else {
-            // CRC matches, now read data
-            // - make sure we have a buffer according to dataLength() and optDataLength()
-            data();
+            // CRC matches and buffer is ready, now read data
             dataIndex = 0; // start of data read
             // - enter payload read state
             state = ps_dataread;
@@ -204,6 +246,7 @@ size_t Esp3Packet::acceptBytes(size_t aNumBytes, uint8_t *aBytes)
           // - check payload CRC now
           if (payloadP[payloadSize-1]!=payloadCRC()) {
             // payload CRC mismatch, discard packet, start scanning for packet at next byte
+            crcErrors++;
             clear();
           }
           else {
@@ -229,14 +272,14 @@ uint8_t *Esp3Packet::data()
 {
   size_t s = dataLength()+optDataLength()+1; // one byte extra for CRC
   if (s!=payloadSize || !payloadP) {
-    if (payloadSize>300) {
+    if (s>ESP3_MAX_PAYLOADBYTES) {
       // safety - prevent huge telegrams
       clearData();
       return NULL;
     }
+    clearData();
     payloadSize = s;
-    if (payloadP) delete [] payloadP;
-    payloadP = new uint8_t[payloadSize];
+    payloadP = payloadSize<=ESP3_INLINE_PAYLOAD_SIZE ? inlinePayload : new uint8_t[payloadSize];
     memset(payloadP, 0, payloadSize); // zero out
   }
   return payloadP;
@@ -274,6 +317,164 @@ void Esp3Packet::finalize()
 
 
 
+#pragma mark - ESP3 stream parser
+
+
+Esp3Parser::Esp3Parser() :
+  crcErrors(0)
+{
+}
+
+
+void Esp3Parser::parse(size_t aNumBytes, const uint8_t *aBytes, Esp3PacketCB aPacketCB)
+{
+  if (pending.empty()) {
+    // usual case: scan directly in the receive buffer, only keep incomplete packet at the end
+    size_t used = scan(aBytes, aNumBytes, aPacketCB);
+    if (used<aNumBytes) pending.assign((const char *)aBytes+used, aNumBytes-used);
+  }
+  else {
+    // continue incomplete packet
+    pending.append((const char *)aBytes, aNumBytes);
+    size_t used = scan((const uint8_t *)pending.data(), pending.size(), aPacketCB);
+    pending.erase(0, used);
+  }
+}
+
+
+size_t Esp3Parser::scan(const uint8_t *aBytes, size_t aNumBytes, Esp3PacketCB &aPacketCB)
+{
+  size_t pos = 0;
+  while (pos<aNumBytes) {
+    // find sync byte
+    const uint8_t *syncP = (const uint8_t *)memchr(aBytes+pos, 0x55, aNumBytes-pos);
+    if (!syncP) return aNumBytes; // no packet start in the rest, discard it
+    pos = syncP-aBytes;
+    if (aNumBytes-pos<ESP3_HEADERBYTES) return pos; // header incomplete, keep it
+    // check header CRC
+    if (Esp3Packet::crc8(syncP+1, ESP3_HEADERBYTES-2)!=syncP[ESP3_HEADERBYTES-1]) {
+      // not a valid header, next sync byte could be within the bad header
+      crcErrors++;
+      pos++;
+      continue;
+    }
+    size_t payloadSize = (syncP[1]<<8) + syncP[2] + syncP[3] + 1; // data, optdata and CRC
+    if (payloadSize>ESP3_MAX_PAYLOADBYTES) {
+      // header with correct CRC by chance, or packet we could not store anyway: treat like bad header
+      crcErrors++;
+      pos++;
+      continue;
+    }
+    if (aNumBytes-pos<ESP3_HEADERBYTES+payloadSize) return pos; // payload incomplete, keep packet
+    const uint8_t *payloadP = syncP+ESP3_HEADERBYTES;
+    pos += ESP3_HEADERBYTES+payloadSize; // in any case, continue scanning after this packet
+    if (Esp3Packet::crc8(payloadP, payloadSize-1)!=payloadP[payloadSize-1]) {
+      // bad payload, discard packet
+      crcErrors++;
+      continue;
+    }
+    // valid packet
+    Esp3PacketPtr packet = Esp3PacketPtr(new Esp3Packet);
+    memcpy(packet->header, syncP, ESP3_HEADERBYTES);
+    memcpy(packet->data(), payloadP, payloadSize);
+    packet->state = Esp3Packet::ps_complete;
+    aPacketCB(packet);
+  }
+  return pos;
+}
+
+
+
+#pragma mark - duplicate telegram filter
+
+#define ESP3_DUPLICATE_FILTER_PROBES 4 // number of slots checked for a sender
+
+// default windows: copies from repeaters arrive within a few 100mS
+#define ESP3_DEFAULT_DUPLICATE_WINDOW_RPS (500*MilliSecond)
+#define ESP3_DEFAULT_DUPLICATE_WINDOW_1BS (500*MilliSecond)
+#define ESP3_DEFAULT_DUPLICATE_WINDOW_4BS (1*Second)
+#define ESP3_DEFAULT_DUPLICATE_WINDOW_OTHER (1*Second)
+
+
+Esp3DuplicateFilter::Esp3DuplicateFilter()
+{
+  memset(slots, 0, sizeof(slots));
+  windows[family_RPS] = ESP3_DEFAULT_DUPLICATE_WINDOW_RPS;
+  windows[family_1BS] = ESP3_DEFAULT_DUPLICATE_WINDOW_1BS;
+  windows[family_4BS] = ESP3_DEFAULT_DUPLICATE_WINDOW_4BS;
+  windows[family_other] = ESP3_DEFAULT_DUPLICATE_WINDOW_OTHER;
+  const char *help = "EnOcean radio telegrams ignored as copies of an already received telegram (e.g. from repeaters)";
+  suppressedMetrics[family_RPS] = Metrics::counter("vdcd_enocean_duplicates_suppressed_total", help, "family=\"RPS\"");
+  suppressedMetrics[family_1BS] = Metrics::counter("vdcd_enocean_duplicates_suppressed_total", help, "family=\"1BS\"");
+  suppressedMetrics[family_4BS] = Metrics::counter("vdcd_enocean_duplicates_suppressed_total", help, "family=\"4BS\"");
+  suppressedMetrics[family_other] = Metrics::counter("vdcd_enocean_duplicates_suppressed_total", help, "family=\"other\"");
+}
+
+
+void Esp3DuplicateFilter::setWindow(ProfileFamily aFamily, MLMicroSeconds aWindow)
+{
+  if (aFamily<numFamilies) windows[aFamily] = aWindow;
+}
+
+
+Esp3DuplicateFilter::ProfileFamily Esp3DuplicateFilter::familyOf(RadioOrg aRorg)
+{
+  switch (aRorg) {
+    case rorg_RPS: return family_RPS;
+    case rorg_1BS: return family_1BS;
+    case rorg_4BS: return family_4BS;
+    default: return family_other;
+  }
+}
+
+
+bool Esp3DuplicateFilter::isDuplicate(Esp3PacketPtr aPacket)
+{
+  if (aPacket->packetType()!=pt_radio) return false;
+  RadioOrg rorg = aPacket->eepRorg();
+  ProfileFamily family = familyOf(rorg);
+  MLMicroSeconds window = windows[family];
+  if (window<=0) return false; // filter disabled for this family
+  EnoceanAddress sender = aPacket->radioSender();
+  // FNV-1a hash of RORG, user data and status without repeater count
+  uint32_t h = 2166136261u;
+  h = (h^rorg)*16777619u;
+  uint8_t *d = aPacket->radioUserData();
+  for (size_t i=0; i<aPacket->radioUserDataLength(); i++) {
+    h = (h^d[i])*16777619u;
+  }
+  h = (h^(aPacket->radioStatus() & ~status_repeaterCount_mask))*16777619u;
+  // look up sender
+  MLMicroSeconds now = MainLoop::now();
+  uint32_t idx = ((sender*2654435761u)>>16) % ESP3_DUPLICATE_FILTER_SLOTS; // multiplicative hash
+  Slot *victim = NULL;
+  for (int i=0; i<ESP3_DUPLICATE_FILTER_PROBES; i++) {
+    Slot *slotP = &slots[(idx+i) % ESP3_DUPLICATE_FILTER_SLOTS];
+    if (slotP->lastSeen!=0 && slotP->sender==sender) {
+      // sender known
+      bool dup = slotP->dataHash==h && now-slotP->lastSeen<window;
+      if (dup) {
+        suppressedMetrics[family]->inc();
+        FOCUSLOG("Esp3DuplicateFilter: ignoring copy of telegram from %08X (repeater count %d)\n", sender, aPacket->radioRepeaterCount());
+      }
+      else {
+        // new telegram, remember it
+        slotP->dataHash = h;
+        slotP->lastSeen = now;
+      }
+      return dup;
+    }
+    if (!victim || slotP->lastSeen<victim->lastSeen) victim = slotP; // unused (0) or oldest slot
+  }
+  // sender not known yet, use unused or oldest slot
+  victim->sender = sender;
+  victim->dataHash = h;
+  victim->lastSeen = now;
+  return false;
+}
+
+
+
 #pragma mark - radio telegram specifics
 
 
@@ -782,11 +983,11 @@ uint8_t Esp3Packet::addToCrc8(uint8_t aByte, uint8_t aCRCValue)
 }
 
 
-uint8_t Esp3Packet::crc8(uint8_t *aDataP, size_t aNumBytes, uint8_t aCRCValue)
+uint8_t Esp3Packet::crc8(const uint8_t *aDataP, size_t aNumBytes, uint8_t aCRCValue)
 {
-  int i;
-  for (i = 0; i<aNumBytes; i++) {
-    aCRCValue = addToCrc8(aCRCValue, aDataP[i]);
+  const uint8_t *endP = aDataP+aNumBytes;
+  while (aDataP<endP) {
+    aCRCValue = CRC8Table[aCRCValue ^ *aDataP++];
   }
   return aCRCValue;
 }
@@ -874,6 +1075,87 @@ const char *EnoceanComm::manufacturerName(EnoceanManufacturer aManufacturerCode)
 #define ENOCEAN_ESP3_ALIVECHECK_INTERVAL (30*Second)
 #define ENOCEAN_ESP3_ALIVECHECK_TIMEOUT (3*Second)
 
+#define ENOCEAN_ESP3_RESPONSE_TIMEOUT (500*MilliSecond) // max time for the modem to answer a packet (ESP3 spec)
+#define ENOCEAN_ESP3_TX_RETRIES 3 // how often to retry a packet the modem could not accept for now
+#define ENOCEAN_ESP3_TX_RETRY_DELAY (250*MilliSecond)
+
+#define ENOCEAN_DEFAULT_TX_DUTY_CYCLE 0.01 // 1% duty cycle limit of the 868MHz SRD band
+#define ENOCEAN_DEFAULT_TX_MAX_BURST (360*MilliSecond) // allows for about 100 4BS telegrams in a burst
+
+
+#pragma mark - Esp3TxOperation
+
+namespace p44 {
+
+  /// a packet queued for sending, completes when the modem has answered with a RESPONSE packet
+  class Esp3TxOperation : public Operation
+  {
+    typedef Operation inherited;
+    friend class EnoceanComm;
+
+    EnoceanComm &enoceanComm;
+    Esp3PacketPtr packet;
+    Esp3TxClass txClass;
+    uint64_t coalesceKey; ///< 0 if not coalescable, otherwise identifies destination and RORG
+    Esp3ResponseCB responseCB;
+    MLMicroSeconds queuedAt;
+    int retries;
+    bool throttled; ///< set when sending had to be delayed because of the duty cycle limit
+    Esp3PacketPtr response;
+    ErrorPtr txError;
+
+  public:
+
+    Esp3TxOperation(EnoceanComm &aEnoceanComm, Esp3PacketPtr aPacket, Esp3TxClass aTxClass, Esp3ResponseCB aResponseCB) :
+      enoceanComm(aEnoceanComm),
+      packet(aPacket),
+      txClass(aTxClass),
+      coalesceKey(0),
+      responseCB(aResponseCB),
+      queuedAt(MainLoop::now()),
+      retries(0),
+      throttled(false)
+    {
+      if (txClass==esp3tx_actuator && packet->packetType()==pt_radio) {
+        coalesceKey = ((uint64_t)packet->eepRorg()<<32) + packet->radioDestination();
+      }
+      setTimeout(ENOCEAN_ESP3_RESPONSE_TIMEOUT);
+    };
+
+    virtual bool initiate()
+    {
+      if (!enoceanComm.transmitReady()) return false; // stay queued until connected
+      if (!enoceanComm.txBudgetAvailable(*this)) return false;
+      if (!inherited::initiate()) return false;
+      txError = enoceanComm.transmitPacket(packet);
+      return true;
+    };
+
+    virtual bool hasCompleted()
+    {
+      return response || txError;
+    };
+
+    virtual OperationPtr finalize(OperationQueue *aQueueP)
+    {
+      return enoceanComm.txCompleted(Esp3TxOperationPtr(this), txError);
+    };
+
+    virtual void abortOperation(ErrorPtr aError)
+    {
+      if (!aborted) {
+        aborted = true;
+        enoceanComm.txCompleted(Esp3TxOperationPtr(this), aError);
+      }
+    };
+
+  };
+
+} // namespace p44
+
+
+#pragma mark - EnoceanComm
+
 
 
 EnoceanComm::EnoceanComm(MainLoop &aMainLoop) :
@@ -882,8 +1164,21 @@ EnoceanComm::EnoceanComm(MainLoop &aMainLoop) :
   aliveTimeoutTicket(0),
   apiVersion(0),
   appVersion(0),
-  myAddress(0)
+  myAddress(0),
+  txDutyCycle(ENOCEAN_DEFAULT_TX_DUTY_CYCLE),
+  txMaxBurst(ENOCEAN_DEFAULT_TX_MAX_BURST),
+  txBudget(ENOCEAN_DEFAULT_TX_MAX_BURST),
+  txBudgetUpdated(MainLoop::now())
 {
+  traceLabel = "enocean";
+  rxTelegramsMetric = Metrics::counter("vdcd_enocean_rx_packets_total", "ESP3 packets received from the EnOcean modem");
+  txTelegramsMetric = Metrics::counter("vdcd_enocean_tx_packets_total", "ESP3 packets sent to the EnOcean modem");
+  crcErrorsMetric = Metrics::counter("vdcd_enocean_crc_errors_total", "ESP3 header or payload CRC errors");
+  txErrorsMetric = Metrics::counter("vdcd_enocean_tx_errors_total", "ESP3 packets that could not be sent");
+  txSupersededMetric = Metrics::counter("vdcd_enocean_tx_superseded_total", "actuator telegrams dropped because superseded before sending");
+  txThrottledMetric = Metrics::counter("vdcd_enocean_tx_throttled_total", "radio telegrams delayed to stay within the duty cycle limit");
+  txQueueDepthMetric = Metrics::gauge("vdcd_enocean_tx_queue_depth", "ESP3 packets queued for sending");
+  txLatencyMetric = Metrics::histogram("vdcd_enocean_tx_latency_seconds", "time from queueing an ESP3 packet until the modem has accepted it");
 }
 
 
@@ -906,14 +1201,30 @@ void EnoceanComm::setConnectionSpecification(const char *aConnectionSpec, uint16
 }
 
 
+void EnoceanComm::setTxDutyCycle(double aDutyCycle, MLMicroSeconds aMaxBurstAirtime)
+{
+  txDutyCycle = aDutyCycle;
+  txMaxBurst = aMaxBurstAirtime;
+  txBudget = txMaxBurst;
+  txBudgetUpdated = MainLoop::now();
+}
+
+
 void EnoceanComm::startWatchDog()
 {
   // schedule first alive check quickly
-  aliveCheckTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&EnoceanComm::aliveCheck, this), 2*Second);
+  callOnQueueThread(boost::bind(&EnoceanComm::startAliveChecks, this));
 }
 
 
 
+// runs on the communication thread
+void EnoceanComm::startAliveChecks()
+{
+  aliveCheckTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&EnoceanComm::aliveCheck, this), 2*Second);
+}
+
+
 void EnoceanComm::aliveCheck()
 {
   FOCUSLOG("EnoceanComm: checking enocean module operation by sending CO_RD_VERSION command\n");
@@ -924,16 +1235,31 @@ void EnoceanComm::aliveCheck()
   checkPacket->setDataLength(1); // CO_RD_VERSION has no parameters
   // set the command
   checkPacket->data()[0] = CO_RD_VERSION;
-  // send packet
-  sendPacket(checkPacket);
+  // queue packet (we are on the communication thread already)
+  queueTransmission(Esp3TxOperationPtr(new Esp3TxOperation(*this, checkPacket, esp3tx_modem, boost::bind(&EnoceanComm::aliveCheckResponse, this, _1, _2))));
   // schedule a response timeout.
-  // Note: for now, reception of any packet counts as successful alive check, actual response is not yet checked
+  // Note: reception of any packet counts as successful alive check, the response is only needed to get the versions
   aliveTimeoutTicket= MainLoop::currentMainLoop().executeOnce(boost::bind(&EnoceanComm::aliveCheckTimeout, this), ENOCEAN_ESP3_ALIVECHECK_TIMEOUT);
   // also schedule the next alive check
   aliveCheckTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&EnoceanComm::aliveCheck, this), ENOCEAN_ESP3_ALIVECHECK_INTERVAL);
 }
 
 
+void EnoceanComm::aliveCheckResponse(Esp3PacketPtr aResponsePacket, ErrorPtr aError)
+{
+  if (Error::isOK(aError) && aResponsePacket->dataLength()==33) {
+    // - extract versions
+    uint8_t *d = aResponsePacket->data();
+    // - atomic updates, because these are read from other threads
+    uint32_t v;
+    v = (d[1]<<24)+(d[2]<<16)+(d[3]<<8)+d[4]; __sync_lock_test_and_set(&appVersion, v);
+    v = (d[5]<<24)+(d[6]<<16)+(d[7]<<8)+d[8]; __sync_lock_test_and_set(&apiVersion, v);
+    v = (d[9]<<24)+(d[10]<<16)+(d[11]<<8)+d[12]; __sync_lock_test_and_set(&myAddress, v);
+    FOCUSLOG("Received CO_RD_VERSION  answer: appVersion=0x%08X, apiVersion=0x%08X, modemAddress=0x%08X\n", modemAppVersion(), modemApiVersion(), modemAddress());
+  }
+}
+
+
 void EnoceanComm::aliveCheckOK()
 {
   // cancel timeout (watchdog)
@@ -988,51 +1314,45 @@ size_t EnoceanComm::acceptBytes(size_t aNumBytes, uint8_t *aBytes)
     }
     FOCUSLOG("%s\n",d.c_str());
   }
-	size_t remainingBytes = aNumBytes;
-	while (remainingBytes>0) {
-		if (!currentIncomingPacket) {
-			currentIncomingPacket = Esp3PacketPtr(new Esp3Packet);
-		}
-		// pass bytes to current telegram
-		size_t consumedBytes = currentIncomingPacket->acceptBytes(remainingBytes, aBytes);
-		if (currentIncomingPacket->isComplete()) {
-      FOCUSLOG("Received Enocean Packet:\n%s", currentIncomingPacket->description().c_str());
-      dispatchPacket(currentIncomingPacket);
-      // forget the packet, further incoming bytes will create new packet
-			currentIncomingPacket = Esp3PacketPtr(); // forget
-		}
-		// continue with rest (if any)
-		aBytes+=consumedBytes;
-		remainingBytes-=consumedBytes;
-	}
-	return aNumBytes-remainingBytes;
+  // parse entire buffer, incomplete packet at the end is kept by the parser
+  parser.parse(aNumBytes, aBytes, boost::bind(&EnoceanComm::packetReceived, this, _1));
+  long crcErrors = parser.takeCrcErrors();
+  if (crcErrors>0) crcErrorsMetric->inc(crcErrors);
+	return aNumBytes;
+}
+
+
+void EnoceanComm::packetReceived(Esp3PacketPtr aPacket)
+{
+  FOCUSLOG("Received Enocean Packet:\n%s", aPacket->description().c_str());
+  dispatchPacket(aPacket);
 }
 
 
 void EnoceanComm::dispatchPacket(Esp3PacketPtr aPacket)
 {
+  rxTelegramsMetric->inc();
   // for now: any packet reception counts as successful alive check
   aliveCheckOK();
   // dispatch the packet
   PacketType pt = aPacket->packetType();
   if (pt==pt_radio) {
     // incoming radio packet
-    if (radioPacketHandler) {
-      // call the handler
-      radioPacketHandler(aPacket, ErrorPtr());
-    }
+    // - handler lives on the thread that created the EnoceanComm
+    callOnOwnerThread(boost::bind(&EnoceanComm::deliverRadioPacket, this, aPacket));
   }
   else if (pt==pt_response) {
-    // TODO: %%% have queue check for operations awaiting a response command
-    // check for version
-    if (aPacket->dataLength()==33) {
-      // %%% for now, the only pt_response is that related to CO_RD_VERSION sent by watchdog
-      // - extract versions
-      uint8_t *d = aPacket->data();
-      appVersion = (d[1]<<24)+(d[2]<<16)+(d[3]<<8)+d[4];
-      apiVersion = (d[5]<<24)+(d[6]<<16)+(d[7]<<8)+d[8];
-      myAddress = (d[9]<<24)+(d[10]<<16)+(d[11]<<8)+d[12];
-      FOCUSLOG("Received CO_RD_VERSION  answer: appVersion=0x%08X, apiVersion=0x%08X, modemAddress=0x%08X\n", appVersion, apiVersion, myAddress);
+    // response to the packet sent last
+    // - only the first operation in the queue can be waiting for it, as packets are sent one by one
+    Esp3TxOperationPtr txOp;
+    if (!operationQueue.empty()) txOp = boost::dynamic_pointer_cast<Esp3TxOperation>(operationQueue.front());
+    if (txOp && txOp->isInitiated() && !txOp->hasCompleted()) {
+      txOp->response = aPacket;
+      // let the queue finalize it and send the next packet
+      processOperations();
+    }
+    else {
+      FOCUSLOG("EnoceanComm: unexpected RESPONSE packet ignored\n");
     }
   }
   else {
@@ -1042,17 +1362,94 @@ void EnoceanComm::dispatchPacket(Esp3PacketPtr aPacket)
 
 
 
-void EnoceanComm::sendPacket(Esp3PacketPtr aPacket)
+// runs on the thread that created the EnoceanComm
+void EnoceanComm::deliverRadioPacket(Esp3PacketPtr aPacket)
+{
+  if (radioPacketHandler) {
+    // call the handler
+    radioPacketHandler(aPacket, ErrorPtr());
+  }
+}
+
+
+
+void EnoceanComm::sendPacket(Esp3PacketPtr aPacket, Esp3TxClass aTxClass)
+{
+  callOnQueueThread(boost::bind(&EnoceanComm::queueTransmission, this, Esp3TxOperationPtr(new Esp3TxOperation(*this, aPacket, aTxClass, NULL))));
+}
+
+
+// runs on the communication thread
+void EnoceanComm::queueTransmission(Esp3TxOperationPtr aTxOp)
+{
+  OperationList::iterator pos;
+  if (aTxOp->coalesceKey) {
+    // a newer telegram for the same actuator replaces one that is not yet sent, and takes its place in the queue
+    for (pos = operationQueue.begin(); pos!=operationQueue.end(); ++pos) {
+      Esp3TxOperationPtr op = boost::dynamic_pointer_cast<Esp3TxOperation>(*pos);
+      if (op && op->coalesceKey==aTxOp->coalesceKey && !op->isInitiated()) {
+        FOCUSLOG("EnoceanComm: actuator telegram to %08X superseded before sending\n", op->packet->radioDestination());
+        txSupersededMetric->inc();
+        *pos = aTxOp;
+        TRACE_EVENT(aTxOp->traceId, traceLabel, "queued", NULL);
+        op->abortOperation(ErrorPtr(new EnoceanCommError(EnoceanCommErrorSuperseded)));
+        return;
+      }
+    }
+  }
+  // queue after all packets of the same or a more urgent class
+  for (pos = operationQueue.begin(); pos!=operationQueue.end(); ++pos) {
+    Esp3TxOperationPtr op = boost::dynamic_pointer_cast<Esp3TxOperation>(*pos);
+    if (op && op->txClass>aTxOp->txClass && !op->isInitiated()) break;
+  }
+  operationQueue.insert(pos, aTxOp);
+  TRACE_EVENT(aTxOp->traceId, traceLabel, "queued", NULL);
+  updateTxQueueDepth();
+}
+
+
+// estimated airtime of a radio telegram: 3 subtelegrams, each the radio data plus about 8 bytes
+// of preamble, sync, length and CRC, at 125kbit/s (8uS per bit)
+static MLMicroSeconds radioAirtime(Esp3PacketPtr aPacket)
+{
+  return 3*(aPacket->dataLength()+8)*8*8;
+}
+
+
+// runs on the communication thread
+bool EnoceanComm::txBudgetAvailable(Esp3TxOperation &aTxOp)
+{
+  if (txDutyCycle<=0 || aTxOp.packet->packetType()!=pt_radio) return true; // no airtime limit
+  // refill airtime budget for the time passed
+  MLMicroSeconds now = MainLoop::now();
+  txBudget += (now-txBudgetUpdated)*txDutyCycle;
+  if (txBudget>txMaxBurst) txBudget = txMaxBurst;
+  txBudgetUpdated = now;
+  if (txBudget>=radioAirtime(aTxOp.packet)) return true;
+  if (!aTxOp.throttled) {
+    aTxOp.throttled = true;
+    txThrottledMetric->inc();
+    FOCUSLOG("EnoceanComm: duty cycle limit reached, delaying radio telegram\n");
+  }
+  return false;
+}
+
+
+// runs on the communication thread
+ErrorPtr EnoceanComm::transmitPacket(Esp3PacketPtr aPacket)
 {
   // finalize, calc CRC
   aPacket->finalize();
-  // transmit
-  // - fixed header
+  if (txDutyCycle>0 && aPacket->packetType()==pt_radio) {
+    txBudget -= radioAirtime(aPacket);
+  }
+  // transmit header and payload in a single write, so the modem always gets the complete frame at once
+  string frame((const char *)aPacket->header, ESP3_HEADERBYTES);
+  frame.append((const char *)aPacket->payloadP, aPacket->payloadSize);
   ErrorPtr err;
-  serialComm->transmitBytes(ESP3_HEADERBYTES, aPacket->header, err);
-  if (Error::isOK(err)) {
-    // - payload
-    serialComm->transmitBytes(aPacket->payloadSize, aPacket->payloadP, err);
+  size_t res = serialComm->transmitBytes(frame.size(), (const uint8_t *)frame.c_str(), err);
+  if (Error::isOK(err) && res!=frame.size()) {
+    err = ErrorPtr(new EnoceanCommError(EnoceanCommErrorTransmit, string_format("only %zu of %zu bytes sent", res, frame.size())));
   }
   if (!Error::isOK(err)) {
     LOG(LOG_ERR, "EnoceanComm: sendPacket: error sending packet over serial: %s\n", err->description().c_str());
@@ -1060,9 +1457,53 @@ void EnoceanComm::sendPacket(Esp3PacketPtr aPacket)
   else {
     FOCUSLOG("Sent EnOcean packet:\n%s", aPacket->description().c_str());
   }
+  return err;
 }
 
 
+// runs on the communication thread
+OperationPtr EnoceanComm::txCompleted(Esp3TxOperationPtr aTxOp, ErrorPtr aError)
+{
+  OperationPtr retryOp;
+  if (Error::isOK(aError)) {
+    uint8_t ret = aTxOp->response->dataLength()>0 ? aTxOp->response->data()[0] : RET_ERROR;
+    if (ret==RET_OK) {
+      txTelegramsMetric->inc();
+      // Note: histograms must be updated on the main thread
+      callOnOwnerThread(boost::bind(&MetricHistogram::observe, txLatencyMetric, MainLoop::now()-aTxOp->queuedAt));
+    }
+    else if ((ret==RET_NO_FREE_BUFFER || ret==RET_LOCK_SET) && aTxOp->retries<ENOCEAN_ESP3_TX_RETRIES) {
+      // modem cannot take the packet right now, try again a bit later
+      LOG(LOG_INFO, "EnoceanComm: modem busy (return code %d), retrying packet\n", ret);
+      Esp3TxOperationPtr op = Esp3TxOperationPtr(new Esp3TxOperation(*this, aTxOp->packet, aTxOp->txClass, aTxOp->responseCB));
+      op->queuedAt = aTxOp->queuedAt;
+      op->retries = aTxOp->retries+1;
+      op->throttled = aTxOp->throttled;
+      op->traceId = aTxOp->traceId;
+      op->setInitiationDelay(ENOCEAN_ESP3_TX_RETRY_DELAY);
+      retryOp = op;
+    }
+    else {
+      aError = ErrorPtr(new EnoceanCommError(EnoceanCommErrorResponse, string_format("modem return code %d", ret)));
+    }
+  }
+  if (!Error::isOK(aError)) {
+    if (!aError->isError(EnoceanCommError::domain(), EnoceanCommErrorSuperseded)) {
+      LOG(LOG_WARNING, "EnoceanComm: packet not sent: %s\n", aError->description().c_str());
+      txErrorsMetric->inc();
+    }
+  }
+  if (!retryOp && aTxOp->responseCB) {
+    Esp3ResponseCB cb = aTxOp->responseCB;
+    aTxOp->responseCB = NULL; // call once only
+    cb(aTxOp->response, aError);
+  }
+  updateTxQueueDepth();
+  return retryOp;
+}
 
 
-
+void EnoceanComm::updateTxQueueDepth()
+{
+  txQueueDepthMetric->set(operationQueue.size());
+}
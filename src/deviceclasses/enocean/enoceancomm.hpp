@@ -26,6 +26,7 @@
 
 #include "serialqueue.hpp"
 #include "digitalio.hpp"
+#include "metrics.hpp"
 
 using namespace std;
 
@@ -112,6 +113,16 @@ namespace p44 {
   #define CO_RD_SECURITY 0x15 // Read security information (level, keys)
   #define CO_WR_SECURITY 0x16 // Write security information (level, keys)
 
+  // response return codes
+  #define RET_OK 0x00 // OK, command is understood and triggered
+  #define RET_ERROR 0x01 // There is an error occurred
+  #define RET_NOT_SUPPORTED 0x02 // The functionality is not supported by that implementation
+  #define RET_WRONG_PARAM 0x03 // There was a wrong parameter in the command
+  #define RET_OPERATION_DENIED 0x04 // Operation denied
+  #define RET_LOCK_SET 0x05 // Duty cycle lock
+  #define RET_BUFFER_TO_SMALL 0x06 // The buffer is too small to process this telegram
+  #define RET_NO_FREE_BUFFER 0x07 // Currently all internal buffers are used
+
   /// Enocean Manufacturer number (11 bits)
   typedef uint16_t EnoceanManufacturer;
   // unknown marker
@@ -126,6 +137,11 @@ namespace p44 {
   const EnoceanAddress EnoceanBroadcast = 0xFFFFFFFF; // broadcast
 
 	class EnoceanComm;
+  class Esp3Parser;
+
+  /// payloads up to this size (data+optdata+CRC) are stored inline in the Esp3Packet, without extra allocation.
+  /// Covers all radio telegrams except large VLD/chained ones.
+  #define ESP3_INLINE_PAYLOAD_SIZE 64
 
   class Esp3Packet;
 	typedef boost::intrusive_ptr<Esp3Packet> Esp3PacketPtr;
@@ -135,6 +151,7 @@ namespace p44 {
     typedef P44Obj inherited;
 
     friend class EnoceanComm;
+    friend class Esp3Parser;
 
   public:
     typedef enum {
@@ -148,11 +165,13 @@ namespace p44 {
   private:
     // packet contents
     uint8_t header[6]; ///< the ESP3 header
-    uint8_t *payloadP; ///< the payload or NULL if none defined
+    uint8_t *payloadP; ///< the payload or NULL if none defined (points to inlinePayload for small payloads)
     size_t payloadSize; ///< the payload size
+    uint8_t inlinePayload[ESP3_INLINE_PAYLOAD_SIZE]; ///< storage for small payloads
     // scanner
     PacketState state; ///< scanning state
     size_t dataIndex; ///< data scanner index
+    int crcErrors; ///< number of header or payload CRC errors encountered while scanning for this packet
 
     
   public:
@@ -160,6 +179,10 @@ namespace p44 {
     Esp3Packet();
     virtual ~Esp3Packet();
 
+    /// packets are allocated from a pool of recycled packet objects
+    static void *operator new(size_t aSize);
+    static void operator delete(void *aPtr, size_t aSize);
+
     /// add one byte to a ESP3 CRC8
     /// @param aByte the byte to add
     /// @param aCRCValue the current CRC
@@ -170,7 +193,7 @@ namespace p44 {
     /// @param aNumBytes number of bytes
     /// @param aCRCValue start value, feed in existing CRC to continue adding bytes. Defaults to 0.
     /// @return updated CRC
-    static uint8_t crc8(uint8_t *aDataP, size_t aNumBytes, uint8_t aCRCValue = 0);
+    static uint8_t crc8(const uint8_t *aDataP, size_t aNumBytes, uint8_t aCRCValue = 0);
 
     /// clear the packet so that we can re-start accepting bytes and looking for packet start or
     /// start filling in information for creating an outgoing packet
@@ -185,8 +208,12 @@ namespace p44 {
     /// @param aNumBytes number of bytes ready for accepting
     /// @param aBytes pointer to bytes buffer
     /// @return number of bytes operation could accept, 0 if none (means that packet is already complete)
+    /// @note this parses byte by byte. To parse a stream of packets, Esp3Parser is more efficient.
     size_t acceptBytes(size_t aNumBytes, uint8_t *aBytes);
 
+    /// @return number of header or payload CRC errors acceptBytes() has encountered, resets the counter
+    int takeCrcErrors() { int e = crcErrors; crcErrors = 0; return e; };
+
 
     /// finalize packet to make it ready for sending (complete header fields, calculate CRCs)
     void finalize();
@@ -329,15 +356,144 @@ namespace p44 {
   };
 
 
+  /// callback for packets found by Esp3Parser
+  typedef boost::function<void (Esp3PacketPtr aEsp3PacketPtr)> Esp3PacketCB;
+
+  /// ESP3 stream parser
+  /// Scans entire receive buffers for sync bytes and validates header and payload CRCs over the buffered spans,
+  /// rather than passing every byte through a state machine. Only the bytes of an incomplete packet at the end
+  /// of a buffer are kept for the next call.
+  /// Resynchronisation is the same as with Esp3Packet::acceptBytes(): after a header CRC error, scanning for
+  /// the next sync byte restarts right after the sync byte of the bad header, after a payload CRC error, it
+  /// restarts after the bad packet.
+  class Esp3Parser
+  {
+    string pending; ///< bytes of a not yet complete packet from previous calls
+    long crcErrors; ///< number of CRC errors found so far
+
+  public:
+
+    Esp3Parser();
+
+    /// parse bytes
+    /// @param aNumBytes number of bytes
+    /// @param aBytes bytes received
+    /// @param aPacketCB called for every complete packet with valid CRCs found
+    void parse(size_t aNumBytes, const uint8_t *aBytes, Esp3PacketCB aPacketCB);
+
+    /// @return number of header or payload CRC errors found, resets the counter
+    long takeCrcErrors() { long e = crcErrors; crcErrors = 0; return e; };
+
+    /// forget bytes of incomplete packet
+    void reset() { pending.clear(); };
+
+  private:
+
+    size_t scan(const uint8_t *aBytes, size_t aNumBytes, Esp3PacketCB &aPacketCB);
+
+  };
+
+
+  /// number of senders the duplicate filter can track
+  #define ESP3_DUPLICATE_FILTER_SLOTS 256
+
+  /// Duplicate radio telegram filter
+  /// With repeaters, the same telegram arrives two or three times, with increasing repeater count. This filter
+  /// remembers the last telegram of each sender (by a hash of RORG, user data and status without repeater count)
+  /// and recognizes copies of it arriving within a time window. Comparing with the sender's last telegram only
+  /// (rather than with all its recent telegrams) makes sure quickly repeated identical actions, which are always
+  /// separated by other telegrams (e.g. press-release-press of a rocker), are never suppressed.
+  /// @note memory is fixed, lookup is a hash of the sender address with a short linear probe. When all probed slots
+  ///   are in use, the oldest is replaced, which can only cause a duplicate to be passed, never a telegram to be lost.
+  class Esp3DuplicateFilter
+  {
+  public:
+
+    /// profile families with separately configurable time windows
+    typedef enum {
+      family_RPS,
+      family_1BS,
+      family_4BS,
+      family_other, ///< VLD and everything else
+      numFamilies
+    } ProfileFamily;
+
+  private:
+
+    typedef struct {
+      EnoceanAddress sender;
+      uint32_t dataHash;
+      MLMicroSeconds lastSeen; ///< 0 if slot is unused
+    } Slot;
+    Slot slots[ESP3_DUPLICATE_FILTER_SLOTS];
+
+    MLMicroSeconds windows[numFamilies];
+    MetricCounterPtr suppressedMetrics[numFamilies];
+
+  public:
+
+    Esp3DuplicateFilter();
+
+    /// set time window for recognizing duplicates
+    /// @param aFamily profile family
+    /// @param aWindow max time between the original telegram and its copies, 0 to disable the filter for this family
+    void setWindow(ProfileFamily aFamily, MLMicroSeconds aWindow);
+
+    /// check a received radio packet, and remember it as its sender's last telegram
+    /// @param aPacket radio packet
+    /// @return true if aPacket is a copy of a telegram already seen, and should not be processed
+    bool isDuplicate(Esp3PacketPtr aPacket);
+
+    /// @param aRorg radio org
+    /// @return profile family aRorg belongs to
+    static ProfileFamily familyOf(RadioOrg aRorg);
+
+  };
+
+
   typedef boost::function<void (Esp3PacketPtr aEsp3PacketPtr, ErrorPtr aError)> RadioPacketCB;
 
+  typedef enum {
+    EnoceanCommErrorOK,
+    EnoceanCommErrorResponse, ///< modem answered with a return code other than RET_OK
+    EnoceanCommErrorTransmit, ///< packet could not be written to the modem
+    EnoceanCommErrorSuperseded, ///< packet was replaced by a newer one before being sent
+  } EnoceanCommErrors;
+
+  class EnoceanCommError : public Error
+  {
+  public:
+    static const char *domain() { return "EnoceanComm"; }
+    virtual const char *getErrorDomain() const { return EnoceanCommError::domain(); };
+    EnoceanCommError(EnoceanCommErrors aError) : Error(ErrorCode(aError)) {};
+    EnoceanCommError(EnoceanCommErrors aError, std::string aErrorMessage) : Error(ErrorCode(aError), aErrorMessage) {};
+  };
+
+
+  /// callback for the modem's RESPONSE to a sent packet
+  /// @param aResponsePacket the RESPONSE packet, NULL when no response was received
+  /// @param aError set when the packet could not be sent or no response was received in time
+  typedef boost::function<void (Esp3PacketPtr aResponsePacket, ErrorPtr aError)> Esp3ResponseCB;
+
+  /// transmit classes, determining the order in which queued packets are sent
+  typedef enum {
+    esp3tx_modem, ///< command for the modem itself, sent before any queued radio telegram
+    esp3tx_actuator, ///< radio telegram carrying the complete new state of an actuator. Replaces an actuator telegram
+                     ///  to the same destination that is still waiting in the queue
+    esp3tx_normal, ///< other radio telegrams (teach-in responses etc.), sent after queued actuator telegrams
+  } Esp3TxClass;
+
+  class Esp3TxOperation;
+  typedef boost::intrusive_ptr<Esp3TxOperation> Esp3TxOperationPtr;
+
   typedef boost::intrusive_ptr<EnoceanComm> EnoceanCommPtr;
 	// Enocean communication
 	class EnoceanComm : public SerialOperationQueue
 	{
 		typedef SerialOperationQueue inherited;
+    friend class Esp3TxOperation;
 		
-		Esp3PacketPtr currentIncomingPacket;
+		Esp3Parser parser;
     RadioPacketCB radioPacketHandler;
 
     DigitalIoPtr enoceanResetPin;
@@ -347,6 +503,22 @@ namespace p44 {
     uint32_t appVersion;
     uint32_t apiVersion;
     EnoceanAddress myAddress;
+
+    // transmit duty cycle
+    double txDutyCycle; ///< fraction of time the radio may be transmitting, 0 for no limit
+    MLMicroSeconds txMaxBurst; ///< max airtime that can be used in a burst
+    double txBudget; ///< airtime currently available (in MLMicroSeconds, as double so frequent refills do not lose fractions)
+    MLMicroSeconds txBudgetUpdated; ///< when txBudget was last refilled
+
+    // metrics
+    MetricCounterPtr rxTelegramsMetric;
+    MetricCounterPtr txTelegramsMetric;
+    MetricCounterPtr crcErrorsMetric;
+    MetricCounterPtr txErrorsMetric;
+    MetricCounterPtr txSupersededMetric;
+    MetricCounterPtr txThrottledMetric;
+    MetricGaugePtr txQueueDepthMetric;
+    MetricHistogramPtr txLatencyMetric;
 		
 	public:
 		
@@ -362,17 +534,23 @@ namespace p44 {
     /// start the EnOcean modem watchdog (regular version commands, hard reset if no answer in time)
     void startWatchDog();
 
+    /// set the radio duty cycle limit for sending
+    /// @param aDutyCycle max fraction of time the radio may be transmitting (0.01 = 1%), 0 for no limit
+    /// @param aMaxBurstAirtime max airtime that can be used in a burst (after a longer time without sending)
+    /// @note must be called before any packets are sent
+    void setTxDutyCycle(double aDutyCycle, MLMicroSeconds aMaxBurstAirtime);
+
     /// get modem application version
     /// @return modem application version in 0xmmbbaaBB (mm=main version, bb=beta/minor, aa=alpha/revision, BB=build)
-    uint32_t modemAppVersion() { return appVersion; }
+    uint32_t modemAppVersion() { return __sync_add_and_fetch(&appVersion, 0); }
 
     /// get modem API version
     /// @return modem API version in 0xmmbbaaBB (mm=main version, bb=beta/minor, aa=alpha/revision, BB=build)
-    uint32_t modemApiVersion() { return apiVersion; }
+    uint32_t modemApiVersion() { return __sync_add_and_fetch(&apiVersion, 0); }
 
     /// get modem Enocean chip ID (enocean address)
     /// @return modem enocean address
-    EnoceanAddress modemAddress() { return myAddress; }
+    EnoceanAddress modemAddress() { return __sync_add_and_fetch(&myAddress, 0); }
 
 
     /// derived implementation: deliver bytes to the ESP3 parser
@@ -382,11 +560,18 @@ namespace p44 {
     virtual size_t acceptBytes(size_t aNumBytes, uint8_t *aBytes);
 
     /// set callback to handle received radio packets 
+    /// @note the handler is always called on the thread that created the EnoceanComm, even if the EnoceanComm
+    ///   runs on its own thread (see OperationQueue::runsOnOwnThread())
     void setRadioPacketHandler(RadioPacketCB aRadioPacketCB);
 
     /// send a packet
     /// @param aPacket a Esp4Packet which must be ready for being finalize()d
-    void sendPacket(Esp3PacketPtr aPacket);
+    /// @param aTxClass determines the order of sending and if the packet may be replaced by a newer one while queued
+    /// @note packets are queued and sent one by one, each waiting for the modem's RESPONSE. Radio telegrams are
+    ///   delayed as needed to stay within the duty cycle limit (see setTxDutyCycle())
+    /// @note when the EnoceanComm runs on its own thread, the packet is passed to that thread for sending,
+    ///   so the caller must not modify aPacket any more after calling sendPacket()
+    void sendPacket(Esp3PacketPtr aPacket, Esp3TxClass aTxClass = esp3tx_normal);
 
     /// manufacturer name lookup
     /// @param aManufacturerCode EEP manufacturer code
@@ -401,7 +586,16 @@ namespace p44 {
 
   private:
 
+    void packetReceived(Esp3PacketPtr aPacket);
+    void queueTransmission(Esp3TxOperationPtr aTxOp);
+    bool txBudgetAvailable(Esp3TxOperation &aTxOp);
+    ErrorPtr transmitPacket(Esp3PacketPtr aPacket);
+    OperationPtr txCompleted(Esp3TxOperationPtr aTxOp, ErrorPtr aError);
+    void updateTxQueueDepth();
+    void deliverRadioPacket(Esp3PacketPtr aPacket);
+    void startAliveChecks();
     void aliveCheck();
+    void aliveCheckResponse(Esp3PacketPtr aResponsePacket, ErrorPtr aError);
     void aliveCheckTimeout();
     void aliveCheckOK();
     void resetDone();
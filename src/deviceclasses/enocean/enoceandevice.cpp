@@ -241,8 +241,8 @@ void EnoceanDevice::sendOutgoingUpdate()
       outgoingEsp3Packet->setRadioDestination(enoceanAddress); // the target is the device I manage
       outgoingEsp3Packet->finalize();
       LOG(LOG_INFO, "EnOcean device %s: sending outgoing packet:\n%s", shortDesc().c_str(), outgoingEsp3Packet->description().c_str());
-      // send it
-      getEnoceanDeviceContainer().enoceanComm.sendPacket(outgoingEsp3Packet);
+      // send it (carries the complete state, so it replaces an update not yet sent)
+      getEnoceanDeviceContainer().enoceanComm.sendPacket(outgoingEsp3Packet, esp3tx_actuator);
     }
   }
 }
@@ -272,10 +272,8 @@ void EnoceanDevice::handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr)
   lastPacketTime = MainLoop::now();
   lastRSSI = aEsp3PacketPtr->radioDBm();
   lastRepeaterCount = aEsp3PacketPtr->radioRepeaterCount();
-  // pass to every channel
-  for (EnoceanChannelHandlerVector::iterator pos = channels.begin(); pos!=channels.end(); ++pos) {
-    (*pos)->handleRadioPacket(aEsp3PacketPtr);
-  }
+  // let channels process the packet
+  dispatchToChannels(aEsp3PacketPtr);
   // if device cannot be updated whenever output value change is requested, send updates after receiving a message
   if (pendingDeviceUpdate || updateAtEveryReceive) {
     // send updates, if any
@@ -286,6 +284,15 @@ void EnoceanDevice::handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr)
 }
 
 
+void EnoceanDevice::dispatchToChannels(Esp3PacketPtr aEsp3PacketPtr)
+{
+  // pass to every channel
+  for (EnoceanChannelHandlerVector::iterator pos = channels.begin(); pos!=channels.end(); ++pos) {
+    (*pos)->handleRadioPacket(aEsp3PacketPtr);
+  }
+}
+
+
 void EnoceanDevice::checkPresence(PresenceCB aPresenceResultHandler)
 {
   bool present = true;
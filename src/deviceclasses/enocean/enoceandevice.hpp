@@ -105,8 +105,6 @@ namespace p44 {
     const char *iconBaseName; ///< icon base name
     bool groupColoredIcon; ///< if set, use color suffix with icon base name
 
-    EnoceanChannelHandlerVector channels; ///< the channel handlers for this device
-
     bool alwaysUpdateable; ///< if set, device updates are sent immediately, otherwise, updates are only sent as response to a device message
     bool updateAtEveryReceive; ///< if set, current values are sent to the device whenever a message is received, even if output state has not changed
     bool pendingDeviceUpdate; ///< set when update to the device is pending
@@ -288,6 +286,13 @@ namespace p44 {
 
   protected:
 
+    EnoceanChannelHandlerVector channels; ///< the channel handlers for this device
+
+    /// pass a received radio packet to the channels
+    /// @param aEsp3PacketPtr the radio packet
+    /// @note base class implementation passes packet to every channel's handleRadioPacket()
+    virtual void dispatchToChannels(Esp3PacketPtr aEsp3PacketPtr);
+
     // property access implementation
     virtual int numProps(int aDomain, PropertyDescriptorPtr aParentDescriptor);
     virtual PropertyDescriptorPtr getDescriptorByIndex(int aPropIndex, int aDomain, PropertyDescriptorPtr aParentDescriptor);
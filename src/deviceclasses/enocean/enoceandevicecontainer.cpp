@@ -30,11 +30,17 @@ EnoceanDeviceContainer::EnoceanDeviceContainer(int aInstanceNumber, DeviceContai
   selfTesting(false),
   disableProximityCheck(false),
   heatingValveSensorsEnabled(true),
-	enoceanComm(MainLoop::currentMainLoop())
+	enoceanComm(commMainLoop())
 {
 }
 
 
+EnoceanDeviceContainer::~EnoceanDeviceContainer()
+{
+  stopCommThread();
+}
+
+
 
 const char *EnoceanDeviceContainer::deviceClassIdentifier() const
 {
@@ -256,6 +262,10 @@ void EnoceanDeviceContainer::handleRadioPacket(Esp3PacketPtr aEsp3PacketPtr, Err
     LOG(LOG_INFO, "Radio packet error: %s\n", aError->description().c_str());
     return;
   }
+  // ignore copies of telegrams already processed (repeaters)
+  if (duplicateFilter.isDuplicate(aEsp3PacketPtr)) {
+    return;
+  }
   // check learning mode
   if (learningMode) {
     // no learn/unlearn actions detected so far
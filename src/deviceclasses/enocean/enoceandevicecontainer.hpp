@@ -95,12 +95,16 @@ namespace p44 {
   public:
 
     EnoceanDeviceContainer(int aInstanceNumber, DeviceContainer *aDeviceContainerP, int aTag);
+    virtual ~EnoceanDeviceContainer();
 		
 		void initialize(CompletedCB aCompletedCB, bool aFactoryReset);
 
     // the Enocean communication object
     EnoceanComm enoceanComm;
 
+    // filter for copies of radio telegrams (from repeaters), time windows can be configured per profile family
+    Esp3DuplicateFilter duplicateFilter;
+
     // dS-specific flag that can be cleared to suppress including sensors on heating valves (A5-20-01)
     bool heatingValveSensorsEnabled;
 
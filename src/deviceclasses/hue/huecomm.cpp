@@ -32,7 +32,8 @@ HueApiOperation::HueApiOperation(HueComm &aHueComm, HttpMethods aMethod, const c
   url(aUrl),
   data(aData),
   resultHandler(aResultHandler),
-  completed(false)
+  completed(false),
+  requestStartTime(Never)
 {
 }
 
@@ -57,7 +58,12 @@ bool HueApiOperation::initiate()
     case httpMethodDELETE : methodStr = "DELETE"; break;
     default : methodStr = "GET"; data.reset(); break;
   }
-  hueComm.bridgeAPIComm.jsonRequest(url.c_str(), boost::bind(&HueApiOperation::processAnswer, this, _1, _2), methodStr, data);
+  if (!hueComm.bridgeAPIComm.jsonRequest(url.c_str(), boost::bind(&HueApiOperation::processAnswer, this, _1, _2), methodStr, data)) {
+    // bridgeAPIComm still busy with another request, queue will retry later
+    return false;
+  }
+  hueComm.requestsMetric->inc();
+  requestStartTime = MainLoop::now();
   // executed
   return inherited::initiate();
 }
@@ -67,6 +73,7 @@ bool HueApiOperation::initiate()
 void HueApiOperation::processAnswer(JsonObjectPtr aJsonResponse, ErrorPtr aError)
 {
   error = aError;
+  hueComm.latencyMetric->observe(MainLoop::now()-requestStartTime);
   if (Error::isOK(error)) {
     // pre-process response in case of non-GET
     if (method!=httpMethodGET) {
@@ -110,6 +117,7 @@ void HueApiOperation::processAnswer(JsonObjectPtr aJsonResponse, ErrorPtr aError
       data = aJsonResponse;
     }
   }
+  if (!Error::isOK(error)) hueComm.errorsMetric->inc();
   // done
   completed = true;
   // have queue reprocessed
@@ -139,7 +147,7 @@ OperationPtr HueApiOperation::finalize(p44::OperationQueue *aQueueP)
 void HueApiOperation::abortOperation(ErrorPtr aError)
 {
   if (!aborted) {
-    if (!completed) {
+    if (isInitiated() && !completed) {
       hueComm.bridgeAPIComm.cancelRequest();
     }
     if (resultHandler) {
@@ -157,6 +165,9 @@ void HueApiOperation::abortOperation(ErrorPtr aError)
 // string used in place of UUID when using fixed hue API URL
 #define PSEUDO_UUID_FOR_FIXED_API "fixed_api_base_URL"
 
+// max time to wait for the bridge to answer at the cached API base URL
+#define CACHED_URL_CHECK_TIMEOUT (5*Second)
+
 class p44::BridgeFinder : public P44Obj
 {
   HueComm &hueComm;
@@ -178,6 +189,15 @@ public:
   MLMicroSeconds startedAuth; ///< when auth was started
   long retryLoginTicket;
 
+  // cached base URL validation
+  JsonWebClient cacheCheckComm; ///< separate client, as SSDP refind runs in parallel
+  bool validatingCache; ///< set while the cached base URL is being checked
+  long cacheCheckTicket;
+  JsonWebClient descriptionComm; ///< separate client for description XML, so hueComm.bridgeAPIComm is free as soon as the bridge is found
+  bool descriptionPending; ///< set while a description XML request is in progress
+  bool refindReported; ///< set when refind result has been reported
+  ErrorPtr searchError; ///< SSDP refind failure, reported only if the cached base URL turns out invalid as well
+
   // params and results
   string uuid; ///< the UUID for searching the hue bridge via SSDP
   string userName; ///< the user name / token
@@ -188,7 +208,13 @@ public:
     callback(aFindHandler),
     hueComm(aHueComm),
     startedAuth(Never),
-    retryLoginTicket(0)
+    retryLoginTicket(0),
+    cacheCheckComm(MainLoop::currentMainLoop()),
+    validatingCache(false),
+    cacheCheckTicket(0),
+    descriptionComm(MainLoop::currentMainLoop()),
+    descriptionPending(false),
+    refindReported(false)
   {
     bridgeDetector = SsdpSearchPtr(new SsdpSearch(MainLoop::currentMainLoop()));
   }
@@ -196,6 +222,7 @@ public:
   virtual ~BridgeFinder()
   {
     MainLoop::currentMainLoop().cancelExecutionTicket(retryLoginTicket);
+    MainLoop::currentMainLoop().cancelExecutionTicket(cacheCheckTicket);
   }
 
   void findNewBridge(const char *aUserName, const char *aDeviceType, MLMicroSeconds aAuthTimeWindow, HueComm::HueBridgeFindCB aFindHandler)
@@ -229,8 +256,18 @@ public:
     uuid = hueComm.uuid;;
     userName = hueComm.userName;
     if (hueComm.fixedBaseURL.empty() && uuid!=PSEUDO_UUID_FOR_FIXED_API) {
-      // actually search for bridge
       keepAlive = BridgeFinderPtr(this);
+      if (!hueComm.cachedBaseURL.empty()) {
+        // try bridge at the address where we found it last time
+        // Note: usually, it is still there (DHCP leases are long), so this saves waiting for SSDP answers
+        validatingCache = true;
+        string url = hueComm.cachedBaseURL + "/" + userName + "/config";
+        DBGLOG(LOG_DEBUG, "Checking hue Bridge %s at last known API URL %s\n", uuid.c_str(), hueComm.cachedBaseURL.c_str());
+        cacheCheckComm.jsonRequest(url.c_str(), boost::bind(&BridgeFinder::handleCachedConfigAnswer, this, _1, _2));
+        cacheCheckTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&BridgeFinder::cachedConfigTimeout, this), CACHED_URL_CHECK_TIMEOUT);
+      }
+      // actually search for bridge
+      // Note: when checking cached URL, this runs in the background and is only used when the check fails
       bridgeDetector->startSearch(boost::bind(&BridgeFinder::bridgeRefindHandler, this, _1, _2), uuid.c_str());
     }
     else {
@@ -243,12 +280,102 @@ public:
   };
 
 
+  void handleCachedConfigAnswer(JsonObjectPtr aJsonResponse, ErrorPtr aError)
+  {
+    if (!validatingCache) return; // timed out already
+    validatingCache = false;
+    MainLoop::currentMainLoop().cancelExecutionTicket(cacheCheckTicket);
+    if (Error::isOK(aError) && aJsonResponse && isConfigOfBridge(aJsonResponse)) {
+      // the bridge is still at the cached address
+      hueComm.baseURL = hueComm.cachedBaseURL;
+      hueComm.apiReady = true; // can use API now
+      DBGLOG(LOG_DEBUG, "pre-known hue Bridge %s confirmed at last known API URL %s\n", hueComm.uuid.c_str(), hueComm.baseURL.c_str());
+      refindEnded(ErrorPtr()); // success
+      return;
+    }
+    LOG(LOG_INFO, "hue Bridge %s not accessible at last known API URL %s, relying on SSDP search\n", uuid.c_str(), hueComm.cachedBaseURL.c_str());
+    if (searchError) {
+      // SSDP search has failed as well
+      refindEnded(searchError);
+    }
+  }
+
+
+  void cachedConfigTimeout()
+  {
+    cacheCheckTicket = 0;
+    cacheCheckComm.cancelRequest();
+    handleCachedConfigAnswer(JsonObjectPtr(), ErrorPtr(new HueCommError(HueCommErrorUuidNotFound, "no answer at last known API URL")));
+  }
+
+
+  /// @return true if aConfig is the configuration of the bridge we are looking for, accessible with our user name
+  bool isConfigOfBridge(JsonObjectPtr aConfig)
+  {
+    // - invalid user names return an error array, or only a subset of the config without the whitelist
+    if (!aConfig->isType(json_type_object) || !aConfig->get("whitelist")) return false;
+    // - bridge UUIDs end with the MAC address
+    JsonObjectPtr o = aConfig->get("mac");
+    if (!o) return false;
+    string mac;
+    string m = o->stringValue();
+    for (size_t i=0; i<m.size(); i++) {
+      if (isxdigit(m[i])) mac += tolower(m[i]);
+    }
+    if (mac.size()!=12 || uuid.size()<12) return false;
+    for (size_t i=0; i<12; i++) {
+      if (tolower(uuid[uuid.size()-12+i])!=mac[i]) return false;
+    }
+    return true;
+  }
+
+
+  /// report refind result (once), and stop whatever is still in progress
+  void refindEnded(ErrorPtr aError)
+  {
+    if (refindReported) return;
+    refindReported = true;
+    bridgeDetector->stopSearch();
+    if (validatingCache) {
+      validatingCache = false;
+      MainLoop::currentMainLoop().cancelExecutionTicket(cacheCheckTicket);
+      cacheCheckComm.cancelRequest();
+    }
+    if (descriptionPending) {
+      descriptionPending = false;
+      descriptionComm.cancelRequest();
+    }
+    callback(aError);
+    // Note: we might be called from a cacheCheckComm or descriptionComm callback, which still accesses
+    //   the client afterwards, so do not delete the object right now
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&BridgeFinder::release, this));
+  }
+
+
+  void release()
+  {
+    keepAlive.reset(); // will delete object if nobody else keeps it
+  }
+
+
+  /// SSDP refind failed
+  void refindFailed(ErrorPtr aError)
+  {
+    if (validatingCache) {
+      // cached URL might still be valid, report failure only if it isn't
+      searchError = aError;
+      return;
+    }
+    refindEnded(aError);
+  }
+
+
   void bridgeRefindHandler(SsdpSearchPtr aSsdpSearch, ErrorPtr aError)
   {
+    if (refindReported) return; // already found via cached URL
     if (!Error::isOK(aError)) {
       // could not find bridge, return error
-      callback(ErrorPtr(new HueCommError(HueCommErrorUuidNotFound)));
-      keepAlive.reset(); // will delete object if nobody else keeps it
+      refindFailed(ErrorPtr(new HueCommError(HueCommErrorUuidNotFound)));
       return; // done
     }
     else {
@@ -287,7 +414,8 @@ public:
   {
     if (currentBridgeCandidate!=bridgeCandiates.end()) {
       // request description XML
-      hueComm.bridgeAPIComm.httpRequest(
+      descriptionPending = true;
+      descriptionComm.httpRequest(
         (currentBridgeCandidate->second).c_str(),
         boost::bind(&BridgeFinder::handleServiceDescriptionAnswer, this, _1, _2),
         "GET"
@@ -297,8 +425,7 @@ public:
       // done with all candidates
       if (refind) {
         // failed getting description, return error
-        callback(ErrorPtr(new HueCommError(HueCommErrorDescription)));
-        keepAlive.reset(); // will delete object if nobody else keeps it
+        refindFailed(ErrorPtr(new HueCommError(HueCommErrorDescription)));
         return; // done
       }
       else {
@@ -314,6 +441,11 @@ public:
 
   void handleServiceDescriptionAnswer(const string &aResponse, ErrorPtr aError)
   {
+    descriptionPending = false;
+    if (refind && refindReported) {
+      // found via cached URL meanwhile, not needed any more (release already scheduled by refindEnded())
+      return;
+    }
     if (Error::isOK(aError)) {
       // show
       //DBGLOG(LOG_DEBUG, "Received bridge description:\n%s\n", aResponse.c_str());
@@ -342,8 +474,7 @@ public:
                 hueComm.baseURL = url; // save it
                 hueComm.apiReady = true; // can use API now
                 DBGLOG(LOG_DEBUG, "pre-known hue Bridge %s found at %s\n", hueComm.uuid.c_str(), hueComm.baseURL.c_str());
-                callback(ErrorPtr()); // success
-                keepAlive.reset(); // will delete object if nobody else keeps it
+                refindEnded(ErrorPtr()); // success
                 return; // done
               }
               else {
@@ -445,6 +576,10 @@ HueComm::HueComm() :
   findInProgress(false),
   apiReady(false)
 {
+  traceLabel = "hue";
+  requestsMetric = Metrics::counter("vdcd_hue_requests_total", "hue bridge API requests sent");
+  errorsMetric = Metrics::counter("vdcd_hue_errors_total", "hue bridge API requests failed or answered with an error");
+  latencyMetric = Metrics::histogram("vdcd_hue_request_duration_seconds", "hue bridge API request round trip time");
 }
 
 
@@ -27,6 +27,7 @@
 #include "ssdpsearch.hpp"
 #include "jsonwebclient.hpp"
 #include "operationqueue.hpp"
+#include "metrics.hpp"
 
 using namespace std;
 
@@ -92,6 +93,7 @@ namespace p44 {
     bool completed;
     ErrorPtr error;
     HueApiResultCB resultHandler;
+    MLMicroSeconds requestStartTime;
 
     void processAnswer(JsonObjectPtr aJsonResponse, ErrorPtr aError);
 
@@ -115,10 +117,16 @@ namespace p44 {
   {
     typedef OperationQueue inherited;
     friend class BridgeFinder;
+    friend class HueApiOperation;
 
     bool findInProgress;
     bool apiReady;
 
+    // metrics
+    MetricCounterPtr requestsMetric;
+    MetricCounterPtr errorsMetric;
+    MetricHistogramPtr latencyMetric;
+
   public:
 
     HueComm();
@@ -136,6 +144,7 @@ namespace p44 {
     string fixedBaseURL; ///< fixed hue API base URL, bypasses any SSDP searches
     string uuid; ///< the UUID for searching the hue bridge via SSDP
     string userName; ///< the user name
+    string cachedBaseURL; ///< API base URL where the bridge was found last time, checked first by refindBridge()
 
     /// @}
 
@@ -186,6 +195,8 @@ namespace p44 {
     /// find an already known bridge again (might have different IP in DHCP environment)
     /// @param aFindHandler called to deliver find result
     /// @note ssdpUuid and apiToken member variables must be set to the pre-know bridge's parameters before calling this
+    /// @note if cachedBaseURL is set, the bridge is first looked for there, with SSDP search only used when it is not
+    ///   found there (SSDP search is started in parallel, so this does not delay finding a moved bridge)
     void refindBridge(HueBridgeFindCB aFindHandler);
 
   };
@@ -60,8 +60,9 @@ string HueDeviceContainer::getExtraInfo()
 
 // Version history
 //  1 : first version
+//  2 : added hueBridgeBaseURL
 #define HUE_SCHEMA_MIN_VERSION 1 // minimally supported version, anything older will be deleted
-#define HUE_SCHEMA_VERSION 1 // current version
+#define HUE_SCHEMA_VERSION 2 // current version
 
 string HuePersistence::dbSchemaUpgradeSQL(int aFromVersion, int &aToVersion)
 {
@@ -74,10 +75,18 @@ string HuePersistence::dbSchemaUpgradeSQL(int aFromVersion, int &aToVersion)
     sql.append(
       "ALTER TABLE globs ADD hueBridgeUUID TEXT;"
       "ALTER TABLE globs ADD hueBridgeUser TEXT;"
+      "ALTER TABLE globs ADD hueBridgeBaseURL TEXT;"
     );
     // reached final version in one step
     aToVersion = HUE_SCHEMA_VERSION;
   }
+  else if (aFromVersion==1) {
+    // V1->V2: last known API base URL added
+    sql =
+      "ALTER TABLE globs ADD hueBridgeBaseURL TEXT;";
+    // reached version 2
+    aToVersion = 2;
+  }
   return sql;
 }
 
@@ -109,19 +118,21 @@ void HueDeviceContainer::collectDevices(CompletedCB aCompletedCB, bool aIncremen
     // full collect, remove all devices
     removeDevices(aClearSettings);
   }
-  // load hue bridge uuid and token
+  // load hue bridge uuid, token and last known API URL
   sqlite3pp::query qry(db);
-  if (qry.prepare("SELECT hueBridgeUUID, hueBridgeUser FROM globs")==SQLITE_OK) {
+  if (qry.prepare("SELECT hueBridgeUUID, hueBridgeUser, hueBridgeBaseURL FROM globs")==SQLITE_OK) {
     sqlite3pp::query::iterator i = qry.begin();
     if (i!=qry.end()) {
       bridgeUuid = nonNullCStr(i->get<const char *>(0));
       bridgeUserName = nonNullCStr(i->get<const char *>(1));
+      bridgeBaseURL = nonNullCStr(i->get<const char *>(2));
     }
   }
   if (bridgeUuid.length()>0) {
-    // we know a bridge by UUID, try to refind it
+    // we know a bridge by UUID, try to refind it (at the last known URL first)
     hueComm.uuid = bridgeUuid;
     hueComm.userName = bridgeUserName;
+    hueComm.cachedBaseURL = bridgeBaseURL;
     hueComm.refindBridge(boost::bind(&HueDeviceContainer::refindResultHandler, this, _1));
   }
   else {
@@ -145,6 +156,12 @@ void HueDeviceContainer::refindResultHandler(ErrorPtr aError)
       hueComm.userName.c_str(),
       hueComm.baseURL.c_str()
     );
+    if (hueComm.baseURL!=bridgeBaseURL) {
+      // bridge has moved (or was found for the first time with this version), remember new URL for next startup
+      bridgeBaseURL = hueComm.baseURL;
+      hueComm.cachedBaseURL = bridgeBaseURL;
+      db.executef("UPDATE globs SET hueBridgeBaseURL='%s'", bridgeBaseURL.c_str());
+    }
     // collect existing lights
     // Note: for now we don't search for new lights, this is left to the Hue App, so users have control
     //   if they want new lights added or not
@@ -198,21 +215,25 @@ void HueDeviceContainer::searchResultHandler(ErrorPtr aError)
       // - delete it from the whitelist
       string url = "/config/whitelist/" + hueComm.userName;
       hueComm.apiAction(httpMethodDELETE, url.c_str(), JsonObjectPtr(), NULL);
-      // - forget uuid + user name
+      // - forget uuid + user name + URL
       bridgeUuid.clear();
       bridgeUserName.clear();
+      bridgeBaseURL.clear();
     }
     else {
       // new bridge found
       learnIn = true;
       bridgeUuid = hueComm.uuid;
       bridgeUserName = hueComm.userName;
+      bridgeBaseURL = hueComm.baseURL;
     }
+    hueComm.cachedBaseURL = bridgeBaseURL;
     // save the bridge parameters
     db.executef(
-      "UPDATE globs SET hueBridgeUUID='%s', hueBridgeUser='%s'",
+      "UPDATE globs SET hueBridgeUUID='%s', hueBridgeUser='%s', hueBridgeBaseURL='%s'",
       bridgeUuid.c_str(),
-      bridgeUserName.c_str()
+      bridgeUserName.c_str(),
+      bridgeBaseURL.c_str()
     );
     // now process the learn in/out
     if (learnIn) {
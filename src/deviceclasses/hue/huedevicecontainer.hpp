@@ -63,6 +63,7 @@ namespace p44 {
 
     string bridgeUuid; ///< the UUID for searching the hue bridge via SSDP
     string bridgeUserName; ///< the user name registered with the bridge
+    string bridgeBaseURL; ///< the API base URL (containing the IP address) where the bridge was found last time
 
     /// @}
 
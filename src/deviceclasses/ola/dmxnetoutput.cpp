@@ -0,0 +1,474 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+#include "dmxnetoutput.hpp"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+using namespace p44;
+
+
+#define DMXNET_MIN_FRAME_INTERVAL (23*MilliSecond) // DMX512 full frame rate is 44Hz, receivers don't take more
+#define DMXNET_REFRESH_INTERVAL (800*MilliSecond) // sACN receivers consider a source lost after 2.5 seconds
+
+#define SACN_PORT 5568
+#define SACN_PACKET_SIZE 638
+#define SACN_PRIORITY 100
+#define ARTNET_PORT 6454
+#define ARTNET_PACKET_SIZE (18+dmxUniverseSize)
+
+// offsets of the per-frame fields in the packets
+#define SACN_SEQUENCE 111
+#define SACN_UNIVERSE 113
+#define SACN_DATA 126
+#define ARTNET_SEQUENCE 12
+#define ARTNET_UNIVERSE 14
+#define ARTNET_DATA 18
+
+
+#pragma mark - DmxNetUniverse
+
+#define FRAME_FRESH 0x04 // set in sharedFrame when the writer has committed a frame the reader has not yet picked up
+#define FRAME_INDEX_MASK 0x03
+
+DmxNetUniverse::DmxNetUniverse(uint16_t aUniverse) :
+  universe(aUniverse),
+  sharedFrame(1),
+  writeFrame(0),
+  dirty(false),
+  readFrame(2),
+  unsent(false),
+  lastSent(Never)
+{
+  memset(frames, 0, sizeof(frames));
+  memset(sequence, 0, sizeof(sequence));
+}
+
+
+void DmxNetUniverse::commit()
+{
+  // make sure the frame contents are visible before the frame is
+  __sync_synchronize();
+  int prev = __sync_lock_test_and_set(&sharedFrame, writeFrame|FRAME_FRESH);
+  // the frame we got back is no longer in use by anyone, continue with a copy of the committed one
+  int next = prev & FRAME_INDEX_MASK;
+  memcpy(frames[next], frames[writeFrame], dmxUniverseSize);
+  writeFrame = next;
+  dirty = false;
+}
+
+
+bool DmxNetUniverse::pickUp()
+{
+  if ((__sync_fetch_and_or(&sharedFrame, 0) & FRAME_FRESH)==0) return false; // nothing new
+  int prev = __sync_lock_test_and_set(&sharedFrame, readFrame);
+  readFrame = prev & FRAME_INDEX_MASK;
+  __sync_synchronize();
+  return true;
+}
+
+
+
+#pragma mark - DmxNetOutput
+
+
+DmxNetOutput::DmxNetOutput(MainLoop &aSendLoop) :
+  sendLoop(aSendLoop),
+  firstUniverse(1),
+  socketFd(-1),
+  sourceName("vdcd"),
+  pendingResolves(0),
+  commitTicket(0),
+  wakePending(0),
+  sending(false),
+  sendTicket(0),
+  sendFailing(false)
+{
+  memset(cid, 0, sizeof(cid));
+  const char *help = "Number of DMX512 frames sent to the network";
+  framesSentMetric[dmxnet_sacn] = Metrics::counter("vdcd_dmx_frames_sent_total", help, "protocol=\"sacn\"");
+  framesSentMetric[dmxnet_artnet] = Metrics::counter("vdcd_dmx_frames_sent_total", help, "protocol=\"artnet\"");
+  sendErrorsMetric = Metrics::counter("vdcd_dmx_send_errors_total", "Number of DMX512 frames that could not be sent");
+}
+
+
+DmxNetOutput::~DmxNetOutput()
+{
+  // Note: sending thread must be stopped already when sending on a separate thread
+  MainLoop::currentMainLoop().cancelExecutionTicket(commitTicket);
+  sendLoop.cancelExecutionTicket(sendTicket);
+  if (socketFd>=0) {
+    close(socketFd);
+    socketFd = -1;
+  }
+}
+
+
+ErrorPtr DmxNetOutput::setDestinations(const string &aDestinations, uint16_t aFirstUniverse)
+{
+  destinations.clear();
+  firstUniverse = aFirstUniverse;
+  size_t start = 0;
+  while (start<aDestinations.size()) {
+    size_t e = aDestinations.find(',', start);
+    if (e==string::npos) e = aDestinations.size();
+    string spec = trimWhiteSpace(aDestinations.substr(start, e-start));
+    start = e+1;
+    if (spec.empty()) continue;
+    Destination dest;
+    string proto;
+    size_t i = spec.find(':');
+    if (i!=string::npos) {
+      proto = lowerCase(spec.substr(0,i));
+      dest.host = spec.substr(i+1);
+    }
+    else {
+      proto = lowerCase(spec);
+    }
+    if (proto=="sacn" || proto=="e131")
+      dest.protocol = dmxnet_sacn;
+    else if (proto=="artnet")
+      dest.protocol = dmxnet_artnet;
+    else
+      return ErrorPtr(new DmxNetError(DmxNetErrorBadDestination, string_format("unknown DMX network protocol '%s'", proto.c_str())));
+    memset(&dest.address, 0, sizeof(dest.address));
+    dest.address.family = AF_UNSPEC; // not yet resolved
+    destinations.push_back(dest);
+  }
+  if (destinations.size()==0) {
+    return ErrorPtr(new DmxNetError(DmxNetErrorNoDestination, "no DMX network destination"));
+  }
+  return ErrorPtr();
+}
+
+
+void DmxNetOutput::setSource(const string &aSourceName, const uint8_t *aCid)
+{
+  sourceName = aSourceName;
+  memcpy(cid, aCid, sizeof(cid));
+}
+
+
+string DmxNetOutput::description()
+{
+  string s;
+  for (DestinationsVector::iterator pos = destinations.begin(); pos!=destinations.end(); ++pos) {
+    if (!s.empty()) s += ", ";
+    s += pos->protocol==dmxnet_sacn ? "sACN" : "Art-Net";
+    s += pos->host.empty() ? (pos->protocol==dmxnet_sacn ? " multicast" : " broadcast") : " to "+pos->host;
+  }
+  string_format_append(s, ", universes from %d", firstUniverse);
+  return s;
+}
+
+
+#pragma mark - mainloop side
+
+void DmxNetOutput::start(StatusCB aStartedCB)
+{
+  if (destinations.size()==0) {
+    if (aStartedCB) aStartedCB(ErrorPtr(new DmxNetError(DmxNetErrorNoDestination, "no DMX network destination")));
+    return;
+  }
+  socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (socketFd<0) {
+    if (aStartedCB) aStartedCB(SysError::errNo("cannot create DMX network socket: "));
+    return;
+  }
+  // never block the sending thread, a frame that cannot be sent now is superseded by the next one anyway
+  fcntl(socketFd, F_SETFL, fcntl(socketFd, F_GETFL, 0) | O_NONBLOCK);
+  // Art-Net default destination is broadcast
+  int one = 1;
+  setsockopt(socketFd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+  // resolve explicitly specified hosts
+  startedCB = aStartedCB;
+  pendingResolves = 1; // prevent resolvesDone() before all resolves are started
+  for (int i=0; i<(int)destinations.size(); i++) {
+    Destination &dest = destinations[i];
+    if (!dest.host.empty()) {
+      pendingResolves++;
+      DnsResolver::sharedResolver().resolve(
+        dest.host, string_format("%d", dest.protocol==dmxnet_sacn ? SACN_PORT : ARTNET_PORT),
+        AF_INET, SOCK_DGRAM, 0,
+        boost::bind(&DmxNetOutput::resolved, DmxNetOutputPtr(this), _1, _2, i)
+      );
+    }
+  }
+  if (--pendingResolves==0) resolvesDone();
+}
+
+
+void DmxNetOutput::resolved(ErrorPtr aError, const ResolvedAddressVector &aAddresses, int aDestIndex)
+{
+  Destination &dest = destinations[aDestIndex];
+  if (Error::isOK(aError) && aAddresses.size()>0) {
+    dest.address = aAddresses[0];
+  }
+  else {
+    LOG(LOG_ERR, "DMX network destination '%s' cannot be resolved, not sending there: %s\n", dest.host.c_str(), aError ? aError->description().c_str() : "no address");
+  }
+  if (--pendingResolves==0) resolvesDone();
+}
+
+
+void DmxNetOutput::resolvesDone()
+{
+  // from now on, destinations and socket belong to the sending thread
+  sendLoop.post(boost::bind(&DmxNetOutput::startSending, DmxNetOutputPtr(this)));
+  LOG(LOG_NOTICE, "DMX network output: %s\n", description().c_str());
+  if (startedCB) {
+    StatusCB cb = startedCB;
+    startedCB = NULL;
+    cb(ErrorPtr());
+  }
+}
+
+
+void DmxNetOutput::setChannel(DmxChannel aChannel, DmxValue aChannelValue)
+{
+  if (aChannel<1) return;
+  size_t idx = (aChannel-1)/dmxUniverseSize;
+  if (idx>=universes.size()) universes.resize(idx+1);
+  DmxNetUniverse *u = universes[idx].get();
+  if (!u) {
+    // first channel in this universe, create it and let the sending thread know
+    DmxNetUniversePtr nu = DmxNetUniversePtr(new DmxNetUniverse(firstUniverse+idx));
+    universes[idx] = nu;
+    sendLoop.post(boost::bind(&DmxNetOutput::addSendUniverse, DmxNetOutputPtr(this), nu));
+    u = nu.get();
+  }
+  DmxValue &v = u->frames[u->writeFrame][(aChannel-1)%dmxUniverseSize];
+  if (v!=aChannelValue) {
+    v = aChannelValue;
+    u->dirty = true;
+    // commit all changes of this mainloop cycle at once
+    if (!commitTicket) {
+      commitTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&DmxNetOutput::commitChanges, this, _1));
+    }
+  }
+}
+
+
+void DmxNetOutput::commitChanges(MLMicroSeconds aCycleStartTime)
+{
+  commitTicket = 0;
+  for (UniversesVector::iterator pos = universes.begin(); pos!=universes.end(); ++pos) {
+    if (*pos && (*pos)->dirty) (*pos)->commit();
+  }
+  // wake up sending thread, unless a wakeup is already underway
+  if (__sync_bool_compare_and_swap(&wakePending, 0, 1)) {
+    sendLoop.post(boost::bind(&DmxNetOutput::wakeup, DmxNetOutputPtr(this)));
+  }
+}
+
+
+
+#pragma mark - sending thread side
+
+
+void DmxNetOutput::startSending()
+{
+  prepareHeaders();
+  sending = true;
+  sendDue(MainLoop::now());
+}
+
+
+void DmxNetOutput::addSendUniverse(DmxNetUniversePtr aUniverse)
+{
+  sendUniverses.push_back(aUniverse);
+  if (sending) sendDue(MainLoop::now());
+}
+
+
+void DmxNetOutput::wakeup()
+{
+  // clear the flag before looking at the frames, so a commit happening now will post a new wakeup
+  __sync_bool_compare_and_swap(&wakePending, 1, 0);
+  if (sending) sendDue(MainLoop::now());
+}
+
+
+void DmxNetOutput::sendTimer(MLMicroSeconds aCycleStartTime)
+{
+  sendTicket = 0;
+  sendDue(MainLoop::now());
+}
+
+
+void DmxNetOutput::sendDue(MLMicroSeconds aNow)
+{
+  MLMicroSeconds next = Never;
+  for (UniversesVector::iterator pos = sendUniverses.begin(); pos!=sendUniverses.end(); ++pos) {
+    DmxNetUniverse &u = **pos;
+    if (u.pickUp()) u.unsent = true;
+    if (u.lastSent==Never && !u.unsent) continue; // nothing committed yet, don't send an empty frame
+    // changed frames go out as soon as the frame rate allows, unchanged ones are just refreshed
+    MLMicroSeconds due = u.lastSent + (u.unsent ? DMXNET_MIN_FRAME_INTERVAL : DMXNET_REFRESH_INTERVAL);
+    if (due<=aNow) {
+      sendUniverse(u, aNow);
+      due = aNow+DMXNET_REFRESH_INTERVAL;
+    }
+    if (next==Never || due<next) next = due;
+  }
+  sendLoop.cancelExecutionTicket(sendTicket);
+  if (next!=Never) {
+    sendTicket = sendLoop.executeOnceAt(boost::bind(&DmxNetOutput::sendTimer, this, _1), next);
+  }
+}
+
+
+static void setBE16(uint8_t *aP, uint16_t aValue)
+{
+  aP[0] = aValue>>8;
+  aP[1] = aValue & 0xFF;
+}
+
+
+static void setBE32(uint8_t *aP, uint32_t aValue)
+{
+  setBE16(aP, aValue>>16);
+  setBE16(aP+2, aValue & 0xFFFF);
+}
+
+
+void DmxNetOutput::prepareHeaders()
+{
+  // E1.31 data packet
+  uint8_t *p = packet[dmxnet_sacn];
+  memset(p, 0, SACN_PACKET_SIZE);
+  // - root layer
+  setBE16(p+0, 0x0010); // preamble size
+  setBE16(p+2, 0x0000); // postamble size
+  memcpy(p+4, "ASC-E1.17\0\0\0", 12); // ACN packet identifier
+  setBE16(p+16, 0x7000 | (SACN_PACKET_SIZE-16)); // flags & length
+  setBE32(p+18, 0x00000004); // VECTOR_ROOT_E131_DATA
+  memcpy(p+22, cid, 16);
+  // - framing layer
+  setBE16(p+38, 0x7000 | (SACN_PACKET_SIZE-38)); // flags & length
+  setBE32(p+40, 0x00000002); // VECTOR_E131_DATA_PACKET
+  strncpy((char *)p+44, sourceName.c_str(), 63); // source name, NUL terminated
+  p[108] = SACN_PRIORITY;
+  setBE16(p+109, 0); // no synchronisation
+  // p[SACN_SEQUENCE] set per frame
+  p[112] = 0; // options
+  // universe set per frame
+  // - DMP layer
+  setBE16(p+115, 0x7000 | (SACN_PACKET_SIZE-115)); // flags & length
+  p[117] = 0x02; // VECTOR_DMP_SET_PROPERTY
+  p[118] = 0xA1; // address type & data type
+  setBE16(p+119, 0x0000); // first property address
+  setBE16(p+121, 0x0001); // address increment
+  setBE16(p+123, dmxUniverseSize+1); // property value count
+  p[125] = 0; // DMX512 start code
+  // Art-Net ArtDmx packet
+  p = packet[dmxnet_artnet];
+  memset(p, 0, ARTNET_PACKET_SIZE);
+  memcpy(p, "Art-Net\0", 8);
+  p[8] = 0x00; p[9] = 0x50; // OpDmx, little endian
+  setBE16(p+10, 14); // protocol version
+  // p[ARTNET_SEQUENCE] set per frame
+  p[13] = 0; // physical
+  // universe set per frame
+  setBE16(p+16, dmxUniverseSize); // data length
+}
+
+
+void DmxNetOutput::sendUniverse(DmxNetUniverse &aUniverse, MLMicroSeconds aNow)
+{
+  aUniverse.unsent = false;
+  aUniverse.lastSent = aNow;
+  const DmxValue *frame = aUniverse.frames[aUniverse.readFrame];
+  for (int proto=0; proto<dmxnet_numProtocols; proto++) {
+    uint8_t *p = packet[proto];
+    size_t len = 0;
+    for (DestinationsVector::iterator pos = destinations.begin(); pos!=destinations.end(); ++pos) {
+      if (pos->protocol!=proto) continue;
+      if (len==0) {
+        // first destination for this protocol, prepare the packet
+        uint8_t &seq = aUniverse.sequence[proto];
+        if (proto==dmxnet_sacn) {
+          p[SACN_SEQUENCE] = seq++;
+          setBE16(p+SACN_UNIVERSE, aUniverse.universe);
+          memcpy(p+SACN_DATA, frame, dmxUniverseSize);
+          len = SACN_PACKET_SIZE;
+        }
+        else {
+          if (++seq==0) seq = 1; // 0 means sequencing disabled in Art-Net
+          p[ARTNET_SEQUENCE] = seq;
+          p[ARTNET_UNIVERSE] = aUniverse.universe & 0xFF; // SubUni
+          p[ARTNET_UNIVERSE+1] = (aUniverse.universe>>8) & 0x7F; // Net
+          memcpy(p+ARTNET_DATA, frame, dmxUniverseSize);
+          len = ARTNET_PACKET_SIZE;
+        }
+      }
+      // determine address
+      struct sockaddr_in defaultAddr;
+      const struct sockaddr *addrP;
+      socklen_t addrLen;
+      if (pos->host.empty()) {
+        memset(&defaultAddr, 0, sizeof(defaultAddr));
+        defaultAddr.sin_family = AF_INET;
+        if (proto==dmxnet_sacn) {
+          // universe multicast group 239.255.UHI.ULO
+          defaultAddr.sin_addr.s_addr = htonl(0xEFFF0000 | aUniverse.universe);
+          defaultAddr.sin_port = htons(SACN_PORT);
+        }
+        else {
+          defaultAddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+          defaultAddr.sin_port = htons(ARTNET_PORT);
+        }
+        addrP = (const struct sockaddr *)&defaultAddr;
+        addrLen = sizeof(defaultAddr);
+      }
+      else if (pos->address.family==AF_INET) {
+        addrP = (const struct sockaddr *)&pos->address.addr;
+        addrLen = pos->address.addrLen;
+      }
+      else {
+        continue; // could not be resolved
+      }
+      if (sendto(socketFd, p, len, 0, addrP, addrLen)<0) {
+        sendErrorsMetric->inc();
+        if (!sendFailing) {
+          LOG(LOG_WARNING, "DMX network: cannot send universe %d: %s\n", aUniverse.universe, strerror(errno));
+          sendFailing = true;
+        }
+      }
+      else {
+        framesSentMetric[proto]->inc();
+        if (sendFailing) {
+          LOG(LOG_NOTICE, "DMX network: sending works again\n");
+          sendFailing = false;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,206 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __vdcd__dmxnetoutput__
+#define __vdcd__dmxnetoutput__
+
+#include "p44_common.hpp"
+#include "dnsresolver.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  typedef uint16_t DmxChannel;
+  typedef uint8_t DmxValue;
+  const DmxChannel dmxNone = 0; // no channel
+
+  const int dmxUniverseSize = 512; ///< number of channels per DMX512 universe
+
+
+  // Errors
+  typedef enum {
+    DmxNetErrorOK,
+    DmxNetErrorBadDestination, ///< destination specification could not be parsed
+    DmxNetErrorNoDestination, ///< no destination specified
+    DmxNetErrorSocket, ///< UDP socket could not be created
+  } DmxNetErrors;
+
+  class DmxNetError : public Error
+  {
+  public:
+    static const char *domain() { return "DmxNet"; }
+    virtual const char *getErrorDomain() const { return DmxNetError::domain(); };
+    DmxNetError(DmxNetErrors aError) : Error(ErrorCode(aError)) {};
+    DmxNetError(DmxNetErrors aError, std::string aErrorMessage) : Error(ErrorCode(aError), aErrorMessage) {};
+  };
+
+
+  typedef enum {
+    dmxnet_sacn, ///< ANSI E1.31 streaming ACN, UDP port 5568, multicast by default
+    dmxnet_artnet, ///< Art-Net ArtDmx, UDP port 6454, broadcast by default
+    dmxnet_numProtocols
+  } DmxNetProtocol;
+
+
+  class DmxNetUniverse;
+  typedef boost::intrusive_ptr<DmxNetUniverse> DmxNetUniversePtr;
+
+  class DmxNetOutput;
+  typedef boost::intrusive_ptr<DmxNetOutput> DmxNetOutputPtr;
+
+
+  /// one DMX512 universe, with a lock-free frame handoff from the mainloop (writer) to the sending thread (reader)
+  /// @note There are three frame buffers: one owned by the writer, one owned by the reader, and one in between.
+  ///   The writer hands over its frame by exchanging it with the one in between (and continues with a copy of what it
+  ///   has just handed over), the reader picks up a new frame by exchanging its own with the one in between, but
+  ///   only if that one was marked fresh by the writer. Neither side ever waits for the other.
+  class DmxNetUniverse : public P44Obj
+  {
+    typedef P44Obj inherited;
+    friend class DmxNetOutput;
+
+    uint16_t universe; ///< the universe number as sent on the network
+
+    DmxValue frames[3][dmxUniverseSize];
+    volatile int sharedFrame; ///< index of the frame in between, ORed with frameFresh when the writer has committed it
+
+    // writer (mainloop) side
+    int writeFrame; ///< index of the frame the writer modifies
+    bool dirty; ///< set when writeFrame has changes not yet committed
+
+    // reader (sending thread) side
+    int readFrame; ///< index of the frame last sent
+    bool unsent; ///< set when readFrame has been picked up but not yet sent (frame rate limit)
+    MLMicroSeconds lastSent; ///< when this universe was last sent
+    uint8_t sequence[dmxnet_numProtocols]; ///< next sequence number per protocol
+
+  public:
+
+    DmxNetUniverse(uint16_t aUniverse);
+
+  private:
+
+    /// writer: hand over the current frame to the reader
+    void commit();
+
+    /// reader: pick up the most recently committed frame
+    /// @return true if there was a new frame
+    bool pickUp();
+
+  };
+
+
+  /// Sends DMX512 universes to the network using sACN (E1.31) and/or Art-Net.
+  /// Channel values are set on the mainloop. All changes made within one mainloop cycle are committed together
+  /// and trigger sending the affected universes on the sending mainloop (usually a separate thread), limited to
+  /// the DMX512 frame rate. Unchanged universes are refreshed periodically, as receivers usually treat a source
+  /// not sending for more than 2.5 seconds as lost.
+  class DmxNetOutput : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    typedef struct {
+      DmxNetProtocol protocol;
+      string host; ///< empty for the protocol's default (sACN: universe multicast group, Art-Net: broadcast)
+      ResolvedAddress address; ///< resolved address of host
+    } Destination;
+    typedef vector<Destination> DestinationsVector;
+
+    MainLoop &sendLoop;
+    uint16_t firstUniverse;
+    DestinationsVector destinations;
+    int socketFd;
+    string sourceName;
+    uint8_t cid[16];
+    int pendingResolves;
+    StatusCB startedCB;
+
+    // mainloop side
+    typedef vector<DmxNetUniversePtr> UniversesVector;
+    UniversesVector universes; ///< indexed by (universe - firstUniverse)
+    long commitTicket;
+    volatile int wakePending; ///< set while a wakeup of the sending thread is posted but not yet executed
+
+    // sending thread side
+    UniversesVector sendUniverses; ///< the universes known to the sending thread
+    bool sending; ///< set once the sending thread has started
+    long sendTicket;
+    bool sendFailing; ///< set after a send error, to log only the first of a series
+    uint8_t packet[dmxnet_numProtocols][638]; ///< packet buffers, headers prepared once
+
+    MetricCounterPtr framesSentMetric[dmxnet_numProtocols];
+    MetricCounterPtr sendErrorsMetric;
+
+  public:
+
+    /// create output
+    /// @param aSendLoop the mainloop to send packets from (may be the current mainloop)
+    DmxNetOutput(MainLoop &aSendLoop);
+    virtual ~DmxNetOutput();
+
+    /// set destinations
+    /// @param aDestinations comma separated list of protocol[:host], protocol being "sacn" or "artnet". Without host,
+    ///   sACN is sent to the standard multicast group of each universe, Art-Net is broadcast.
+    /// @param aFirstUniverse the universe number DMX channels 1..512 are sent to. Channels above 512 continue in the
+    ///   following universes.
+    /// @return error if destinations cannot be parsed
+    ErrorPtr setDestinations(const string &aDestinations, uint16_t aFirstUniverse);
+
+    /// set the source identification as sent in sACN packets
+    /// @param aSourceName user readable name of the source
+    /// @param aCid 16 byte component identifier, should be unique for the source and stable across restarts
+    void setSource(const string &aSourceName, const uint8_t *aCid);
+
+    /// resolve destinations, open socket and start sending
+    /// @param aStartedCB called on the mainloop when ready or failed
+    void start(StatusCB aStartedCB);
+
+    /// set DMX channel value
+    /// @param aChannel the DMX channel number, 1..512 for the first universe, 513..1024 for the next etc.
+    /// @param aChannelValue the value to set for the channel, 0..255
+    /// @note must be called on the mainloop. Changes are sent when the current mainloop cycle is done.
+    void setChannel(DmxChannel aChannel, DmxValue aChannelValue);
+
+    /// @return textual description of the destinations
+    string description();
+
+  private:
+
+    void resolved(ErrorPtr aError, const ResolvedAddressVector &aAddresses, int aDestIndex);
+    void resolvesDone();
+    void commitChanges(MLMicroSeconds aCycleStartTime);
+
+    // sending thread side
+    void startSending();
+    void addSendUniverse(DmxNetUniversePtr aUniverse);
+    void wakeup();
+    void sendDue(MLMicroSeconds aNow);
+    void sendTimer(MLMicroSeconds aCycleStartTime);
+    void sendUniverse(DmxNetUniverse &aUniverse, MLMicroSeconds aNow);
+    void prepareHeaders();
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__vdcd__dmxnetoutput__) */
@@ -21,8 +21,6 @@
 
 #include "oladevice.hpp"
 
-#if !DISABLE_OLA
-
 #include "lightbehaviour.hpp"
 #include "colorlightbehaviour.hpp"
 #include "movinglightbehaviour.hpp"
@@ -68,11 +66,14 @@ static bool nextChannelSpec(string &aConfig, size_t &aStartPos, char &aChannelTy
 OlaDevice::OlaDevice(OlaDeviceContainer *aClassContainerP, const string &aDeviceConfig) :
   inherited(aClassContainerP),
   olaType(ola_unknown),
+  olaDeviceRowID(0),
   whiteChannel(dmxNone),
   redChannel(dmxNone),
   greenChannel(dmxNone),
   blueChannel(dmxNone),
   amberChannel(dmxNone),
+  hPosChannel(dmxNone),
+  vPosChannel(dmxNone),
   transitionTicket(0)
 {
   // evaluate config
@@ -388,7 +389,5 @@ string OlaDevice::description()
   return s;
 }
 
-#endif // !DISABLE_OLA
-
 
 
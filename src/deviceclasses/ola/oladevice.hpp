@@ -24,8 +24,6 @@
 
 #include "device.hpp"
 
-#if !DISABLE_OLA
-
 #include "oladevicecontainer.hpp"
 
 using namespace std;
@@ -131,7 +129,7 @@ namespace p44 {
   protected:
 
     /// Set DMX channel value
-    /// @param aChannel the DMX channel number - 1..512
+    /// @param aChannel the DMX channel number - 1..512 (higher numbers address following universes with DMX network output)
     /// @param aChannelValue the value to set for the channel, 0..255
     void setDMXChannel(DmxChannel aChannel, DmxValue aChannelValue);
 
@@ -147,5 +145,4 @@ namespace p44 {
 
 } // namespace p44
 
-#endif // !DISABLE_OLA
 #endif /* defined(__vdcd__oladevice__) */
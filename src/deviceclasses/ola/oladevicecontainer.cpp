@@ -21,12 +21,8 @@
 
 #include "oladevicecontainer.hpp"
 
-#if !DISABLE_OLA
-
 #include "oladevice.hpp"
 
-#include <ola/DmxBuffer.h>
-
 using namespace p44;
 
 
@@ -63,10 +59,32 @@ string OlaDevicePersistence::dbSchemaUpgradeSQL(int aFromVersion, int &aToVersio
 
 OlaDeviceContainer::OlaDeviceContainer(int aInstanceNumber, DeviceContainer *aDeviceContainerP, int aTag) :
   DeviceClassContainer(aInstanceNumber, aDeviceContainerP, aTag)
+  #if !DISABLE_OLA
+  ,dmxBufferP(NULL),
+  olaClientP(NULL)
+  #endif
 {
 }
 
 
+OlaDeviceContainer::~OlaDeviceContainer()
+{
+  stopCommThread();
+}
+
+
+ErrorPtr OlaDeviceContainer::useDmxNet(const string &aDestinations, uint16_t aFirstUniverse)
+{
+  // sending runs on the hardware communication thread, if enabled
+  DmxNetOutputPtr output = DmxNetOutputPtr(new DmxNetOutput(commMainLoop()));
+  ErrorPtr err = output->setDestinations(aDestinations, aFirstUniverse);
+  if (Error::isOK(err)) {
+    dmxNetOutput = output;
+  }
+  return err;
+}
+
+
 #define DMX512_INTERFRAME_PAUSE (50*MilliSecond)
 #define DMX512_RETRY_INTERVAL (15*Second)
 #define DMX512_UNIVERSE 42
@@ -78,14 +96,28 @@ void OlaDeviceContainer::initialize(CompletedCB aCompletedCB, bool aFactoryReset
   string databaseName = getPersistentDataDir();
   string_format_append(databaseName, "%s_%d.sqlite3", deviceClassIdentifier(), getInstanceNumber());
   err = db.connectAndInitialize(databaseName.c_str(), OLADEVICES_SCHEMA_VERSION, OLADEVICES_SCHEMA_MIN_VERSION, aFactoryReset);
+  if (dmxNetOutput) {
+    // built-in network output, identified by our dSUID
+    string cid = dSUID.getBinary();
+    cid.resize(16);
+    dmxNetOutput->setSource(string_format("vdcd %s", dSUID.getString().c_str()), (const uint8_t *)cid.c_str());
+    dmxNetOutput->start(aCompletedCB);
+    return;
+  }
+  #if !DISABLE_OLA
   // launch OLA thread
   pthread_mutex_init(&olaBufferAccess, NULL);
   olaThread = MainLoop::currentMainLoop().executeInThread(boost::bind(&OlaDeviceContainer::olaThreadRoutine, this, _1), NULL);
   // done
   aCompletedCB(ErrorPtr());
+  #else
+  aCompletedCB(ErrorPtr(new DmxNetError(DmxNetErrorNoDestination, "no OLA support, DMX network output must be configured")));
+  #endif
 }
 
 
+#if !DISABLE_OLA
+
 void OlaDeviceContainer::olaThreadRoutine(ChildThreadWrapper &aThread)
 {
   // turn on OLA logging when loglevel is debugging, otherwise off
@@ -113,13 +145,22 @@ void OlaDeviceContainer::olaThreadRoutine(ChildThreadWrapper &aThread)
 }
 
 
+#endif // !DISABLE_OLA
+
+
 void OlaDeviceContainer::setDMXChannel(DmxChannel aChannel, DmxValue aChannelValue)
 {
+  if (dmxNetOutput) {
+    dmxNetOutput->setChannel(aChannel, aChannelValue);
+    return;
+  }
+  #if !DISABLE_OLA
   if (dmxBufferP && aChannel>=1 && aChannel<=512) {
     pthread_mutex_lock(&olaBufferAccess);
     dmxBufferP->SetChannel(aChannel-1, aChannelValue);
     pthread_mutex_unlock(&olaBufferAccess);
   }
+  #endif
 }
 
 
@@ -225,6 +266,4 @@ ErrorPtr OlaDeviceContainer::handleMethod(VdcApiRequestPtr aRequest, const strin
   return respErr;
 }
 
-#endif // !DISABLE_OLA
-
 
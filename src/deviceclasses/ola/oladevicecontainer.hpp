@@ -24,23 +24,20 @@
 
 #include "vdcd_common.hpp"
 
-#if !DISABLE_OLA
-
 #include "deviceclasscontainer.hpp"
 #include "device.hpp"
+#include "dmxnetoutput.hpp"
 
+#if !DISABLE_OLA
 #include <ola/DmxBuffer.h>
 #include <ola/Logging.h>
 #include <ola/client/StreamingClient.h>
+#endif
 
 using namespace std;
 
 namespace p44 {
 
-  typedef uint16_t DmxChannel;
-  typedef uint8_t DmxValue;
-  const DmxChannel dmxNone = 0; // no channel
-
   class OlaDeviceContainer;
   class OlaDevice;
   typedef boost::intrusive_ptr<OlaDevice> OlaDevicePtr;
@@ -65,15 +62,27 @@ namespace p44 {
 
     OlaDevicePersistence db;
 
+    #if !DISABLE_OLA
     // OLA Thread
     ChildThreadWrapperPtr olaThread;
     pthread_mutex_t olaBufferAccess;
     ola::DmxBuffer *dmxBufferP;
     ola::client::StreamingClient *olaClientP;
+    #endif
 
+    // built-in sACN/Art-Net output (instead of OLA)
+    DmxNetOutputPtr dmxNetOutput;
 
   public:
     OlaDeviceContainer(int aInstanceNumber, DeviceContainer *aDeviceContainerP, int aTag);
+    virtual ~OlaDeviceContainer();
+
+    /// send DMX512 directly to the network using sACN (E1.31) and/or Art-Net, instead of via the OLA server
+    /// @param aDestinations comma separated list of protocol[:host], see DmxNetOutput::setDestinations()
+    /// @param aFirstUniverse the universe DMX channels 1..512 go to, higher channel numbers continue in the following universes
+    /// @return error if destinations are invalid
+    /// @note must be called before initialize()
+    ErrorPtr useDmxNet(const string &aDestinations, uint16_t aFirstUniverse);
 
     void initialize(CompletedCB aCompletedCB, bool aFactoryReset);
 
@@ -99,18 +108,19 @@ namespace p44 {
 
     /// @return human readable, language independent suffix to explain vdc functionality.
     ///   Will be appended to product name to create modelName() for vdcs
-    virtual string vdcModelSuffix() { return "OLA/DMX512"; }
+    virtual string vdcModelSuffix() { return dmxNetOutput ? "DMX512" : "OLA/DMX512"; }
 
   private:
 
     OlaDevicePtr addOlaDevice(string aDeviceType, string aDeviceConfig);
 
+    #if !DISABLE_OLA
     void olaThreadRoutine(ChildThreadWrapper &aThread);
+    #endif
     void setDMXChannel(DmxChannel aChannel, DmxValue aChannelValue);
 
   };
 
 } // namespace p44
 
-#endif // !DISABLE_OLA
 #endif /* defined(__vdcd__oladevicecontainer__) */
@@ -27,6 +27,9 @@
 #include "buttonbehaviour.hpp"
 #include "lightbehaviour.hpp"
 
+#define SPARK_STATE_RETRIES 5 // state updates are retried (with backoff) this many times on communication errors
+#define SPARK_QUERY_RETRIES 1 // queries the device depends on (version, state) are retried once
+
 
 using namespace p44;
 
@@ -195,8 +198,8 @@ DsScenePtr SparkDeviceSettings::newDefaultScene(SceneNo aSceneNo)
 
 SparkIoDevice::SparkIoDevice(StaticDeviceContainer *aClassContainerP, const string &aDeviceConfig) :
   StaticDevice((DeviceClassContainer *)aClassContainerP),
-  sparkCloudComm(MainLoop::currentMainLoop()),
-  apiVersion(0)
+  apiVersion(0),
+  stateRequests(0)
 {
   // config must be: sparkCoreId:accessToken
   size_t i = aDeviceConfig.find(":");
@@ -221,14 +224,15 @@ SparkIoDevice::SparkIoDevice(StaticDeviceContainer *aClassContainerP, const stri
 
 
 
-bool SparkIoDevice::sparkApiCall(JsonWebClientCB aResponseCB, string aArgs)
+void SparkIoDevice::sparkApiCall(JsonWebClientCB aResponseCB, string aArgs, const string &aCoalesceKey, int aMaxRetries)
 {
   string url = string_format("https://api.spark.io/v1/devices/%s/vdsd", sparkCoreID.c_str());
   string data;
   HttpComm::appendFormValue(data, "access_token", sparkCoreToken);
   HttpComm::appendFormValue(data, "args", aArgs);
   LOG(LOG_DEBUG,"sparkApiCall to %s - data = %s\n", url.c_str(), data.c_str());
-  return sparkCloudComm.jsonReturningRequest(url.c_str(), aResponseCB, "POST", data);
+  // all cloud devices share the queue, which limits concurrent requests and backs off when the cloud is unreachable
+  CloudRequestQueue::sharedQueue().request(url, aResponseCB, "POST", data, NULL, aCoalesceKey, aMaxRetries);
 }
 
 
@@ -236,10 +240,7 @@ bool SparkIoDevice::sparkApiCall(JsonWebClientCB aResponseCB, string aArgs)
 void SparkIoDevice::initializeDevice(CompletedCB aCompletedCB, bool aFactoryReset)
 {
   // get vdsd API version
-  if (!sparkApiCall(boost::bind(&SparkIoDevice::apiVersionReceived, this, aCompletedCB, aFactoryReset, _1, _2), "version")) {
-    // could not even issue request, init complete
-    inherited::initializeDevice(aCompletedCB, aFactoryReset);
-  }
+  sparkApiCall(boost::bind(&SparkIoDevice::apiVersionReceived, SparkIoDevicePtr(this), aCompletedCB, aFactoryReset, _1, _2), "version", "", SPARK_QUERY_RETRIES);
 }
 
 
@@ -271,7 +272,7 @@ void SparkIoDevice::checkPresence(PresenceCB aPresenceResultHandler)
     return;
   }
   // query the device
-  sparkApiCall(boost::bind(&SparkIoDevice::presenceStateReceived, this, aPresenceResultHandler, _1, _2), "version");
+  sparkApiCall(boost::bind(&SparkIoDevice::presenceStateReceived, SparkIoDevicePtr(this), aPresenceResultHandler, _1, _2), "version");
 }
 
 
@@ -295,7 +296,7 @@ void SparkIoDevice::applyChannelValues(DoneCB aDoneCB, bool aForDimming)
   if (sl) {
     if (!needsToApplyChannels()) {
       // NOP for this call
-      channelValuesSent(sl, aDoneCB, JsonObjectPtr(), ErrorPtr());
+      if (aDoneCB) aDoneCB();
       return;
     }
     // needs update
@@ -326,30 +327,29 @@ void SparkIoDevice::applyChannelValues(DoneCB aDoneCB, bool aForDimming)
     // set output value
     if (apiVersion==2) {
       string args = string_format("state=%lu", stateWord);
-      // posting might fail if done too early
-      if (!sparkApiCall(boost::bind(&SparkIoDevice::channelValuesSent, this, sl, aDoneCB, _1, _2), args)) {
-        // retry after a while
-        MainLoop::currentMainLoop().executeOnce(boost::bind(&SparkIoDevice::applyChannelValues, this, aDoneCB, aForDimming), 1*Second);
-      }
+      // queued per device, so a state not yet sent is replaced by this one (latest state wins)
+      stateRequests++;
+      sparkApiCall(boost::bind(&SparkIoDevice::channelValuesSent, SparkIoDevicePtr(this), sl, stateRequests, _1, _2), args, sparkCoreID, SPARK_STATE_RETRIES);
     }
     else {
       // error, wrong API
-      channelValuesSent(sl, aDoneCB, JsonObjectPtr(), ErrorPtr(new WebError(415)));
+      LOG(LOG_DEBUG, "Spark vdsd: cannot set state, unsupported API version %d\n", apiVersion);
     }
   }
+  // confirm done: cloud latency and retries must not hold up applying further changes, which are coalesced in the queue
+  if (aDoneCB) aDoneCB();
 }
 
 
-void SparkIoDevice::channelValuesSent(SparkLightBehaviourPtr aSparkLightBehaviour, DoneCB aDoneCB, JsonObjectPtr aJsonResponse, ErrorPtr aError)
+void SparkIoDevice::channelValuesSent(SparkLightBehaviourPtr aSparkLightBehaviour, long aStateRequest, JsonObjectPtr aJsonResponse, ErrorPtr aError)
 {
   if (Error::isOK(aError)) {
-    aSparkLightBehaviour->appliedColorValues();
+    // only the most recent state sent reflects the current channel values
+    if (aStateRequest==stateRequests) aSparkLightBehaviour->appliedColorValues();
   }
   else {
     LOG(LOG_DEBUG, "Spark API error: %s\n", aError->description().c_str());
   }
-  // confirm done
-  if (aDoneCB) aDoneCB();
 }
 
 
@@ -357,7 +357,7 @@ void SparkIoDevice::channelValuesSent(SparkLightBehaviourPtr aSparkLightBehaviou
 void SparkIoDevice::syncChannelValues(DoneCB aDoneCB)
 {
   // query light attributes and state
-  sparkApiCall(boost::bind(&SparkIoDevice::channelValuesReceived, this, aDoneCB, _1, _2), "state");
+  sparkApiCall(boost::bind(&SparkIoDevice::channelValuesReceived, SparkIoDevicePtr(this), aDoneCB, _1, _2), "state", "", SPARK_QUERY_RETRIES);
 }
 
 
@@ -25,7 +25,7 @@
 
 #include "device.hpp"
 
-#include "jsonwebclient.hpp"
+#include "cloudrequestqueue.hpp"
 #include "colorlightbehaviour.hpp"
 #include "staticdevicecontainer.hpp"
 
@@ -162,8 +162,8 @@ namespace p44 {
 
     string sparkCoreID;
     string sparkCoreToken;
-    JsonWebClient sparkCloudComm;
     int apiVersion;
+    long stateRequests; ///< number of state updates queued so far, to recognize the result of the most recent one
 
   public:
     SparkIoDevice(StaticDeviceContainer *aClassContainerP, const string &aDeviceConfig);
@@ -229,12 +229,12 @@ namespace p44 {
 
   private:
 
-    bool sparkApiCall(JsonWebClientCB aResponseCB, string aArgs);
+    void sparkApiCall(JsonWebClientCB aResponseCB, string aArgs, const string &aCoalesceKey = "", int aMaxRetries = 0);
 
     void apiVersionReceived(CompletedCB aCompletedCB, bool aFactoryReset, JsonObjectPtr aJsonResponse, ErrorPtr aError);
     void presenceStateReceived(PresenceCB aPresenceResultHandler, JsonObjectPtr aDeviceInfo, ErrorPtr aError);
 
-    void channelValuesSent(SparkLightBehaviourPtr aSparkLightBehaviour, DoneCB aDoneCB, JsonObjectPtr aJsonResponse, ErrorPtr aError);
+    void channelValuesSent(SparkLightBehaviourPtr aSparkLightBehaviour, long aStateRequest, JsonObjectPtr aJsonResponse, ErrorPtr aError);
     void channelValuesReceived(DoneCB aDoneCB, JsonObjectPtr aJsonResponse, ErrorPtr aError);
 
   };
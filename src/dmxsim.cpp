@@ -0,0 +1,342 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// dmxsim: sACN (E1.31) / Art-Net DMX512 receiver and test pattern sender
+//
+// - listen mode receives sACN and Art-Net on their standard UDP ports (joining the sACN multicast groups
+//   of the given universes), and periodically reports per universe and protocol the frame rate, the number
+//   of frames with changed contents, sequence number gaps and the first channel values.
+//   Run vdcd with --dmxnet sacn:127.0.0.1,artnet:127.0.0.1 to check its output without any DMX hardware.
+// - send mode drives the DmxNetOutput engine (as used by vdcd) with a test pattern, optionally sending
+//   from a separate thread.
+
+#include "application.hpp"
+
+#include "dmxnetoutput.hpp"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SACN_PORT 5568
+#define ARTNET_PORT 6454
+
+#define DEFAULT_REPORT_INTERVAL 1 // seconds
+#define DEFAULT_PATTERN_INTERVAL 40 // milliseconds
+#define DEFAULT_CHANNELS 512
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+#define MAINLOOP_CYCLE_TIME_uS 2000 // 2mS
+#define REPORT_CHANNELS 16 // number of channels shown in reports
+
+using namespace p44;
+
+
+class DmxSim : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  // listen mode
+  typedef struct {
+    long frames;
+    long changed;
+    long gaps;
+    int lastSeq; ///< -1 if none received yet
+    DmxValue data[dmxUniverseSize];
+  } UniverseStats;
+  typedef map<pair<int,int>, UniverseStats> StatsMap; ///< keyed by protocol, universe
+  StatsMap stats;
+  int sockets[dmxnet_numProtocols];
+  MLMicroSeconds reportInterval;
+  MLMicroSeconds lastReport;
+
+  // send mode
+  MainLoopThreadPtr sendThread;
+  DmxNetOutputPtr output;
+  int numChannels;
+  MLMicroSeconds patternInterval;
+  long patternSteps;
+  long step;
+
+public:
+
+  DmxSim() :
+    reportInterval(DEFAULT_REPORT_INTERVAL*Second),
+    lastReport(Never),
+    numChannels(DEFAULT_CHANNELS),
+    patternInterval(DEFAULT_PATTERN_INTERVAL*MilliSecond),
+    patternSteps(0),
+    step(0)
+  {
+    sockets[dmxnet_sacn] = -1;
+    sockets[dmxnet_artnet] = -1;
+  }
+
+  virtual ~DmxSim()
+  {
+    if (sendThread) sendThread->stop();
+    for (int i=0; i<dmxnet_numProtocols; i++) {
+      if (sockets[i]>=0) close(sockets[i]);
+    }
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  listen: %s [-u universes] [-R seconds]\n", name);
+    fprintf(stderr, "  send:   %s -s destinations [-u universe] [-c channels] [-i ms] [-n steps] [-t]\n", name);
+    fprintf(stderr, "    -u universes    : listen: comma separated sACN universes to join multicast groups for (default=1)\n");
+    fprintf(stderr, "                      send: first universe (default=1)\n");
+    fprintf(stderr, "    -R seconds      : statistics report interval (default=%d)\n", DEFAULT_REPORT_INTERVAL);
+    fprintf(stderr, "    -s destinations : send test pattern to protocol[:host][,...] (protocol=sacn|artnet)\n");
+    fprintf(stderr, "    -c channels     : number of channels to send, above 512 continues in following universes (default=%d)\n", DEFAULT_CHANNELS);
+    fprintf(stderr, "    -i ms           : interval between pattern steps (default=%d)\n", DEFAULT_PATTERN_INTERVAL);
+    fprintf(stderr, "    -n steps        : number of pattern steps to send before exiting, 0=forever (default=0)\n");
+    fprintf(stderr, "    -t              : send from a separate thread\n");
+    fprintf(stderr, "    -l loglevel     : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    const char *destinations = NULL;
+    const char *universes = "1";
+    bool threaded = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "hu:R:s:c:i:n:tl:")) != -1)
+    {
+      switch (c) {
+        case 'u': universes = optarg; break;
+        case 'R': reportInterval = atof(optarg)*Second; break;
+        case 's': destinations = optarg; break;
+        case 'c': numChannels = atoi(optarg); break;
+        case 'i': patternInterval = atoi(optarg)*MilliSecond; break;
+        case 'n': patternSteps = atol(optarg); break;
+        case 't': threaded = true; break;
+        case 'l': loglevel = atoi(optarg); break;
+        case 'h':
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    SETLOGLEVEL(loglevel);
+
+    if (destinations) {
+      // send mode
+      if (numChannels<1 || numChannels>0xFFFF || patternInterval<=0) {
+        usage(argv[0]);
+        exit(1);
+      }
+      MainLoop *sendLoop = &MainLoop::currentMainLoop();
+      if (threaded) {
+        sendThread = MainLoopThreadPtr(new MainLoopThread);
+        sendLoop = &sendThread->mainLoop();
+        sendLoop->setLoopCycleTime(MAINLOOP_CYCLE_TIME_uS); // not yet running, so safe to configure
+      }
+      output = DmxNetOutputPtr(new DmxNetOutput(*sendLoop));
+      ErrorPtr err = output->setDestinations(destinations, atoi(universes));
+      if (!Error::isOK(err)) {
+        fprintf(stderr, "Invalid destinations: %s\n", err->description().c_str());
+        exit(1);
+      }
+      uint8_t cid[16];
+      for (int i=0; i<16; i++) cid[i] = rand();
+      output->setSource("dmxsim", cid);
+      if (sendThread) sendThread->start();
+      output->start(boost::bind(&DmxSim::sendStarted, this, _1));
+      return run();
+    }
+
+    // listen mode
+    sockets[dmxnet_sacn] = openListener(SACN_PORT);
+    sockets[dmxnet_artnet] = openListener(ARTNET_PORT);
+    if (sockets[dmxnet_sacn]<0 || sockets[dmxnet_artnet]<0) {
+      exit(1);
+    }
+    // join sACN multicast groups
+    const char *p = universes;
+    while (*p) {
+      int u = atoi(p);
+      struct ip_mreq mreq;
+      mreq.imr_multiaddr.s_addr = htonl(0xEFFF0000 | (u & 0xFFFF));
+      mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+      if (setsockopt(sockets[dmxnet_sacn], IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))<0) {
+        LOG(LOG_WARNING, "Cannot join multicast group for sACN universe %d: %s\n", u, strerror(errno));
+      }
+      while (*p && *p!=',') p++;
+      if (*p) p++;
+    }
+    for (int i=0; i<dmxnet_numProtocols; i++) {
+      MainLoop::currentMainLoop().registerPollHandler(sockets[i], POLLIN, boost::bind(&DmxSim::packetReceived, this, _1, _2, _3, (DmxNetProtocol)i));
+    }
+    printf("Listening for sACN on port %d and Art-Net on port %d\n", SACN_PORT, ARTNET_PORT);
+    lastReport = MainLoop::now();
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&DmxSim::report, this), reportInterval);
+    return run();
+  }
+
+
+  #pragma mark - listen mode
+
+  int openListener(int aPort)
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd<0) {
+      fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+      return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(aPort);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))<0) {
+      fprintf(stderr, "Cannot bind to UDP port %d: %s\n", aPort, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+
+  bool packetReceived(MLMicroSeconds aCycleStartTime, int aFd, int aPollFlags, DmxNetProtocol aProtocol)
+  {
+    if ((aPollFlags & POLLIN)==0) return false;
+    uint8_t buf[1024];
+    ssize_t n = recv(aFd, buf, sizeof(buf), 0);
+    if (n<0) return false;
+    int universe, seq;
+    const uint8_t *data;
+    size_t count;
+    if (aProtocol==dmxnet_sacn) {
+      if (n<126 || memcmp(buf+4, "ASC-E1.17", 9)!=0 || buf[21]!=0x04 || buf[43]!=0x02 || buf[125]!=0) {
+        LOG(LOG_INFO, "Ignoring non-DMX sACN packet (%zd bytes)\n", n);
+        return true;
+      }
+      seq = buf[111];
+      universe = (buf[113]<<8) + buf[114];
+      count = ((buf[123]<<8) + buf[124]) - 1; // includes start code
+      data = buf+126;
+      if (count>(size_t)n-126) count = n-126;
+    }
+    else {
+      if (n<18 || memcmp(buf, "Art-Net\0", 8)!=0 || buf[8]!=0x00 || buf[9]!=0x50) {
+        LOG(LOG_INFO, "Ignoring non-ArtDmx Art-Net packet (%zd bytes)\n", n);
+        return true;
+      }
+      seq = buf[12];
+      universe = ((buf[15] & 0x7F)<<8) + buf[14];
+      count = (buf[16]<<8) + buf[17];
+      data = buf+18;
+      if (count>(size_t)n-18) count = n-18;
+    }
+    if (count>dmxUniverseSize) count = dmxUniverseSize;
+    StatsMap::iterator pos = stats.find(make_pair((int)aProtocol, universe));
+    if (pos==stats.end()) {
+      UniverseStats s;
+      memset(&s, 0, sizeof(s));
+      s.lastSeq = -1;
+      pos = stats.insert(make_pair(make_pair((int)aProtocol, universe), s)).first;
+    }
+    UniverseStats &s = pos->second;
+    s.frames++;
+    if (s.lastSeq>=0 && seq!=0) {
+      int expected = (s.lastSeq+1) & 0xFF;
+      if (aProtocol==dmxnet_artnet && expected==0) expected = 1; // Art-Net skips 0
+      if (seq!=expected) s.gaps++;
+    }
+    s.lastSeq = seq;
+    if (memcmp(s.data, data, count)!=0) {
+      s.changed++;
+      memcpy(s.data, data, count);
+    }
+    return true;
+  }
+
+
+  void report()
+  {
+    MLMicroSeconds now = MainLoop::now();
+    double secs = (double)(now-lastReport)/Second;
+    lastReport = now;
+    for (StatsMap::iterator pos = stats.begin(); pos!=stats.end(); ++pos) {
+      UniverseStats &s = pos->second;
+      printf("%-7s universe %5d: %6.1f fps, %5ld changed, %3ld gaps :",
+        pos->first.first==dmxnet_sacn ? "sACN" : "Art-Net", pos->first.second,
+        s.frames/secs, s.changed, s.gaps
+      );
+      for (int i=0; i<REPORT_CHANNELS; i++) printf(" %02X", s.data[i]);
+      printf("\n");
+      s.frames = 0;
+      s.changed = 0;
+      s.gaps = 0;
+    }
+    fflush(stdout);
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&DmxSim::report, this), reportInterval);
+  }
+
+
+  #pragma mark - send mode
+
+  void sendStarted(ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      fprintf(stderr, "Cannot start sending: %s\n", aError->description().c_str());
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    printf("Sending %d channels: %s%s\n", numChannels, output->description().c_str(), sendThread ? " (from separate thread)" : "");
+    fflush(stdout);
+    nextStep();
+  }
+
+
+  void nextStep()
+  {
+    // running light over all channels, each channel a different phase
+    for (int ch=1; ch<=numChannels; ch++) {
+      output->setChannel(ch, (DmxValue)(step+ch));
+    }
+    step++;
+    if (patternSteps>0 && step>=patternSteps) {
+      // give the last frame time to go out
+      MainLoop::currentMainLoop().executeOnce(boost::bind(&DmxSim::terminateApp, this, EXIT_SUCCESS), 100*MilliSecond);
+      return;
+    }
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&DmxSim::nextStep, this), patternInterval);
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create the mainloop
+  MainLoop::currentMainLoop().setLoopCycleTime(MAINLOOP_CYCLE_TIME_uS);
+  // create app with current mainloop
+  static DmxSim application;
+  // pass control
+  return application.main(argc, argv);
+}
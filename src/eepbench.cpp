@@ -0,0 +1,184 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// eepbench: measures EnOcean 4BS profile handling, without any radio module or vdSM connection
+// - lookup: Enocean4bsHandler::newDevice() for subdevice indices that do not exist (pure profile lookup)
+// - create: Enocean4bsHandler::newDevice() creating devices including their channels and behaviours
+// - decode: EnoceanDevice::handleRadioPacket() with synthetic A5-xx-xx data telegrams, spread over one device
+//   per profile, down to the sensor and binary input behaviours
+
+#include "application.hpp"
+
+#include "devicecontainer.hpp"
+#include "enoceandevicecontainer.hpp"
+#include "enocean4bs.hpp"
+
+#define DEFAULT_NUM_TELEGRAMS 1000000
+#define DEFAULT_NUM_CREATES 10000
+#define DEFAULT_LOGLEVEL LOG_WARNING
+
+#define NUM_SYNTHETIC_TELEGRAMS 1024 // different telegrams, cycled through
+
+using namespace p44;
+
+
+namespace {
+
+  /// the profiles benchmarked: all table driven sensor profiles with more than one channel, some single
+  /// channel ones, and the A5-13-0X multisensor
+  const EnoceanProfile benchProfiles[] = {
+    0xA50205, 0xA50220, 0xA50401, 0xA50602, 0xA50703, 0xA50801, 0xA51003, 0xA51006, 0xA51011, 0xA51201, 0xA51301,
+    0 // terminator
+  };
+
+} // namespace
+
+
+
+class EepBench : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  long numTelegrams;
+  long numCreates;
+
+  DeviceContainerPtr deviceContainer;
+  EnoceanDeviceContainerPtr enoceanDeviceContainer;
+
+public:
+
+  EepBench() :
+    numTelegrams(DEFAULT_NUM_TELEGRAMS),
+    numCreates(DEFAULT_NUM_CREATES)
+  {
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [options]\n", name);
+    fprintf(stderr, "    -n telegrams : number of telegrams to decode (default: %d)\n", DEFAULT_NUM_TELEGRAMS);
+    fprintf(stderr, "    -c creates   : number of device creations and lookups (default: %d)\n", DEFAULT_NUM_CREATES);
+    fprintf(stderr, "    -l loglevel  : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    int c;
+    while ((c = getopt(argc, argv, "hn:c:l:")) != -1)
+    {
+      switch (c) {
+        case 'n':
+          numTelegrams = atol(optarg);
+          break;
+        case 'c':
+          numCreates = atol(optarg);
+          break;
+        case 'l':
+          loglevel = atoi(optarg);
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    if (numTelegrams<1 || numCreates<1) {
+      usage(argv[0]);
+      exit(1);
+    }
+    SETLOGLEVEL(loglevel);
+    SETERRLEVEL(LOG_ERR, true);
+    // app now ready to run
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    // device container without API connection, devices are never announced so nothing gets pushed
+    deviceContainer = DeviceContainerPtr(new DeviceContainer());
+    enoceanDeviceContainer = EnoceanDeviceContainerPtr(new EnoceanDeviceContainer(1, deviceContainer.get(), 1));
+    int numProfiles = 0;
+    while (benchProfiles[numProfiles]) numProfiles++;
+    printf("%d profiles, %ld creations, %ld telegrams\n", numProfiles, numCreates, numTelegrams);
+    printf("%-8s %12s %12s\n", "", "per second", "nS each");
+    // lookup: subdevice 1 does not exist for any of the profiles
+    MLMicroSeconds start = MainLoop::now();
+    long found = 0;
+    for (long i=0; i<numCreates; i++) {
+      if (Enocean4bsHandler::newDevice(enoceanDeviceContainer.get(), 0x100, 1, benchProfiles[i%numProfiles], manufacturer_unknown, false)) found++;
+    }
+    report("lookup", numCreates, MainLoop::now()-start);
+    // create
+    start = MainLoop::now();
+    for (long i=0; i<numCreates; i++) {
+      if (Enocean4bsHandler::newDevice(enoceanDeviceContainer.get(), 0x100, 0, benchProfiles[i%numProfiles], manufacturer_unknown, false)) found++;
+    }
+    report("create", numCreates, MainLoop::now()-start);
+    if (found!=numCreates) {
+      LOG(LOG_ERR, "expected %ld devices to be created, got %ld\n", numCreates, found);
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    // one device per profile
+    vector<EnoceanDevicePtr> devices;
+    for (int i=0; i<numProfiles; i++) {
+      devices.push_back(Enocean4bsHandler::newDevice(enoceanDeviceContainer.get(), 0x100+i, 0, benchProfiles[i], manufacturer_unknown, false));
+    }
+    // synthetic telegrams with random data, LRN bit set (= data telegram), A5-13-0X identifier 1 or 2
+    vector<Esp3PacketPtr> telegrams;
+    for (int i=0; i<NUM_SYNTHETIC_TELEGRAMS; i++) {
+      Esp3PacketPtr packet = Esp3PacketPtr(new Esp3Packet);
+      packet->initForRorg(rorg_4BS);
+      uint32_t data = ((uint32_t)rand()<<16) ^ (uint32_t)rand();
+      data = (data & ~0xF8) | LRN_BIT_MASK | ((1+(i&1))<<4);
+      packet->set4BSdata(data);
+      telegrams.push_back(packet);
+    }
+    // decode
+    start = MainLoop::now();
+    for (long i=0; i<numTelegrams; i++) {
+      devices[i%numProfiles]->handleRadioPacket(telegrams[i%NUM_SYNTHETIC_TELEGRAMS]);
+    }
+    report("decode", numTelegrams, MainLoop::now()-start);
+    terminateApp(EXIT_SUCCESS);
+  }
+
+
+  void report(const char *aName, long aCount, MLMicroSeconds aTime)
+  {
+    if (aTime<1) aTime = 1;
+    printf("%-8s %12.0f %12.1f\n", aName, (double)aCount*Second/aTime, (double)aTime*1000/aCount);
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create app with current mainloop
+  static EepBench application;
+  // pass control
+  return application.main(argc, argv);
+}
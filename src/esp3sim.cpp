@@ -0,0 +1,785 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// esp3sim: EnOcean ESP3 traffic capture, replay and synthetic radio load generator
+//
+// - capture mode records the raw ESP3 byte stream of a real EnOcean module (serial or TCP proxy)
+//   into a text file, one received chunk per line, prefixed with the time offset in microseconds.
+// - serve mode emulates an EnOcean module on a pseudo terminal and/or a TCP port, so vdcd can be
+//   run with --enocean /dev/pts/N or --enocean localhost:port. It answers the common commands vdcd
+//   sends (CO_RD_VERSION alive check), and feeds radio traffic either replayed from a capture file
+//   (real time or accelerated) or synthesized from populations of 4BS temperature sensors,
+//   RPS rockers and 1BS contacts, with a configurable share of telegrams from unknown senders.
+// - parser benchmark mode measures ESP3 parser throughput on a capture file, comparing the byte-by-byte
+//   Esp3Packet::acceptBytes() with the buffer scanning Esp3Parser (as used by EnoceanComm).
+
+#include "application.hpp"
+
+#include "socketcomm.hpp"
+#include "serialcomm.hpp"
+
+#include "enoceancomm.hpp"
+
+#include <termios.h>
+
+#define DEFAULT_ENOCEANPORT 2102
+#define DEFAULT_ENOCEANBAUDRATE 57600
+#define DEFAULT_REPORT_INTERVAL 10 // seconds
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+#define MAINLOOP_CYCLE_TIME_uS 2000 // 2mS
+
+#define GENERATOR_INTERVAL (10*MilliSecond) // synthetic telegrams are generated in batches at this interval
+#define MAX_PENDING_OUTPUT 65536 // max bytes buffered per output before telegrams get dropped
+
+// base addresses for the known sender populations
+#define BASE_ADDR_4BS 0x01A10000
+#define BASE_ADDR_RPS 0x01A20000
+#define BASE_ADDR_1BS 0x01A30000
+// unknown senders are random addresses in this range
+#define BASE_ADDR_UNKNOWN 0x01B00000
+
+// EEPs used for synthesized devices
+#define SIM_EEP_4BS 0xA50205 // temperature sensor 0..40°C
+#define SIM_EEP_1BS 0xD50001 // single input contact
+
+using namespace p44;
+
+
+#pragma mark - output connections
+
+/// an output connection (pty or TCP client) with its pending output
+class Esp3Output : public P44Obj
+{
+public:
+  FdCommPtr comm;
+  string pending; ///< bytes not yet written
+  Esp3Parser parser; ///< parser for received commands
+
+  Esp3Output(FdCommPtr aComm) : comm(aComm) {};
+};
+typedef boost::intrusive_ptr<Esp3Output> Esp3OutputPtr;
+
+
+/// a recorded chunk of the ESP3 byte stream
+typedef struct {
+  MLMicroSeconds offset; ///< time offset from start of capture
+  string bytes; ///< the raw bytes
+} CaptureChunk;
+
+
+#pragma mark - simulator application
+
+class Esp3Sim : public Application
+{
+  // capture
+  SerialCommPtr captureComm;
+  FILE *captureFile;
+  MLMicroSeconds captureStart;
+
+  // outputs
+  FdCommPtr ptyComm;
+  int ptySlaveFd;
+  SocketCommPtr tcpServer;
+  typedef list<Esp3OutputPtr> OutputList;
+  OutputList outputs;
+
+  // replay
+  typedef vector<CaptureChunk> ChunkVector;
+  ChunkVector chunks;
+  size_t nextChunk;
+  MLMicroSeconds replayStart;
+  double speedFactor; ///< 1=real time, >1 accelerated, 0=as fast as possible
+  bool loopReplay;
+
+  // synthetic load
+  int num4BS;
+  int numRPS;
+  int num1BS;
+  int unknownPercent;
+  double telegramRate; ///< telegrams per second
+  double telegramCredit; ///< fractional telegrams not yet generated
+  MLMicroSeconds lastGenerated;
+  vector<bool> rockerPressed; ///< state of the RPS rockers, to alternate press/release
+
+  // statistics
+  MLMicroSeconds reportInterval;
+  MLMicroSeconds statsStart;
+  long telegramsSent;
+  long bytesSent;
+  long bytesDropped;
+  long commandsAnswered;
+
+public:
+
+  Esp3Sim() :
+    captureFile(NULL),
+    ptySlaveFd(-1),
+    nextChunk(0),
+    speedFactor(1),
+    loopReplay(false),
+    num4BS(0),
+    numRPS(0),
+    num1BS(0),
+    unknownPercent(0),
+    telegramRate(0),
+    telegramCredit(0),
+    lastGenerated(Never),
+    reportInterval(DEFAULT_REPORT_INTERVAL*Second)
+  {
+    resetStats();
+  }
+
+
+  virtual ~Esp3Sim()
+  {
+    if (captureFile) fclose(captureFile);
+    if (ptySlaveFd>=0) close(ptySlaveFd);
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  capture: %s -c enoceanpath -w capturefile [-l loglevel]\n", name);
+    fprintf(stderr, "  serve:   %s [-t] [-P port] [replay or synthetic options]\n", name);
+    fprintf(stderr, "    -c enoceanpath  : EnOcean serial port device or enocean proxy ipaddr[:port] to capture from\n");
+    fprintf(stderr, "    -w capturefile  : file to write the captured ESP3 stream to\n");
+    fprintf(stderr, "    -t              : serve emulated EnOcean module on a pseudo terminal (name is printed at startup)\n");
+    fprintf(stderr, "    -P port         : serve emulated EnOcean module on TCP port\n");
+    fprintf(stderr, "    -N              : allow TCP connections from non-local clients\n");
+    fprintf(stderr, "    -r capturefile  : replay captured ESP3 stream\n");
+    fprintf(stderr, "    -B capturefile  : benchmark ESP3 parsers on captured stream and exit\n");
+    fprintf(stderr, "    -x factor       : replay speed factor, 0=as fast as possible (default=1=real time)\n");
+    fprintf(stderr, "    -L              : loop replay\n");
+    fprintf(stderr, "    -4 count        : number of simulated 4BS temperature sensors (EEP A5-02-05)\n");
+    fprintf(stderr, "    -s count        : number of simulated RPS rockers (EEP F6-02-01)\n");
+    fprintf(stderr, "    -1 count        : number of simulated 1BS contacts (EEP D5-00-01)\n");
+    fprintf(stderr, "    -u percent      : percentage of synthetic telegrams from unknown senders (default=0)\n");
+    fprintf(stderr, "    -f rate         : synthetic telegrams per second (default=10 per simulated device)\n");
+    fprintf(stderr, "    -T              : send a teach-in telegram for every simulated device at startup\n");
+    fprintf(stderr, "    -R seconds      : statistics report interval, 0=none (default=%d)\n", DEFAULT_REPORT_INTERVAL);
+    fprintf(stderr, "    -l loglevel     : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    const char *captureSpec = NULL;
+    const char *captureFileName = NULL;
+    const char *replayFileName = NULL;
+    const char *benchFileName = NULL;
+    bool usePty = false;
+    const char *tcpPort = NULL;
+    bool nonLocal = false;
+    bool teachIn = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "hc:w:tP:Nr:B:x:L4:s:1:u:f:TR:l:")) != -1)
+    {
+      switch (c) {
+        case 'c': captureSpec = optarg; break;
+        case 'w': captureFileName = optarg; break;
+        case 't': usePty = true; break;
+        case 'P': tcpPort = optarg; break;
+        case 'N': nonLocal = true; break;
+        case 'r': replayFileName = optarg; break;
+        case 'B': benchFileName = optarg; break;
+        case 'x': speedFactor = atof(optarg); break;
+        case 'L': loopReplay = true; break;
+        case '4': num4BS = atoi(optarg); break;
+        case 's': numRPS = atoi(optarg); break;
+        case '1': num1BS = atoi(optarg); break;
+        case 'u': unknownPercent = atoi(optarg); break;
+        case 'f': telegramRate = atof(optarg); break;
+        case 'T': teachIn = true; break;
+        case 'R': reportInterval = atof(optarg)*Second; break;
+        case 'l': loglevel = atoi(optarg); break;
+        case 'h':
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    SETLOGLEVEL(loglevel);
+
+    if (benchFileName) {
+      // parser benchmark mode
+      ErrorPtr err = loadCapture(benchFileName);
+      if (!Error::isOK(err)) {
+        fprintf(stderr, "Cannot load capture file '%s': %s\n", benchFileName, err->description().c_str());
+        exit(1);
+      }
+      return benchmarkParsers() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (captureSpec) {
+      // capture mode
+      if (!captureFileName) {
+        usage(argv[0]);
+        exit(1);
+      }
+      captureFile = fopen(captureFileName, "w");
+      if (!captureFile) {
+        fprintf(stderr, "Cannot create capture file '%s'\n", captureFileName);
+        exit(1);
+      }
+      fprintf(captureFile, "# esp3sim capture: <time offset in uS> <raw ESP3 bytes in hex>\n");
+      captureComm = SerialCommPtr(new SerialComm(MainLoop::currentMainLoop()));
+      captureComm->setConnectionSpecification(captureSpec, DEFAULT_ENOCEANPORT, DEFAULT_ENOCEANBAUDRATE);
+      captureComm->setReceiveHandler(boost::bind(&Esp3Sim::captureDataReceived, this, _1));
+      captureStart = MainLoop::now();
+      captureComm->requestConnection();
+      printf("Capturing ESP3 stream from %s into %s\n", captureSpec, captureFileName);
+      if (reportInterval>0) {
+        MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::report, this), reportInterval);
+      }
+      return run();
+    }
+
+    // serve mode
+    if (!usePty && !tcpPort) {
+      usage(argv[0]);
+      exit(1);
+    }
+    if (replayFileName) {
+      ErrorPtr err = loadCapture(replayFileName);
+      if (!Error::isOK(err)) {
+        fprintf(stderr, "Cannot load capture file '%s': %s\n", replayFileName, err->description().c_str());
+        exit(1);
+      }
+      printf("Replaying %zu chunks from %s at speed factor %.1f%s\n", chunks.size(), replayFileName, speedFactor, loopReplay ? ", looping" : "");
+    }
+    int numDevices = num4BS+numRPS+num1BS;
+    if (numDevices>0) {
+      if (telegramRate<=0) telegramRate = 10*numDevices;
+      rockerPressed.resize(numRPS, false);
+      printf(
+        "Synthesizing %.1f telegrams/s from %d 4BS sensors, %d RPS rockers, %d 1BS contacts, %d%% unknown senders\n",
+        telegramRate, num4BS, numRPS, num1BS, unknownPercent
+      );
+    }
+    if (usePty) {
+      ErrorPtr err = openPty();
+      if (!Error::isOK(err)) {
+        fprintf(stderr, "Cannot open pseudo terminal: %s\n", err->description().c_str());
+        exit(1);
+      }
+    }
+    if (tcpPort) {
+      tcpServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+      tcpServer->setConnectionParams(NULL, tcpPort, SOCK_STREAM, AF_INET);
+      tcpServer->setAllowNonlocalConnections(nonLocal);
+      tcpServer->startServer(boost::bind(&Esp3Sim::tcpConnectionHandler, this, _1), 3);
+      printf("EnOcean module listening on TCP port %s\n", tcpPort);
+    }
+    // start traffic
+    if (teachIn) {
+      sendTeachIns();
+    }
+    if (!chunks.empty()) {
+      replayStart = MainLoop::now();
+      MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::replayNext, this), 0);
+    }
+    if (numDevices>0) {
+      lastGenerated = MainLoop::now();
+      MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::generate, this), GENERATOR_INTERVAL);
+    }
+    if (reportInterval>0) {
+      MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::report, this), reportInterval);
+    }
+    // app now ready to run
+    return run();
+  }
+
+
+  #pragma mark - capture
+
+  void captureDataReceived(ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) return;
+    string bytes;
+    captureComm->receiveString(bytes);
+    if (bytes.size()>0) {
+      fprintf(captureFile, "%lld %s\n", MainLoop::now()-captureStart, binaryToHexString(bytes).c_str());
+      fflush(captureFile);
+      bytesSent += bytes.size();
+    }
+  }
+
+
+  ErrorPtr loadCapture(const char *aFileName)
+  {
+    FILE *f = fopen(aFileName, "r");
+    if (!f) return SysError::errNo("cannot open: ");
+    char line[1100];
+    while (fgets(line, sizeof(line), f)) {
+      if (line[0]=='#') continue;
+      long long offset;
+      char hex[1024];
+      if (sscanf(line, "%lld %1023s", &offset, hex)==2) {
+        CaptureChunk chunk;
+        chunk.offset = offset;
+        chunk.bytes = hexToBinaryString(hex);
+        chunks.push_back(chunk);
+      }
+    }
+    fclose(f);
+    return ErrorPtr();
+  }
+
+
+  #pragma mark - parser benchmark
+
+  long benchPackets; ///< packets found in current benchmark pass
+
+  void benchPacketFound(Esp3PacketPtr aPacket)
+  {
+    benchPackets++;
+  }
+
+
+  /// parse all chunks once the way EnoceanComm used to: one Esp3Packet at a time, byte by byte
+  void benchPacketPass(long &aCrcErrors)
+  {
+    Esp3PacketPtr packet;
+    for (ChunkVector::iterator pos = chunks.begin(); pos!=chunks.end(); ++pos) {
+      uint8_t *bytes = (uint8_t *)pos->bytes.c_str();
+      size_t remaining = pos->bytes.size();
+      while (remaining>0) {
+        if (!packet) packet = Esp3PacketPtr(new Esp3Packet);
+        size_t used = packet->acceptBytes(remaining, bytes);
+        aCrcErrors += packet->takeCrcErrors();
+        if (packet->isComplete()) {
+          benchPacketFound(packet);
+          packet.reset();
+        }
+        bytes += used;
+        remaining -= used;
+      }
+    }
+  }
+
+
+  /// parse all chunks once with Esp3Parser
+  void benchParserPass(long &aCrcErrors)
+  {
+    Esp3Parser parser;
+    Esp3PacketCB cb = boost::bind(&Esp3Sim::benchPacketFound, this, _1);
+    for (ChunkVector::iterator pos = chunks.begin(); pos!=chunks.end(); ++pos) {
+      parser.parse(pos->bytes.size(), (const uint8_t *)pos->bytes.c_str(), cb);
+    }
+    aCrcErrors += parser.takeCrcErrors();
+  }
+
+
+  bool benchmarkParsers()
+  {
+    size_t numBytes = 0;
+    for (ChunkVector::iterator pos = chunks.begin(); pos!=chunks.end(); ++pos) numBytes += pos->bytes.size();
+    if (numBytes==0) {
+      fprintf(stderr, "Capture file contains no data\n");
+      return false;
+    }
+    printf("%zu bytes in %zu chunks\n", numBytes, chunks.size());
+    printf("%-8s %10s %12s %10s %10s %10s\n", "", "MB/s", "packets/s", "nS/packet", "packets", "crcerrors");
+    long packetsPerPass[2];
+    long crcErrorsPerPass[2];
+    for (int parser=0; parser<2; parser++) {
+      long passes = 0;
+      long crcErrors = 0;
+      benchPackets = 0;
+      MLMicroSeconds start = MainLoop::now();
+      MLMicroSeconds elapsed;
+      do {
+        if (parser==0) benchPacketPass(crcErrors); else benchParserPass(crcErrors);
+        passes++;
+        elapsed = MainLoop::now()-start;
+      } while (elapsed<2*Second);
+      packetsPerPass[parser] = benchPackets/passes;
+      crcErrorsPerPass[parser] = crcErrors/passes;
+      double secs = (double)elapsed/Second;
+      printf(
+        "%-8s %10.1f %12.0f %10.0f %10ld %10ld\n",
+        parser==0 ? "packet" : "stream",
+        (double)numBytes*passes/secs/1e6,
+        benchPackets/secs,
+        benchPackets>0 ? secs*1e9/benchPackets : 0.0,
+        packetsPerPass[parser],
+        crcErrorsPerPass[parser]
+      );
+    }
+    if (packetsPerPass[0]!=packetsPerPass[1] || crcErrorsPerPass[0]!=crcErrorsPerPass[1]) {
+      printf("MISMATCH: parsers found different packets or CRC errors\n");
+      return false;
+    }
+    return true;
+  }
+
+
+  #pragma mark - connections
+
+  ErrorPtr openPty()
+  {
+    int masterFd = posix_openpt(O_RDWR|O_NOCTTY);
+    if (masterFd<0 || grantpt(masterFd)<0 || unlockpt(masterFd)<0) {
+      return SysError::errNo("posix_openpt: ");
+    }
+    const char *slaveName = ptsname(masterFd);
+    // keep the slave side open ourselves, so the master does not see a hangup when vdcd closes the port
+    ptySlaveFd = open(slaveName, O_RDWR|O_NOCTTY);
+    if (ptySlaveFd<0) {
+      return SysError::errNo("open pty slave: ");
+    }
+    // raw mode, no echo
+    struct termios tio;
+    tcgetattr(ptySlaveFd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(ptySlaveFd, TCSANOW, &tio);
+    ptyComm = FdCommPtr(new FdComm(MainLoop::currentMainLoop()));
+    Esp3OutputPtr out = Esp3OutputPtr(new Esp3Output(ptyComm));
+    ptyComm->setReceiveHandler(boost::bind(&Esp3Sim::dataReceived, this, out.get(), _1));
+    ptyComm->setFd(masterFd);
+    ptyComm->makeNonBlocking();
+    outputs.push_back(out);
+    printf("EnOcean module available at %s\n", slaveName);
+    return ErrorPtr();
+  }
+
+
+  SocketCommPtr tcpConnectionHandler(SocketCommPtr aServerSocketComm)
+  {
+    SocketCommPtr conn = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+    Esp3OutputPtr out = Esp3OutputPtr(new Esp3Output(conn));
+    conn->setReceiveHandler(boost::bind(&Esp3Sim::dataReceived, this, out.get(), _1));
+    conn->setConnectionStatusHandler(boost::bind(&Esp3Sim::tcpConnectionStatus, this, _1, _2));
+    outputs.push_back(out);
+    LOG(LOG_NOTICE, "EnOcean client connected via TCP\n");
+    return conn;
+  }
+
+
+  void tcpConnectionStatus(SocketCommPtr aSocketComm, ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      LOG(LOG_NOTICE, "EnOcean client disconnected: %s\n", aError->description().c_str());
+      for (OutputList::iterator pos = outputs.begin(); pos!=outputs.end(); ++pos) {
+        if ((*pos)->comm==aSocketComm) {
+          outputs.erase(pos);
+          break;
+        }
+      }
+    }
+  }
+
+
+  /// commands sent by vdcd to the emulated module
+  void dataReceived(Esp3Output *aOutput, ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) return;
+    Esp3OutputPtr keepAlive(aOutput);
+    string input;
+    aOutput->comm->receiveAndAppendToString(input);
+    aOutput->parser.parse(input.size(), (const uint8_t *)input.c_str(), boost::bind(&Esp3Sim::handleCommand, this, aOutput, _1));
+  }
+
+
+  void handleCommand(Esp3Output *aOutput, Esp3PacketPtr aPacket)
+  {
+    Esp3PacketPtr resp = Esp3PacketPtr(new Esp3Packet);
+    resp->setPacketType(pt_response);
+    if (aPacket->packetType()==pt_common_cmd && aPacket->dataLength()>0 && aPacket->data()[0]==CO_RD_VERSION) {
+      // version info: return code, app version, api version, chip ID, chip version, app description
+      resp->setDataLength(33);
+      uint8_t *d = resp->data();
+      d[0] = RET_OK;
+      d[1] = 2; d[2] = 6; // app version 2.6.x.x
+      d[5] = 2; d[6] = 6; // api version 2.6.x.x
+      d[9] = 0xFF; d[10] = 0xA0; d[11] = 0x00; d[12] = 0x01; // chip ID = modem address
+      strncpy((char *)d+17, "esp3sim", 16);
+      LOG(LOG_INFO, "Answered CO_RD_VERSION\n");
+    }
+    else {
+      // just acknowledge everything else
+      resp->setDataLength(1);
+      resp->data()[0] = RET_OK;
+      LOG(LOG_INFO, "Acknowledged packet type 0x%02X\n", aPacket->packetType());
+    }
+    commandsAnswered++;
+    sendTo(aOutput, packetBytes(resp));
+  }
+
+
+  #pragma mark - output
+
+  /// @return complete ESP3 byte stream for a packet
+  string packetBytes(Esp3PacketPtr aPacket)
+  {
+    aPacket->finalize();
+    size_t payloadLen = aPacket->dataLength()+aPacket->optDataLength();
+    string s;
+    s.reserve(6+payloadLen+1);
+    s += (char)0x55;
+    s += (char)((aPacket->dataLength()>>8) & 0xFF);
+    s += (char)(aPacket->dataLength() & 0xFF);
+    s += (char)aPacket->optDataLength();
+    s += (char)aPacket->packetType();
+    s += (char)aPacket->headerCRC();
+    s.append((const char *)aPacket->data(), payloadLen);
+    s += (char)aPacket->payloadCRC();
+    return s;
+  }
+
+
+  void sendTo(Esp3Output *aOutput, const string &aBytes)
+  {
+    if (aOutput->pending.size()+aBytes.size()>MAX_PENDING_OUTPUT) {
+      // receiver does not keep up (or nobody has the pty open)
+      bytesDropped += aBytes.size();
+      return;
+    }
+    aOutput->pending += aBytes;
+    flush(aOutput);
+  }
+
+
+  void sendToAll(const string &aBytes)
+  {
+    for (OutputList::iterator pos = outputs.begin(); pos!=outputs.end(); ++pos) {
+      sendTo(pos->get(), aBytes);
+    }
+    bytesSent += aBytes.size();
+  }
+
+
+  void flush(Esp3Output *aOutput)
+  {
+    if (aOutput->pending.empty()) return;
+    ErrorPtr err;
+    size_t n = aOutput->comm->transmitBytes(aOutput->pending.size(), (const uint8_t *)aOutput->pending.c_str(), err);
+    if (!Error::isOK(err)) {
+      if (!err->isError(SysError::domain(), EAGAIN)) {
+        LOG(LOG_WARNING, "Cannot send ESP3 data: %s\n", err->description().c_str());
+        aOutput->pending.clear();
+        return;
+      }
+      n = 0;
+    }
+    aOutput->pending.erase(0, n);
+    if (aOutput->pending.empty()) {
+      aOutput->comm->setTransmitHandler(NULL);
+    }
+    else {
+      // wait until output is ready again
+      aOutput->comm->setTransmitHandler(boost::bind(&Esp3Sim::readyForTransmit, this, aOutput, _1));
+    }
+  }
+
+
+  void readyForTransmit(Esp3Output *aOutput, ErrorPtr aError)
+  {
+    Esp3OutputPtr keepAlive(aOutput);
+    flush(aOutput);
+  }
+
+
+  #pragma mark - replay
+
+  void replayNext()
+  {
+    MLMicroSeconds elapsed = MainLoop::now()-replayStart;
+    // send all chunks that are due
+    while (nextChunk<chunks.size()) {
+      CaptureChunk &chunk = chunks[nextChunk];
+      MLMicroSeconds due = speedFactor>0 ? chunk.offset/speedFactor : 0;
+      if (due>elapsed) {
+        MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::replayNext, this), due-elapsed);
+        return;
+      }
+      sendToAll(chunk.bytes);
+      telegramsSent++;
+      nextChunk++;
+      if (speedFactor<=0 && nextChunk % 100==0) break; // let mainloop run now and then
+    }
+    if (nextChunk>=chunks.size()) {
+      if (!loopReplay) {
+        printf("Replay complete\n");
+        return;
+      }
+      nextChunk = 0;
+      replayStart = MainLoop::now();
+    }
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::replayNext, this), 0);
+  }
+
+
+  #pragma mark - synthetic load
+
+  Esp3PacketPtr radioPacket(RadioOrg aRorg, EnoceanAddress aSender, uint8_t aStatus)
+  {
+    Esp3PacketPtr p = Esp3PacketPtr(new Esp3Packet);
+    p->initForRorg(aRorg);
+    p->setRadioSender(aSender);
+    p->setRadioDestination(EnoceanBroadcast);
+    p->data()[p->dataLength()-1] = aStatus;
+    // make it look like a received telegram
+    uint8_t *o = p->optData();
+    o[0] = 1; // one subtelegram
+    o[5] = 50+(rand() % 40); // -50..-90dBm
+    return p;
+  }
+
+
+  Esp3PacketPtr sensorTelegram(EnoceanAddress aSender)
+  {
+    Esp3PacketPtr p = radioPacket(rorg_4BS, aSender, 0);
+    // A5-02-05: DB1 = temperature 255..0 for 0..40°C, DB0 bit 3 = data telegram
+    uint8_t temp = 255-(uint8_t)((15+(rand() % 100)/10.0)*255/40);
+    p->set4BSdata((temp<<8) | LRN_BIT_MASK);
+    return p;
+  }
+
+
+  Esp3PacketPtr rockerTelegram(EnoceanAddress aSender, bool aPressed)
+  {
+    // F6-02-01: press of rocker A, upper button = N-message, release = U-message
+    Esp3PacketPtr p = radioPacket(rorg_RPS, aSender, aPressed ? status_T21|status_NU : status_T21);
+    p->radioUserData()[0] = aPressed ? 0x10 : 0x00;
+    return p;
+  }
+
+
+  Esp3PacketPtr contactTelegram(EnoceanAddress aSender, bool aClosed)
+  {
+    // D5-00-01: bit 3 = data telegram, bit 0 = contact closed
+    Esp3PacketPtr p = radioPacket(rorg_1BS, aSender, 0);
+    p->radioUserData()[0] = LRN_BIT_MASK | (aClosed ? 0x01 : 0x00);
+    return p;
+  }
+
+
+  void sendTeachIns()
+  {
+    for (int i=0; i<num4BS; i++) {
+      Esp3PacketPtr p = radioPacket(rorg_4BS, BASE_ADDR_4BS+i, 0);
+      p->set4BSdata(0);
+      p->set4BSTeachInEEP(SIM_EEP_4BS);
+      p->radioUserData()[3] = 0x80; // teach-in with EEP, LRN bit cleared
+      sendToAll(packetBytes(p));
+    }
+    for (int i=0; i<numRPS; i++) {
+      // any RPS telegram serves as teach-in
+      sendToAll(packetBytes(rockerTelegram(BASE_ADDR_RPS+i, true)));
+      sendToAll(packetBytes(rockerTelegram(BASE_ADDR_RPS+i, false)));
+    }
+    for (int i=0; i<num1BS; i++) {
+      Esp3PacketPtr p = radioPacket(rorg_1BS, BASE_ADDR_1BS+i, 0);
+      p->radioUserData()[0] = 0x00; // LRN bit cleared = teach-in
+      sendToAll(packetBytes(p));
+    }
+    printf("Sent teach-in telegrams for %d devices\n", num4BS+numRPS+num1BS);
+  }
+
+
+  void generate()
+  {
+    MLMicroSeconds now = MainLoop::now();
+    telegramCredit += telegramRate*(now-lastGenerated)/Second;
+    lastGenerated = now;
+    int numDevices = num4BS+numRPS+num1BS;
+    string burst;
+    while (telegramCredit>=1) {
+      telegramCredit -= 1;
+      bool unknown = unknownPercent>0 && (rand() % 100)<unknownPercent;
+      int dev = rand() % numDevices;
+      Esp3PacketPtr p;
+      if (dev<num4BS) {
+        p = sensorTelegram(unknown ? BASE_ADDR_UNKNOWN+(rand() & 0xFFFF) : BASE_ADDR_4BS+dev);
+      }
+      else if (dev<num4BS+numRPS) {
+        dev -= num4BS;
+        if (unknown) {
+          p = rockerTelegram(BASE_ADDR_UNKNOWN+(rand() & 0xFFFF), true);
+        }
+        else {
+          rockerPressed[dev] = !rockerPressed[dev];
+          p = rockerTelegram(BASE_ADDR_RPS+dev, rockerPressed[dev]);
+        }
+      }
+      else {
+        dev -= num4BS+numRPS;
+        p = contactTelegram(unknown ? BASE_ADDR_UNKNOWN+(rand() & 0xFFFF) : BASE_ADDR_1BS+dev, rand() & 1);
+      }
+      burst += packetBytes(p);
+      telegramsSent++;
+    }
+    if (!burst.empty()) sendToAll(burst);
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::generate, this), GENERATOR_INTERVAL);
+  }
+
+
+  #pragma mark - statistics
+
+  void resetStats()
+  {
+    statsStart = MainLoop::now();
+    telegramsSent = 0;
+    bytesSent = 0;
+    bytesDropped = 0;
+    commandsAnswered = 0;
+  }
+
+
+  void report()
+  {
+    double secs = (double)(MainLoop::now()-statsStart)/Second;
+    if (secs>0) {
+      if (captureComm) {
+        printf("captured %6.1f bytes/s\n", bytesSent/secs);
+      }
+      else {
+        printf(
+          "%7.1f telegrams/s, %8.1f bytes/s, %ld bytes dropped, %ld commands answered, %zu clients\n",
+          telegramsSent/secs,
+          bytesSent/secs,
+          bytesDropped,
+          commandsAnswered,
+          outputs.size()
+        );
+      }
+      fflush(stdout);
+    }
+    resetStats();
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&Esp3Sim::report, this), reportInterval);
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create the mainloop
+  MainLoop::currentMainLoop().setLoopCycleTime(MAINLOOP_CYCLE_TIME_uS);
+  // create app with current mainloop
+  static Esp3Sim application;
+  // pass control
+  return application.main(argc, argv);
+}
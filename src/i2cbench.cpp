@@ -0,0 +1,226 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// i2cbench: counts I2C bus transactions for color transition steps on a PCA9685 PWM controller, on a simulated
+// bus (no /dev/i2c needed)
+// - channel: each channel written in its own transaction (flushed after every channel, as before batching)
+// - batched: all channels of a step set from one mainloop handler, flushed automatically afterwards
+// - unchanged: steps repeating the previous values, which should cause no bus traffic at all
+// With -L, simulated bus accesses take time like on real hardware, so the effect on step duration shows as well.
+
+#include "application.hpp"
+
+#include "i2c.hpp"
+#include "simhardware.hpp"
+
+#define PCA9685_ADDRESS 0x40 // as in the device ID "PCA9685@40" below
+#define DEFAULT_NUM_STEPS 10000
+#define DEFAULT_NUM_CHANNELS 3
+#define DEFAULT_LOGLEVEL LOG_WARNING
+
+using namespace p44;
+
+
+class I2CBench : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  long numSteps;
+  int numChannels;
+
+  I2CAnalogPortDevicePtr pwm;
+  long step;
+  MLMicroSeconds start;
+
+public:
+
+  I2CBench() :
+    numSteps(DEFAULT_NUM_STEPS),
+    numChannels(DEFAULT_NUM_CHANNELS)
+  {
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [options]\n", name);
+    fprintf(stderr, "    -n steps     : number of transition steps per run (default: %d)\n", DEFAULT_NUM_STEPS);
+    fprintf(stderr, "    -c channels  : number of PWM channels changed per step, 1..16 (default: %d)\n", DEFAULT_NUM_CHANNELS);
+    fprintf(stderr, "    -L uS[,uS]   : simulated bus time per transaction[,per byte] (default: 0)\n");
+    fprintf(stderr, "    -l loglevel  : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    long perTransaction = 0;
+    long perByte = 0;
+    int c;
+    while ((c = getopt(argc, argv, "hn:c:L:l:")) != -1)
+    {
+      switch (c) {
+        case 'n':
+          numSteps = atol(optarg);
+          break;
+        case 'c':
+          numChannels = atoi(optarg);
+          break;
+        case 'L':
+          sscanf(optarg, "%ld,%ld", &perTransaction, &perByte);
+          break;
+        case 'l':
+          loglevel = atoi(optarg);
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    if (numSteps<1 || numChannels<1 || numChannels>16) {
+      usage(argv[0]);
+      exit(1);
+    }
+    SETLOGLEVEL(loglevel);
+    SETERRLEVEL(LOG_ERR, true);
+    SimHardware::sharedSimHardware().setLatency(perTransaction, perByte);
+    // app now ready to run
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    pwm = boost::dynamic_pointer_cast<I2CAnalogPortDevice>(I2CManager::sharedManager()->getDevice(0, "PCA9685@40", true));
+    if (!pwm) {
+      LOG(LOG_ERR, "cannot create simulated PCA9685\n");
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    printf("%ld steps, %d channels per step\n", numSteps, numChannels);
+    printf("%-10s %14s %14s %14s %12s %12s\n", "", "transactions", "data bytes", "dev selects", "bus uS", "uS each");
+    // channel: every channel flushed separately
+    pwm->getBus().resetStats();
+    start = MainLoop::now();
+    for (long i=0; i<numSteps; i++) {
+      for (int ch=0; ch<numChannels; ch++) {
+        pwm->setPinValue(ch, stepValue(i, ch));
+        pwm->flushRegisters();
+      }
+    }
+    report("channel");
+    // batched: steps run as mainloop handlers, like AnalogIODevice transition steps
+    step = 0;
+    pwm->getBus().resetStats();
+    start = MainLoop::now();
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&I2CBench::batchedStep, this));
+  }
+
+
+  double stepValue(long aStep, int aChannel)
+  {
+    // channels ramp at different speeds, so every step changes every channel
+    return (double)((aStep*(aChannel+1)) % 1000 + 1)/10;
+  }
+
+
+  /// LED register bytes (ON_L, ON_H, OFF_L, OFF_H) the PCA9685 must have for a channel value,
+  /// as per datasheet (on time staggered by channel number, full on/off bits at the ends of the range)
+  void ledRegisters(int aChannel, double aValue, uint8_t aLedData[4])
+  {
+    uint16_t v = (uint16_t)(aValue*40.96);
+    if (v==0) {
+      aLedData[0] = 0; aLedData[1] = 0; aLedData[2] = 0; aLedData[3] = 0x10; // full off
+    }
+    else if (v>=0x0FFF) {
+      aLedData[0] = 0; aLedData[1] = 0x10; aLedData[2] = 0; aLedData[3] = 0; // full on
+    }
+    else {
+      uint16_t off = ((aChannel<<8)+v) & 0xFFF;
+      aLedData[0] = 0; aLedData[1] = aChannel; aLedData[2] = off & 0xFF; aLedData[3] = (off>>8) & 0xF;
+    }
+  }
+
+
+  void batchedStep()
+  {
+    if (step>=numSteps) {
+      report("batched");
+      // unchanged: same values again
+      pwm->getBus().resetStats();
+      start = MainLoop::now();
+      for (long i=0; i<numSteps; i++) {
+        for (int ch=0; ch<numChannels; ch++) {
+          pwm->setPinValue(ch, stepValue(numSteps-1, ch));
+        }
+        pwm->flushRegisters();
+      }
+      report("unchanged");
+      // check simulated device has the values last set
+      // Note: must check the register image on the simulated bus, not getPinValue(), which only reads
+      //   the driver's shadow registers and would not notice a flush that did not write
+      for (int ch=0; ch<numChannels; ch++) {
+        uint8_t expected[4];
+        ledRegisters(ch, stepValue(numSteps-1, ch), expected);
+        for (int i=0; i<4; i++) {
+          uint8_t r = 6+ch*4+i; // LEDn_ON_L..LEDn_OFF_H
+          uint8_t b;
+          pwm->getBus().getSimulatedRegister(PCA9685_ADDRESS, r, b);
+          if (b!=expected[i]) {
+            LOG(LOG_ERR, "channel %d: register 0x%02X expected 0x%02X, bus has 0x%02X\n", ch, r, expected[i], b);
+            terminateApp(EXIT_FAILURE);
+            return;
+          }
+        }
+      }
+      terminateApp(EXIT_SUCCESS);
+      return;
+    }
+    for (int ch=0; ch<numChannels; ch++) {
+      pwm->setPinValue(ch, stepValue(step, ch));
+    }
+    step++;
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&I2CBench::batchedStep, this));
+  }
+
+
+  void report(const char *aName)
+  {
+    MLMicroSeconds t = MainLoop::now()-start;
+    const I2CBusStats &stats = pwm->getBus().getStats();
+    printf(
+      "%-10s %14.2f %14.2f %14.2f %12.3f %12.3f\n", aName,
+      (double)stats.transactions/numSteps, (double)stats.bytes/numSteps, (double)stats.deviceSelects/numSteps,
+      (double)stats.busyTime/numSteps, (double)t/numSteps
+    );
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create app with current mainloop
+  static I2CBench application;
+  // pass control
+  return application.main(argc, argv);
+}
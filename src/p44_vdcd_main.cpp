@@ -20,11 +20,11 @@
 #include "enoceandevicecontainer.hpp"
 #include "staticdevicecontainer.hpp"
 
-#if !DISABLE_OLA
 #include "oladevicecontainer.hpp"
-#endif
 
 #include "digitalio.hpp"
+#include "simhardware.hpp"
+#include "cloudrequestqueue.hpp"
 
 
 #define DEFAULT_USE_PROTOBUF_API 1 // 0: no, 1: yes
@@ -247,40 +247,55 @@ public:
       { 0  , "dalirxadj",     true,  "adjustment;DALI signal adjustment for receiving" },
       { 'b', "enocean",       true,  "bridge;EnOcean modem serial port device or proxy host[:port]" },
       { 0,   "enoceanreset",  true,  "pinspec;set I/O pin connected to EnOcean module reset" },
+      { 0,   "enoceandupwindows", true, "rps,1bs,4bs,other;milliseconds within which copies of EnOcean telegrams (from repeaters) are ignored, 0=process all" },
       { 0,   "huelights",     false, "enable support for hue LED lamps (via hue bridge)" },
       { 0,   "hueapiurl",     true,  "hue API url; use hue bridge API at specific location (disables UPnP/SSDP search)" },
       #if !DISABLE_OLA
       { 0,   "ola",           false, "enable support for OLA (Open Lighting Architecture) server" },
       #endif
+      { 0,   "dmxnet",        true,  "protocol[:host][,...];send DMX512 directly via sACN/E1.31 and/or Art-Net (protocol=sacn|artnet),\n"
+                                     "default is sACN multicast/Art-Net broadcast" },
+      { 0,   "dmxuniverse",   true,  "universe;first DMX512 universe for --dmxnet (default 1), channels above 512 use the following universes" },
       { 0,   "staticdevices", false, "enable support for statically defined devices" },
       { 'C', "vdsmport",      true,  "port;port number/service name for vdSM to connect to (default pbuf:" DEFAULT_PBUF_VDSMSERVICE ", JSON:" DEFAULT_JSON_VDSMSERVICE ")" },
       { 'i', "vdsmnonlocal",  false, "allow vdSM connections from non-local clients" },
       { 'w', "startupdelay",  true,  "seconds;delay startup" },
       { 0  , "announcepause", true,  "milliseconds;pause between device announcements at startup" },
+      { 0  , "vdsmtimeout",   true,  "seconds;timeout for method calls sent to the vdSM (pbuf API only, 0=none)" },
+      { 0  , "vdsmmaxpending",true,  "count;max number of method calls awaiting an answer from the vdSM (pbuf API only, 0=unlimited)" },
       { 'l', "loglevel",      true,  "level;set max level of log message detail to show on stdout" },
       { 0  , "errlevel",      true,  "level;set max level for log messages to go to stderr as well" },
       { 0  , "mainloopstats", true,  "interval;0=no stats, 1..N interval (5Sec steps)" },
       { 0  , "dontlogerrors", false, "don't duplicate error messages (see --errlevel) on stdout" },
       { 's', "sqlitedir",     true,  "dirpath;set SQLite DB directory (default = " DEFAULT_DBDIR ")" },
+      { 0  , "packedscenes",  false, "store device scene tables as one packed record per device" },
+      { 0  , "commthreads",   false, "run DALI, EnOcean and DMX network communication on separate threads" },
       { 0  , "icondir",       true,  "icon directory;specifiy path to directory containing device icons" },
       { 'W', "cfgapiport",    true,  "port;server port number for web configuration JSON API (default=none)" },
       { 0  , "cfgapinonlocal",false, "allow web configuration JSON API from non-local clients" },
+      { 0  , "metricsport",   true,  "port;server port number for Prometheus metrics (default=none)" },
+      { 0  , "metricsnonlocal",false,"allow metrics access from non-local clients" },
+      { 0  , "tracebuffer",   true,  "events;enable request tracing, keeping the specified number of trace events (default=none)" },
+      { 0  , "simlatency",    true,  "uS[,uS];time per transaction[,per byte] of simulated (sim.) hardware accesses (default=0)" },
       { 0  , "sparkcore",     true,  "sparkCoreID:authToken;add spark core based cloud device" },
+      { 0  , "cloudrequests", true,  "count;max number of cloud API requests in progress at the same time (default=4)" },
       { 'g', "digitalio",     true,  "iospec:[!](button|light|relay);add static digital input or output device\n"
                                      "Use ! for inverted polarity (default is noninverted input)\n"
                                      "iospec is of form [bus.[device.]]pin:\n"
                                      "- gpio.gpionumber : generic Linux GPIO\n"
       #if !DISABLE_I2C
                                      "- i2cN.DEVICE@i2caddr.pinNumber : numbered pin of device at i2caddr on i2c bus N\n"
-                                     "  (supported for DEVICE : TCA9555, PCF8574)"
+                                     "  (supported for DEVICE : TCA9555, PCF8574)\n"
       #endif
+                                     "- sim.iospec : simulated hardware (no actual I/O, see --simlatency)"
                                      },
       { 0  , "analogio",      true,  "iospec:(dimmer|rgbdimmer|valve);add static analog input or output device\n"
                                      "iospec is of form [bus.[device.]]pin:\n"
       #if !DISABLE_I2C
                                      "- i2cN.DEVICE@i2caddr.pinNumber : numbered pin of device at i2caddr on i2c bus N\n"
-                                     "  (supported for DEVICE : PCA9685)"
+                                     "  (supported for DEVICE : PCA9685)\n"
       #endif
+                                     "- sim.iospec : simulated hardware (no actual I/O, see --simlatency)"
                                      },
       { 'k', "consoleio",     true,  "name[:(dimmer|button|valve)];add static debug device which reads and writes console\n"
                                      "(for inputs: first char of name=action key)" },
@@ -355,6 +370,8 @@ public:
       const char *dbdir = DEFAULT_DBDIR;
       getStringOption("sqlitedir", dbdir);
       p44VdcHost->setPersistentDataDir(dbdir);
+      p44VdcHost->setPackedSceneStorage(getOption("packedscenes"));
+      p44VdcHost->setCommThreads(getOption("commthreads"));
 
       // - set icon directory
       const char *icondir = NULL;
@@ -405,7 +422,13 @@ public:
       getIntOption("protobufapi", protobufapi);
       const char *vdsmport;
       if (protobufapi) {
-        p44VdcHost->vdcApiServer = VdcApiServerPtr(new VdcPbufApiServer());
+        VdcPbufApiServerPtr pbufApiServer = VdcPbufApiServerPtr(new VdcPbufApiServer());
+        int vdsmTimeout = DEFAULT_VDSM_REQUEST_TIMEOUT/Second;
+        int vdsmMaxPending = DEFAULT_VDSM_MAX_PENDING_REQUESTS;
+        getIntOption("vdsmtimeout", vdsmTimeout);
+        getIntOption("vdsmmaxpending", vdsmMaxPending);
+        pbufApiServer->setRequestLimits(vdsmTimeout>0 ? vdsmTimeout*Second : Never, vdsmMaxPending>0 ? vdsmMaxPending : 0);
+        p44VdcHost->vdcApiServer = pbufApiServer;
         vdsmport = (char *) DEFAULT_PBUF_VDSMSERVICE;
       }
       else {
@@ -426,6 +449,35 @@ public:
         p44VdcHost->startConfigApi();
       }
 
+      // Create metrics server
+      const char *metricsPort = getOption("metricsport");
+      if (metricsPort) {
+        p44VdcHost->metricsServer->setConnectionParams(NULL, metricsPort, SOCK_STREAM, AF_INET);
+        p44VdcHost->metricsServer->setAllowNonlocalConnections(getOption("metricsnonlocal"));
+        p44VdcHost->startMetricsServer();
+      }
+
+      // Enable request tracing
+      int traceEvents = 0;
+      if (getIntOption("tracebuffer", traceEvents) && traceEvents>0) {
+        Trace::enable(traceEvents);
+      }
+
+      // Latency of simulated hardware
+      const char *simLatency = getOption("simlatency");
+      if (simLatency) {
+        long perTransaction = 0;
+        long perByte = 0;
+        sscanf(simLatency, "%ld,%ld", &perTransaction, &perByte);
+        SimHardware::sharedSimHardware().setLatency(perTransaction, perByte);
+      }
+
+      // Concurrency limit for cloud devices
+      int cloudRequests;
+      if (getIntOption("cloudrequests", cloudRequests)) {
+        CloudRequestQueue::sharedQueue().setMaxConcurrent(cloudRequests);
+      }
+
       // Create static container structure
       // - Add DALI devices class if DALI bridge serialport/host is specified
       const char *daliname = getOption("dali");
@@ -449,6 +501,16 @@ public:
         int valveSensors = DEFAULT_USE_VALVE_SENSORS;
         getIntOption("valvesensors", protobufapi);
         enoceanDeviceContainer->heatingValveSensorsEnabled = valveSensors;
+        // duplicate telegram filter windows
+        string dupwin;
+        if (getStringOption("enoceandupwindows", dupwin)) {
+          int w[Esp3DuplicateFilter::numFamilies];
+          if (sscanf(dupwin.c_str(), "%d,%d,%d,%d", &w[0], &w[1], &w[2], &w[3])==Esp3DuplicateFilter::numFamilies) {
+            for (int i=0; i<Esp3DuplicateFilter::numFamilies; i++) {
+              enoceanDeviceContainer->duplicateFilter.setWindow((Esp3DuplicateFilter::ProfileFamily)i, w[i]*MilliSecond);
+            }
+          }
+        }
         // add
         enoceanDeviceContainer->addClassToDeviceContainer();
       }
@@ -461,13 +523,29 @@ public:
         }
         hueDeviceContainer->addClassToDeviceContainer();
       }
+      // - Add OLA or DMX network support
+      string dmxnet;
+      bool useDmxNet = getStringOption("dmxnet", dmxnet);
       #if !DISABLE_OLA
-      // - Add OLA support
-      if (getOption("ola")) {
+      if (getOption("ola") || useDmxNet) {
+      #else
+      if (useDmxNet) {
+      #endif
         OlaDeviceContainerPtr olaDeviceContainer = OlaDeviceContainerPtr(new OlaDeviceContainer(1, p44VdcHost.get(), 5)); // Tag 5 = ola
-        olaDeviceContainer->addClassToDeviceContainer();
+        ErrorPtr err;
+        if (useDmxNet) {
+          int universe = 1;
+          getIntOption("dmxuniverse", universe);
+          err = olaDeviceContainer->useDmxNet(dmxnet, universe);
+        }
+        if (Error::isOK(err)) {
+          olaDeviceContainer->addClassToDeviceContainer();
+        }
+        else {
+          LOG(LOG_ERR, "Invalid --dmxnet: %s\n", err->description().c_str());
+          terminateApp(EXIT_FAILURE);
+        }
       }
-      #endif
       // - Add static devices if we explictly want it or have collected any config from the command line
       if (getOption("staticdevices") || staticDeviceConfigs.size()>0) {
         StaticDeviceContainerPtr staticDeviceContainer = StaticDeviceContainerPtr(new StaticDeviceContainer(1, staticDeviceConfigs, p44VdcHost.get(), 4)); // Tag 4 = static
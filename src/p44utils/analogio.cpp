@@ -32,6 +32,7 @@
 #include "iopin.hpp"
 #include "gpio.hpp"
 #include "i2c.hpp"
+#include "simhardware.hpp"
 
 #include "logger.hpp"
 #include "mainloop.hpp"
@@ -48,19 +49,22 @@ AnalogIo::AnalogIo(const char* aAnalogIoName, bool aOutput, double aInitialValue
     ioPin = AnalogIOPinPtr(new AnalogMissingPin(aInitialValue));
     return;
   }
+  // check for simulated hardware: sim.<iospec>
+  bool simulated = name.substr(0,4)=="sim.";
+  string spec = simulated ? name.substr(4) : name;
   // dissect name into bus, device, pin
   string busName;
   string deviceName;
   string pinName;
-  size_t i = name.find(".");
+  size_t i = spec.find(".");
   if (i==string::npos) {
-    // no structured name, NOP
-    return;
+    // no structured name, NOP (unless simulated)
+    if (!simulated) return;
   }
   else {
-    busName = name.substr(0,i);
+    busName = spec.substr(0,i);
     // rest is device + pinname or just pinname
-    pinName = name.substr(i+1,string::npos);
+    pinName = spec.substr(i+1,string::npos);
     i = pinName.find(".");
     if (i!=string::npos) {
       // separate device and pin names
@@ -71,12 +75,16 @@ AnalogIo::AnalogIo(const char* aAnalogIoName, bool aOutput, double aInitialValue
     }
   }
   // now create appropriate pin
-  DBGLOG(LOG_DEBUG, "AnalogIo: bus name = '%s'\n", busName.c_str());
+  DBGLOG(LOG_DEBUG, "AnalogIo: bus name = '%s'%s\n", busName.c_str(), simulated ? " (simulated)" : "");
   if (busName.substr(0,3)=="i2c") {
-    // i2c<busnum>.<devicespec>.<pinnum>
+    // [sim.]i2c<busnum>.<devicespec>.<pinnum>
     int busNumber = atoi(busName.c_str()+3);
     int pinNumber = atoi(pinName.c_str());
-    ioPin = AnalogIOPinPtr(new AnalogI2CPin(busNumber, deviceName.c_str(), pinNumber, output, aInitialValue));
+    ioPin = AnalogIOPinPtr(new AnalogI2CPin(busNumber, deviceName.c_str(), pinNumber, output, aInitialValue, simulated));
+  }
+  else if (simulated) {
+    // sim.<anything else>: quiet simulated pin
+    ioPin = AnalogIOPinPtr(new SimAnalogPin(name.c_str(), output, aInitialValue));
   }
   else if (busName=="syscmd") {
     // analog I/O calling system command to set value
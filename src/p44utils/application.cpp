@@ -23,6 +23,7 @@
 #include "mainloop.hpp"
 
 #include <sys/stat.h> // for umask
+#include <signal.h>
 
 using namespace p44;
 
@@ -70,6 +71,8 @@ void Application::initialize()
 
 int Application::run()
 {
+  // writing to a pipe or socket whose reader has gone must report EPIPE, not kill the app
+  signal(SIGPIPE, SIG_IGN);
 	// schedule the initialize() method as first mainloop method
 	mainLoop.executeOnce(boost::bind(&Application::initialize, this));
 	// run the mainloop
@@ -0,0 +1,355 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+#include "cloudrequestqueue.hpp"
+
+using namespace p44;
+
+#define DEFAULT_MAX_CONCURRENT 4 // max number of requests in progress over all endpoints
+#define BACKOFF_BASE (1*Second) // backoff after first failure
+#define BACKOFF_MAX (60*Second) // backoff does not grow beyond this
+#define REQUEST_TIMEOUT (30*Second) // requests not answered within this time are cancelled
+
+
+#pragma mark - CloudEndpoint
+
+CloudEndpoint::CloudEndpoint(const string &aName) :
+  name(aName),
+  consecutiveFailures(0),
+  backoffUntil(Never)
+{
+  string label = string_format("endpoint=\"%s\"", aName.c_str());
+  requestsMetric = Metrics::counter("vdcd_cloud_requests_total", "cloud API requests sent", label.c_str());
+  errorsMetric = Metrics::counter("vdcd_cloud_errors_total", "cloud API requests failed", label.c_str());
+  retriesMetric = Metrics::counter("vdcd_cloud_retries_total", "cloud API requests retried after a communication error", label.c_str());
+  coalescedMetric = Metrics::counter("vdcd_cloud_coalesced_total", "cloud API requests replaced by a newer one before being sent", label.c_str());
+  latencyMetric = Metrics::histogram("vdcd_cloud_request_duration_seconds", "cloud API request round trip time", label.c_str());
+}
+
+
+void CloudEndpoint::failed()
+{
+  if (consecutiveFailures<16) consecutiveFailures++; // enough to reach BACKOFF_MAX
+  MLMicroSeconds backoff = BACKOFF_BASE<<(consecutiveFailures-1);
+  if (backoff>BACKOFF_MAX) backoff = BACKOFF_MAX;
+  // half fixed, half random
+  backoff = backoff/2 + (MLMicroSeconds)(((double)rand()/RAND_MAX)*(backoff/2));
+  backoffUntil = MainLoop::now()+backoff;
+  LOG(LOG_INFO, "Cloud endpoint %s: %d consecutive failures, backing off for %.1f seconds\n", name.c_str(), consecutiveFailures, (double)backoff/Second);
+}
+
+
+void CloudEndpoint::succeeded()
+{
+  consecutiveFailures = 0;
+  backoffUntil = Never;
+}
+
+
+JsonWebClientPtr CloudEndpoint::getClient()
+{
+  if (idleClients.empty()) {
+    FOCUSLOG("Cloud endpoint %s: creating new web client\n", name.c_str());
+    return JsonWebClientPtr(new JsonWebClient(MainLoop::currentMainLoop()));
+  }
+  JsonWebClientPtr client = idleClients.front();
+  idleClients.pop_front();
+  return client;
+}
+
+
+void CloudEndpoint::returnClient(JsonWebClientPtr aClient)
+{
+  idleClients.push_back(aClient);
+}
+
+
+
+#pragma mark - CloudRequestOperation
+
+
+CloudRequestOperation::CloudRequestOperation(
+  CloudRequestQueue &aQueue, CloudEndpointPtr aEndpoint,
+  const string &aUrl, const string &aMethod, const string &aPostData, const string &aContentType,
+  const string &aCoalesceKey, int aMaxRetries, JsonWebClientCB aResultHandler
+) :
+  queue(aQueue),
+  endpoint(aEndpoint),
+  url(aUrl),
+  method(aMethod),
+  postData(aPostData),
+  contentType(aContentType),
+  coalesceKey(aCoalesceKey),
+  retriesLeft(aMaxRetries),
+  resultHandler(aResultHandler),
+  completed(false),
+  requestStartTime(Never)
+{
+  // requests to other endpoints or with other keys must not wait for this one
+  inSequence = false;
+  setTimeout(REQUEST_TIMEOUT);
+}
+
+
+CloudRequestOperation::~CloudRequestOperation()
+{
+}
+
+
+bool CloudRequestOperation::canInitiate()
+{
+  if (!endpoint->ready(MainLoop::now()) || queue.activeRequests>=queue.maxConcurrent)
+    return false;
+  // requests for the same key (device) must not overtake each other
+  if (!coalesceKey.empty() && queue.hasInProgress(coalesceKey))
+    return false;
+  return inherited::canInitiate();
+}
+
+
+bool CloudRequestOperation::initiate()
+{
+  // Note: inherited checks canInitiate(), which is no longer true once the request is sent
+  if (!inherited::initiate())
+    return false;
+  webClient = endpoint->getClient();
+  queue.activeRequests++;
+  endpoint->requestsMetric->inc();
+  requestStartTime = MainLoop::now();
+  FOCUSLOG("CloudRequestQueue: %s %s (%d in progress)\n", method.c_str(), url.c_str(), queue.activeRequests);
+  // Note: operation is kept alive by the callback until the request has ended
+  if (!webClient->jsonReturningRequest(
+    url.c_str(), boost::bind(&CloudRequestOperation::processAnswer, CloudRequestOperationPtr(this), _1, _2),
+    method.c_str(), postData, contentType.empty() ? NULL : contentType.c_str()
+  )) {
+    // cannot happen as the client is used by this request only, but never leave the operation hanging
+    requestEnded();
+    error = ErrorPtr(new HttpCommError(HttpCommError_noConnection, "web client busy"));
+    completed = true;
+  }
+  queue.updateQueuedMetric();
+  // executed
+  return true;
+}
+
+
+void CloudRequestOperation::requestEnded()
+{
+  if (webClient) {
+    endpoint->returnClient(webClient);
+    webClient.reset();
+    queue.activeRequests--;
+  }
+}
+
+
+void CloudRequestOperation::processAnswer(JsonObjectPtr aJsonResponse, ErrorPtr aError)
+{
+  if (completed) return; // aborted meanwhile
+  requestEnded();
+  endpoint->latencyMetric->observe(MainLoop::now()-requestStartTime);
+  response = aJsonResponse;
+  error = aError;
+  if (Error::isOK(error)) {
+    endpoint->succeeded();
+  }
+  else {
+    endpoint->errorsMetric->inc();
+    // only communication problems make the endpoint back off, not errors reported by the API
+    if (error->isDomain(HttpCommError::domain())) {
+      endpoint->failed();
+    }
+  }
+  completed = true;
+  // Note: queue picks up the result in its idle handler. Processing it from here could start the next request on
+  //   the same web client from within its callback, which is not safe.
+}
+
+
+bool CloudRequestOperation::hasCompleted()
+{
+  return completed;
+}
+
+
+OperationPtr CloudRequestOperation::finalize(p44::OperationQueue *aQueueP)
+{
+  if (
+    !Error::isOK(error) && error->isDomain(HttpCommError::domain()) && retriesLeft>0 &&
+    (coalesceKey.empty() || !queue.hasWaiting(coalesceKey))
+  ) {
+    // retry, will be initiated when the endpoint's backoff has expired
+    LOG(LOG_INFO, "CloudRequestQueue: %s failed (%s), %d retries left\n", url.c_str(), error->description().c_str(), retriesLeft);
+    endpoint->retriesMetric->inc();
+    CloudRequestOperationPtr retry = CloudRequestOperationPtr(new CloudRequestOperation(
+      queue, endpoint, url, method, postData, contentType, coalesceKey, retriesLeft-1, resultHandler
+    ));
+    resultHandler = NULL;
+    return retry;
+  }
+  // final result
+  if (resultHandler) {
+    JsonWebClientCB cb = resultHandler;
+    resultHandler = NULL; // call once only
+    cb(response, error);
+  }
+  queue.updateQueuedMetric();
+  return OperationPtr(); // no operation to insert
+}
+
+
+void CloudRequestOperation::abortOperation(ErrorPtr aError)
+{
+  if (!aborted) {
+    aborted = true;
+    if (initiated && !completed) {
+      // timed out
+      if (webClient) webClient->cancelRequest();
+      requestEnded();
+      endpoint->errorsMetric->inc();
+      endpoint->failed();
+    }
+    completed = true;
+    if (resultHandler) {
+      JsonWebClientCB cb = resultHandler;
+      resultHandler = NULL; // call once only
+      cb(JsonObjectPtr(), aError);
+    }
+  }
+}
+
+
+
+#pragma mark - CloudRequestQueue
+
+static CloudRequestQueuePtr sharedCloudRequestQueue;
+
+
+CloudRequestQueue::CloudRequestQueue() :
+  inherited(MainLoop::currentMainLoop()),
+  maxConcurrent(DEFAULT_MAX_CONCURRENT),
+  activeRequests(0)
+{
+  traceLabel = "cloud";
+  queuedMetric = Metrics::gauge("vdcd_cloud_requests_queued", "cloud API requests waiting to be sent");
+}
+
+
+CloudRequestQueue::~CloudRequestQueue()
+{
+}
+
+
+CloudRequestQueue &CloudRequestQueue::sharedQueue()
+{
+  if (!sharedCloudRequestQueue) {
+    sharedCloudRequestQueue = CloudRequestQueuePtr(new CloudRequestQueue);
+  }
+  return *sharedCloudRequestQueue;
+}
+
+
+CloudEndpointPtr CloudRequestQueue::endpointFor(const string &aURL)
+{
+  string protocol, host;
+  splitURL(aURL.c_str(), &protocol, &host, NULL);
+  string name = protocol + "://" + host;
+  EndpointMap::iterator pos = endpoints.find(name);
+  if (pos!=endpoints.end()) return pos->second;
+  CloudEndpointPtr ep = CloudEndpointPtr(new CloudEndpoint(name));
+  endpoints[name] = ep;
+  return ep;
+}
+
+
+bool CloudRequestQueue::hasWaiting(const string &aCoalesceKey)
+{
+  for (OperationList::iterator pos = operationQueue.begin(); pos!=operationQueue.end(); ++pos) {
+    CloudRequestOperationPtr op = boost::dynamic_pointer_cast<CloudRequestOperation>(*pos);
+    if (op && !op->isInitiated() && op->coalesceKey==aCoalesceKey) return true;
+  }
+  return false;
+}
+
+
+bool CloudRequestQueue::hasInProgress(const string &aCoalesceKey)
+{
+  for (OperationList::iterator pos = operationQueue.begin(); pos!=operationQueue.end(); ++pos) {
+    CloudRequestOperationPtr op = boost::dynamic_pointer_cast<CloudRequestOperation>(*pos);
+    if (op && op->isInitiated() && !op->completed && op->coalesceKey==aCoalesceKey) return true;
+  }
+  return false;
+}
+
+
+void CloudRequestQueue::updateQueuedMetric()
+{
+  int waiting = 0;
+  for (OperationList::iterator pos = operationQueue.begin(); pos!=operationQueue.end(); ++pos) {
+    if (!(*pos)->isInitiated()) waiting++;
+  }
+  queuedMetric->set(waiting);
+}
+
+
+void CloudRequestQueue::request(
+  const string &aURL, JsonWebClientCB aResultHandler,
+  const char *aMethod, const string &aPostData, const char *aContentType,
+  const string &aCoalesceKey, int aMaxRetries
+)
+{
+  CloudEndpointPtr ep = endpointFor(aURL);
+  // latest wins: remove requests with the same key not yet sent
+  OperationList superseded;
+  if (!aCoalesceKey.empty()) {
+    OperationList::iterator pos = operationQueue.begin();
+    while (pos!=operationQueue.end()) {
+      CloudRequestOperationPtr op = boost::dynamic_pointer_cast<CloudRequestOperation>(*pos);
+      if (op && !op->isInitiated() && op->coalesceKey==aCoalesceKey) {
+        superseded.push_back(op);
+        pos = operationQueue.erase(pos);
+      }
+      else {
+        ++pos;
+      }
+    }
+  }
+  CloudRequestOperationPtr op = CloudRequestOperationPtr(new CloudRequestOperation(
+    *this, ep, aURL, nonNullCStr(aMethod), aPostData, nonNullCStr(aContentType), aCoalesceKey, aMaxRetries, aResultHandler
+  ));
+  queueOperation(op);
+  updateQueuedMetric();
+  // report superseded requests only now, as their result handlers might queue new requests
+  for (OperationList::iterator pos = superseded.begin(); pos!=superseded.end(); ++pos) {
+    ep->coalescedMetric->inc();
+    FOCUSLOG("CloudRequestQueue: request for '%s' superseded\n", aCoalesceKey.c_str());
+    (*pos)->abortOperation(ErrorPtr(new CloudRequestError(CloudRequestErrorSuperseded)));
+  }
+  // process operations
+  processOperations();
+}
@@ -0,0 +1,198 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__cloudrequestqueue__
+#define __p44utils__cloudrequestqueue__
+
+#include "p44_common.hpp"
+
+#include "jsonwebclient.hpp"
+#include "operationqueue.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+
+  // Errors
+  typedef enum {
+    CloudRequestErrorOK,
+    CloudRequestErrorSuperseded, ///< request was replaced by a newer one with the same coalescing key before it was sent
+  } CloudRequestErrors;
+
+  class CloudRequestError : public Error
+  {
+  public:
+    static const char *domain() { return "CloudRequest"; }
+    virtual const char *getErrorDomain() const { return CloudRequestError::domain(); };
+    CloudRequestError(CloudRequestErrors aError) : Error(ErrorCode(aError)) {};
+    CloudRequestError(CloudRequestErrors aError, std::string aErrorMessage) : Error(ErrorCode(aError), aErrorMessage) {};
+  };
+
+
+  class CloudRequestQueue;
+  typedef boost::intrusive_ptr<CloudRequestQueue> CloudRequestQueuePtr;
+
+
+  /// a cloud endpoint (protocol://host), with the pool of web clients requests to this endpoint use
+  class CloudEndpoint : public P44Obj
+  {
+    friend class CloudRequestQueue;
+    friend class CloudRequestOperation;
+
+    string name;
+    typedef std::list<JsonWebClientPtr> WebClientList;
+    WebClientList idleClients; ///< web clients not currently in use, for the next requests
+    int consecutiveFailures;
+    MLMicroSeconds backoffUntil; ///< no requests to this endpoint before this time
+
+    // metrics
+    MetricCounterPtr requestsMetric;
+    MetricCounterPtr errorsMetric;
+    MetricCounterPtr retriesMetric;
+    MetricCounterPtr coalescedMetric;
+    MetricHistogramPtr latencyMetric;
+
+    CloudEndpoint(const string &aName);
+
+    /// @return true if a request can be sent to this endpoint now
+    bool ready(MLMicroSeconds aNow) { return aNow>=backoffUntil; };
+
+    /// @return an idle web client, or a new one if all are in use
+    /// @note the number of clients is bounded by the queue's max number of requests in progress
+    JsonWebClientPtr getClient();
+
+    /// @param aClient web client no longer in use, can be reused for the next request
+    void returnClient(JsonWebClientPtr aClient);
+
+    /// account for a failed request: back off exponentially, with jitter so endpoints recovering from the same
+    /// network problem are not all retried at the same time
+    void failed();
+
+    /// account for a successful request: end backoff
+    void succeeded();
+  };
+  typedef boost::intrusive_ptr<CloudEndpoint> CloudEndpointPtr;
+
+
+  class CloudRequestOperation : public Operation
+  {
+    typedef Operation inherited;
+    friend class CloudRequestQueue;
+
+    CloudRequestQueue &queue;
+    CloudEndpointPtr endpoint;
+    string url;
+    string method;
+    string postData;
+    string contentType;
+    string coalesceKey;
+    int retriesLeft;
+    JsonWebClientCB resultHandler;
+    JsonWebClientPtr webClient; ///< the endpoint's web client used while the request is in progress
+
+    bool completed;
+    JsonObjectPtr response;
+    ErrorPtr error;
+    MLMicroSeconds requestStartTime;
+
+    void processAnswer(JsonObjectPtr aJsonResponse, ErrorPtr aError);
+    void requestEnded();
+
+  public:
+
+    CloudRequestOperation(
+      CloudRequestQueue &aQueue, CloudEndpointPtr aEndpoint,
+      const string &aUrl, const string &aMethod, const string &aPostData, const string &aContentType,
+      const string &aCoalesceKey, int aMaxRetries, JsonWebClientCB aResultHandler
+    );
+    virtual ~CloudRequestOperation();
+
+    virtual bool canInitiate();
+    virtual bool initiate();
+    virtual bool hasCompleted();
+    virtual OperationPtr finalize(p44::OperationQueue *aQueueP);
+    virtual void abortOperation(ErrorPtr aError);
+
+  };
+  typedef boost::intrusive_ptr<CloudRequestOperation> CloudRequestOperationPtr;
+
+
+  /// Shared scheduler for requests to cloud web APIs (such as the spark cloud), to be used by all cloud based devices
+  /// - a small pool of web clients per endpoint, so requests to the same endpoint can run in parallel (up to the
+  ///   max number of requests in progress), and finished clients are reused instead of creating new ones
+  /// - requests with the same coalescing key (usually, per device) are sent one at a time, in order
+  /// - requests with the same coalescing key (usually, per device) replace each other while not yet sent, so only the
+  ///   latest state is sent
+  /// - failed requests are retried with exponential backoff and jitter, per endpoint
+  /// - at most a configurable number of requests are in progress at the same time
+  class CloudRequestQueue : public OperationQueue
+  {
+    typedef OperationQueue inherited;
+    friend class CloudRequestOperation;
+
+    typedef std::map<string, CloudEndpointPtr> EndpointMap;
+    EndpointMap endpoints;
+
+    int maxConcurrent; ///< max number of requests in progress at the same time
+    int activeRequests; ///< number of requests in progress
+    MetricGaugePtr queuedMetric;
+
+    CloudRequestQueue();
+
+  public:
+
+    virtual ~CloudRequestQueue();
+
+    /// @return the process-wide cloud request queue
+    static CloudRequestQueue &sharedQueue();
+
+    /// @param aMaxConcurrent max number of requests in progress at the same time (over all endpoints)
+    void setMaxConcurrent(int aMaxConcurrent) { maxConcurrent = aMaxConcurrent>0 ? aMaxConcurrent : 1; };
+
+    /// queue a request expected to return JSON (see JsonWebClient::jsonReturningRequest())
+    /// @param aURL the http or https URL to send the request to
+    /// @param aResultHandler will be called when the request completes, fails finally or is superseded
+    /// @param aMethod the HTTP method to use
+    /// @param aPostData the raw POST data to send (for POST or PUT requests)
+    /// @param aContentType the content type, NULL for default ("application/x-www-form-urlencoded")
+    /// @param aCoalesceKey if not empty, a request with the same key still waiting to be sent is replaced by this one
+    ///   (and its result handler called with CloudRequestErrorSuperseded)
+    /// @param aMaxRetries how many times to retry the request when it fails due to a communication error
+    void request(
+      const string &aURL, JsonWebClientCB aResultHandler,
+      const char *aMethod = "POST", const string &aPostData = "", const char *aContentType = NULL,
+      const string &aCoalesceKey = "", int aMaxRetries = 0
+    );
+
+  private:
+
+    CloudEndpointPtr endpointFor(const string &aURL);
+    bool hasWaiting(const string &aCoalesceKey);
+    bool hasInProgress(const string &aCoalesceKey);
+    void updateQueuedMetric();
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44utils__cloudrequestqueue__) */
@@ -0,0 +1,281 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+#include "coprocess.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+using namespace p44;
+
+#define COPROCESS_RESTART_INTERVAL (5*Second) // helper is not restarted more often than this
+#define COPROCESS_MAX_ANSWER 4096 // answer lines longer than this are considered garbage
+
+
+static void ignoreAnswer(ErrorPtr aError, const string &aAnswer)
+{
+  // nop
+}
+
+
+namespace p44 {
+
+  /// pipe to or from the helper, reporting when the helper closes its end
+  class CoProcessPipe : public FdComm
+  {
+    typedef FdComm inherited;
+
+    FdCommCB hungUpHandler;
+
+  public:
+
+    CoProcessPipe(MainLoop &aMainLoop, FdCommCB aHungUpHandler) :
+      inherited(aMainLoop),
+      hungUpHandler(aHungUpHandler)
+    {
+    }
+
+  protected:
+
+    virtual void dataExceptionHandler(int aFd, int aPollFlags)
+    {
+      // poll would report the hangup again and again, so stop monitoring (fd is closed with the other pipe later)
+      mainLoop.unregisterPollHandler(aFd);
+      if (hungUpHandler) hungUpHandler(ErrorPtr(new CoProcessError(CoProcessErrorNotRunning, "helper has closed its stdin or stdout")));
+    }
+
+  };
+
+} // namespace p44
+
+
+CoProcess::CoProcess(MainLoop &aMainLoop, const string &aCommandLine) :
+  mainLoop(aMainLoop),
+  commandLine(aCommandLine),
+  pid(-1),
+  lastStart(Never),
+  timeoutTicket(0)
+{
+}
+
+
+CoProcess::~CoProcess()
+{
+  mainLoop.cancelExecutionTicket(timeoutTicket);
+  closePipes();
+}
+
+
+ErrorPtr CoProcess::start()
+{
+  // Note: writing to a helper that has died must not take the daemon with it. Application::run() ignores SIGPIPE,
+  //   so this just results in an EPIPE error
+  lastStart = MainLoop::now();
+  int toPipe[2];
+  int fromPipe[2];
+  if (pipe(toPipe)<0) return SysError::errNo("CoProcess: ");
+  if (pipe(fromPipe)<0) {
+    ErrorPtr err = SysError::errNo("CoProcess: ");
+    close(toPipe[0]);
+    close(toPipe[1]);
+    return err;
+  }
+  char *args[4];
+  args[0] = (char *)"sh";
+  args[1] = (char *)"-c";
+  args[2] = (char *)commandLine.c_str();
+  args[3] = NULL;
+  ErrorPtr err;
+  pid = MainLoop::spawn("/bin/sh", args, NULL, toPipe[0], fromPipe[1], err);
+  // child's ends of the pipes are not needed here
+  close(toPipe[0]);
+  close(fromPipe[1]);
+  if (pid<0) {
+    close(toPipe[1]);
+    close(fromPipe[0]);
+    return err;
+  }
+  LOG(LOG_INFO, "CoProcess: started helper '%s' (pid=%d)\n", commandLine.c_str(), pid);
+  toHelper = FdCommPtr(new CoProcessPipe(mainLoop, boost::bind(&CoProcess::helperHungUp, this, _1)));
+  toHelper->setFd(toPipe[1]);
+  toHelper->makeNonBlocking();
+  fromHelper = FdCommPtr(new CoProcessPipe(mainLoop, boost::bind(&CoProcess::helperHungUp, this, _1)));
+  fromHelper->setReceiveHandler(boost::bind(&CoProcess::answerReceived, this, _1));
+  fromHelper->setFd(fromPipe[0]);
+  fromHelper->makeNonBlocking();
+  answerBuffer.clear();
+  pendingOutput.clear();
+  // Note: keeps this object alive until the helper has terminated
+  mainLoop.waitForPid(boost::bind(&CoProcess::helperTerminated, CoProcessPtr(this), _2, _3), pid);
+  return ErrorPtr();
+}
+
+
+void CoProcess::closePipes()
+{
+  if (toHelper) {
+    toHelper->stopMonitoringAndClose();
+    toHelper.reset();
+  }
+  if (fromHelper) {
+    fromHelper->stopMonitoringAndClose();
+    fromHelper.reset();
+  }
+}
+
+
+void CoProcess::terminate()
+{
+  // pending request is abandoned without callback, as the requester might be gone already
+  mainLoop.cancelExecutionTicket(timeoutTicket);
+  answerCB.clear();
+  // closing stdin lets the helper exit by itself
+  closePipes();
+  if (pid>0) {
+    kill(pid, SIGTERM);
+  }
+}
+
+
+void CoProcess::helperTerminated(pid_t aPid, int aStatus)
+{
+  if (aPid!=pid) return; // not the current helper
+  LOG(LOG_WARNING, "CoProcess: helper '%s' (pid=%d) has terminated with status %d\n", commandLine.c_str(), aPid, WEXITSTATUS(aStatus));
+  pid = -1;
+  closePipes();
+  deliverAnswer(ErrorPtr(new CoProcessError(CoProcessErrorNotRunning, "helper terminated")), "");
+}
+
+
+void CoProcess::helperHungUp(ErrorPtr aError)
+{
+  // a helper that does not talk to us any more is of no use, even if it keeps running
+  LOG(LOG_WARNING, "CoProcess: helper '%s' (pid=%d) has closed its pipes -> killing it\n", commandLine.c_str(), pid);
+  if (pid>0) kill(pid, SIGKILL);
+  deliverAnswer(aError, "");
+}
+
+
+void CoProcess::request(const string &aRequest, CoProcessAnswerCB aAnswerCB, MLMicroSeconds aTimeout)
+{
+  if (busy()) {
+    if (aAnswerCB) aAnswerCB(ErrorPtr(new CoProcessError(CoProcessErrorBusy, "request already in progress")), "");
+    return;
+  }
+  if (pid<0) {
+    // (re)start helper, but not in a tight loop when it keeps failing
+    ErrorPtr err;
+    if (lastStart!=Never && MainLoop::now()<lastStart+COPROCESS_RESTART_INTERVAL) {
+      err = ErrorPtr(new CoProcessError(CoProcessErrorNotRunning, "helper not running"));
+    }
+    else {
+      err = start();
+    }
+    if (!Error::isOK(err)) {
+      if (aAnswerCB) aAnswerCB(err, "");
+      return;
+    }
+  }
+  answerCB = aAnswerCB;
+  if (answerCB.empty()) answerCB = &ignoreAnswer; // still marks request in progress
+  FOCUSLOG("CoProcess: sending '%s'\n", aRequest.c_str());
+  pendingOutput = aRequest;
+  pendingOutput += '\n';
+  readyForOutput(ErrorPtr());
+  if (busy()) {
+    timeoutTicket = mainLoop.executeOnce(boost::bind(&CoProcess::answerTimeout, this, _1), aTimeout);
+  }
+}
+
+
+void CoProcess::readyForOutput(ErrorPtr aError)
+{
+  if (!toHelper) return;
+  FdCommPtr keepAlive = toHelper; // answer callback might terminate us
+  if (Error::isOK(aError) && !pendingOutput.empty()) {
+    size_t n = toHelper->transmitBytes(pendingOutput.size(), (const uint8_t *)pendingOutput.c_str(), aError);
+    pendingOutput.erase(0, n);
+  }
+  if (!Error::isOK(aError)) {
+    LOG(LOG_ERR, "CoProcess: cannot send request to helper '%s': %s\n", commandLine.c_str(), aError->description().c_str());
+    pendingOutput.clear();
+    deliverAnswer(aError, "");
+  }
+  // wait for pipe to accept more data only while there is something left to send
+  if (toHelper) toHelper->setTransmitHandler(pendingOutput.empty() ? FdCommCB() : boost::bind(&CoProcess::readyForOutput, this, _1));
+}
+
+
+void CoProcess::answerReceived(ErrorPtr aError)
+{
+  if (!fromHelper) return;
+  FdCommPtr keepAlive = fromHelper; // answer callback might terminate us
+  if (Error::isOK(aError)) {
+    aError = fromHelper->receiveAndAppendToString(answerBuffer);
+  }
+  if (!Error::isOK(aError)) {
+    LOG(LOG_ERR, "CoProcess: error reading from helper '%s': %s\n", commandLine.c_str(), aError->description().c_str());
+    deliverAnswer(aError, "");
+    return;
+  }
+  size_t e;
+  while ((e = answerBuffer.find('\n'))!=string::npos) {
+    string answer = answerBuffer.substr(0, e);
+    answerBuffer.erase(0, e+1);
+    if (!answer.empty() && answer[answer.size()-1]=='\r') answer.erase(answer.size()-1);
+    if (busy()) {
+      deliverAnswer(ErrorPtr(), answer);
+    }
+    else {
+      LOG(LOG_INFO, "CoProcess: helper '%s' sent unexpected line: %s\n", commandLine.c_str(), answer.c_str());
+    }
+  }
+  if (answerBuffer.size()>COPROCESS_MAX_ANSWER) {
+    LOG(LOG_WARNING, "CoProcess: helper '%s' sends overlong line, discarded\n", commandLine.c_str());
+    answerBuffer.clear();
+  }
+}
+
+
+void CoProcess::answerTimeout(MLMicroSeconds aCycleStartTime)
+{
+  timeoutTicket = 0;
+  LOG(LOG_ERR, "CoProcess: helper '%s' did not answer in time -> killing it\n", commandLine.c_str());
+  if (pid>0) kill(pid, SIGKILL);
+  deliverAnswer(ErrorPtr(new CoProcessError(CoProcessErrorTimeout, "helper did not answer in time")), "");
+}
+
+
+void CoProcess::deliverAnswer(ErrorPtr aError, const string &aAnswer)
+{
+  if (answerCB.empty()) return; // no request in progress
+  mainLoop.cancelExecutionTicket(timeoutTicket);
+  CoProcessAnswerCB cb = answerCB;
+  answerCB.clear(); // request done, callback may issue the next one
+  cb(aError, aAnswer);
+}
@@ -0,0 +1,119 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__coprocess__
+#define __p44utils__coprocess__
+
+#include "p44_common.hpp"
+
+#include "fdcomm.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  // Errors
+  typedef enum {
+    CoProcessErrorOK,
+    CoProcessErrorBusy, ///< a request is already in progress
+    CoProcessErrorNotRunning, ///< helper process could not be started or has terminated
+    CoProcessErrorTimeout, ///< helper process did not answer in time
+    CoProcessErrorFailed, ///< helper process answered with an error
+  } CoProcessErrors;
+
+  class CoProcessError : public Error
+  {
+  public:
+    static const char *domain() { return "CoProcess"; }
+    virtual const char *getErrorDomain() const { return CoProcessError::domain(); };
+    CoProcessError(CoProcessErrors aError) : Error(ErrorCode(aError)) {};
+    CoProcessError(CoProcessErrors aError, std::string aErrorMessage) : Error(ErrorCode(aError), aErrorMessage) {};
+  };
+
+
+  /// callback for delivering the answer of a coprocess
+  /// @param aError set if no answer could be obtained
+  /// @param aAnswer the answer line (without line end)
+  typedef boost::function<void (ErrorPtr aError, const string &aAnswer)> CoProcessAnswerCB;
+
+
+  class CoProcess;
+  typedef boost::intrusive_ptr<CoProcess> CoProcessPtr;
+
+  /// Long running helper process, started once and then talked to line by line via its stdin/stdout.
+  /// For every line sent, the helper must answer with exactly one line. Only one request can be in progress
+  /// at a time. The helper is (re)started on demand when it is not running.
+  class CoProcess : public P44Obj
+  {
+    typedef P44Obj inherited;
+
+    MainLoop &mainLoop;
+    string commandLine;
+    pid_t pid;
+    MLMicroSeconds lastStart;
+    FdCommPtr toHelper;
+    FdCommPtr fromHelper;
+    string pendingOutput; ///< part of the request not yet written to the helper
+    string answerBuffer; ///< received but not yet processed answer text
+    CoProcessAnswerCB answerCB; ///< set while a request is in progress
+    long timeoutTicket;
+
+  public:
+
+    /// create coprocess (does not yet start the helper)
+    /// @param aMainLoop the mainloop to run the communication on
+    /// @param aCommandLine shell command line starting the helper
+    CoProcess(MainLoop &aMainLoop, const string &aCommandLine);
+    virtual ~CoProcess();
+
+    /// send a request line to the helper and get the answer line
+    /// @param aRequest the request, without line end
+    /// @param aAnswerCB called with the answer, or an error
+    /// @param aTimeout time the helper has to answer. When exceeded, the helper is considered hung and is killed
+    void request(const string &aRequest, CoProcessAnswerCB aAnswerCB, MLMicroSeconds aTimeout);
+
+    /// @return true if a request is in progress
+    bool busy() { return !answerCB.empty(); };
+
+    /// terminate the helper (closes its stdin, so well behaving helpers can exit cleanly)
+    /// @note a request in progress is abandoned, its callback will not be called
+    void terminate();
+
+    /// @return textual description
+    string description() { return commandLine; };
+
+  private:
+
+    ErrorPtr start();
+    void closePipes();
+    void helperTerminated(pid_t aPid, int aStatus);
+    void helperHungUp(ErrorPtr aError);
+    void answerReceived(ErrorPtr aError);
+    void readyForOutput(ErrorPtr aError);
+    void answerTimeout(MLMicroSeconds aCycleStartTime);
+    void deliverAnswer(ErrorPtr aError, const string &aAnswer);
+
+  };
+
+} // namespace p44
+
+
+#endif /* defined(__p44utils__coprocess__) */
@@ -33,6 +33,7 @@
 #include "iopin.hpp"
 #include "gpio.hpp"
 #include "i2c.hpp"
+#include "simhardware.hpp"
 
 #include "logger.hpp"
 #include "mainloop.hpp"
@@ -58,19 +59,22 @@ DigitalIo::DigitalIo(const char* aName, bool aOutput, bool aInverted, bool aInit
     ioPin = IOPinPtr(new MissingPin(initialPinState));
     return;
   }
+  // check for simulated hardware: sim.<iospec>
+  bool simulated = name.substr(0,4)=="sim.";
+  string spec = simulated ? name.substr(4) : name;
   // dissect name into bus, device, pin
   string busName;
   string deviceName;
   string pinName;
-  size_t i = name.find(".");
+  size_t i = spec.find(".");
   if (i==string::npos) {
     // no structured name, assume GPIO
     busName = "gpio";
   }
   else {
-    busName = name.substr(0,i);
+    busName = spec.substr(0,i);
     // rest is device + pinname or just pinname
-    pinName = name.substr(i+1,string::npos);
+    pinName = spec.substr(i+1,string::npos);
     if (busName!="syscmd") {
       i = pinName.find(".");
       if (i!=string::npos) {
@@ -83,7 +87,20 @@ DigitalIo::DigitalIo(const char* aName, bool aOutput, bool aInverted, bool aInit
     }
   }
   // now create appropriate pin
-  DBGLOG(LOG_DEBUG, "DigitalIo: bus name = '%s'\n", busName.c_str());
+  DBGLOG(LOG_DEBUG, "DigitalIo: bus name = '%s'%s\n", busName.c_str(), simulated ? " (simulated)" : "");
+  if (simulated) {
+    if (busName.substr(0,3)=="i2c") {
+      // sim.i2c<busnum>.<devicespec>.<pinnum>: actual device logic on a simulated bus
+      int busNumber = atoi(busName.c_str()+3);
+      int pinNumber = atoi(pinName.c_str());
+      ioPin = IOPinPtr(new I2CPin(busNumber, deviceName.c_str(), pinNumber, output, initialPinState, true));
+    }
+    else {
+      // sim.gpio.<n>, sim.led.<n> or any other name: quiet simulated pin
+      ioPin = IOPinPtr(new SimGpioPin(name.c_str(), output, initialPinState));
+    }
+    return;
+  }
   #ifndef __APPLE__
   if (busName=="gpio") {
     // Linux generic GPIO
@@ -0,0 +1,251 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+#include "dnsresolver.hpp"
+
+using namespace p44;
+
+#define DEFAULT_POSITIVE_TTL (60*Second)
+#define DEFAULT_NEGATIVE_TTL (5*Second)
+
+
+#pragma mark - ResolveJob
+
+namespace p44 {
+
+  /// a single lookup running in a child thread
+  class ResolveJob : public P44Obj
+  {
+    typedef P44Obj inherited;
+    friend class DnsResolver;
+
+    DnsResolver &resolver;
+    string key;
+    // request
+    string host;
+    string service;
+    struct addrinfo hints;
+    // result
+    int gaiError;
+    ResolvedAddressVector addresses;
+    // callbacks waiting for the result
+    typedef list<DnsResolveCB> CallbackList;
+    CallbackList callbacks;
+    ChildThreadWrapperPtr thread;
+
+  public:
+
+    ResolveJob(DnsResolver &aResolver, const string &aKey, const string &aHost, const string &aService, const struct addrinfo &aHints) :
+      resolver(aResolver),
+      key(aKey),
+      host(aHost),
+      service(aService),
+      hints(aHints),
+      gaiError(0)
+    {
+    }
+
+    /// perform the lookup. Is called in the child thread, must not touch anything but the job's own fields
+    void lookup()
+    {
+      struct addrinfo *list = NULL;
+      gaiError = getaddrinfo(host.c_str(), service.c_str(), &hints, &list);
+      if (gaiError==0) {
+        for (struct addrinfo *ai = list; ai; ai = ai->ai_next) {
+          ResolvedAddress ra;
+          if (ai->ai_addrlen>sizeof(ra.addr)) continue;
+          ra.family = ai->ai_family;
+          ra.sockType = ai->ai_socktype;
+          ra.protocol = ai->ai_protocol;
+          ra.addrLen = ai->ai_addrlen;
+          memcpy(&ra.addr, ai->ai_addr, ai->ai_addrlen);
+          addresses.push_back(ra);
+        }
+        freeaddrinfo(list);
+      }
+    }
+
+    void threadRoutine(ChildThreadWrapper &aThread)
+    {
+      lookup();
+    }
+
+    void threadSignal(ChildThreadWrapper &aThread, ThreadSignals aSignalCode)
+    {
+      if (aSignalCode==threadSignalFailedToStart) {
+        // no thread available, do it the blocking way
+        LOG(LOG_WARNING, "DnsResolver: cannot start thread, resolving '%s' synchronously\n", host.c_str());
+        lookup();
+      }
+      else if (aSignalCode!=threadSignalCompleted && aSignalCode!=threadSignalCancelled) {
+        return; // not yet done
+      }
+      resolver.jobDone(ResolveJobPtr(this));
+    }
+
+  };
+
+} // namespace p44
+
+
+#pragma mark - DnsResolver
+
+// the current thread's resolver (one per mainloop, as lookups complete on the mainloop that started them)
+#if BOOST_DISABLE_THREADS
+static DnsResolver *currentDnsResolverP = NULL;
+#else
+static __thread DnsResolver *currentDnsResolverP = NULL;
+#endif
+
+
+DnsResolver::DnsResolver() :
+  positiveTTL(DEFAULT_POSITIVE_TTL),
+  negativeTTL(DEFAULT_NEGATIVE_TTL)
+{
+}
+
+
+DnsResolver &DnsResolver::sharedResolver()
+{
+  if (currentDnsResolverP==NULL) {
+    // need to create it
+    currentDnsResolverP = new DnsResolver();
+  }
+  return *currentDnsResolverP;
+}
+
+
+void DnsResolver::setCacheTTL(MLMicroSeconds aPositiveTTL, MLMicroSeconds aNegativeTTL)
+{
+  positiveTTL = aPositiveTTL;
+  negativeTTL = aNegativeTTL;
+}
+
+
+void DnsResolver::flushCache()
+{
+  cache.clear();
+}
+
+
+string DnsResolver::cacheKey(const string &aHost, const string &aService, int aFamily, int aSockType, int aProtocol)
+{
+  return string_format("%s/%s/%d/%d/%d", aHost.c_str(), aService.c_str(), aFamily, aSockType, aProtocol);
+}
+
+
+bool DnsResolver::resolveNow(const string &aHost, const string &aService, int aFamily, int aSockType, int aProtocol, ErrorPtr &aError, ResolvedAddressVector &aAddresses)
+{
+  // numeric addresses can be converted without asking the resolver
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_NUMERICHOST;
+  hints.ai_family = aFamily;
+  hints.ai_socktype = aSockType;
+  hints.ai_protocol = aProtocol;
+  ResolveJob numeric(*this, "", aHost, aService, hints);
+  numeric.lookup();
+  if (numeric.gaiError==0) {
+    aAddresses = numeric.addresses;
+    return true;
+  }
+  // check cache
+  CacheMap::iterator pos = cache.find(cacheKey(aHost, aService, aFamily, aSockType, aProtocol));
+  if (pos!=cache.end()) {
+    if (pos->second.expires>MainLoop::now()) {
+      FOCUSLOG("DnsResolver: cache hit for '%s'\n", aHost.c_str());
+      aError = pos->second.error;
+      aAddresses = pos->second.addresses;
+      return true;
+    }
+    // expired
+    cache.erase(pos);
+  }
+  return false;
+}
+
+
+void DnsResolver::resolve(const string &aHost, const string &aService, int aFamily, int aSockType, int aProtocol, DnsResolveCB aResolvedCB)
+{
+  ErrorPtr err;
+  ResolvedAddressVector addresses;
+  if (resolveNow(aHost, aService, aFamily, aSockType, aProtocol, err, addresses)) {
+    if (aResolvedCB) aResolvedCB(err, addresses);
+    return;
+  }
+  // need a lookup
+  string key = cacheKey(aHost, aService, aFamily, aSockType, aProtocol);
+  JobMap::iterator pos = pendingJobs.find(key);
+  if (pos!=pendingJobs.end()) {
+    // lookup for the same name already running, just wait for its result
+    pos->second->callbacks.push_back(aResolvedCB);
+    return;
+  }
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = aFamily;
+  hints.ai_socktype = aSockType;
+  hints.ai_protocol = aProtocol;
+  ResolveJobPtr job = ResolveJobPtr(new ResolveJob(*this, key, aHost, aService, hints));
+  job->callbacks.push_back(aResolvedCB);
+  pendingJobs[key] = job;
+  LOG(LOG_DEBUG, "DnsResolver: starting lookup for '%s'\n", aHost.c_str());
+  // Note: job is kept alive by pendingJobs until jobDone()
+  job->thread = MainLoop::currentMainLoop().executeInThread(
+    boost::bind(&ResolveJob::threadRoutine, job.get(), _1),
+    boost::bind(&ResolveJob::threadSignal, job.get(), _1, _2)
+  );
+}
+
+
+void DnsResolver::jobDone(ResolveJobPtr aJob)
+{
+  pendingJobs.erase(aJob->key);
+  aJob->thread.reset();
+  // create the result
+  ErrorPtr err;
+  if (aJob->gaiError!=0) {
+    err = ErrorPtr(new DnsError(aJob->gaiError, string_format("cannot resolve '%s': %s", aJob->host.c_str(), gai_strerror(aJob->gaiError))));
+    LOG(LOG_INFO, "DnsResolver: %s\n", err->description().c_str());
+  }
+  else {
+    FOCUSLOG("DnsResolver: '%s' resolved to %zu addresses\n", aJob->host.c_str(), aJob->addresses.size());
+  }
+  // cache it
+  MLMicroSeconds ttl = err ? negativeTTL : positiveTTL;
+  if (ttl>0) {
+    CacheEntry &ce = cache[aJob->key];
+    ce.expires = MainLoop::now()+ttl;
+    ce.error = err;
+    ce.addresses = aJob->addresses;
+  }
+  // deliver to all waiting callbacks
+  for (ResolveJob::CallbackList::iterator pos = aJob->callbacks.begin(); pos!=aJob->callbacks.end(); ++pos) {
+    if (*pos) (*pos)(err, aJob->addresses);
+  }
+}
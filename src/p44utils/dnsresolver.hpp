@@ -0,0 +1,135 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__dnsresolver__
+#define __p44utils__dnsresolver__
+
+#include "p44_common.hpp"
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+using namespace std;
+
+namespace p44 {
+
+  /// DNS resolution errors, error code is the getaddrinfo() EAI_xxx code
+  class DnsError : public Error
+  {
+  public:
+    static const char *domain() { return "DNS"; }
+    virtual const char *getErrorDomain() const { return DnsError::domain(); };
+    DnsError(ErrorCode aError, std::string aErrorMessage) : Error(aError, aErrorMessage) {};
+  };
+
+
+  /// a resolved socket address (copy of the relevant parts of a struct addrinfo)
+  typedef struct {
+    int family;
+    int sockType;
+    int protocol;
+    socklen_t addrLen;
+    struct sockaddr_storage addr;
+  } ResolvedAddress;
+  typedef vector<ResolvedAddress> ResolvedAddressVector;
+
+  /// callback for delivering resolved addresses
+  /// @param aError set if name could not be resolved
+  /// @param aAddresses the resolved addresses, in the order getaddrinfo() returned them
+  typedef boost::function<void (ErrorPtr aError, const ResolvedAddressVector &aAddresses)> DnsResolveCB;
+
+
+  class DnsResolver;
+  typedef boost::intrusive_ptr<DnsResolver> DnsResolverPtr;
+
+  class ResolveJob;
+  typedef boost::intrusive_ptr<ResolveJob> ResolveJobPtr;
+
+  /// Asynchronous host name resolution with a result cache
+  /// getaddrinfo() blocks, possibly for many seconds when the resolver is slow or unreachable. DnsResolver runs
+  /// it in a child thread and delivers the result on the mainloop. Concurrent requests for the same name share a
+  /// single lookup. Numeric addresses are resolved immediately without a thread.
+  /// @note getaddrinfo() does not expose the TTL of DNS records, so results are cached for a fixed time (which should
+  ///   be chosen shorter than typical TTLs). Failed lookups are cached for a shorter time to avoid hammering the
+  ///   resolver with retries.
+  class DnsResolver : public P44Obj
+  {
+    typedef P44Obj inherited;
+    friend class ResolveJob;
+
+    typedef struct {
+      MLMicroSeconds expires;
+      ErrorPtr error;
+      ResolvedAddressVector addresses;
+    } CacheEntry;
+    typedef map<string, CacheEntry> CacheMap;
+    CacheMap cache;
+
+    typedef map<string, ResolveJobPtr> JobMap;
+    JobMap pendingJobs;
+
+    MLMicroSeconds positiveTTL;
+    MLMicroSeconds negativeTTL;
+
+  public:
+
+    DnsResolver();
+
+    /// @return the resolver for the current thread's mainloop
+    /// @note each thread running a mainloop gets its own resolver (and cache), because results are delivered
+    ///   on the mainloop that started the lookup. Resolvers must not be passed to other threads.
+    static DnsResolver &sharedResolver();
+
+    /// set cache lifetimes
+    /// @param aPositiveTTL how long successful lookups are cached, 0 to disable caching
+    /// @param aNegativeTTL how long failed lookups are cached, 0 to disable caching
+    void setCacheTTL(MLMicroSeconds aPositiveTTL, MLMicroSeconds aNegativeTTL);
+
+    /// remove all cached results
+    void flushCache();
+
+    /// resolve host and service name
+    /// @param aHost host name or numeric address
+    /// @param aService service name or port number
+    /// @param aFamily address family (AF_UNSPEC for any)
+    /// @param aSockType socket type (SOCK_STREAM, SOCK_DGRAM...)
+    /// @param aProtocol protocol (usually 0)
+    /// @param aResolvedCB will be called with the result on the mainloop. Note that this happens from within resolve()
+    ///   when the result is available immediately (numeric address or cached result)
+    void resolve(const string &aHost, const string &aService, int aFamily, int aSockType, int aProtocol, DnsResolveCB aResolvedCB);
+
+    /// get a result from cache (or numeric address), never blocks
+    /// @param aError set to the cached error for cached failed lookups
+    /// @param aAddresses set to the cached addresses
+    /// @return true if a result was available, false if a lookup would be needed
+    bool resolveNow(const string &aHost, const string &aService, int aFamily, int aSockType, int aProtocol, ErrorPtr &aError, ResolvedAddressVector &aAddresses);
+
+  private:
+
+    static string cacheKey(const string &aHost, const string &aService, int aFamily, int aSockType, int aProtocol);
+    void jobDone(ResolveJobPtr aJob);
+
+  };
+
+} // namespace p44
+
+
+#endif /* defined(__p44utils__dnsresolver__) */
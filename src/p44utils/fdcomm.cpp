@@ -62,7 +62,8 @@ void FdComm::setFd(int aFd)
         dataFd,
         (receiveHandler ? POLLIN : 0) | // report ready to read if we have a handler
         (transmitHandler ? POLLOUT : 0), // report ready to transmit if we have a handler
-        boost::bind(&FdComm::dataMonitorHandler, this, _1, _2, _3)
+        boost::bind(&FdComm::dataMonitorHandler, this, _1, _2, _3),
+        "fd data"
       );
     }
   }
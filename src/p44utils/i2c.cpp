@@ -66,18 +66,19 @@ I2CManager *I2CManager::sharedManager()
 
 
 
-I2CDevicePtr I2CManager::getDevice(int aBusNumber, const char *aDeviceID)
+I2CDevicePtr I2CManager::getDevice(int aBusNumber, const char *aDeviceID, bool aSimulated)
 {
   // find or create bus
-  I2CBusMap::iterator pos = busMap.find(aBusNumber);
+  I2CBusMap &buses = aSimulated ? simBusMap : busMap;
+  I2CBusMap::iterator pos = buses.find(aBusNumber);
   I2CBusPtr bus;
-  if (pos!=busMap.end()) {
+  if (pos!=buses.end()) {
     bus = pos->second;
   }
   else {
     // bus does not exist yet, create it
-    bus = I2CBusPtr(new I2CBus(aBusNumber));
-    busMap[aBusNumber] = bus;
+    bus = I2CBusPtr(new I2CBus(aBusNumber, aSimulated));
+    buses[aBusNumber] = bus;
   }
   // dissect device ID into type and busAddress
   // - type string
@@ -124,11 +125,17 @@ I2CDevicePtr I2CManager::getDevice(int aBusNumber, const char *aDeviceID)
 #pragma mark - I2CBus
 
 
-I2CBus::I2CBus(int aBusNumber) :
+I2CBus::I2CBus(int aBusNumber, bool aSimulated) :
   busFD(-1),
   busNumber(aBusNumber),
-  lastDeviceAddress(-1)
+  lastDeviceAddress(-1),
+  transactionStart(Never),
+  simulated(aSimulated)
 {
+  resetStats();
+  if (simulated) {
+    simInterface = SimHardware::sharedSimHardware().getInterface(string_format("i2c%d", busNumber));
+  }
 }
 
 
@@ -153,15 +160,72 @@ I2CDevicePtr I2CBus::getDevice(const char *aDeviceID)
 }
 
 
+void I2CBus::resetStats()
+{
+  stats.transactions = 0;
+  stats.bytes = 0;
+  stats.deviceSelects = 0;
+  stats.busyTime = 0;
+}
+
+
+void I2CBus::transferred(int aBytes)
+{
+  stats.transactions++;
+  if (aBytes>0) stats.bytes += aBytes;
+  if (transactionStart!=Never) {
+    stats.busyTime += MainLoop::now()-transactionStart;
+    transactionStart = Never;
+  }
+}
+
+
+/// simulated bus: register image per device, writes and reads of multiple bytes auto-increment the register
+/// @return number of bytes transferred
+int I2CBus::simAccess(I2CDevice *aDeviceP, bool aWrite, uint8_t aRegister, uint8_t aCount, uint8_t *aDataP)
+{
+  SimRegisters &regs = simDevices[aDeviceP->deviceAddress]; // creates zeroed image on first access
+  for (uint8_t i=0; i<aCount; i++) {
+    if (aWrite)
+      regs.reg[(uint8_t)(aRegister+i)] = aDataP[i];
+    else
+      aDataP[i] = regs.reg[(uint8_t)(aRegister+i)];
+  }
+  simInterface->transaction(aCount);
+  return aCount;
+}
+
+
+void I2CBus::setSimulatedRegister(uint8_t aDeviceAddress, uint8_t aRegister, uint8_t aValue)
+{
+  simDevices[aDeviceAddress].reg[aRegister] = aValue;
+}
+
+
+void I2CBus::getSimulatedRegister(uint8_t aDeviceAddress, uint8_t aRegister, uint8_t &aValue)
+{
+  aValue = simDevices[aDeviceAddress].reg[aRegister];
+}
+
+
 
 bool I2CBus::I2CReadByte(I2CDevice *aDeviceP, uint8_t &aByte)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot read
-  #if !DISABLE_I2C
-  int res = i2c_smbus_read_byte(busFD);
-  #else
-  int res = 0x42; // dummy
-  #endif
+  int res;
+  if (simulated) {
+    uint8_t b;
+    simAccess(aDeviceP, false, 0, 1, &b); // plain byte devices are simulated as register 0
+    res = b;
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_read_byte(busFD);
+    #else
+    res = 0x42; // dummy
+    #endif
+  }
+  transferred(1);
   // read is shown only in real Debug log, because button polling creates lots of accesses
   DBGFOCUSLOG("i2c_smbus_read_byte() = %d / 0x%02X\n", res, res);
   if (res<0) return false;
@@ -173,11 +237,19 @@ bool I2CBus::I2CReadByte(I2CDevice *aDeviceP, uint8_t &aByte)
 bool I2CBus::I2CWriteByte(I2CDevice *aDeviceP, uint8_t aByte)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot write
-  #if !DISABLE_I2C
-  int res = i2c_smbus_write_byte(busFD, aByte);
-  #else
-  int res = 1; // ok
-  #endif
+  int res;
+  if (simulated) {
+    simAccess(aDeviceP, true, 0, 1, &aByte);
+    res = 0;
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_write_byte(busFD, aByte);
+    #else
+    res = 1; // ok
+    #endif
+  }
+  transferred(1);
   FOCUSLOG("i2c_smbus_write_byte(byte=0x%02X) = %d\n", aByte, res);
   return (res>=0);
 }
@@ -187,11 +259,20 @@ bool I2CBus::I2CWriteByte(I2CDevice *aDeviceP, uint8_t aByte)
 bool I2CBus::SMBusReadByte(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t &aByte)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot read
-  #if !DISABLE_I2C
-  int res = i2c_smbus_read_byte_data(busFD, aRegister);
-  #else
-  int res = 0x42; // dummy
-  #endif
+  int res;
+  if (simulated) {
+    uint8_t b;
+    simAccess(aDeviceP, false, aRegister, 1, &b);
+    res = b;
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_read_byte_data(busFD, aRegister);
+    #else
+    res = 0x42; // dummy
+    #endif
+  }
+  transferred(1);
   // read is shown only in real Debug log, because button polling creates lots of accesses
   DBGFOCUSLOG("i2c_smbus_read_byte_data(cmd=0x%02X) = %d / 0x%02X\n", aRegister, res, res);
   if (res<0) return false;
@@ -203,12 +284,21 @@ bool I2CBus::SMBusReadByte(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t &aByt
 bool I2CBus::SMBusReadWord(I2CDevice *aDeviceP, uint8_t aRegister, uint16_t &aWord)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot read
-  #if !DISABLE_I2C
-  int res = i2c_smbus_read_word_data(busFD, aRegister);
-  if (res<0) return false;
-  #else
-  int res = 0x4242; // dummy
-  #endif
+  int res;
+  if (simulated) {
+    uint8_t w[2];
+    simAccess(aDeviceP, false, aRegister, 2, w);
+    res = w[0] + (w[1]<<8); // SMBus words are LSB first
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_read_word_data(busFD, aRegister);
+    if (res<0) return false;
+    #else
+    res = 0x4242; // dummy
+    #endif
+  }
+  transferred(2);
   // read is shown only in real Debug log, because button polling creates lots of accesses
   DBGFOCUSLOG("i2c_smbus_read_word_data(cmd=0x%02X) = %d / 0x%04X\n", aRegister, res, res);
   if (res<0) return false;
@@ -220,12 +310,19 @@ bool I2CBus::SMBusReadWord(I2CDevice *aDeviceP, uint8_t aRegister, uint16_t &aWo
 bool I2CBus::SMBusReadBlock(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t &aCount, smbus_block_t &aData)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot read
-  #if !DISABLE_I2C
-  int res = i2c_smbus_read_block_data(busFD, aRegister, aData);
-  if (res<0) return false;
-  #else
-  int res = 0; // no data
-  #endif
+  int res;
+  if (simulated) {
+    res = 0; // no data, simulated devices do not have block registers
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_read_block_data(busFD, aRegister, aData);
+    if (res<0) return false;
+    #else
+    res = 0; // no data
+    #endif
+  }
+  transferred(res+1);
   if (FOCUSLOGENABLED) {
     string data;
     for (uint8_t i=0; i<res; i++) string_format_append(data, ", 0x%02X", aData[i]);
@@ -243,11 +340,19 @@ bool I2CBus::SMBusReadBlock(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t &aCo
 bool I2CBus::SMBusWriteByte(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t aByte)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot write
-  #if !DISABLE_I2C
-  int res = i2c_smbus_write_byte_data(busFD, aRegister, aByte);
-  #else
-  int res = 1; // ok
-  #endif
+  int res;
+  if (simulated) {
+    simAccess(aDeviceP, true, aRegister, 1, &aByte);
+    res = 0;
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_write_byte_data(busFD, aRegister, aByte);
+    #else
+    res = 1; // ok
+    #endif
+  }
+  transferred(1);
   FOCUSLOG("i2c_smbus_write_byte_data(cmd=0x%02X, byte=0x%02X) = %d\n", aRegister, aByte, res);
   return (res>=0);
 }
@@ -256,11 +361,22 @@ bool I2CBus::SMBusWriteByte(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t aByt
 bool I2CBus::SMBusWriteWord(I2CDevice *aDeviceP, uint8_t aRegister, uint16_t aWord)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot write
-  #if !DISABLE_I2C
-  int res = i2c_smbus_write_word_data(busFD, aRegister, aWord);
-  #else
-  int res = 1; // ok
-  #endif
+  int res;
+  if (simulated) {
+    uint8_t w[2];
+    w[0] = aWord & 0xFF; // SMBus words are LSB first
+    w[1] = (aWord>>8) & 0xFF;
+    simAccess(aDeviceP, true, aRegister, 2, w);
+    res = 0;
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_write_word_data(busFD, aRegister, aWord);
+    #else
+    res = 1; // ok
+    #endif
+  }
+  transferred(2);
   FOCUSLOG("i2c_smbus_write_word_data(cmd=0x%02X, word=0x%04X) = %d\n", aRegister, aWord, res);
   return (res>=0);
 }
@@ -269,11 +385,19 @@ bool I2CBus::SMBusWriteWord(I2CDevice *aDeviceP, uint8_t aRegister, uint16_t aWo
 bool I2CBus::SMBusWriteBlock(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t aCount, const uint8_t *aDataP)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot write
-  #if !DISABLE_I2C
-  int res = i2c_smbus_write_block_data(busFD, aRegister, aCount, aDataP);
-  #else
-  int res = 1; // ok
-  #endif
+  int res;
+  if (simulated) {
+    simAccess(aDeviceP, true, aRegister, aCount, (uint8_t *)aDataP);
+    res = 0;
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_write_block_data(busFD, aRegister, aCount, aDataP);
+    #else
+    res = 1; // ok
+    #endif
+  }
+  transferred(aCount+1); // count byte is transferred as well
   if (FOCUSLOGENABLED) {
     string data;
     if (res>=0) {
@@ -289,11 +413,19 @@ bool I2CBus::SMBusWriteBlock(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t aCo
 bool I2CBus::SMBusWriteBytes(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t aCount, const uint8_t *aDataP)
 {
   if (!accessDevice(aDeviceP)) return false; // cannot write
-  #if !DISABLE_I2C
-  int res = i2c_smbus_write_i2c_block_data(busFD, aRegister, aCount, aDataP);
-  #else
-  int res = 1; // ok
-  #endif
+  int res;
+  if (simulated) {
+    simAccess(aDeviceP, true, aRegister, aCount, (uint8_t *)aDataP);
+    res = 0;
+  }
+  else {
+    #if !DISABLE_I2C
+    res = i2c_smbus_write_i2c_block_data(busFD, aRegister, aCount, aDataP);
+    #else
+    res = 1; // ok
+    #endif
+  }
+  transferred(aCount);
   if (FOCUSLOGENABLED) {
     string data;
     if (res>=0) {
@@ -309,18 +441,21 @@ bool I2CBus::SMBusWriteBytes(I2CDevice *aDeviceP, uint8_t aRegister, uint8_t aCo
 
 bool I2CBus::accessDevice(I2CDevice *aDeviceP)
 {
+  // every transaction starts here, transferred() accounts for its duration
+  transactionStart = MainLoop::now();
   if (!accessBus())
     return false;
   if (aDeviceP->deviceAddress == lastDeviceAddress)
     return true; // already set to access that device
   // address the device
   #if !DISABLE_I2C
-  if (ioctl(busFD, I2C_SLAVE, aDeviceP->deviceAddress) < 0) {
+  if (!simulated && ioctl(busFD, I2C_SLAVE, aDeviceP->deviceAddress) < 0) {
     LOG(LOG_ERR,"Error: Cannot access device '%s' on bus %d\n", aDeviceP->deviceID().c_str(), busNumber);
     lastDeviceAddress = -1; // invalidate
     return false;
   }
   #endif
+  stats.deviceSelects++;
   FOCUSLOG("ioctl(busFD, I2C_SLAVE, 0x%02X)\n", aDeviceP->deviceAddress);
   // remember
   lastDeviceAddress = aDeviceP->deviceAddress;
@@ -334,6 +469,10 @@ bool I2CBus::accessBus()
     return true; // already open
   // need to open
   string busDevName = string_format("/dev/i2c-%d", busNumber);
+  if (simulated) {
+    busFD = 1; // dummy, signalling open (never closed, see closeBus())
+    return true;
+  }
   #if !DISABLE_I2C
   busFD = open(busDevName.c_str(), O_RDWR);
   if (busFD<0) {
@@ -353,7 +492,7 @@ void I2CBus::closeBus()
 {
   if (busFD>=0) {
     #ifndef __APPLE__
-    close(busFD);
+    if (!simulated) close(busFD);
     #endif
     busFD = -1;
   }
@@ -364,10 +503,38 @@ void I2CBus::closeBus()
 #pragma mark - I2CDevice
 
 
-I2CDevice::I2CDevice(uint8_t aDeviceAddress, I2CBus *aBusP)
+// register bit sets
+static inline bool regBit(const uint32_t *aBits, uint8_t aRegister)
+{
+  return (aBits[aRegister>>5] & ((uint32_t)1<<(aRegister&0x1F)))!=0;
+}
+
+static inline void setRegBit(uint32_t *aBits, uint8_t aRegister, bool aSet)
+{
+  if (aSet)
+    aBits[aRegister>>5] |= ((uint32_t)1<<(aRegister&0x1F));
+  else
+    aBits[aRegister>>5] &= ~((uint32_t)1<<(aRegister&0x1F));
+}
+
+
+#define MAX_BLOCK_WRITE 32 // SMBus block size limit (I2C_SMBUS_BLOCK_MAX)
+#define MAX_BRIDGED_REGS 4 // unchanged registers rewritten to join two ranges, cheaper than a separate transaction (syscall, START, address, register, STOP)
+
+
+I2CDevice::I2CDevice(uint8_t aDeviceAddress, I2CBus *aBusP) :
+  flushTicket(0)
 {
   i2cbus = aBusP;
   deviceAddress = aDeviceAddress;
+  memset(regKnown, 0, sizeof(regKnown));
+  memset(regDirty, 0, sizeof(regDirty));
+}
+
+
+I2CDevice::~I2CDevice()
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(flushTicket);
 }
 
 
@@ -385,6 +552,76 @@ bool I2CDevice::isKindOf(const char *aDeviceType)
 }
 
 
+void I2CDevice::setRegister(uint8_t aRegister, uint8_t aValue)
+{
+  if (regBit(regKnown, aRegister) && !regBit(regDirty, aRegister) && regShadow[aRegister]==aValue) {
+    return; // device already has that value
+  }
+  regShadow[aRegister] = aValue;
+  setRegBit(regKnown, aRegister, true);
+  setRegBit(regDirty, aRegister, true);
+  if (!flushTicket) {
+    // flush once the current handler is done
+    flushTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&I2CDevice::flushRegisters, I2CDevicePtr(this)));
+  }
+}
+
+
+bool I2CDevice::getRegister(uint8_t aRegister, uint8_t &aValue)
+{
+  if (regBit(regKnown, aRegister)) {
+    aValue = regShadow[aRegister];
+    return true;
+  }
+  return i2cbus->SMBusReadByte(this, aRegister, aValue);
+}
+
+
+void I2CDevice::flushRegisters()
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(flushTicket);
+  int reg = 0;
+  while (reg<256) {
+    if (!regBit(regDirty, reg)) {
+      reg++;
+      continue;
+    }
+    // find range of dirty registers (or just this one if device cannot auto-increment)
+    // - small gaps of registers with known value are bridged by writing these again
+    int n = 1;
+    if (registerAutoIncrement()) {
+      int e = reg+1; // end of range
+      int gap = 0; // known, non-dirty registers after end of range
+      while (e+gap<256 && e+gap-reg<MAX_BLOCK_WRITE) {
+        int r = e+gap;
+        if (regBit(regDirty, r)) {
+          e = r+1; // extend range up to this register
+          gap = 0;
+        }
+        else if (regBit(regKnown, r) && gap<MAX_BRIDGED_REGS) {
+          gap++; // might be bridged
+        }
+        else {
+          break;
+        }
+      }
+      n = e-reg;
+    }
+    bool ok;
+    if (n==1)
+      ok = i2cbus->SMBusWriteByte(this, reg, regShadow[reg]);
+    else
+      ok = i2cbus->SMBusWriteBytes(this, reg, n, regShadow+reg);
+    for (int i=0; i<n; i++) {
+      setRegBit(regDirty, reg+i, false);
+      // if writing failed, device state is unknown, so next setRegister() must write again
+      if (!ok) setRegBit(regKnown, reg+i, false);
+    }
+    reg += n;
+  }
+}
+
+
 
 #pragma mark - I2CBitPortDevice
 
@@ -564,13 +801,13 @@ void PCF8574::updateDirection(int aForBitNo)
 
 
 /// create i2c based digital input or output pin
-I2CPin::I2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, bool aInitialState) :
+I2CPin::I2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, bool aInitialState, bool aSimulated) :
   output(false),
   lastSetState(false)
 {
   pinNumber = aPinNumber;
   output = aOutput;
-  I2CDevicePtr dev = I2CManager::sharedManager()->getDevice(aBusNumber, aDeviceId);
+  I2CDevicePtr dev = I2CManager::sharedManager()->getDevice(aBusNumber, aDeviceId, aSimulated);
   bitPortDevice = boost::dynamic_pointer_cast<I2CBitPortDevice>(dev);
   if (bitPortDevice) {
     bitPortDevice->setAsOutput(pinNumber, output, aInitialState);
@@ -661,20 +898,20 @@ double PCA9685::getPinValue(int aPinNo)
   uint8_t h,l;
   uint16_t onTime, offTime;
   // get off time
-  i2cbus->SMBusReadByte(this, 9+aPinNo*4, h);
+  getRegister(9+aPinNo*4, h);
   if (h & 0x10) {
     // full off
     return 0;
   }
-  i2cbus->SMBusReadByte(this, 8+aPinNo*4, l);
+  getRegister(8+aPinNo*4, l);
   offTime = (h & 0xF)<<8 | l;
   // get on time
-  i2cbus->SMBusReadByte(this, 7+aPinNo*4, h);
+  getRegister(7+aPinNo*4, h);
   if (h & 0x10) {
     // full on
     return 100;
   }
-  i2cbus->SMBusReadByte(this, 6+aPinNo*4, l);
+  getRegister(6+aPinNo*4, l);
   onTime = (h & 0xF)<<8 | l;
   // calculate on ratio in percent
   onTime = (offTime-onTime) & 0xFFF;
@@ -710,8 +947,10 @@ void PCA9685::setPinValue(int aPinNo, double aValue)
     leddata[2] = t & 0xFF; // LSB of end time
     leddata[3] = (t>>8) & 0xF; // 4 MSB of end time
   }
-  // send as one transaction
-  i2cbus->SMBusWriteBytes(this, 6+aPinNo*4, 4, leddata);
+  // batched: changed registers of all pins set in this mainloop cycle are sent together
+  for (int i=0; i<4; i++) {
+    setRegister(6+aPinNo*4+i, leddata[i]);
+  }
 }
 
 
@@ -719,12 +958,12 @@ void PCA9685::setPinValue(int aPinNo, double aValue)
 
 
 /// create i2c based digital input or output pin
-AnalogI2CPin::AnalogI2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, double aInitialValue) :
+AnalogI2CPin::AnalogI2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, double aInitialValue, bool aSimulated) :
   output(false)
 {
   pinNumber = aPinNumber;
   output = aOutput;
-  I2CDevicePtr dev = I2CManager::sharedManager()->getDevice(aBusNumber, aDeviceId);
+  I2CDevicePtr dev = I2CManager::sharedManager()->getDevice(aBusNumber, aDeviceId, aSimulated);
   analogPortDevice = boost::dynamic_pointer_cast<I2CAnalogPortDevice>(dev);
   if (analogPortDevice && output) {
     analogPortDevice->setPinValue(pinNumber, aInitialValue);
@@ -25,6 +25,7 @@
 #include "p44_common.hpp"
 
 #include "iopin.hpp"
+#include "simhardware.hpp"
 
 using namespace std;
 
@@ -36,10 +37,35 @@ namespace p44 {
   class I2CDevice : public P44Obj
   {
     friend class I2CBus;
+
+    // register shadow for batched output
+    uint8_t regShadow[256]; ///< register values as known to be in the device, or pending to be written
+    uint32_t regKnown[8]; ///< bit set = register value in regShadow is valid
+    uint32_t regDirty[8]; ///< bit set = register value in regShadow must be written on next flush
+    long flushTicket;
+
   protected:
     I2CBus *i2cbus;
     uint8_t deviceAddress;
 
+    /// @return true if the device increments the register address with every byte of a multi-byte write,
+    ///   so adjacent registers can be written in a single transaction
+    virtual bool registerAutoIncrement() { return false; };
+
+    /// set a register for batched output
+    /// @param aRegister register to set
+    /// @param aValue new value
+    /// @note the register is not written immediately, but at flushRegisters(), together with other registers
+    ///   changed in the meantime. Writes of values the device is known to already have are skipped.
+    void setRegister(uint8_t aRegister, uint8_t aValue);
+
+    /// get register value
+    /// @param aRegister register to get
+    /// @param aValue will receive the value
+    /// @return true if successful
+    /// @note registers set via setRegister() are returned from the shadow, others are read from the device
+    bool getRegister(uint8_t aRegister, uint8_t &aValue);
+
   public:
 
     /// @return fully qualified device identifier (deviceType@hexaddress)
@@ -55,6 +81,16 @@ namespace p44 {
     /// @param aDeviceAddress slave address of the device
     /// @param aBusP I2CBus object
     I2CDevice(uint8_t aDeviceAddress, I2CBus *aBusP);
+    virtual ~I2CDevice();
+
+    /// @return the bus this device is connected to
+    I2CBus &getBus() { return *i2cbus; };
+
+    /// write all registers changed via setRegister() to the device, contiguous ranges as block writes
+    /// @note called automatically from the mainloop after the handler that changed registers has returned,
+    ///   so all changes made within the same handler (such as the R,G,B values of a transition step) are
+    ///   written together.
+    void flushRegisters();
 
   };
   typedef boost::intrusive_ptr<I2CDevice> I2CDevicePtr;
@@ -63,6 +99,15 @@ namespace p44 {
 
 
 
+  /// I2C bus access statistics
+  typedef struct {
+    long transactions; ///< number of bus transactions (START to STOP)
+    long bytes; ///< number of data bytes transferred (not counting slave address and register bytes)
+    long deviceSelects; ///< number of slave address changes (ioctl only, no bus traffic)
+    MLMicroSeconds busyTime; ///< time spent in bus accesses
+  } I2CBusStats;
+
+
   class I2CBus : public P44Obj
   {
     friend class I2CManager;
@@ -73,10 +118,21 @@ namespace p44 {
     int busFD;
     int lastDeviceAddress;
 
+    I2CBusStats stats;
+    MLMicroSeconds transactionStart;
+
+    // simulation
+    bool simulated;
+    SimInterfacePtr simInterface;
+    typedef struct { uint8_t reg[256]; } SimRegisters;
+    typedef std::map<uint8_t, SimRegisters> SimDeviceMap;
+    SimDeviceMap simDevices;
+
   protected:
     /// create i2c bus
     /// @param aBusNumber i2c bus number in the system
-    I2CBus(int aBusNumber);
+    /// @param aSimulated if set, no actual bus is accessed, but transactions are executed on a register image per device
+    I2CBus(int aBusNumber, bool aSimulated = false);
 
     /// register new I2CDevice
     /// @param the device to register
@@ -118,11 +174,28 @@ namespace p44 {
     bool I2CReadByte(I2CDevice *aDeviceP, uint8_t &aByte);
     bool I2CWriteByte(I2CDevice *aDeviceP, uint8_t aByte);
 
+    /// @return access statistics since creation or last resetStats()
+    const I2CBusStats &getStats() { return stats; };
+
+    /// reset access statistics
+    void resetStats();
+
+    /// @return true if this is a simulated bus
+    bool isSimulated() { return simulated; };
+
+    /// access the register image of a device on a simulated bus, e.g. to inject input states
+    /// @param aDeviceAddress slave address of the device
+    /// @param aRegister register number (plain byte devices like PCF8574 use register 0)
+    /// @param aValue value to set / is set to the current value
+    void setSimulatedRegister(uint8_t aDeviceAddress, uint8_t aRegister, uint8_t aValue);
+    void getSimulatedRegister(uint8_t aDeviceAddress, uint8_t aRegister, uint8_t &aValue);
 
   private:
     bool accessDevice(I2CDevice *aDeviceP);
     bool accessBus();
     void closeBus();
+    void transferred(int aBytes);
+    int simAccess(I2CDevice *aDeviceP, bool aWrite, uint8_t aRegister, uint8_t aCount, uint8_t *aDataP);
 
   };
   typedef boost::intrusive_ptr<I2CBus> I2CBusPtr;
@@ -134,6 +207,7 @@ namespace p44 {
   class I2CManager : public P44Obj
   {
     I2CBusMap busMap;
+    I2CBusMap simBusMap;
 
     I2CManager();
   public:
@@ -146,8 +220,9 @@ namespace p44 {
     /// @param aBusNumber the i2c bus number in the system to use
     /// @param aDeviceID the device name identifying address and type of device
     ///   like "tca9555@25" meaning TCA9555 chip based IO at HEX!! bus address 25
+    /// @param aSimulated if set, the device is on a simulated bus (which is separate from the actual bus with the same number)
     /// @return a device of proper type or empty pointer if none could be found
-    I2CDevicePtr getDevice(int aBusNumber, const char *aDeviceID);
+    I2CDevicePtr getDevice(int aBusNumber, const char *aDeviceID, bool aSimulated = false);
 
   };
 
@@ -260,7 +335,8 @@ namespace p44 {
   public:
 
     /// create i2c based digital input or output pin
-    I2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, bool aInitialState);
+    /// @param aSimulated if set, the pin is on a simulated bus (see I2CManager::getDevice())
+    I2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, bool aInitialState, bool aSimulated = false);
 
     /// get state of pin
     /// @return current state (from actual GPIO pin for inputs, from last set state for outputs)
@@ -321,6 +397,10 @@ namespace p44 {
     virtual double getPinValue(int aPinNo);
     virtual void setPinValue(int aPinNo, double aValue);
 
+  protected:
+
+    virtual bool registerAutoIncrement() { return true; }; // MODE1 AI bit is set at initialisation
+
   };
 
 
@@ -335,7 +415,8 @@ namespace p44 {
   public:
 
     /// create i2c based digital input or output pin
-    AnalogI2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, double aInitialValue);
+    /// @param aSimulated if set, the pin is on a simulated bus (see I2CManager::getDevice())
+    AnalogI2CPin(int aBusNumber, const char *aDeviceId, int aPinNumber, bool aOutput, double aInitialValue, bool aSimulated = false);
 
     /// get value of pin
     /// @return current value (from actual pin for inputs, from last set state for outputs)
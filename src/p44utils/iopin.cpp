@@ -23,6 +23,8 @@
 
 using namespace p44;
 
+#define HELPER_ANSWER_TIMEOUT (10*Second)
+
 
 static char nextIoSimKey = 'a';
 
@@ -68,6 +70,16 @@ void SimPin::setState(bool aState)
 #pragma mark - digital output via system command
 
 
+/// @return error if helper answer signals failure
+static ErrorPtr helperAnswerError(const string &aAnswer)
+{
+  if (aAnswer.substr(0,3)=="ERR") {
+    return ErrorPtr(new CoProcessError(CoProcessErrorFailed, aAnswer));
+  }
+  return ErrorPtr();
+}
+
+
 SysCommandPin::SysCommandPin(const char *aConfig, bool aOutput, bool aInitialState) :
   pinState(aInitialState),
   output(aOutput),
@@ -76,11 +88,18 @@ SysCommandPin::SysCommandPin(const char *aConfig, bool aOutput, bool aInitialSta
 {
   // separate commands for switching on and off
   //  oncommand|offcommand
+  // or persistent helper
+  //  @helpercommand
   string s = aConfig;
-  size_t i = s.find("|", 0);
-  if (i!=string::npos) {
-    onCommand = s.substr(0,i);
-    offCommand = s.substr(i+1);
+  if (s.size()>0 && s[0]=='@') {
+    coProcess = CoProcessPtr(new CoProcess(MainLoop::currentMainLoop(), s.substr(1)));
+  }
+  else {
+    size_t i = s.find("|", 0);
+    if (i!=string::npos) {
+      onCommand = s.substr(0,i);
+      offCommand = s.substr(i+1);
+    }
   }
   // force setting initial state
   pinState = !aInitialState;
@@ -88,8 +107,15 @@ SysCommandPin::SysCommandPin(const char *aConfig, bool aOutput, bool aInitialSta
 }
 
 
+SysCommandPin::~SysCommandPin()
+{
+  if (coProcess) coProcess->terminate();
+}
+
+
 string SysCommandPin::stateSetCommand(bool aState)
 {
+  if (coProcess) return coProcess->description();
   return aState ? onCommand : offCommand;
 }
 
@@ -114,11 +140,23 @@ void SysCommandPin::applyState(bool aState)
   else {
     // trigger change
     changing = true;
-    MainLoop::currentMainLoop().fork_and_system(boost::bind(&SysCommandPin::stateUpdated, this, _2, _3), stateSetCommand(aState).c_str());
+    if (coProcess) {
+      coProcess->request(aState ? "set 1" : "set 0", boost::bind(&SysCommandPin::stateAnswered, this, _1, _2), HELPER_ANSWER_TIMEOUT);
+    }
+    else {
+      MainLoop::currentMainLoop().fork_and_system(boost::bind(&SysCommandPin::stateUpdated, this, _2, _3), stateSetCommand(aState).c_str());
+    }
   }
 }
 
 
+void SysCommandPin::stateAnswered(ErrorPtr aError, const string &aAnswer)
+{
+  if (Error::isOK(aError)) aError = helperAnswerError(aAnswer);
+  stateUpdated(aError, aAnswer);
+}
+
+
 void SysCommandPin::stateUpdated(ErrorPtr aError, const string &aOutputString)
 {
   if (!Error::isOK(aError)) {
@@ -186,6 +224,8 @@ AnalogSysCommandPin::AnalogSysCommandPin(const char *aConfig, bool aOutput, doub
 {
   // Save set command
   //  [range|]offcommand
+  // or persistent helper
+  //  [range|]@helpercommand
   setCommand = aConfig;
   size_t i = setCommand.find("|", 0);
   // check for range
@@ -193,19 +233,35 @@ AnalogSysCommandPin::AnalogSysCommandPin(const char *aConfig, bool aOutput, doub
     sscanf(setCommand.substr(0,i).c_str(), "%d", &range);
     setCommand.erase(0,i+1);
   }
+  if (setCommand.size()>0 && setCommand[0]=='@') {
+    coProcess = CoProcessPtr(new CoProcess(MainLoop::currentMainLoop(), setCommand.substr(1)));
+  }
   // force setting initial state
   pinValue = aInitialValue+1;
   setValue(aInitialValue);
 }
 
 
+AnalogSysCommandPin::~AnalogSysCommandPin()
+{
+  if (coProcess) coProcess->terminate();
+}
+
+
+int AnalogSysCommandPin::scaledValue(double aValue)
+{
+  return (int)(aValue/100*range); // aValue assumed to be 0..100
+}
+
+
 string AnalogSysCommandPin::valueSetCommand(double aValue)
 {
+  if (coProcess) return coProcess->description();
   size_t vpos = setCommand.find("${VALUE}");
   string cmd;
   if (vpos!=string::npos) {
     cmd = setCommand;
-    cmd.replace(vpos, vpos+8, string_format("%d", (int)(aValue/100*range))); // aValue assumed to be 0..100
+    cmd.replace(vpos, 8, string_format("%d", scaledValue(aValue)));
   }
   return cmd;
 }
@@ -231,11 +287,23 @@ void AnalogSysCommandPin::applyValue(double aValue)
   else {
     // trigger change
     changing = true;
-    MainLoop::currentMainLoop().fork_and_system(boost::bind(&AnalogSysCommandPin::valueUpdated, this, _2, _3), valueSetCommand(aValue).c_str());
+    if (coProcess) {
+      coProcess->request(string_format("set %d", scaledValue(aValue)), boost::bind(&AnalogSysCommandPin::valueAnswered, this, _1, _2), HELPER_ANSWER_TIMEOUT);
+    }
+    else {
+      MainLoop::currentMainLoop().fork_and_system(boost::bind(&AnalogSysCommandPin::valueUpdated, this, _2, _3), valueSetCommand(aValue).c_str());
+    }
   }
 }
 
 
+void AnalogSysCommandPin::valueAnswered(ErrorPtr aError, const string &aAnswer)
+{
+  if (Error::isOK(aError)) aError = helperAnswerError(aAnswer);
+  valueUpdated(aError, aAnswer);
+}
+
+
 void AnalogSysCommandPin::valueUpdated(ErrorPtr aError, const string &aOutputString)
 {
   if (!Error::isOK(aError)) {
@@ -25,6 +25,7 @@
 #include "p44_common.hpp"
 
 #include "consolekey.hpp"
+#include "coprocess.hpp"
 
 using namespace std;
 
@@ -95,6 +96,7 @@ namespace p44 {
   {
     string onCommand;
     string offCommand;
+    CoProcessPtr coProcess; ///< set when the pin is driven by a persistent helper rather than by a command per change
     bool pinState;
     bool output;
     bool changing;
@@ -102,7 +104,10 @@ namespace p44 {
 
   public:
     // create a pin using a command line to act
+    /// @note if aConfig starts with '@', the rest is a helper command line that is started once and then receives
+    ///   "set 1" or "set 0" lines on stdin, answering each with one line on stdout ("ERR..." on failure)
     SysCommandPin(const char *aConfig, bool aOutput, bool aInitialState);
+    virtual ~SysCommandPin();
 
     /// get state of pin
     /// @return current state (from actual GPIO pin for inputs, from last set state for outputs)
@@ -117,6 +122,7 @@ namespace p44 {
     string stateSetCommand(bool aState);
     void applyState(bool aState);
     void stateUpdated(ErrorPtr aError, const string &aOutputString);
+    void stateAnswered(ErrorPtr aError, const string &aAnswer);
 
   };
 
@@ -187,6 +193,7 @@ namespace p44 {
   class AnalogSysCommandPin : public AnalogIOPin
   {
     string setCommand;
+    CoProcessPtr coProcess; ///< set when the pin is driven by a persistent helper rather than by a command per change
     double pinValue;
     int range;
     bool output;
@@ -195,7 +202,10 @@ namespace p44 {
 
   public:
     // create a pin using a command line to act
+    /// @note if the command starts with '@', the rest is a helper command line that is started once and then
+    ///   receives "set <value>" lines on stdin, answering each with one line on stdout ("ERR..." on failure)
     AnalogSysCommandPin(const char *aConfig, bool aOutput, double aInitialValue);
+    virtual ~AnalogSysCommandPin();
 
     /// get value of pin
     /// @return current value (from actual pin for inputs, from last set state for outputs)
@@ -207,9 +217,11 @@ namespace p44 {
 
   private:
 
+    int scaledValue(double aValue);
     string valueSetCommand(double aValue);
     void applyValue(double aValue);
     void valueUpdated(ErrorPtr aError, const string &aOutputString);
+    void valueAnswered(ErrorPtr aError, const string &aAnswer);
     
   };
 
@@ -27,6 +27,11 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "fdcomm.hpp"
 
@@ -35,6 +40,8 @@
 
 #define MAINLOOP_DEFAULT_CYCLE_TIME_uS 100000 // 100mS
 
+#define DEFAULT_MAX_WORKER_THREADS 8
+
 
 using namespace p44;
 
@@ -105,11 +112,33 @@ MainLoop::MainLoop() :
   cycleStartTime(Never),
   exitCode(EXIT_SUCCESS),
   idleHandlersChanged(false),
-  oneTimeHandlersChanged(false)
+  oneTimeHandlersChanged(false),
+  postedCalls(NULL),
+  postSignalFd(-1),
+  postWakeFd(-1)
 {
   #if MAINLOOP_STATISTICS
   statistics_reset();
   #endif
+  // create the fd used by other threads to wake us up for posted calls
+  #ifdef __linux__
+  postSignalFd = eventfd(0, EFD_NONBLOCK);
+  postWakeFd = postSignalFd;
+  #else
+  int pipeFdPair[2];
+  if (pipe(pipeFdPair)==0) {
+    postSignalFd = pipeFdPair[0];
+    postWakeFd = pipeFdPair[1];
+    fcntl(postSignalFd, F_SETFL, fcntl(postSignalFd, F_GETFL) | O_NONBLOCK);
+    fcntl(postWakeFd, F_SETFL, fcntl(postWakeFd, F_GETFL) | O_NONBLOCK);
+  }
+  #endif
+  if (postSignalFd>=0) {
+    registerPollHandler(postSignalFd, POLLIN, boost::bind(&MainLoop::postSignalHandler, this, _3));
+  }
+  else {
+    LOG(LOG_ERR, "MainLoop: cannot create wakeup fd, posted calls will be delayed up to one cycle: %s\n", strerror(errno));
+  }
 }
 
 
@@ -150,19 +179,20 @@ void MainLoop::unregisterIdleHandlers(void *aSubscriberP)
 }
 
 
-long MainLoop::executeOnce(OneTimeCB aCallback, MLMicroSeconds aDelay)
+long MainLoop::executeOnce(OneTimeCB aCallback, MLMicroSeconds aDelay, const char *aTag)
 {
 	MLMicroSeconds executionTime = now()+aDelay;
-	return executeOnceAt(aCallback, executionTime);
+	return executeOnceAt(aCallback, executionTime, aTag);
 }
 
 
-long MainLoop::executeOnceAt(OneTimeCB aCallback, MLMicroSeconds aExecutionTime)
+long MainLoop::executeOnceAt(OneTimeCB aCallback, MLMicroSeconds aExecutionTime, const char *aTag)
 {
 	OnetimeHandler h;
   h.ticketNo = ++ticketNo;
   h.executionTime = aExecutionTime;
 	h.callback = aCallback;
+  h.tag = aTag;
   return scheduleOneTimeHandler(h);
 }
 
@@ -185,6 +215,7 @@ long MainLoop::scheduleOneTimeHandler(OnetimeHandler &aHandler)
   }
   // none executes later than this one, just append
   onetimeHandlers.push_back(aHandler);
+  oneTimeHandlersChanged = true; // a running runOnetimeHandlers() might already be past the end
   return ticketNo;
 }
 
@@ -257,16 +288,47 @@ void MainLoop::waitForPid(WaitCB aCallback, pid_t aPid)
 extern char **environ;
 
 
-void MainLoop::fork_and_execve(ExecCB aCallback, const char *aPath, char *const aArgv[], char *const aEnvp[], bool aPipeBackStdOut)
+pid_t MainLoop::spawn(const char *aPath, char *const aArgv[], char *const aEnvp[], int aStdInFd, int aStdOutFd, ErrorPtr &aError)
 {
-  LOG(LOG_DEBUG,"fork_and_execve: preparing to fork for executing '%s' now\n", aPath);
-  pid_t child_pid;
-  int answerPipe[2]; /* Child to parent pipe */
-
-  // prepare environment
   if (aEnvp==NULL) {
     aEnvp = environ; // use my own environment
   }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (aStdInFd>=0) posix_spawn_file_actions_adddup2(&actions, aStdInFd, STDIN_FILENO);
+  if (aStdOutFd>=0) posix_spawn_file_actions_adddup2(&actions, aStdOutFd, STDOUT_FILENO);
+  // close all other open file descriptors in the child
+  int maxFd = getdtablesize();
+  for (int fd=STDERR_FILENO+1; fd<maxFd; fd++) {
+    if (fcntl(fd, F_GETFD)>=0) posix_spawn_file_actions_addclose(&actions, fd);
+  }
+  // child gets default signal handling, and no signals blocked
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t sigs;
+  sigfillset(&sigs);
+  posix_spawnattr_setsigdefault(&attr, &sigs);
+  sigemptyset(&sigs);
+  posix_spawnattr_setsigmask(&attr, &sigs);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETSIGMASK);
+  pid_t pid;
+  int res = posix_spawn(&pid, aPath, &actions, &attr, aArgv, aEnvp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (res!=0) {
+    aError = ErrorPtr(new SysError(res, string_format("cannot start '%s': ", aPath).c_str()));
+    return -1;
+  }
+  LOG(LOG_DEBUG,"spawn: '%s' started as pid=%d\n", aPath, pid);
+  return pid;
+}
+
+
+void MainLoop::fork_and_execve(ExecCB aCallback, const char *aPath, char *const aArgv[], char *const aEnvp[], bool aPipeBackStdOut)
+{
+  LOG(LOG_DEBUG,"fork_and_execve: preparing to spawn for executing '%s' now\n", aPath);
+  int answerPipe[2]; /* Child to parent pipe */
+
   // prepare pipe in case we want answer collected
   if (aPipeBackStdOut) {
     if(pipe(answerPipe)<0) {
@@ -275,45 +337,30 @@ void MainLoop::fork_and_execve(ExecCB aCallback, const char *aPath, char *const
       return;
     }
   }
-  // fork child process
-  child_pid = fork();
+  // start child process
+  ErrorPtr err;
+  pid_t child_pid = spawn(aPath, aArgv, aEnvp, -1, aPipeBackStdOut ? answerPipe[1] : -1, err);
   if (child_pid>=0) {
-    // fork successful
-    if (child_pid==0) {
-      // this is the child process (fork() returns 0 for the child process)
-      LOG(LOG_DEBUG,"forked child process: preparing for execve\n", aPath);
-      if (aPipeBackStdOut) {
-        dup2(answerPipe[1],STDOUT_FILENO); // replace STDOUT by writing end of pipe
-        close(answerPipe[1]); // release the original descriptor (does NOT really close the file)
-        close(answerPipe[0]); // close child's reading end of pipe (parent uses it!)
-      }
-      // close all non-std file descriptors
-      int fd = getdtablesize();
-      while (fd>STDERR_FILENO) close(fd--);
-      // change to the requested child process
-      execve(aPath, aArgv, aEnvp); // replace process with new binary/script
-      // execv returns only in case of error
-      exit(127);
-    }
-    else {
-      // this is the parent process, wait for the child to terminate
-      LOG(LOG_DEBUG,"fork_and_execve: child pid=%d, parent will now set up pipe string collector\n", child_pid);
-      FdStringCollectorPtr ans;
-      if (aPipeBackStdOut) {
-        LOG(LOG_DEBUG,"fork_and_execve: parent will now set up pipe string collector\n");
-        close(answerPipe[1]); // close parent's writing end (child uses it!)
-        // set up collector for data returned from child process
-        ans = FdStringCollectorPtr(new FdStringCollector(MainLoop::currentMainLoop()));
-        ans->setFd(answerPipe[0]);
-      }
-      LOG(LOG_DEBUG,"fork_and_execve: now calling waitForPid(%d)\n", child_pid);
-      waitForPid(boost::bind(&MainLoop::execChildTerminated, this, aCallback, ans, _2, _3), child_pid);
+    // this is the parent process, wait for the child to terminate
+    FdStringCollectorPtr ans;
+    if (aPipeBackStdOut) {
+      LOG(LOG_DEBUG,"fork_and_execve: parent will now set up pipe string collector\n");
+      close(answerPipe[1]); // close parent's writing end (child uses it!)
+      // set up collector for data returned from child process
+      ans = FdStringCollectorPtr(new FdStringCollector(MainLoop::currentMainLoop()));
+      ans->setFd(answerPipe[0]);
     }
+    LOG(LOG_DEBUG,"fork_and_execve: now calling waitForPid(%d)\n", child_pid);
+    waitForPid(boost::bind(&MainLoop::execChildTerminated, this, aCallback, ans, _2, _3), child_pid);
   }
   else {
+    if (aPipeBackStdOut) {
+      close(answerPipe[0]);
+      close(answerPipe[1]);
+    }
     if (aCallback) {
-      // fork failed, call back with error
-      aCallback(cycleStartTime, SysError::errNo(),"");
+      // spawn failed, call back with error
+      aCallback(cycleStartTime, err, "");
     }
   }
   return;
@@ -391,13 +438,21 @@ bool MainLoop::runOnetimeHandlers()
       }
       if (terminated) return true; // terminated means everything is considered complete
       OneTimeCB cb = pos->callback; // get handler
+      #if MAINLOOP_STATISTICS
+      const char *tag = pos->tag;
+      MLMicroSeconds hs = now();
+      timerLatenesses.add(hs-pos->executionTime);
+      #endif
       pos = onetimeHandlers.erase(pos); // remove from queue
       cb(cycleStartTime); // call handler
+      #if MAINLOOP_STATISTICS
+      recordHandlerRuntime(tag, now()-hs);
+      #endif
       if (oneTimeHandlersChanged) {
         // callback has caused change of onetime handlers list, pos gets invalid
         break; // but done for now
       }
-      ++pos;
+      // pos already points to next handler (erase() has advanced it)
     }
   } while(oneTimeHandlersChanged && rep-->0); // limit repetitions due to changed one time handlers to prevent endless loop
   ML_STAT_ADD(oneTimeHandlerTime);
@@ -478,7 +533,7 @@ bool MainLoop::checkWait()
 
 
 
-void MainLoop::registerPollHandler(int aFD, int aPollFlags, IOPollCB aPollEventHandler)
+void MainLoop::registerPollHandler(int aFD, int aPollFlags, IOPollCB aPollEventHandler, const char *aTag)
 {
   if (aPollEventHandler.empty())
     unregisterPollHandler(aFD); // no handler means unregistering handler
@@ -487,6 +542,7 @@ void MainLoop::registerPollHandler(int aFD, int aPollFlags, IOPollCB aPollEventH
   h.monitoredFD = aFD;
   h.pollFlags = aPollFlags;
   h.pollHandler = aPollEventHandler;
+  h.tag = aTag;
 	ioPollHandlers[aFD] = h;
 }
 
@@ -518,6 +574,69 @@ void MainLoop::unregisterPollHandler(int aFD)
 
 
 
+#pragma mark - calls posted from other threads
+
+
+void MainLoop::post(SimpleCB aCallback)
+{
+  PostedCall *pc = new PostedCall;
+  pc->callback = aCallback;
+  // push onto list
+  PostedCall *head = NULL;
+  while (true) {
+    pc->next = head;
+    PostedCall *seen = __sync_val_compare_and_swap(&postedCalls, head, pc);
+    if (seen==head) break;
+    head = seen; // list has changed meanwhile, retry
+  }
+  if (head==NULL && postWakeFd>=0) {
+    // list was empty, so mainloop might be sleeping in poll() and needs to be woken up.
+    // (if not empty, a wakeup is already pending, because the mainloop clears the signal before taking the list)
+    uint64_t one = 1;
+    write(postWakeFd, &one, sizeof(one));
+  }
+}
+
+
+bool MainLoop::postSignalHandler(int aPollFlags)
+{
+  if (aPollFlags & POLLIN) {
+    // clear the signal first, then take the calls
+    uint64_t cnt[4];
+    while (read(postSignalFd, cnt, sizeof(cnt))>0);
+    return runPostedCalls();
+  }
+  return false;
+}
+
+
+bool MainLoop::runPostedCalls()
+{
+  // take the entire list at once
+  PostedCall *list = __sync_lock_test_and_set(&postedCalls, (PostedCall *)NULL);
+  if (list==NULL) return false;
+  // list is in LIFO order, reverse it
+  PostedCall *fifo = NULL;
+  while (list) {
+    PostedCall *pc = list;
+    list = pc->next;
+    pc->next = fifo;
+    fifo = pc;
+  }
+  // execute
+  ML_STAT_START
+  while (fifo) {
+    PostedCall *pc = fifo;
+    fifo = pc->next;
+    if (!terminated) pc->callback();
+    delete pc;
+  }
+  ML_STAT_ADD(threadSignalHandlerTime);
+  return true;
+}
+
+
+
 bool MainLoop::handleIOPoll(MLMicroSeconds aTimeout)
 {
   // create poll structure
@@ -569,8 +688,14 @@ bool MainLoop::handleIOPoll(MLMicroSeconds aTimeout)
         IOPollHandlerMap::iterator pos = ioPollHandlers.find(pollfdP->fd);
         if (pos!=ioPollHandlers.end()) {
           // - there is a handler
+          #if MAINLOOP_STATISTICS
+          const char *tag = pos->second.tag;
+          #endif
           if (pos->second.pollHandler(cycleStartTime, pollfdP->fd, pollfdP->revents))
             didHandle = true; // really handled (not just checked flags and decided it's nothing to handle)
+          #if MAINLOOP_STATISTICS
+          recordHandlerRuntime(tag, now()-t);
+          #endif
         }
         ML_STAT_ADD(ioHandlerTime);
       }
@@ -617,6 +742,7 @@ int MainLoop::run()
       if (terminated) break;
       if (!checkWait()) allCompleted = false;
       if (terminated) break;
+      if (postSignalFd<0) runPostedCalls(); // no wakeup fd, must check every time
       MLMicroSeconds timeLeft = remainingCycleTime();
       // if other handlers have not completed yet, don't wait for I/O, just quickly check
       bool iohandled = false;
@@ -642,6 +768,7 @@ int MainLoop::run()
     } // not terminated
     #if MAINLOOP_STATISTICS
     statisticsCycles ++; // one cycle completed
+    cycleDurations.add(now()-cycleStartTime);
     #endif
   } // not terminated
 	return exitCode;
@@ -711,10 +838,99 @@ void MainLoop::statistics_reset()
   oneTimeHandlerTime = 0;
   waitHandlerTime = 0;
   threadSignalHandlerTime = 0;
+  cycleDurations.reset();
+  timerLatenesses.reset();
+  handlerRuntimes.reset();
+  handlerStats.clear();
   #endif
 }
 
 
+#if MAINLOOP_STATISTICS
+
+void MainLoop::recordHandlerRuntime(const char *aTag, MLMicroSeconds aRuntime)
+{
+  handlerRuntimes.add(aRuntime);
+  MLHandlerStats &hs = handlerStats[aTag ? aTag : "untagged"];
+  hs.calls++;
+  hs.totalTime += aRuntime;
+  if (aRuntime>hs.maxTime) hs.maxTime = aRuntime;
+  if (aRuntime>loopCycleTime) {
+    LOG(LOG_INFO, "Mainloop: handler '%s' blocked mainloop for %.6f S\n", aTag ? aTag : "untagged", (double)aRuntime/Second);
+  }
+}
+
+#endif // MAINLOOP_STATISTICS
+
+
+#pragma mark - MLHistogram
+
+
+void MLHistogram::reset()
+{
+  memset(buckets, 0, sizeof(buckets));
+  total = 0;
+  valueSum = 0;
+  maxValue = 0;
+}
+
+
+int MLHistogram::bucketIndexFor(MLMicroSeconds aValue)
+{
+  if (aValue<subBuckets) return aValue<0 ? 0 : (int)aValue; // linear range
+  // find octave (position of highest bit)
+  int octave = subBucketBits;
+  while (octave<maxOctave && (aValue>>(octave+1))!=0) octave++;
+  if ((aValue>>(octave+1))!=0) return numBuckets-1; // beyond range
+  // sub-bucket from the bits below the highest bit
+  int sub = (int)((aValue>>(octave-subBucketBits)) & (subBuckets-1));
+  return subBuckets+(octave-subBucketBits)*subBuckets+sub;
+}
+
+
+MLMicroSeconds MLHistogram::bucketLowerLimit(int aBucketIndex)
+{
+  if (aBucketIndex<subBuckets) return aBucketIndex;
+  int octave = (aBucketIndex-subBuckets)/subBuckets+subBucketBits;
+  int sub = (aBucketIndex-subBuckets)%subBuckets;
+  return ((MLMicroSeconds)(subBuckets+sub))<<(octave-subBucketBits);
+}
+
+
+MLMicroSeconds MLHistogram::bucketUpperLimit(int aBucketIndex)
+{
+  if (aBucketIndex>=numBuckets-1) return Infinite;
+  return bucketLowerLimit(aBucketIndex+1)-1;
+}
+
+
+void MLHistogram::add(MLMicroSeconds aValue)
+{
+  if (aValue<0) aValue = 0;
+  buckets[bucketIndexFor(aValue)]++;
+  total++;
+  valueSum += aValue;
+  if (aValue>maxValue) maxValue = aValue;
+}
+
+
+MLMicroSeconds MLHistogram::percentile(double aPercent) const
+{
+  if (total==0) return 0;
+  uint64_t limit = (uint64_t)(aPercent*total/100+0.5);
+  if (limit<1) limit = 1;
+  uint64_t cnt = 0;
+  for (int i=0; i<numBuckets; i++) {
+    cnt += buckets[i];
+    if (cnt>=limit) {
+      MLMicroSeconds u = bucketUpperLimit(i);
+      return u==Infinite || u>maxValue ? maxValue : u;
+    }
+  }
+  return maxValue;
+}
+
+
 #pragma mark - execution in subthreads
 
 
@@ -724,154 +940,383 @@ ChildThreadWrapperPtr MainLoop::executeInThread(ThreadRoutine aThreadRoutine, Th
 }
 
 
-#pragma mark - ChildThreadWrapper
+#pragma mark - WorkerPool
+
+namespace p44 {
 
+  typedef enum {
+    jobQueued, ///< waiting for a worker
+    jobRunning, ///< running on a worker
+    jobDone, ///< routine has returned, completion is posted
+    jobAbandoned ///< cancelled after completion was already posted
+  } WorkerJobState;
 
-static void *thread_start_function(void *arg)
+  struct WorkerJob {
+    SimpleCB routine; ///< the routine to run on the worker thread
+    SimpleCB completedCB; ///< the callback to run on the submitter's mainloop
+    MainLoop *mainLoopP; ///< the submitter's mainloop
+    WorkerJobState state;
+    bool cancelRequested; ///< set when job is cancelled while running
+    pthread_t worker; ///< the worker thread running the job (when jobRunning)
+  };
+
+} // namespace p44
+
+
+static WorkerPool *sharedWorkerPoolP = NULL;
+
+
+WorkerPool::WorkerPool(size_t aMaxWorkers) :
+  idleWorkers(0),
+  maxWorkers(aMaxWorkers)
 {
-  // pass into method of wrapper
-  return static_cast<ChildThreadWrapper *>(arg)->startFunction();
+  pthread_mutex_init(&poolMutex, NULL);
+  pthread_cond_init(&jobAvailable, NULL);
 }
 
 
-void *ChildThreadWrapper::startFunction()
+WorkerPool &WorkerPool::sharedPool()
 {
-  // run the routine
-  threadRoutine(*this);
-  // signal termination
-  terminated();
+  if (sharedWorkerPoolP==NULL) {
+    sharedWorkerPoolP = new WorkerPool(DEFAULT_MAX_WORKER_THREADS);
+  }
+  return *sharedWorkerPoolP;
+}
+
+
+void WorkerPool::setMaxWorkers(size_t aMaxWorkers)
+{
+  pthread_mutex_lock(&poolMutex);
+  maxWorkers = aMaxWorkers;
+  pthread_mutex_unlock(&poolMutex);
+}
+
+
+size_t WorkerPool::numWorkers()
+{
+  pthread_mutex_lock(&poolMutex);
+  size_t n = workers.size();
+  pthread_mutex_unlock(&poolMutex);
+  return n;
+}
+
+
+size_t WorkerPool::numQueuedJobs()
+{
+  pthread_mutex_lock(&poolMutex);
+  size_t n = jobQueue.size();
+  pthread_mutex_unlock(&poolMutex);
+  return n;
+}
+
+
+static void *worker_start_function(void *arg)
+{
+  static_cast<WorkerPool *>(arg)->workerFunction();
   return NULL;
 }
 
 
+// must be called with poolMutex locked
+bool WorkerPool::startWorker()
+{
+  pthread_t t;
+  if (pthread_create(&t, NULL, worker_start_function, this)!=0) {
+    LOG(LOG_ERR, "WorkerPool: cannot start worker thread: %s\n", strerror(errno));
+    return false;
+  }
+  workers.push_back(t);
+  return true;
+}
 
-ChildThreadWrapper::ChildThreadWrapper(MainLoop &aParentThreadMainLoop, ThreadRoutine aThreadRoutine, ThreadSignalHandler aThreadSignalHandler) :
-  parentThreadMainLoop(aParentThreadMainLoop),
-  threadRoutine(aThreadRoutine),
-  parentSignalHandler(aThreadSignalHandler),
-  threadRunning(false)
+
+WorkerJobPtr WorkerPool::submit(SimpleCB aJobRoutine, SimpleCB aCompletedCB)
 {
-  // create a signal pipe
-  int pipeFdPair[2];
-  if (pipe(pipeFdPair)==0) {
-    // pipe could be created
-    // - save FDs
-    parentSignalFd = pipeFdPair[0]; // 0 is the reading end
-    childSignalFd = pipeFdPair[1]; // 1 is the writing end
-    // - install poll handler in the parent mainloop
-    parentThreadMainLoop.registerPollHandler(parentSignalFd, POLLIN, boost::bind(&ChildThreadWrapper::signalPipeHandler, this, _3));
-    // create a pthread (with default attrs for now
-    threadRunning = true; // before creating it, to make sure it is set when child starts to run
-    if (pthread_create(&pthread, NULL, thread_start_function, this)!=0) {
-      // error, could not create thread, fake a signal callback immediately
-      threadRunning = false;
-      if (parentSignalHandler)
-        parentSignalHandler(*this, threadSignalFailedToStart);
+  WorkerJobPtr job = new WorkerJob;
+  job->routine = aJobRoutine;
+  job->completedCB = aCompletedCB;
+  job->mainLoopP = &MainLoop::currentMainLoop();
+  job->state = jobQueued;
+  job->cancelRequested = false;
+  pthread_mutex_lock(&poolMutex);
+  // make sure there will be a worker for this job
+  if (idleWorkers<=jobQueue.size() && workers.size()<maxWorkers) {
+    if (!startWorker() && workers.empty()) {
+      // no worker at all, cannot run the job
+      pthread_mutex_unlock(&poolMutex);
+      delete job;
+      return NULL;
     }
-    else {
-      // thread created ok, keep wrapper object alive
-      selfRef = ChildThreadWrapperPtr(this);
+  }
+  jobQueue.push_back(job);
+  pthread_cond_signal(&jobAvailable);
+  pthread_mutex_unlock(&poolMutex);
+  return job;
+}
+
+
+void WorkerPool::workerFunction()
+{
+  // Note: cancellation is only enabled while running a job's routine, so a worker is never
+  //   cancelled while holding poolMutex or while waiting for jobs.
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  pthread_mutex_lock(&poolMutex);
+  while (true) {
+    while (jobQueue.empty()) {
+      idleWorkers++;
+      pthread_cond_wait(&jobAvailable, &poolMutex);
+      idleWorkers--;
+    }
+    WorkerJobPtr job = jobQueue.front();
+    jobQueue.pop_front();
+    job->state = jobRunning;
+    job->worker = pthread_self();
+    pthread_mutex_unlock(&poolMutex);
+    // run the job
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    job->routine();
+    pthread_testcancel(); // act on cancellation requested while routine was running without reaching a cancellation point
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&poolMutex);
+    if (job->cancelRequested) {
+      // cancel() has already called pthread_cancel() for this thread and waits for us to terminate
+      pthread_mutex_unlock(&poolMutex);
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+      pthread_testcancel(); // does not return
     }
+    job->state = jobDone;
+    // Note: the job cannot be deleted before the completion we post now is delivered
+    job->mainLoopP->post(boost::bind(&WorkerPool::jobCompleted, this, job));
+  }
+}
+
+
+void WorkerPool::jobCompleted(WorkerJobPtr aJob)
+{
+  if (aJob->state==jobDone && aJob->completedCB) {
+    aJob->completedCB();
+  }
+  delete aJob;
+}
+
+
+void WorkerPool::cancel(WorkerJobPtr aJob)
+{
+  if (!aJob) return;
+  pthread_mutex_lock(&poolMutex);
+  if (aJob->state==jobQueued) {
+    // not yet started, just forget it
+    jobQueue.remove(aJob);
+    pthread_mutex_unlock(&poolMutex);
+    delete aJob;
+  }
+  else if (aJob->state==jobRunning) {
+    // cancel the worker running it
+    aJob->cancelRequested = true;
+    pthread_t worker = aJob->worker;
+    pthread_cancel(worker);
+    pthread_mutex_unlock(&poolMutex);
+    pthread_join(worker, NULL);
+    LOG(LOG_DEBUG, "WorkerPool: cancelled running job, worker thread terminated\n");
+    delete aJob;
+    // replace the worker if needed
+    pthread_mutex_lock(&poolMutex);
+    for (WorkerVector::iterator pos = workers.begin(); pos!=workers.end(); ++pos) {
+      if (pthread_equal(*pos, worker)) {
+        workers.erase(pos);
+        break;
+      }
+    }
+    if (idleWorkers<jobQueue.size() && workers.size()<maxWorkers) {
+      startWorker();
+    }
+    pthread_mutex_unlock(&poolMutex);
   }
   else {
-    // pipe could not be created
-    if (parentSignalHandler)
-      parentSignalHandler(*this, threadSignalFailedToStart);
+    // completion already posted, make sure it will not be delivered
+    aJob->state = jobAbandoned;
+    pthread_mutex_unlock(&poolMutex);
   }
 }
 
 
-ChildThreadWrapper::~ChildThreadWrapper()
+#pragma mark - MainLoopThread
+
+
+static void *mainloop_thread_start_function(void *arg)
 {
-  // cancel thread
-  cancel();
+  static_cast<MainLoopThread *>(arg)->threadFunction();
+  return NULL;
 }
 
 
+MainLoopThread::MainLoopThread() :
+  threadCreated(false),
+  threadMainLoopP(NULL),
+  runRequested(false),
+  stopRequested(false)
+{
+  pthread_mutex_init(&stateMutex, NULL);
+  pthread_cond_init(&stateChanged, NULL);
+  if (pthread_create(&thread, NULL, mainloop_thread_start_function, this)!=0) {
+    LOG(LOG_ERR, "MainLoopThread: cannot create thread, running on calling thread's mainloop instead: %s\n", strerror(errno));
+    return;
+  }
+  threadCreated = true;
+  // wait until the thread has created its mainloop
+  pthread_mutex_lock(&stateMutex);
+  while (threadMainLoopP==NULL) {
+    pthread_cond_wait(&stateChanged, &stateMutex);
+  }
+  pthread_mutex_unlock(&stateMutex);
+}
+
 
-// called from child thread when terminated
-void ChildThreadWrapper::terminated()
+MainLoopThread::~MainLoopThread()
 {
-  signalParentThread(threadSignalCompleted);
+  stop();
 }
 
 
+MainLoop &MainLoopThread::mainLoop()
+{
+  if (!threadCreated) return MainLoop::currentMainLoop();
+  return *threadMainLoopP;
+}
 
 
-// called from child thread to send signal
-void ChildThreadWrapper::signalParentThread(ThreadSignals aSignalCode)
+void MainLoopThread::threadFunction()
+{
+  MainLoop &ml = MainLoop::currentMainLoop(); // creates the thread's mainloop
+  pthread_mutex_lock(&stateMutex);
+  threadMainLoopP = &ml;
+  pthread_cond_broadcast(&stateChanged);
+  // wait until we may run
+  while (!runRequested && !stopRequested) {
+    pthread_cond_wait(&stateChanged, &stateMutex);
+  }
+  bool mayRun = !stopRequested;
+  pthread_mutex_unlock(&stateMutex);
+  if (mayRun) {
+    ml.run();
+  }
+}
+
+
+void MainLoopThread::start()
 {
-  uint8_t sigByte = aSignalCode;
-  write(childSignalFd, &sigByte, 1);
+  if (!threadCreated) return;
+  pthread_mutex_lock(&stateMutex);
+  runRequested = true;
+  pthread_cond_broadcast(&stateChanged);
+  pthread_mutex_unlock(&stateMutex);
 }
 
 
-// cleanup, called from parent thread
-void ChildThreadWrapper::finalizeThreadExecution()
+void MainLoopThread::stop()
 {
-  // synchronize with actual end of thread execution
-  pthread_join(pthread, NULL);
-  threadRunning = false;
-  // unregister the handler
-  MainLoop::currentMainLoop().unregisterPollHandler(parentSignalFd);
-  // close the pipes
-  close(childSignalFd);
-  close(parentSignalFd);
+  if (!threadCreated) return;
+  pthread_mutex_lock(&stateMutex);
+  stopRequested = true;
+  bool running = runRequested;
+  pthread_cond_broadcast(&stateChanged);
+  pthread_mutex_unlock(&stateMutex);
+  if (running) {
+    threadMainLoopP->post(boost::bind(&MainLoop::terminate, threadMainLoopP, EXIT_SUCCESS));
+  }
+  pthread_join(thread, NULL);
+  threadCreated = false;
 }
 
 
 
-// can be called from parent thread
-void ChildThreadWrapper::cancel()
+#pragma mark - ChildThreadWrapper
+
+
+ChildThreadWrapper::ChildThreadWrapper(MainLoop &aParentThreadMainLoop, ThreadRoutine aThreadRoutine, ThreadSignalHandler aThreadSignalHandler) :
+  parentThreadMainLoop(aParentThreadMainLoop),
+  threadRoutine(aThreadRoutine),
+  parentSignalHandler(aThreadSignalHandler),
+  job(NULL),
+  cancelled(false)
 {
-  if (threadRunning) {
-    // cancel it
-    pthread_cancel(pthread);
-    // wait for cancellation to complete
-    finalizeThreadExecution();
-    // cancelled
+  job = WorkerPool::sharedPool().submit(
+    boost::bind(&ChildThreadWrapper::startFunction, this),
+    boost::bind(&ChildThreadWrapper::jobCompleted, this)
+  );
+  if (!job) {
+    // could not run the thread routine, call back immediately
     if (parentSignalHandler)
-      parentSignalHandler(*this, threadSignalCancelled);
+      parentSignalHandler(*this, threadSignalFailedToStart);
+  }
+  else {
+    // keep wrapper object alive until thread routine has completed or was cancelled
+    selfRef = ChildThreadWrapperPtr(this);
   }
 }
 
 
+ChildThreadWrapper::~ChildThreadWrapper()
+{
+  // cancel thread
+  cancel();
+}
+
+
+// called on worker thread
+void ChildThreadWrapper::startFunction()
+{
+  threadRoutine(*this);
+}
+
+
+// called from child thread to send signal
+void ChildThreadWrapper::signalParentThread(ThreadSignals aSignalCode)
+{
+  parentThreadMainLoop.post(boost::bind(&ChildThreadWrapper::deliverSignal, this, aSignalCode));
+}
+
+
+// called on parent thread from Mainloop when the thread routine has returned
+void ChildThreadWrapper::jobCompleted()
+{
+  job = NULL;
+  deliverSignal(threadSignalCompleted);
+}
+
 
 // called on parent thread from Mainloop
-bool ChildThreadWrapper::signalPipeHandler(int aPollFlags)
+void ChildThreadWrapper::deliverSignal(ThreadSignals aSignalCode)
 {
-  ThreadSignals sig = threadSignalNone;
-  //DBGLOG(LOG_DEBUG, "\nMAINTHREAD: signalPipeHandler with pollFlags=0x%X\n", aPollFlags);
-  if (aPollFlags & POLLIN) {
-    uint8_t sigByte;
-    ssize_t res = read(parentSignalFd, &sigByte, 1); // read signal byte
-    if (res==1) {
-      sig = (ThreadSignals)sigByte;
-    }
-  }
-  else if (aPollFlags & POLLHUP) {
-    // HUP means thread has terminated and closed the other end of the pipe already
-    // - treat like receiving a threadSignalCompleted
-    sig = threadSignalCompleted;
+  if (cancelled) return; // signals sent before cancellation are no longer delivered
+  if (parentSignalHandler) {
+    parentSignalHandler(*this, aSignalCode);
   }
-  if (sig!=threadSignalNone) {
-    // check for thread terminated
-    if (sig==threadSignalCompleted) {
-      // finalize thread execution first
-      finalizeThreadExecution();
-    }
-    // got signal byte, call handler
-    if (parentSignalHandler) {
-      ML_STAT_START_AT(parentThreadMainLoop.now());
-      parentSignalHandler(*this, sig);
-      ML_STAT_ADD_AT(parentThreadMainLoop.threadSignalHandlerTime, parentThreadMainLoop.now());
-    }
+  if (aSignalCode==threadSignalCompleted) {
     // in case nobody keeps this object any more, it might be deleted now
     selfRef.reset();
-    // handled some i/O
-    return true;
   }
-  return false; // did not handle any I/O
 }
 
 
+// can be called from parent thread
+void ChildThreadWrapper::cancel()
+{
+  if (job) {
+    // cancel it and wait for cancellation to complete
+    WorkerPool::sharedPool().cancel(job);
+    job = NULL;
+    cancelled = true;
+    if (parentSignalHandler)
+      parentSignalHandler(*this, threadSignalCancelled);
+    // signals posted by the thread before it was cancelled may still be pending and refer to this object,
+    // so release it only after these
+    parentThreadMainLoop.post(boost::bind(&ChildThreadWrapper::releaseSelf, this));
+  }
+}
+
+
+void ChildThreadWrapper::releaseSelf()
+{
+  selfRef.reset();
+}
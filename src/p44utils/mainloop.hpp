@@ -36,9 +36,12 @@ namespace p44 {
 
   class MainLoop;
   class ChildThreadWrapper;
+  class WorkerPool;
+  class MainLoopThread;
 
   typedef boost::intrusive_ptr<MainLoop> MainLoopPtr;
   typedef boost::intrusive_ptr<ChildThreadWrapper> ChildThreadWrapperPtr;
+  typedef boost::intrusive_ptr<MainLoopThread> MainLoopThreadPtr;
 
   // Mainloop timing unit
   typedef long long MLMicroSeconds;
@@ -93,6 +96,10 @@ namespace p44 {
   /// @return should true if callback really handled some I/O, false if it only checked flags and found nothing to do
   typedef boost::function<bool (MLMicroSeconds aCycleStartTime, int aFD, int aPollFlags)> IOPollCB;
 
+  /// job in a WorkerPool, opaque handle returned by WorkerPool::submit()
+  struct WorkerJob;
+  typedef struct WorkerJob *WorkerJobPtr;
+
   /// thread routine, will be called on a separate thread
   /// @param aThreadWrapper the object that wraps the thread and allows sending signals to the parent thread
   ///   Use this pointer to call signalParentThread() on
@@ -120,6 +127,84 @@ namespace p44 {
   };
 
 
+  /// log-linear histogram for recording mainloop timing (durations, latencies) in microseconds
+  /// @note each power of two (octave) is divided into subBuckets linear sub-buckets,
+  ///   so relative resolution is constant (25%) over the entire range from 1uS to >1h
+  class MLHistogram
+  {
+  public:
+
+    enum {
+      subBucketBits = 2,
+      subBuckets = 1<<subBucketBits,
+      maxOctave = 32, // 2^32 uS = ~71 minutes, larger values are counted in the last bucket
+      numBuckets = subBuckets+(maxOctave-subBucketBits+1)*subBuckets
+    };
+
+    MLHistogram() { reset(); };
+
+    /// reset all counts
+    void reset();
+
+    /// add a value to the histogram
+    /// @param aValue the value to add (negative values are counted as 0)
+    void add(MLMicroSeconds aValue);
+
+    /// @return number of values recorded
+    uint64_t count() const { return total; };
+
+    /// @return sum of all values recorded
+    MLMicroSeconds sum() const { return valueSum; };
+
+    /// @return largest value recorded
+    MLMicroSeconds max() const { return maxValue; };
+
+    /// @return average value, 0 if none recorded
+    MLMicroSeconds mean() const { return total>0 ? valueSum/(MLMicroSeconds)total : 0; };
+
+    /// @param aPercent percentile to get, 0..100
+    /// @return upper limit of the bucket containing the given percentile (or max value if that is lower)
+    MLMicroSeconds percentile(double aPercent) const;
+
+    /// @param aBucketIndex bucket index 0..numBuckets-1
+    /// @return number of values recorded in that bucket
+    uint32_t bucketCount(int aBucketIndex) const { return buckets[aBucketIndex]; };
+
+    /// @param aBucketIndex bucket index 0..numBuckets-1
+    /// @return the smallest value counted in that bucket
+    static MLMicroSeconds bucketLowerLimit(int aBucketIndex);
+
+    /// @param aBucketIndex bucket index 0..numBuckets-1
+    /// @return the largest value counted in that bucket
+    static MLMicroSeconds bucketUpperLimit(int aBucketIndex);
+
+    /// @param aValue a value
+    /// @return index of the bucket this value is counted in
+    static int bucketIndexFor(MLMicroSeconds aValue);
+
+  private:
+
+    uint32_t buckets[numBuckets];
+    uint64_t total;
+    MLMicroSeconds valueSum;
+    MLMicroSeconds maxValue;
+
+  };
+
+
+  #if MAINLOOP_STATISTICS
+
+  /// runtime statistics for handlers registered with a tag
+  typedef struct {
+    long calls; ///< number of calls
+    MLMicroSeconds totalTime; ///< total runtime of all calls
+    MLMicroSeconds maxTime; ///< runtime of slowest call
+  } MLHandlerStats;
+  typedef std::map<const char *, MLHandlerStats> MLHandlerStatsMap;
+
+  #endif // MAINLOOP_STATISTICS
+
+
   class MainLoop;
 
   class FdStringCollector;
@@ -143,6 +228,7 @@ namespace p44 {
       long ticketNo;
       MLMicroSeconds executionTime;
       OneTimeCB callback;
+      const char *tag;
     } OnetimeHandler;
     typedef std::list<OnetimeHandler> OnetimeHandlerList;
 
@@ -161,11 +247,21 @@ namespace p44 {
       int monitoredFD;
       int pollFlags;
       IOPollCB pollHandler;
+      const char *tag;
     } IOPollHandler;
     typedef std::map<int, IOPollHandler> IOPollHandlerMap;
 
     IOPollHandlerMap ioPollHandlers;
 
+    typedef struct PostedCall {
+      struct PostedCall *next;
+      SimpleCB callback;
+    } PostedCall;
+
+    PostedCall * volatile postedCalls; ///< calls posted from any thread, lock-free list in LIFO order
+    int postSignalFd; ///< eventfd (or reading end of a pipe) signalling posted calls to this mainloop
+    int postWakeFd; ///< fd to write to for waking up this mainloop (same as postSignalFd for eventfd)
+
     long ticketNo;
 
   protected:
@@ -185,6 +281,10 @@ namespace p44 {
     MLMicroSeconds oneTimeHandlerTime;
     MLMicroSeconds waitHandlerTime;
     MLMicroSeconds threadSignalHandlerTime;
+    MLHistogram cycleDurations; ///< duration of complete mainloop cycles
+    MLHistogram timerLatenesses; ///< actual minus scheduled execution time of one-time handlers
+    MLHistogram handlerRuntimes; ///< runtime of individual one-time and I/O handler calls
+    MLHandlerStatsMap handlerStats; ///< per-tag runtime statistics
     #endif
 
 
@@ -226,14 +326,18 @@ namespace p44 {
     /// have handler called from the mainloop once with an optional delay from now
     /// @param aCallback the functor to be called
     /// @param aExecutionTime when to execute (approximately), in now() timescale
+    /// @param aTag if set, runtime of the handler is accounted under this tag in the statistics.
+    ///   Must be a string constant (tags are identified by pointer, not by content)
     /// @return ticket number which can be used to cancel this specific execution request
-    long executeOnceAt(OneTimeCB aCallback, MLMicroSeconds aExecutionTime);
+    long executeOnceAt(OneTimeCB aCallback, MLMicroSeconds aExecutionTime, const char *aTag = NULL);
 
     /// have handler called from the mainloop once with an optional delay from now
     /// @param aCallback the functor to be called
     /// @param aDelay delay from now when to execute (approximately)
+    /// @param aTag if set, runtime of the handler is accounted under this tag in the statistics.
+    ///   Must be a string constant (tags are identified by pointer, not by content)
     /// @return ticket number which can be used to cancel this specific execution request
-    long executeOnce(OneTimeCB aCallback, MLMicroSeconds aDelay = 0);
+    long executeOnce(OneTimeCB aCallback, MLMicroSeconds aDelay = 0, const char *aTag = NULL);
 
     /// cancel pending execution by ticket number
     /// @param aTicketNo ticket of execution to cancel. Will be set to 0 on return
@@ -271,6 +375,18 @@ namespace p44 {
     /// @param aPipeBackStdOut if true, stdout of the child is collected via a pipe by the parent and passed back in aCallBack
     void fork_and_system(ExecCB aCallback, const char *aCommandLine, bool aPipeBackStdOut = false);
 
+    /// start external binary or interpreter script in a separate process, without waiting for it
+    /// @param aPath the path to the binary or script
+    /// @param aArgv a NULL terminated array of arguments, first should be program name
+    /// @param aEnvp a NULL terminated array of environment variables, or NULL to let child inherit parent's environment
+    /// @param aStdInFd if >=0, this file descriptor becomes the child's stdin
+    /// @param aStdOutFd if >=0, this file descriptor becomes the child's stdout
+    /// @param aError set when the process could not be started
+    /// @return pid of the new process, -1 on error
+    /// @note uses posix_spawn(), so the child does not get a copy of our (possibly large) address space. All file
+    ///   descriptors except stdin/out/err are closed in the child, and signal handling is reset to defaults.
+    static pid_t spawn(const char *aPath, char *const aArgv[], char *const aEnvp[], int aStdInFd, int aStdOutFd, ErrorPtr &aError);
+
 
     /// have handler called when a specific process delivers a state change
     /// @param aCallback the functor to be called when given process delivers a state change, NULL to remove callback
@@ -287,7 +403,9 @@ namespace p44 {
     /// @param aFD the file descriptor to poll
     /// @param aPollFlags POLLxxx flags to specify events we want a callback for
     /// @param aFdEventCB the functor to be called when poll() reports an event for one of the flags set in aPollFlags
-    void registerPollHandler(int aFD, int aPollFlags, IOPollCB aPollEventHandler);
+    /// @param aTag if set, runtime of the handler is accounted under this tag in the statistics.
+    ///   Must be a string constant (tags are identified by pointer, not by content)
+    void registerPollHandler(int aFD, int aPollFlags, IOPollCB aPollEventHandler, const char *aTag = NULL);
 
     /// change the poll flags for an already registered handler
     /// @param aFD the file descriptor
@@ -305,7 +423,7 @@ namespace p44 {
     /// @name run handler in separate thread
     /// @{
 
-    /// execute handler in a separate thread
+    /// execute handler in a separate thread (a worker thread of WorkerPool::sharedPool())
     /// @param aThreadRoutine the routine to be executed in a separate thread
     /// @param aThreadSignalHandler will be called from main loop of parent thread when child thread uses signalParentThread()
     /// @return wrapper object for child thread.
@@ -314,6 +432,20 @@ namespace p44 {
     /// @}
 
 
+    /// @name calls from other threads
+    /// @{
+
+    /// have handler called from this mainloop as soon as possible.
+    /// @param aCallback the functor to be called on this mainloop's thread. Calls are executed in the order they were posted.
+    /// @note this is the only MainLoop method that may be called from any thread.
+    /// @note when called from another thread, aCallback is copied and destroyed on both threads. Smart pointers in it
+    ///   are safe (reference counting is atomic), but the objects they point to must not be in use by the posting
+    ///   thread any more, unless these objects are thread safe themselves.
+    void post(SimpleCB aCallback);
+
+    /// @}
+
+
     /// terminate the mainloop
     /// @param aExitCode the code to return from run()
     void terminate(int aExitCode);
@@ -328,6 +460,36 @@ namespace p44 {
     /// reset statistics
     void statistics_reset();
 
+    #if MAINLOOP_STATISTICS
+
+    /// @name access to statistics data
+    /// @{
+
+    /// @return time since last statistics_reset()
+    MLMicroSeconds statisticsPeriod() { return now()-statisticsStartTime; };
+
+    /// @return number of mainloop cycles since last statistics_reset()
+    long statisticsCycleCount() { return statisticsCycles; };
+
+    /// @return max number of one-time handlers waiting since last statistics_reset()
+    size_t maxWaitingOneTimeHandlers() { return maxOneTimeHandlers; };
+
+    /// @return histogram of mainloop cycle durations
+    const MLHistogram &cycleDurationHistogram() { return cycleDurations; };
+
+    /// @return histogram of one-time handler lateness (actual minus scheduled execution time)
+    const MLHistogram &timerLatenessHistogram() { return timerLatenesses; };
+
+    /// @return histogram of individual one-time and I/O handler runtimes
+    const MLHistogram &handlerRuntimeHistogram() { return handlerRuntimes; };
+
+    /// @return runtime statistics per handler tag (untagged handlers are accounted under "untagged")
+    const MLHandlerStatsMap &taggedHandlerStats() { return handlerStats; };
+
+    /// @}
+
+    #endif // MAINLOOP_STATISTICS
+
 
   protected:
 
@@ -336,30 +498,137 @@ namespace p44 {
     bool runIdleHandlers();
     bool checkWait();
     bool handleIOPoll(MLMicroSeconds aTimeout);
+    #if MAINLOOP_STATISTICS
+    void recordHandlerRuntime(const char *aTag, MLMicroSeconds aRuntime);
+    #endif
 
   private:
 
     void execChildTerminated(ExecCB aCallback, FdStringCollectorPtr aAnswerCollector, pid_t aPid, int aStatus);
     void childAnswerCollected(ExecCB aCallback, FdStringCollectorPtr aAnswerCollector, ErrorPtr aError);
     void IOPollHandlerForFd(int aFD, IOPollHandler &h);
+    bool postSignalHandler(int aPollFlags);
+    bool runPostedCalls();
 
   };
 
 
 
-  class ChildThreadWrapper : public P44Obj
+  /// Pool of worker threads for running blocking code (e.g. network or hardware access) outside the mainloop.
+  /// Worker threads are started on demand up to a fixed maximum and then kept running. When all workers are busy,
+  /// jobs are queued and run in submit order. Completion is reported by MainLoop::post() to the submitter's mainloop.
+  /// @note jobs should not run forever, as this permanently occupies a worker.
+  class WorkerPool
+  {
+    pthread_mutex_t poolMutex; ///< protects everything below
+    pthread_cond_t jobAvailable; ///< signalled when a job is queued
+
+    typedef std::list<WorkerJobPtr> JobQueue;
+    JobQueue jobQueue; ///< jobs waiting for a worker
+    typedef std::vector<pthread_t> WorkerVector;
+    WorkerVector workers; ///< running worker threads
+    size_t idleWorkers; ///< number of workers waiting for jobs
+    size_t maxWorkers; ///< max number of worker threads
+
+  public:
+
+    /// create worker pool
+    /// @param aMaxWorkers max number of worker threads
+    WorkerPool(size_t aMaxWorkers);
+
+    /// @return the process wide shared worker pool
+    static WorkerPool &sharedPool();
+
+    /// set max number of worker threads
+    /// @param aMaxWorkers max number of worker threads. Lowering the number does not stop already running workers.
+    void setMaxWorkers(size_t aMaxWorkers);
+
+    /// submit a job
+    /// @param aJobRoutine the routine to run on a worker thread. Must only access objects not used by other threads meanwhile.
+    /// @param aCompletedCB called on the submitting thread's mainloop after aJobRoutine has returned
+    /// @return job handle, which is valid until aCompletedCB is called or cancel() returns.
+    ///   NULL if the job could not be run because no worker thread could be started.
+    WorkerJobPtr submit(SimpleCB aJobRoutine, SimpleCB aCompletedCB);
+
+    /// cancel a job. aCompletedCB of the job will not be called after this.
+    /// @param aJob handle as returned by submit()
+    /// @note a job already running is cancelled with pthread_cancel() at its next cancellation point, and this method
+    ///   waits for that to happen. The worker thread that was running the job is replaced.
+    void cancel(WorkerJobPtr aJob);
+
+    /// @return number of worker threads currently running
+    size_t numWorkers();
+
+    /// @return number of jobs waiting for a worker
+    size_t numQueuedJobs();
+
+    /// method called from the worker threads
+    void workerFunction();
+
+  private:
+
+    bool startWorker();
+    void jobCompleted(WorkerJobPtr aJob);
+
+  };
+
+
+
+
+  /// A thread running its own MainLoop
+  /// The thread and its mainloop are created right away, but the mainloop only starts running with start().
+  /// Until then, the creating thread may set up objects using mainLoop() (e.g. create an OperationQueue on it).
+  /// After start(), these objects belong to the new thread, and other threads may only access them via mainLoop().post().
+  class MainLoopThread : public P44Obj
   {
     typedef P44Obj inherited;
 
-    pthread_t pthread; ///< the pthread
-    bool threadRunning; ///< set if thread is active
+    pthread_t thread;
+    bool threadCreated; ///< set if thread could be created
+    pthread_mutex_t stateMutex; ///< protects the following state
+    pthread_cond_t stateChanged;
+    MainLoop *threadMainLoopP; ///< the thread's mainloop, NULL until thread has created it
+    bool runRequested; ///< set to let the thread run its mainloop
+    bool stopRequested; ///< set to prevent the thread from running its mainloop
+
+  public:
+
+    /// create the thread and its mainloop (but do not run it yet)
+    MainLoopThread();
+
+    /// destructor, stops the thread
+    virtual ~MainLoopThread();
+
+    /// @return the thread's mainloop. If the thread could not be created, this is the calling thread's mainloop,
+    ///   so objects using it will still work (just not on a separate thread).
+    MainLoop &mainLoop();
+
+    /// start running the thread's mainloop
+    void start();
+
+    /// terminate the thread's mainloop and wait for the thread to end
+    /// @note objects set up on this thread must not be used any more after this
+    void stop();
+
+    /// method called from the thread
+    void threadFunction();
+
+  };
+
+
+
+  /// wrapper for running a thread routine on the shared WorkerPool and signalling the parent thread
+  class ChildThreadWrapper : public P44Obj
+  {
+    typedef P44Obj inherited;
 
     MainLoop &parentThreadMainLoop; ///< the parent mainloop which created this thread
-    int childSignalFd; ///< the pipe used to transmit signals from the child thread
-    int parentSignalFd; ///< the pipe monitored by parentThreadMainLoop to get signals from child
 
-    ThreadSignalHandler parentSignalHandler; ///< the handler to call to deliver signals to the main thread
     ThreadRoutine threadRoutine; ///< the actual thread routine to run
+    ThreadSignalHandler parentSignalHandler; ///< the handler to call to deliver signals to the main thread
+
+    WorkerJobPtr job; ///< the worker pool job running the thread routine, NULL if not running
+    bool cancelled; ///< set when cancelled, suppresses delivery of signals still pending
 
     ChildThreadWrapperPtr selfRef;
 
@@ -387,18 +656,14 @@ namespace p44 {
     /// cancel execution and wait for cancellation to complete
     void cancel();
 
-    /// confirm termination
-    void terminated();
-
     /// @}
 
-    /// method called from thread_start_function from this child thread
-    void *startFunction();
-
   private:
 
-    bool signalPipeHandler(int aPollFlags);
-    void finalizeThreadExecution();
+    void startFunction();
+    void jobCompleted();
+    void deliverSignal(ThreadSignals aSignalCode);
+    void releaseSelf();
 
   };
 
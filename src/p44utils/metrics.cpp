@@ -0,0 +1,282 @@
+//
+//  Copyright (c) 2013-2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "metrics.hpp"
+
+using namespace p44;
+
+
+#define MAX_REQUEST_SIZE 4096
+
+
+#pragma mark - Metric
+
+
+Metric::Metric(const char *aName, const char *aLabels, const char *aHelp) :
+  name(nonNullCStr(aName)),
+  labels(nonNullCStr(aLabels)),
+  help(nonNullCStr(aHelp))
+{
+}
+
+
+string Metric::sampleName(const char *aSuffix, const char *aExtraLabel)
+{
+  string s = name;
+  if (aSuffix) s += aSuffix;
+  if (!labels.empty() || aExtraLabel) {
+    s += "{";
+    s += labels;
+    if (aExtraLabel) {
+      if (!labels.empty()) s += ",";
+      s += aExtraLabel;
+    }
+    s += "}";
+  }
+  return s;
+}
+
+
+void MetricCounter::appendSamples(string &aText)
+{
+  string_format_append(aText, "%s %llu\n", sampleName(NULL).c_str(), (unsigned long long)get());
+}
+
+
+static inline double bitsToDouble(uint64_t aBits)
+{
+  double d;
+  memcpy(&d, &aBits, sizeof(d));
+  return d;
+}
+
+static inline uint64_t doubleToBits(double aDouble)
+{
+  uint64_t b;
+  memcpy(&b, &aDouble, sizeof(b));
+  return b;
+}
+
+
+double MetricGauge::get()
+{
+  return bitsToDouble(__sync_add_and_fetch(&valueBits, 0));
+}
+
+
+void MetricGauge::set(double aValue)
+{
+  __sync_lock_test_and_set(&valueBits, doubleToBits(aValue));
+}
+
+
+void MetricGauge::inc(double aBy)
+{
+  uint64_t old = __sync_add_and_fetch(&valueBits, 0);
+  while (true) {
+    uint64_t seen = __sync_val_compare_and_swap(&valueBits, old, doubleToBits(bitsToDouble(old)+aBy));
+    if (seen==old) break;
+    old = seen; // changed by another thread meanwhile, retry
+  }
+}
+
+
+void MetricGauge::appendSamples(string &aText)
+{
+  string_format_append(aText, "%s %.15g\n", sampleName(NULL).c_str(), get());
+}
+
+
+// exported bucket boundaries: 2^minBucketOctave uS (~64uS) .. 2^maxBucketOctave uS (~67S)
+static const int minBucketOctave = 6;
+static const int maxBucketOctave = 26;
+
+void MetricHistogram::appendSamples(string &aText)
+{
+  // cumulative counts at octave boundaries
+  uint64_t cnt = 0;
+  int bi = 0;
+  for (int o=minBucketOctave; o<=maxBucketOctave; o++) {
+    MLMicroSeconds limit = ((MLMicroSeconds)1)<<o;
+    // sum all buckets entirely below the limit
+    while (bi<MLHistogram::numBuckets-1 && MLHistogram::bucketUpperLimit(bi)<limit) {
+      cnt += histogram.bucketCount(bi);
+      bi++;
+    }
+    string le = string_format("le=\"%.6g\"", (double)limit/Second);
+    string_format_append(aText, "%s %llu\n", sampleName("_bucket", le.c_str()).c_str(), (unsigned long long)cnt);
+  }
+  string_format_append(aText, "%s %llu\n", sampleName("_bucket", "le=\"+Inf\"").c_str(), (unsigned long long)histogram.count());
+  string_format_append(aText, "%s %.6f\n", sampleName("_sum").c_str(), (double)histogram.sum()/Second);
+  string_format_append(aText, "%s %llu\n", sampleName("_count").c_str(), (unsigned long long)histogram.count());
+}
+
+
+#pragma mark - Metrics registry
+
+
+Metrics &Metrics::sharedMetrics()
+{
+  static Metrics *sharedMetricsP = NULL;
+  if (sharedMetricsP==NULL) {
+    sharedMetricsP = new Metrics();
+  }
+  return *sharedMetricsP;
+}
+
+
+MetricPtr Metrics::registerMetric(MetricPtr aMetric)
+{
+  // key sorts by name first, so metrics with the same name but different labels are grouped
+  string key = aMetric->name + "{" + aMetric->labels;
+  MetricsMap::iterator pos = metrics.find(key);
+  if (pos!=metrics.end()) {
+    if (pos->second->type()==aMetric->type()) return pos->second; // already registered, share it
+    LOG(LOG_ERR, "Metrics: '%s' already registered with different type\n", aMetric->name.c_str());
+    return aMetric; // unregistered, but usable
+  }
+  metrics[key] = aMetric;
+  return aMetric;
+}
+
+
+MetricCounterPtr Metrics::counter(const char *aName, const char *aHelp, const char *aLabels)
+{
+  return boost::static_pointer_cast<MetricCounter>(sharedMetrics().registerMetric(MetricPtr(new MetricCounter(aName, aLabels, aHelp))));
+}
+
+
+MetricGaugePtr Metrics::gauge(const char *aName, const char *aHelp, const char *aLabels)
+{
+  return boost::static_pointer_cast<MetricGauge>(sharedMetrics().registerMetric(MetricPtr(new MetricGauge(aName, aLabels, aHelp))));
+}
+
+
+MetricHistogramPtr Metrics::histogram(const char *aName, const char *aHelp, const char *aLabels)
+{
+  return boost::static_pointer_cast<MetricHistogram>(sharedMetrics().registerMetric(MetricPtr(new MetricHistogram(aName, aLabels, aHelp))));
+}
+
+
+string Metrics::prometheusText()
+{
+  static const char *typeNames[] = { "counter", "gauge", "histogram" };
+  string text;
+  string lastName;
+  for (MetricsMap::iterator pos = metrics.begin(); pos!=metrics.end(); ++pos) {
+    MetricPtr m = pos->second;
+    if (m->name!=lastName) {
+      // HELP and TYPE once per metric name
+      string_format_append(text, "# HELP %s %s\n", m->name.c_str(), m->help.c_str());
+      string_format_append(text, "# TYPE %s %s\n", m->name.c_str(), typeNames[m->type()]);
+      lastName = m->name;
+    }
+    m->appendSamples(text);
+  }
+  return text;
+}
+
+
+#pragma mark - MetricsConnection
+
+
+MetricsConnection::MetricsConnection(MainLoop &aMainLoop) :
+  inherited(aMainLoop)
+{
+  setReceiveHandler(boost::bind(&MetricsConnection::gotData, this, _1));
+}
+
+
+void MetricsConnection::gotData(ErrorPtr aError)
+{
+  MetricsConnectionPtr keepMeAlive(this); // make sure this object lives until routine terminates
+  if (Error::isOK(aError)) {
+    aError = receiveAndAppendToString(requestBuffer);
+  }
+  if (!Error::isOK(aError)) {
+    LOG(LOG_DEBUG, "Metrics connection: receive error: %s\n", aError->description().c_str());
+    closeConnection();
+    return;
+  }
+  if (requestBuffer.size()>MAX_REQUEST_SIZE) {
+    answer(413, "Request Entity Too Large", "text/plain", "");
+    return;
+  }
+  // wait for end of request header
+  if (requestBuffer.find("\r\n\r\n")==string::npos && requestBuffer.find("\n\n")==string::npos) return;
+  setReceiveHandler(NULL); // one request per connection
+  // request line: GET <path> HTTP/1.x
+  size_t e = requestBuffer.find_first_of("\r\n");
+  string requestLine = requestBuffer.substr(0, e);
+  string method, path;
+  size_t p = requestLine.find(' ');
+  if (p!=string::npos) {
+    method = requestLine.substr(0, p);
+    size_t p2 = requestLine.find(' ', p+1);
+    path = requestLine.substr(p+1, p2==string::npos ? string::npos : p2-p-1);
+  }
+  if (method!="GET") {
+    answer(405, "Method Not Allowed", "text/plain", "");
+  }
+  else if (path!="/metrics" && path!="/") {
+    answer(404, "Not Found", "text/plain", "");
+  }
+  else {
+    answer(200, "OK", "text/plain; version=0.0.4", Metrics::sharedMetrics().prometheusText());
+  }
+}
+
+
+void MetricsConnection::answer(int aStatus, const char *aStatusText, const string &aContentType, const string &aBody)
+{
+  transmitBuffer = string_format(
+    "HTTP/1.0 %d %s\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Length: %d\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    aStatus, aStatusText,
+    aContentType.c_str(),
+    (int)aBody.size()
+  );
+  transmitBuffer += aBody;
+  // send as much as possible now, rest when socket is ready again
+  setTransmitHandler(boost::bind(&MetricsConnection::canSendData, this, _1));
+  canSendData(ErrorPtr());
+}
+
+
+void MetricsConnection::canSendData(ErrorPtr aError)
+{
+  MetricsConnectionPtr keepMeAlive(this); // make sure this object lives until routine terminates
+  size_t bytesToSend = transmitBuffer.size();
+  if (bytesToSend>0 && Error::isOK(aError)) {
+    size_t sentBytes = transmitBytes(bytesToSend, (const uint8_t *)transmitBuffer.c_str(), aError);
+    if (Error::isOK(aError)) {
+      transmitBuffer.erase(0, sentBytes);
+    }
+  }
+  if (!Error::isOK(aError) || transmitBuffer.size()==0) {
+    // all sent (or failed), done with this connection
+    setTransmitHandler(NULL);
+    closeConnection();
+  }
+}
@@ -0,0 +1,237 @@
+//
+//  Copyright (c) 2013-2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__metrics__
+#define __p44utils__metrics__
+
+#include "socketcomm.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  /// @name metrics
+  /// Counters, gauges and histograms for observing the daemon from the outside.
+  /// Metrics are registered once (usually when the owning object is constructed) and the resulting
+  /// object pointer is kept, so updating a metric is just a member increment/assignment.
+  /// @note counters and gauges can be updated from any thread (atomic operations, no locking). Histograms
+  ///   must only be updated from the main thread, and metrics must be registered and exported on the main thread.
+  /// @{
+
+  typedef enum {
+    metrictype_counter,
+    metrictype_gauge,
+    metrictype_histogram
+  } MetricType;
+
+
+  class Metric : public P44Obj
+  {
+    friend class Metrics;
+
+    string name;
+    string labels;
+    string help;
+
+  protected:
+
+    Metric(const char *aName, const char *aLabels, const char *aHelp);
+
+  public:
+
+    /// @return type of this metric
+    virtual MetricType type() = 0;
+
+    /// append sample lines in Prometheus text exposition format
+    /// @param aText string to append to
+    virtual void appendSamples(string &aText) = 0;
+
+  protected:
+
+    /// @param aSuffix suffix to append to the metric name (e.g. "_bucket")
+    /// @param aExtraLabel additional label (such as le="0.5") to include, can be NULL
+    /// @return sample name including labels
+    string sampleName(const char *aSuffix, const char *aExtraLabel = NULL);
+
+  };
+  typedef boost::intrusive_ptr<Metric> MetricPtr;
+
+
+  /// monotonically increasing counter
+  class MetricCounter : public Metric
+  {
+    typedef Metric inherited;
+    friend class Metrics;
+
+    uint64_t value;
+
+    MetricCounter(const char *aName, const char *aLabels, const char *aHelp) : inherited(aName, aLabels, aHelp), value(0) {};
+
+  public:
+
+    /// increment the counter
+    /// @param aBy increment
+    void inc(uint64_t aBy = 1) { __sync_add_and_fetch(&value, aBy); };
+
+    /// @return current value
+    uint64_t get() { return __sync_add_and_fetch(&value, 0); };
+
+    virtual MetricType type() { return metrictype_counter; };
+    virtual void appendSamples(string &aText);
+
+  };
+  typedef boost::intrusive_ptr<MetricCounter> MetricCounterPtr;
+
+
+  /// value that can go up and down
+  class MetricGauge : public Metric
+  {
+    typedef Metric inherited;
+    friend class Metrics;
+
+    uint64_t valueBits; ///< the double value's bits, so it can be updated atomically from any thread
+
+    MetricGauge(const char *aName, const char *aLabels, const char *aHelp) : inherited(aName, aLabels, aHelp), valueBits(0) {};
+
+  public:
+
+    /// set the gauge
+    /// @param aValue new value
+    void set(double aValue);
+
+    /// increment the gauge
+    /// @param aBy increment
+    void inc(double aBy = 1);
+
+    /// decrement the gauge
+    /// @param aBy decrement
+    void dec(double aBy = 1) { inc(-aBy); };
+
+    /// @return current value
+    double get();
+
+    virtual MetricType type() { return metrictype_gauge; };
+    virtual void appendSamples(string &aText);
+
+  };
+  typedef boost::intrusive_ptr<MetricGauge> MetricGaugePtr;
+
+
+  /// distribution of durations, exported in seconds with one bucket per power of two
+  class MetricHistogram : public Metric
+  {
+    typedef Metric inherited;
+    friend class Metrics;
+
+    MLHistogram histogram;
+
+    MetricHistogram(const char *aName, const char *aLabels, const char *aHelp) : inherited(aName, aLabels, aHelp) {};
+
+  public:
+
+    /// record an observation
+    /// @param aDuration the observed duration
+    void observe(MLMicroSeconds aDuration) { histogram.add(aDuration); };
+
+    virtual MetricType type() { return metrictype_histogram; };
+    virtual void appendSamples(string &aText);
+
+  };
+  typedef boost::intrusive_ptr<MetricHistogram> MetricHistogramPtr;
+
+
+  /// registry of all metrics of the process
+  class Metrics
+  {
+    typedef std::map<string, MetricPtr> MetricsMap;
+
+    MetricsMap metrics;
+
+    Metrics() {};
+
+  public:
+
+    /// @return the process-wide metrics registry
+    static Metrics &sharedMetrics();
+
+    /// get (create if not yet existing) a counter
+    /// @param aName metric name, should follow Prometheus naming conventions (e.g. vdcd_dali_frames_total)
+    /// @param aHelp help text (used when metric is created)
+    /// @param aLabels optional label set in Prometheus syntax without braces (e.g. bus="1")
+    /// @return the counter
+    /// @note if a metric of different type with same name and labels exists, a new unregistered
+    ///   metric is returned (so callers never need to check for NULL)
+    static MetricCounterPtr counter(const char *aName, const char *aHelp, const char *aLabels = NULL);
+
+    /// get (create if not yet existing) a gauge
+    /// @param aName metric name
+    /// @param aHelp help text (used when metric is created)
+    /// @param aLabels optional label set in Prometheus syntax without braces
+    /// @return the gauge
+    static MetricGaugePtr gauge(const char *aName, const char *aHelp, const char *aLabels = NULL);
+
+    /// get (create if not yet existing) a histogram
+    /// @param aName metric name (should end in _seconds)
+    /// @param aHelp help text (used when metric is created)
+    /// @param aLabels optional label set in Prometheus syntax without braces
+    /// @return the histogram
+    static MetricHistogramPtr histogram(const char *aName, const char *aHelp, const char *aLabels = NULL);
+
+    /// @return all metrics in Prometheus text exposition format (version 0.0.4)
+    string prometheusText();
+
+  private:
+
+    MetricPtr registerMetric(MetricPtr aMetric);
+
+  };
+
+  /// @}
+
+
+  class MetricsConnection;
+  typedef boost::intrusive_ptr<MetricsConnection> MetricsConnectionPtr;
+
+  /// minimal HTTP server connection answering GET requests with the current metrics
+  /// in Prometheus text format. Rendering is done in one go from in-memory values, transmission
+  /// is non-blocking (handled by the mainloop as the socket accepts more data).
+  class MetricsConnection : public SocketComm
+  {
+    typedef SocketComm inherited;
+
+    string requestBuffer;
+    string transmitBuffer;
+
+  public:
+
+    MetricsConnection(MainLoop &aMainLoop);
+
+  private:
+
+    void gotData(ErrorPtr aError);
+    void answer(int aStatus, const char *aStatusText, const string &aContentType, const string &aBody);
+    void canSendData(ErrorPtr aError);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44utils__metrics__) */
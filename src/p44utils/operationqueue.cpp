@@ -31,7 +31,8 @@ Operation::Operation() :
   timesOutAt(0), // no timeout time set
   initiationDelay(0), // no initiation delay
   initiatesNotBefore(0), // no initiation time
-  inSequence(true) // by default, execute in sequence
+  inSequence(true), // by default, execute in sequence
+  traceId(Trace::current()) // belongs to the request being processed while creating it
 {
 }
 
@@ -115,7 +116,9 @@ bool Operation::hasTimedOutAt(MLMicroSeconds aRefTime)
 
 // create operation queue into specified mainloop
 OperationQueue::OperationQueue(MainLoop &aMainLoop) :
-  mainLoop(aMainLoop)
+  mainLoop(aMainLoop),
+  ownerMainLoop(MainLoop::currentMainLoop()),
+  traceLabel("queue")
 {
   // register with mainloop
   mainLoop.registerIdleHandler(this, boost::bind(&OperationQueue::idleHandler, this));
@@ -130,9 +133,28 @@ OperationQueue::~OperationQueue()
 }
 
 
+void OperationQueue::callOnQueueThread(SimpleCB aCallback)
+{
+  if (runsOnOwnThread())
+    mainLoop.post(aCallback);
+  else
+    aCallback();
+}
+
+
+void OperationQueue::callOnOwnerThread(SimpleCB aCallback)
+{
+  if (runsOnOwnThread())
+    ownerMainLoop.post(aCallback);
+  else
+    aCallback();
+}
+
+
 // queue a new operation
 void OperationQueue::queueOperation(OperationPtr aOperation)
 {
+  TRACE_EVENT(aOperation->traceId, traceLabel, "queued", NULL);
   operationQueue.push_back(aOperation);
 }
 
@@ -161,6 +183,8 @@ bool OperationQueue::idleHandler()
         // remove from list
         operationQueue.erase(pos);
         // abort with timeout
+        TRACE_EVENT(op->traceId, traceLabel, "timed out", NULL);
+        TraceContext tc(op->traceId);
         op->abortOperation(ErrorPtr(new OQError(OQErrorTimedOut)));
         // restart with start of (modified) queue
         pleaseCallAgainSoon = true;
@@ -176,6 +200,9 @@ bool OperationQueue::idleHandler()
             break;
           }
         }
+        else {
+          TRACE_EVENT(op->traceId, traceLabel, "initiated", NULL);
+        }
       }
       if (op->isInitiated()) {
         // initiated, check if already completed
@@ -183,7 +210,10 @@ bool OperationQueue::idleHandler()
           // operation has completed
           // - remove from list
           OperationList::iterator nextPos = operationQueue.erase(pos);
+          TRACE_EVENT(op->traceId, traceLabel, "completed", NULL);
           // - finalize. This might push new operations in front or back of the queue
+          //   Operations created and callbacks called from finalize belong to the same trace
+          TraceContext tc(op->traceId);
           OperationPtr nextOp = op->finalize(this);
           if (nextOp) {
             operationQueue.insert(nextPos, nextOp);
@@ -23,6 +23,7 @@
 #define __p44utils__operationqueue__
 
 #include "p44_common.hpp"
+#include "tracing.hpp"
 
 
 using namespace std;
@@ -64,6 +65,8 @@ namespace p44 {
   public:
     /// if this flag is set, no operation queued after this operation will execute
     bool inSequence;
+    /// the trace this operation belongs to (captured from Trace::current() at construction), 0 if none
+    TraceId traceId;
     /// constructor
     Operation();
     /// set delay for initiation (after first attempt to initiate)
@@ -96,18 +99,30 @@ namespace p44 {
 
   /// Operation queue
   typedef boost::intrusive_ptr<OperationQueue> OperationQueuePtr;
+  /// @note an operation queue can run on another thread's mainloop than the one of the thread creating it (the owner).
+  ///   In this case, the queue and everything it does belongs to that other thread, and subclasses must use
+  ///   callOnQueueThread() and callOnOwnerThread() to pass requests and results between the threads.
   class OperationQueue : public P44Obj
   {
     MainLoop &mainLoop;
+    MainLoop &ownerMainLoop; ///< mainloop of the thread which created the queue
   protected:
     typedef list<OperationPtr> OperationList;
     OperationList operationQueue;
+    /// category used for trace events of operations in this queue (e.g. "dali")
+    const char *traceLabel;
   public:
     /// create operation queue linked into specified mainloop
+    /// @param aMainLoop the mainloop to run the queue. If this is not the mainloop of the calling thread, aMainLoop's
+    ///   thread must not be running yet (see MainLoopThread)
     OperationQueue(MainLoop &aMainLoop);
     /// destructor
+    /// @note a queue running on another thread must only be destroyed after that thread has terminated
     virtual ~OperationQueue();
 
+    /// @return true if the queue runs on another thread than the thread which has created it
+    bool runsOnOwnThread() { return &mainLoop!=&ownerMainLoop; };
+
     /// queue a new operation
     /// @param aOperation the operation to queue
     void queueOperation(OperationPtr aOperation);
@@ -117,7 +132,17 @@ namespace p44 {
 
     /// abort all pending operations
     void abortOperations();
-    
+
+  protected:
+
+    /// have a call executed on the thread running the queue
+    /// @param aCallback to be called on the queue's thread. Called directly when queue is not running on its own thread.
+    void callOnQueueThread(SimpleCB aCallback);
+
+    /// have a call executed on the thread which created the queue
+    /// @param aCallback to be called on the owner's thread. Called directly when queue is not running on its own thread.
+    void callOnOwnerThread(SimpleCB aCallback);
+
   private:
     /// handler which is registered with mainloop
     /// @return true if operations processed for now, i.e. no need to call again immediately
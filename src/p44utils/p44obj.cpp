@@ -26,14 +26,17 @@ using namespace p44;
 
 namespace p44 {
 
+  // Note: reference counting is atomic, so smart pointers can be passed between threads (e.g. with MainLoop::post()).
+  //   This does NOT make the objects themselves thread safe.
+
   void intrusive_ptr_add_ref(P44Obj* o)
   {
-    ++(o->refCount);
+    __sync_add_and_fetch(&o->refCount, 1);
   }
 
   void intrusive_ptr_release(P44Obj* o)
   {
-    if(--(o->refCount) == 0)
+    if(__sync_sub_and_fetch(&o->refCount, 1) == 0)
       delete o;
   }
 
@@ -28,9 +28,26 @@
 
 #include "persistentparams.hpp"
 
+#include "metrics.hpp"
+
 using namespace p44;
 
 
+// metrics are shared by all PersistentParams instances
+static MetricCounterPtr rowsWrittenMetric;
+static MetricCounterPtr writeErrorsMetric;
+static MetricHistogramPtr writeTimeMetric;
+
+static void initMetrics()
+{
+  if (!rowsWrittenMetric) {
+    rowsWrittenMetric = Metrics::counter("vdcd_persistence_rows_written_total", "parameter rows written to the SQLite store");
+    writeErrorsMetric = Metrics::counter("vdcd_persistence_write_errors_total", "failed parameter row writes");
+    writeTimeMetric = Metrics::histogram("vdcd_persistence_write_duration_seconds", "time to write a single parameter row");
+  }
+}
+
+
 PersistentParams::PersistentParams(ParamStore &aParamStore) :
   paramStore(aParamStore),
   dirty(false),
@@ -227,7 +244,12 @@ void PersistentParams::bindToStatement(sqlite3pp::statement &aStatement, int &aI
 ErrorPtr PersistentParams::saveToStore(const char *aParentIdentifier, bool aMultipleChildrenAllowed)
 {
   ErrorPtr err;
+  // save own row and children in one transaction if needed
+  bool inTransaction = dirty && saveInTransaction() && paramStore.executef("BEGIN")==SQLITE_OK;
+  uint64_t previousRowid = rowid;
   if (dirty) {
+    initMetrics();
+    MLMicroSeconds writeStart = MainLoop::now();
     sqlite3pp::command cmd(paramStore);
     string sql;
     // cleanup: remove all previous records for that parent if not multiple children allowed
@@ -314,12 +336,28 @@ ErrorPtr PersistentParams::saveToStore(const char *aParentIdentifier, bool aMult
     }
     if (!Error::isOK(err)) {
       LOG(LOG_ERR, "saveToStore: %s - failed: %s\n", sql.c_str(), err->description().c_str());
+      writeErrorsMetric->inc();
     }
+    else {
+      rowsWrittenMetric->inc();
+    }
+    writeTimeMetric->observe(MainLoop::now()-writeStart);
   }
   // anyway, have children checked
   if (Error::isOK(err)) {
     err = saveChildren();
   }
+  if (inTransaction) {
+    if (Error::isOK(err) && paramStore.executef("COMMIT")!=SQLITE_OK) {
+      err = paramStore.error();
+    }
+    if (!Error::isOK(err)) {
+      // nothing of this save is in the DB, so try again next time
+      paramStore.executef("ROLLBACK");
+      rowid = previousRowid;
+      dirty = true;
+    }
+  }
   return err;
 }
 
@@ -106,11 +106,21 @@ namespace p44 {
     /// delete child parameters (if any)
     virtual ErrorPtr deleteChildren() { return ErrorPtr(); };
 
+    /// @return true if own row and child parameters must be saved in a single transaction
+    /// @note subclasses that move data between their own row and child rows must return true,
+    ///   so an interrupted save cannot leave both or none of the copies in the DB
+    virtual bool saveInTransaction() { return false; };
+
     /// @}
 
     /// mark the parameter set dirty (so it will be saved to DB next time saveToStore is called
     virtual void markDirty();
 
+    /// mark the parameter set clean
+    /// @note only to be used when the values have been persisted by other means than saveToStore(),
+    ///   e.g. as part of a parent's record
+    void markClean() { dirty = false; }
+
     /// @return true if needs to be saved
     bool isDirty() { return dirty; }
 
@@ -21,6 +21,8 @@
 
 #include "serialcomm.hpp"
 
+#include "simhardware.hpp"
+
 #include <sys/ioctl.h>
 
 using namespace p44;
@@ -60,6 +62,10 @@ void SerialComm::setConnectionSpecification(const char* aConnectionSpec, uint16_
         sscanf(opt.c_str(), "%d", &aDefaultBaudRate);
       }
     }
+    else if (strncmp(aConnectionSpec, "sim.", 4)==0) {
+      // simulated serial line
+      path = aConnectionSpec;
+    }
     else {
       // IP host
       splitHost(aConnectionSpec, &path, &aDefaultPort);
@@ -84,7 +90,6 @@ ErrorPtr SerialComm::establishConnection()
   if (!connectionOpen) {
     // Open connection to bridge
     connectionFd = 0;
-    int res;
     struct termios newtio;
     serialConnection = connectionPath[0]=='/';
     // check type of input
@@ -139,25 +144,46 @@ ErrorPtr SerialComm::establishConnection()
       tcflush(connectionFd, TCIFLUSH);
       tcsetattr(connectionFd,TCSANOW,&newtio);
     }
+    else if (connectionPath.substr(0,4)=="sim.") {
+      // simulated serial line: loopback to whoever else opens the same name
+      ErrorPtr err;
+      connectionFd = SimHardware::sharedSimHardware().openSerial(connectionPath.substr(4), err);
+      if (connectionFd<0) {
+        return err;
+      }
+    }
     else {
       // assume it's an IP address or hostname
-      struct sockaddr_in conn_addr;
-      if ((connectionFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return SysError::errNo("Cannot create socket: ");
+      // - connect without blocking: SocketComm resolves the name and connects in the background, and
+      //   we fail for now (proxyConnectionStatusHandler() or background retry will take over the socket later)
+      if (!proxyConnection) {
+        proxyConnection = SocketCommPtr(new SocketComm(mainLoop));
+        proxyConnection->setConnectionParams(connectionPath.c_str(), string_format("%d", connectionPort).c_str(), SOCK_STREAM, AF_INET);
+        proxyConnection->setConnectionStatusHandler(boost::bind(&SerialComm::proxyConnectionStatusHandler, this, _2));
       }
-      // prepare IP address
-      memset(&conn_addr, '0', sizeof(conn_addr));
-      conn_addr.sin_family = AF_INET;
-      conn_addr.sin_port = htons(connectionPort);
-      struct hostent *server;
-      server = gethostbyname(connectionPath.c_str());
-      if (server == NULL) {
-        return ErrorPtr(new SerialCommError(SerialCommErrorInvalidHost));
+      if (!proxyConnection->connected()) {
+        if (proxyError) {
+          // last attempt has failed, report it (next call will try again)
+          ErrorPtr err = proxyError;
+          proxyError.reset();
+          return err;
+        }
+        ErrorPtr err = proxyConnection->initiateConnection();
+        if (!Error::isOK(err)) {
+          return err;
+        }
+        return ErrorPtr(new SerialCommError(SerialCommErrorConnecting, string_format("connection to %s:%d in progress", connectionPath.c_str(), connectionPort)));
       }
-      memcpy((char *)&conn_addr.sin_addr.s_addr, (char *)server->h_addr, server->h_length);
-      if ((res = connect(connectionFd, (struct sockaddr *)&conn_addr, sizeof(conn_addr))) < 0) {
-        return SysError::errNo("Cannot open socket: ");
+      // - take over the connected socket, SocketComm closing its copy does not shut down the connection
+      connectionFd = dup(proxyConnection->getFd());
+      proxyConnection->setConnectionStatusHandler(NULL);
+      proxyConnection->closeConnection();
+      proxyConnection.reset();
+      if (connectionFd<0) {
+        return SysError::errNo("Cannot take over proxy connection: ");
       }
+      // - SocketComm connects non-blocking, but serial connections are operated blocking
+      fcntl(connectionFd, F_SETFL, fcntl(connectionFd, F_GETFL) & ~O_NONBLOCK);
     }
     // successfully opened
     connectionOpen = true;
@@ -176,7 +202,7 @@ bool SerialComm::requestConnection()
     if (!reconnecting) {
       LOG(LOG_ERR, "SerialComm: requestConnection() could not open connection now: %s -> entering background retry mode\n", err->description().c_str());
       reconnecting = true;
-      MainLoop::currentMainLoop().executeOnce(boost::bind(&SerialComm::reconnectHandler, this), 5*Second);
+      mainLoop.executeOnce(boost::bind(&SerialComm::reconnectHandler, this), 5*Second);
     }
     return false;
   }
@@ -189,6 +215,13 @@ bool SerialComm::requestConnection()
 void SerialComm::closeConnection()
 {
   reconnecting = false; // explicit close, don't try to reconnect any more
+  if (proxyConnection) {
+    // abort connecting to the proxy
+    proxyConnection->setConnectionStatusHandler(NULL);
+    proxyConnection->closeConnection();
+    proxyConnection.reset();
+  }
+  proxyError.reset();
   if (connectionOpen) {
 		// stop monitoring
 		setFd(-1);
@@ -196,6 +229,10 @@ void SerialComm::closeConnection()
     if (serialConnection) {
       tcsetattr(connectionFd,TCSANOW,&oldTermIO);
     }
+    else if (connectionPath.substr(0,4)=="sim.") {
+      // make sure a reopen creates a new line instead of getting the other end of this one
+      SimHardware::sharedSimHardware().closeSerial(connectionPath.substr(4), connectionFd);
+    }
     // close
     close(connectionFd);
     // closed
@@ -252,7 +289,7 @@ void SerialComm::reconnectHandler()
     if (!Error::isOK(err)) {
       LOG(LOG_ERR, "SerialComm: re-connect failed: %s -> retry again later\n", err->description().c_str());
       reconnecting = true;
-      MainLoop::currentMainLoop().executeOnce(boost::bind(&SerialComm::reconnectHandler, this), 15*Second);
+      mainLoop.executeOnce(boost::bind(&SerialComm::reconnectHandler, this), 15*Second);
     }
     else {
       LOG(LOG_NOTICE, "SerialComm: successfully reconnected to %s\n", connectionPath.c_str());
@@ -261,3 +298,27 @@ void SerialComm::reconnectHandler()
 }
 
 
+void SerialComm::proxyConnectionStatusHandler(ErrorPtr aError)
+{
+  if (Error::isOK(aError)) {
+    // proxy connection established, take it over now rather than at the next retry or transmission
+    // Note: not from within the handler, SocketComm is still setting up the connection
+    mainLoop.executeOnce(boost::bind(&SerialComm::proxyConnected, this));
+  }
+  else {
+    proxyError = aError;
+  }
+}
+
+
+void SerialComm::proxyConnected()
+{
+  if (!proxyConnection) return; // closed meanwhile
+  ErrorPtr err = establishConnection();
+  if (Error::isOK(err)) {
+    LOG(LOG_NOTICE, "SerialComm: connected to %s:%d\n", connectionPath.c_str(), connectionPort);
+  }
+  else {
+    LOG(LOG_ERR, "SerialComm: cannot take over connection to %s:%d: %s\n", connectionPath.c_str(), connectionPort, err->description().c_str());
+  }
+}
@@ -25,6 +25,7 @@
 #include "p44_common.hpp"
 
 #include "fdcomm.hpp"
+#include "socketcomm.hpp"
 
 // unix I/O and network
 #include <sys/types.h>
@@ -54,6 +55,7 @@ namespace p44 {
     SerialCommErrorOK,
     SerialCommErrorInvalidHost,
     SerialCommErrorUnknownBaudrate,
+    SerialCommErrorConnecting, ///< connection to TCP proxy is not yet established
   } SerialCommErrors;
 
   class SerialCommError : public Error
@@ -84,6 +86,8 @@ namespace p44 {
     struct termios oldTermIO;
     bool serialConnection;
     bool reconnecting;
+    SocketCommPtr proxyConnection; ///< TCP proxy connection while it is being established
+    ErrorPtr proxyError; ///< failure of the last attempt to connect to the TCP proxy, reported by next establishConnection()
 
   public:
 
@@ -91,7 +95,8 @@ namespace p44 {
     virtual ~SerialComm();
 
     /// Specify the serial connection parameters as single string
-    /// @param aConnectionSpec "/dev[:baudrate]" or "hostname[:port]"
+    /// @param aConnectionSpec "/dev[:baudrate]", "hostname[:port]" or "sim.<name>" for a simulated serial line
+    ///   connected to the other party opening the same name (see SimHardware::openSerial())
     /// @param aDefaultPort default port number for TCP connection (irrelevant for direct serial device connection)
     /// @param aDefaultBaudRate default baud rate for serial connection (irrelevant for TCP connection)
     void setConnectionSpecification(const char* aConnectionSpec, uint16_t aDefaultPort, int aDefaultBaudRate);
@@ -104,7 +109,8 @@ namespace p44 {
 
     /// establish the serial connection
     /// @note can be called multiple times, opens connection only if not already open
-    /// @return error in case connection cannot be opened
+    /// @return error in case connection cannot be opened. For TCP proxies, this is SerialCommErrorConnecting
+    ///   while the connection is established in the background; it is taken over as soon as it is connected.
     ErrorPtr establishConnection();
 
     /// tries to establish the connection, and will retry if opening fails right now
@@ -127,6 +133,8 @@ namespace p44 {
   private:
 
     void reconnectHandler();
+    void proxyConnectionStatusHandler(ErrorPtr aError);
+    void proxyConnected();
 
   };
 
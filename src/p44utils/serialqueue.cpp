@@ -49,6 +49,12 @@ void SerialOperation::setTransmitter(SerialOperationTransmitter aTransmitter)
   transmitter = aTransmitter;
 }
 
+// set transmitter readiness check
+void SerialOperation::setTransmitReady(SerialOperationTransmitReady aTransmitReady)
+{
+  transmitReady = aTransmitReady;
+}
+
 
 // call to deliver received bytes
 size_t SerialOperation::acceptBytes(size_t aNumBytes, uint8_t *aBytes)
@@ -136,6 +142,8 @@ void SerialOperationSend::appendData(size_t aNumBytes, uint8_t *aBytes)
 bool SerialOperationSend::initiate()
 {
   if (!canInitiate()) return false;
+  // don't send before the transmitter is ready, operation stays queued until then
+  if (transmitReady && !transmitReady()) return false;
   FOCUSLOG("SerialOperationSend::initiate: sending %d bytes now\n", dataSize);
   size_t res;
   if (dataP && transmitter) {
@@ -302,6 +310,7 @@ void SerialOperationQueue::receiveHandler(ErrorPtr aError)
 void SerialOperationQueue::queueSerialOperation(SerialOperationPtr aOperation)
 {
   aOperation->setTransmitter(transmitter);
+  aOperation->setTransmitReady(boost::bind(&SerialOperationQueue::transmitReady, this));
   inherited::queueOperation(aOperation);
 }
 
@@ -372,6 +381,16 @@ size_t SerialOperationQueue::standardTransmitter(size_t aNumBytes, const uint8_t
 
 
 
+bool SerialOperationQueue::transmitReady()
+{
+  // make sure the connection gets opened, but postpone sending while a TCP proxy connection is still being
+  // established in the background (operations are initiated when the queue is processed next after connecting)
+  ErrorPtr err = serialComm->establishConnection();
+  return !Error::isError(err, SerialCommError::domain(), SerialCommErrorConnecting);
+}
+
+
+
 size_t SerialOperationQueue::standardReceiver(size_t aMaxBytes, uint8_t *aBytes)
 {
   FOCUSLOG("SerialOperationQueue::standardReceiver(%d bytes) called\n", aMaxBytes);
@@ -65,6 +65,10 @@ namespace p44 {
   /// SerialOperation transmitter
   typedef boost::function<size_t (size_t aNumBytes, const uint8_t *aBytes)> SerialOperationTransmitter;
 
+  /// SerialOperation transmitter readiness check
+  /// @return false if transmitting must be postponed (e.g. connection still being established)
+  typedef boost::function<bool ()> SerialOperationTransmitReady;
+
 
   /// Serial operation
   class SerialOperation : public Operation
@@ -72,6 +76,7 @@ namespace p44 {
     friend class SerialOperationSendAndReceive;
   protected:
     SerialOperationTransmitter transmitter;
+    SerialOperationTransmitReady transmitReady;
     SerialOperationFinalizeCB callback;
   public:
     /// constructor
@@ -80,6 +85,9 @@ namespace p44 {
     /// set transmitter
     void setTransmitter(SerialOperationTransmitter aTransmitter);
 
+    /// set transmitter readiness check
+    void setTransmitReady(SerialOperationTransmitReady aTransmitReady);
+
     /// call to deliver received bytes
     /// @param aNumBytes number of bytes ready for accepting
     /// @param aBytes pointer to bytes buffer
@@ -191,6 +199,12 @@ namespace p44 {
     /// @param aOperation the serial IO operation to queue
     void queueSerialOperation(SerialOperationPtr aOperation);
 
+  protected:
+    /// check if sending operations can be initiated now
+    /// @return false while the connection is still being established in the background (operations
+    ///   must stay queued until then), true otherwise (even if the connection has failed, so sending reports it)
+    bool transmitReady();
+
   private:
     /// base class implementation: deliver bytes to the most recent waiting operation
     virtual size_t acceptBytes(size_t aNumBytes, uint8_t *aBytes);
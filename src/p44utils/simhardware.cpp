@@ -0,0 +1,228 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// File scope debugging options
+// - Set ALWAYS_DEBUG to 1 to enable DBGLOG output even in non-DEBUG builds of this file
+#define ALWAYS_DEBUG 0
+// - set FOCUSLOGLEVEL to non-zero log level (usually, 5,6, or 7==LOG_DEBUG) to get focus (extensive logging) for this file
+//   Note: must be before including "logger.hpp" (or anything that includes "logger.hpp")
+#define FOCUSLOGLEVEL 0
+
+#include "simhardware.hpp"
+
+#include <sys/socket.h>
+
+using namespace p44;
+
+
+#pragma mark - SimInterface
+
+SimInterface::SimInterface(const char *aName) :
+  name(aName)
+{
+  string label = string_format("interface=\"%s\"", aName);
+  transactionsMetric = Metrics::counter("vdcd_simio_transactions_total", "transactions on simulated hardware interfaces", label.c_str());
+  bytesMetric = Metrics::counter("vdcd_simio_bytes_total", "data bytes transferred on simulated hardware interfaces", label.c_str());
+  busyMetric = Metrics::counter("vdcd_simio_busy_microseconds_total", "time spent in simulated hardware accesses", label.c_str());
+}
+
+
+MLMicroSeconds SimInterface::transaction(int aBytes)
+{
+  MLMicroSeconds start = MainLoop::now();
+  MLMicroSeconds latency = SimHardware::sharedSimHardware().latencyFor(aBytes);
+  if (latency>0) usleep((useconds_t)latency);
+  MLMicroSeconds t = MainLoop::now()-start;
+  transactionsMetric->inc();
+  if (aBytes>0) bytesMetric->inc(aBytes);
+  busyMetric->inc(t);
+  FOCUSLOG("SimInterface '%s': %d bytes, %lld uS\n", name.c_str(), aBytes, t);
+  return t;
+}
+
+
+#pragma mark - SimHardware
+
+SimHardware::SimHardware() :
+  transactionLatency(0),
+  byteLatency(0)
+{
+  pthread_mutex_init(&mapMutex, NULL);
+}
+
+
+SimHardware &SimHardware::sharedSimHardware()
+{
+  static SimHardware simHardware;
+  return simHardware;
+}
+
+
+void SimHardware::setLatency(MLMicroSeconds aPerTransaction, MLMicroSeconds aPerByte)
+{
+  transactionLatency = aPerTransaction;
+  byteLatency = aPerByte;
+  LOG(LOG_NOTICE, "Simulated hardware: %lld uS per transaction, %lld uS per byte\n", aPerTransaction, aPerByte);
+}
+
+
+SimInterfacePtr SimHardware::getInterface(const string &aName)
+{
+  pthread_mutex_lock(&mapMutex);
+  SimInterfacePtr iface;
+  SimInterfaceMap::iterator pos = interfaces.find(aName);
+  if (pos!=interfaces.end()) {
+    iface = pos->second;
+  }
+  else {
+    iface = SimInterfacePtr(new SimInterface(aName.c_str()));
+    interfaces[aName] = iface;
+  }
+  pthread_mutex_unlock(&mapMutex);
+  return iface;
+}
+
+
+bool SimHardware::getPinState(const string &aName)
+{
+  return getPinValue(aName)!=0;
+}
+
+
+void SimHardware::setPinState(const string &aName, bool aState)
+{
+  setPinValue(aName, aState ? 1 : 0);
+}
+
+
+double SimHardware::getPinValue(const string &aName)
+{
+  double v = 0;
+  pthread_mutex_lock(&mapMutex);
+  PinValueMap::iterator pos = pinValues.find(aName);
+  if (pos!=pinValues.end()) v = pos->second;
+  pthread_mutex_unlock(&mapMutex);
+  return v;
+}
+
+
+void SimHardware::setPinValue(const string &aName, double aValue)
+{
+  pthread_mutex_lock(&mapMutex);
+  pinValues[aName] = aValue;
+  pthread_mutex_unlock(&mapMutex);
+}
+
+
+int SimHardware::openSerial(const string &aName, ErrorPtr &aError)
+{
+  int fd = -1;
+  pthread_mutex_lock(&mapMutex);
+  SerialLineMap::iterator pos = serialLines.find(aName);
+  if (pos!=serialLines.end()) {
+    // second party gets the other end
+    fd = pos->second.waitingFd;
+    serialLines.erase(pos);
+  }
+  else {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)<0) {
+      aError = SysError::errNo("SimHardware: cannot create serial line: ");
+    }
+    else {
+      SerialLine &line = serialLines[aName];
+      line.openedFd = fds[0];
+      line.waitingFd = fds[1];
+      fd = fds[0];
+      LOG(LOG_INFO, "Simulated serial line '%s' created\n", aName.c_str());
+    }
+  }
+  pthread_mutex_unlock(&mapMutex);
+  return fd;
+}
+
+
+void SimHardware::closeSerial(const string &aName, int aFd)
+{
+  pthread_mutex_lock(&mapMutex);
+  SerialLineMap::iterator pos = serialLines.find(aName);
+  if (pos!=serialLines.end() && pos->second.openedFd==aFd) {
+    // first party closes before the second one opened: the line is dead, don't hand out its other end
+    close(pos->second.waitingFd);
+    serialLines.erase(pos);
+    LOG(LOG_INFO, "Simulated serial line '%s' removed\n", aName.c_str());
+  }
+  pthread_mutex_unlock(&mapMutex);
+}
+
+
+#pragma mark - SimGpioPin
+
+SimGpioPin::SimGpioPin(const char *aName, bool aOutput, bool aInitialState) :
+  name(aName),
+  output(aOutput)
+{
+  simInterface = SimHardware::sharedSimHardware().getInterface("gpio");
+  SimHardware::sharedSimHardware().setPinState(name, aInitialState);
+  LOG(LOG_INFO, "Initialized simulated GPIO \"%s\" as %s with initial state %s\n", name.c_str(), aOutput ? "output" : "input", aInitialState ? "HI" : "LO");
+}
+
+
+bool SimGpioPin::getState()
+{
+  simInterface->transaction(1);
+  return SimHardware::sharedSimHardware().getPinState(name);
+}
+
+
+void SimGpioPin::setState(bool aState)
+{
+  if (!output) return; // non-outputs cannot be set
+  simInterface->transaction(1);
+  SimHardware::sharedSimHardware().setPinState(name, aState);
+}
+
+
+#pragma mark - SimAnalogPin
+
+SimAnalogPin::SimAnalogPin(const char *aName, bool aOutput, double aInitialValue) :
+  name(aName),
+  output(aOutput)
+{
+  simInterface = SimHardware::sharedSimHardware().getInterface("analog");
+  SimHardware::sharedSimHardware().setPinValue(name, aInitialValue);
+  LOG(LOG_INFO, "Initialized simulated analog pin \"%s\" as %s with initial value %.2f\n", name.c_str(), aOutput ? "output" : "input", aInitialValue);
+}
+
+
+double SimAnalogPin::getValue()
+{
+  simInterface->transaction(2);
+  return SimHardware::sharedSimHardware().getPinValue(name);
+}
+
+
+void SimAnalogPin::setValue(double aValue)
+{
+  if (!output) return; // non-outputs cannot be set
+  simInterface->transaction(2);
+  SimHardware::sharedSimHardware().setPinValue(name, aValue);
+}
@@ -0,0 +1,197 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__simhardware__
+#define __p44utils__simhardware__
+
+#include "p44_common.hpp"
+
+#include "iopin.hpp"
+#include "metrics.hpp"
+
+#include <pthread.h>
+
+using namespace std;
+
+namespace p44 {
+
+  /// one simulated hardware interface (a GPIO pin, an I2C bus...), which takes the configured time per
+  /// access and counts accesses in metrics labelled with the interface name
+  class SimInterface : public P44Obj
+  {
+    friend class SimHardware;
+
+    string name;
+    MetricCounterPtr transactionsMetric;
+    MetricCounterPtr bytesMetric;
+    MetricCounterPtr busyMetric;
+
+    SimInterface(const char *aName);
+
+  public:
+
+    /// @return name of the interface
+    const string &getName() { return name; };
+
+    /// perform a simulated transaction: blocks for the configured latency, like the real hardware access would
+    /// @param aBytes number of data bytes transferred
+    /// @return time spent
+    MLMicroSeconds transaction(int aBytes);
+
+  };
+  typedef boost::intrusive_ptr<SimInterface> SimInterfacePtr;
+
+
+  /// Hardware-free backends for GPIO, I2C and serial interfaces, selected by prefixing the pin or
+  /// connection specification with "sim." (see DigitalIo, AnalogIo and SerialComm)
+  /// @note can be used from comm threads, accesses to the interface, pin and serial line maps are serialized
+  class SimHardware
+  {
+    MLMicroSeconds transactionLatency;
+    MLMicroSeconds byteLatency;
+
+    pthread_mutex_t mapMutex; ///< protects the maps below
+
+    typedef std::map<string, SimInterfacePtr> SimInterfaceMap;
+    SimInterfaceMap interfaces;
+
+    typedef std::map<string, double> PinValueMap;
+    PinValueMap pinValues;
+
+    typedef struct {
+      int openedFd; ///< end returned to the first party
+      int waitingFd; ///< end waiting for the second party to open
+    } SerialLine;
+    typedef std::map<string, SerialLine> SerialLineMap;
+    SerialLineMap serialLines; ///< loopback pairs waiting for the second party to open
+
+    SimHardware();
+
+  public:
+
+    /// @return the process-wide simulated hardware
+    static SimHardware &sharedSimHardware();
+
+    /// set the time simulated hardware accesses take
+    /// @param aPerTransaction time per transaction (syscall, bus arbitration, addressing...)
+    /// @param aPerByte additional time per data byte (e.g. 90uS for one byte on a 100kHz I2C bus)
+    void setLatency(MLMicroSeconds aPerTransaction, MLMicroSeconds aPerByte);
+
+    /// @param aName name of the interface, used as label in the metrics
+    /// @return the interface (created on first use)
+    SimInterfacePtr getInterface(const string &aName);
+
+    /// @param aName name of a simulated GPIO pin
+    /// @return current state of the pin (as set by setPinState() for inputs, or by the output)
+    bool getPinState(const string &aName);
+
+    /// @param aName name of a simulated GPIO pin
+    /// @param aState new state (for an input: as sensed by the next read of the input)
+    void setPinState(const string &aName, bool aState);
+
+    /// @param aName name of a simulated analog pin
+    /// @return current value of the pin
+    double getPinValue(const string &aName);
+
+    /// @param aName name of a simulated analog pin
+    /// @param aValue new value (for an input: as sensed by the next read of the input)
+    void setPinValue(const string &aName, double aValue);
+
+    /// open one end of a simulated serial line
+    /// @param aName name of the line. The first opener gets one end, the second the other end of a loopback pair.
+    /// @param aError set when no line can be created
+    /// @return file descriptor to use like a serial port, or -1 on error
+    int openSerial(const string &aName, ErrorPtr &aError);
+
+    /// forget a simulated serial line end that is being closed
+    /// @param aName name of the line
+    /// @param aFd the file descriptor returned by openSerial(). When the second party has not opened the line yet,
+    ///   the waiting end is closed as well, so the next openSerial() creates a new line.
+    /// @note does not close aFd itself, this is up to the caller
+    void closeSerial(const string &aName, int aFd);
+
+  private:
+
+    MLMicroSeconds latencyFor(int aBytes) { return transactionLatency+aBytes*byteLatency; };
+    friend class SimInterface;
+
+  };
+
+
+  /// simulated GPIO or LED pin, without hardware and without console interaction (unlike SimPin),
+  /// for performance and regression tests. Accesses count as transactions of the "gpio" interface.
+  class SimGpioPin : public IOPin
+  {
+    typedef IOPin inherited;
+
+    string name;
+    bool output;
+    SimInterfacePtr simInterface;
+
+  public:
+
+    /// create simulated pin
+    /// @param aName name of the pin, under which tests can access the state via SimHardware
+    /// @param aOutput use as output
+    /// @param aInitialState initial state assumed for inputs and set for outputs
+    SimGpioPin(const char *aName, bool aOutput, bool aInitialState);
+
+    /// get state of pin
+    /// @return current state (simulated input state, or last set state for outputs)
+    virtual bool getState();
+
+    /// set state of pin (NOP for inputs)
+    /// @param aState new state to set output to
+    virtual void setState(bool aState);
+
+  };
+
+
+  /// simulated analog pin, without hardware and without console interaction (unlike AnalogSimPin)
+  class SimAnalogPin : public AnalogIOPin
+  {
+    typedef AnalogIOPin inherited;
+
+    string name;
+    bool output;
+    SimInterfacePtr simInterface;
+
+  public:
+
+    /// create simulated analog pin
+    /// @param aName name of the pin, under which tests can access the value via SimHardware
+    /// @param aOutput use as output
+    /// @param aInitialValue initial value assumed for inputs and set for outputs
+    SimAnalogPin(const char *aName, bool aOutput, double aInitialValue);
+
+    /// get value of pin
+    /// @return current value (simulated input value, or last set value for outputs)
+    virtual double getValue();
+
+    /// set value of pin (NOP for inputs)
+    /// @param aValue new value to set output to
+    virtual void setValue(double aValue);
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__p44utils__simhardware__) */
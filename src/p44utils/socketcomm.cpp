@@ -26,18 +26,22 @@
 
 using namespace p44;
 
+// delay before starting a parallel connection attempt to the next address when the previous attempt is still in progress
+#define CONNECTION_ATTEMPT_DELAY (250*MilliSecond)
+
 SocketComm::SocketComm(MainLoop &aMainLoop) :
   FdComm(aMainLoop),
-  connectionOpen(false),
+  connectionFd(-1),
+  nextAddress(0),
+  attemptTicket(0),
+  connectGeneration(0),
+  currentSockAddrP(NULL),
   isConnecting(false),
   isClosing(false),
+  connectionOpen(false),
   serving(false),
-  addressInfoList(NULL),
-  currentAddressInfo(NULL),
-  currentSockAddrP(NULL),
   maxServerConnections(1),
-  serverConnection(NULL),
-  connectionFd(-1)
+  serverConnection(NULL)
 {
 }
 
@@ -138,7 +142,8 @@ ErrorPtr SocketComm::startServer(ServerConnectionCB aServerConnectionHandler, in
       mainLoop.registerPollHandler(
         connectionFd,
         POLLIN,
-        boost::bind(&SocketComm::connectionAcceptHandler, this, _1, _2, _3)
+        boost::bind(&SocketComm::connectionAcceptHandler, this, _1, _2, _3),
+        "socket accept"
       );
     }
   }
@@ -253,37 +258,22 @@ bool SocketComm::connectable()
 
 ErrorPtr SocketComm::initiateConnection()
 {
-  int res;
   ErrorPtr err;
 
   if (!connectionOpen && !isConnecting && !serverConnection) {
-    freeAddressInfo();
     if (hostNameOrAddress.empty()) {
       err = ErrorPtr(new SocketCommError(SocketCommErrorNoParams,"Missing connection parameters"));
-      goto done;
     }
-    // try to resolve host name
-    struct addrinfo hint;
-    memset(&hint, 0, sizeof(addrinfo));
-    hint.ai_flags = 0; // no flags
-    hint.ai_family = protocolFamily;
-    hint.ai_socktype = socketType;
-    hint.ai_protocol = protocol;
-    res = getaddrinfo(hostNameOrAddress.c_str(), serviceOrPortNo.c_str(), &hint, &addressInfoList);
-    if (res!=0) {
-      // error
-      err = ErrorPtr(new SocketCommError(SocketCommErrorCannotResolve, string_format("getaddrinfo error %d: %s", res, gai_strerror(res))));
-      DBGLOG(LOG_DEBUG, "SocketComm: getaddrinfo failed: %s\n", err->description().c_str());
-      goto done;
+    else {
+      // resolve host name (asynchronously, unless numeric or cached)
+      LOG(LOG_DEBUG, "Initiating connection to %s:%s\n", hostNameOrAddress.c_str(), serviceOrPortNo.c_str());
+      isConnecting = true;
+      DnsResolver::sharedResolver().resolve(
+        hostNameOrAddress, serviceOrPortNo, protocolFamily, socketType, protocol,
+        boost::bind(&SocketComm::addressesResolved, this, SocketCommPtr(this), connectGeneration, _1, _2)
+      );
     }
-    // now try all addresses in the list
-    // - init iterator pointer
-    currentAddressInfo = addressInfoList;
-    // - try connecting first address
-    LOG(LOG_DEBUG, "Initiating connection to %s:%s\n", hostNameOrAddress.c_str(), serviceOrPortNo.c_str());
-    err = connectNextAddress();
   }
-done:
   if (!Error::isOK(err) && connectionStatusHandler) {
     connectionStatusHandler(this, err);
   }
@@ -292,12 +282,39 @@ done:
 }
 
 
-void SocketComm::freeAddressInfo()
+void SocketComm::addressesResolved(SocketCommPtr aKeepAlive, unsigned int aGeneration, ErrorPtr aError, const ResolvedAddressVector &aAddresses)
 {
-  if (!currentAddressInfo && addressInfoList) {
-    // entire list consumed, free it
-    freeaddrinfo(addressInfoList);
-    addressInfoList = NULL;
+  if (aGeneration!=connectGeneration || !isConnecting) {
+    // connection was closed or re-initiated in the meantime
+    return;
+  }
+  ErrorPtr err;
+  if (!Error::isOK(aError)) {
+    err = ErrorPtr(new SocketCommError(SocketCommErrorCannotResolve, aError->description()));
+    DBGLOG(LOG_DEBUG, "SocketComm: name resolution failed: %s\n", err->description().c_str());
+  }
+  else {
+    // order addresses for connecting, alternating between address families
+    // (first family as returned by resolver first, for happy eyeballs style connecting)
+    addresses.clear();
+    nextAddress = 0;
+    ResolvedAddressVector others;
+    for (ResolvedAddressVector::const_iterator pos = aAddresses.begin(); pos!=aAddresses.end(); ++pos) {
+      if (pos->family==aAddresses.front().family) addresses.push_back(*pos);
+      else others.push_back(*pos);
+    }
+    for (size_t i=0; i<others.size(); i++) {
+      addresses.insert(addresses.begin()+min(2*i+1, addresses.size()), others[i]);
+    }
+    // - try connecting first address
+    err = connectNextAddress();
+  }
+  if (!Error::isOK(err)) {
+    isConnecting = false;
+    addresses.clear();
+    if (connectionStatusHandler) {
+      connectionStatusHandler(this, err);
+    }
   }
 }
 
@@ -307,74 +324,34 @@ ErrorPtr SocketComm::connectNextAddress()
   int res;
   ErrorPtr err;
 
-  // close possibly not fully open connection FD
-  internalCloseConnection();
-  // try to create a socket
-  int socketFD = -1;
   // as long as we have more addresses to check and not already connecting
   bool startedConnecting = false;
-  while (currentAddressInfo && !startedConnecting) {
+  while (nextAddress<addresses.size() && !startedConnecting) {
+    const ResolvedAddress &ra = addresses[nextAddress++];
     err.reset();
-    socketFD = socket(currentAddressInfo->ai_family, currentAddressInfo->ai_socktype, currentAddressInfo->ai_protocol);
+    // try to create a socket
+    int socketFD = socket(ra.family, ra.sockType, ra.protocol);
     if (socketFD==-1) {
       err = SysError::errNo("Cannot create client socket: ");
+      continue;
     }
-    else {
-      // usable address found, socket created
-      // - make socket non-blocking
-      makeNonBlocking(socketFD);
-      // Now we have a socket
-      if (connectionLess) {
-        // UDP: no connect phase
-        startedConnecting = true;
-        // save valid address info for later use (UDP needs it to send datagrams)
-        if (currentSockAddrP)
-          free(currentSockAddrP);
-        currentSockAddrLen = currentAddressInfo->ai_addrlen;
-        currentSockAddrP = (sockaddr *)malloc(currentSockAddrLen);
-        memcpy(currentSockAddrP, currentAddressInfo->ai_addr, currentAddressInfo->ai_addrlen);
-      }
-      else {
-        // TCP: initiate connection
-        res = connect(socketFD, currentAddressInfo->ai_addr, currentAddressInfo->ai_addrlen);
-        LOG(LOG_DEBUG, "- Attempting connection with address family = %d, protocol = %d\n", currentAddressInfo->ai_family, currentAddressInfo->ai_protocol);
-        if (res==0 || errno==EINPROGRESS) {
-          // connection initiated (or already open, but connectionMonitorHandler will take care in both cases)
-          startedConnecting = true;
-        }
-        else {
-          // immediate error connecting
-          err = SysError::errNo("Cannot connect: ");
-        }
-      }
-    }
-    // advance to next address
-    currentAddressInfo = currentAddressInfo->ai_next;
-  }
-  if (!startedConnecting) {
-    // exhausted addresses without starting to connect
-    if (!err) err = ErrorPtr(new SocketCommError(SocketCommErrorNoConnection, "No connection could be established"));
-    LOG(LOG_DEBUG, "Cannot initiate connection to %s:%s\n", hostNameOrAddress.c_str(), serviceOrPortNo.c_str(), err->description().c_str());
-  }
-  else {
-    if (!connectionLess) {
-      // connection in progress
-      isConnecting = true;
-      // - save FD
-      connectionFd = socketFD;
-      // - install callback for when FD becomes writable (or errors out)
-      mainLoop.registerPollHandler(
-        connectionFd,
-        POLLOUT,
-        boost::bind(&SocketComm::connectionMonitorHandler, this, _1, _2, _3)
-      );
-    }
-    else {
-      // UDP socket successfully created
-      LOG(LOG_DEBUG, "Connectionless socket ready for address family = %d, protocol = %d\n", protocolFamily, protocol);
+    // usable address found, socket created
+    // - make socket non-blocking
+    makeNonBlocking(socketFD);
+    // Now we have a socket
+    if (connectionLess) {
+      // UDP: no connect phase
+      // - save valid address info for later use (UDP needs it to send datagrams)
+      if (currentSockAddrP)
+        free(currentSockAddrP);
+      currentSockAddrLen = ra.addrLen;
+      currentSockAddrP = (sockaddr *)malloc(currentSockAddrLen);
+      memcpy(currentSockAddrP, &ra.addr, ra.addrLen);
+      LOG(LOG_DEBUG, "Connectionless socket ready for address family = %d, protocol = %d\n", ra.family, ra.protocol);
       connectionOpen = true;
       isConnecting = false;
-      currentAddressInfo = NULL; // no more addresses to check
+      addresses.clear(); // no more addresses to check
+      connectionFd = socketFD;
       // immediately use socket for I/O
       setFd(socketFD);
       // call handler if defined
@@ -382,15 +359,70 @@ ErrorPtr SocketComm::connectNextAddress()
         // connection ok
         connectionStatusHandler(this, ErrorPtr());
       }
+      return ErrorPtr();
     }
+    // TCP: initiate connection
+    res = connect(socketFD, (const struct sockaddr *)&ra.addr, ra.addrLen);
+    LOG(LOG_DEBUG, "- Attempting connection with address family = %d, protocol = %d\n", ra.family, ra.protocol);
+    if (res==0 || errno==EINPROGRESS) {
+      // connection initiated (or already open, but connectionMonitorHandler will take care in both cases)
+      startedConnecting = true;
+      connectingFds.push_back(socketFD);
+      // - install callback for when FD becomes writable (or errors out)
+      mainLoop.registerPollHandler(
+        socketFD,
+        POLLOUT,
+        boost::bind(&SocketComm::connectionMonitorHandler, this, _1, _2, _3),
+        "socket connect"
+      );
+    }
+    else {
+      // immediate error connecting
+      err = SysError::errNo("Cannot connect: ");
+      close(socketFD);
+    }
+  }
+  if (startedConnecting) {
+    // if this attempt does not succeed quickly, start the next one in parallel
+    mainLoop.cancelExecutionTicket(attemptTicket);
+    if (nextAddress<addresses.size()) {
+      attemptTicket = mainLoop.executeOnce(boost::bind(&SocketComm::attemptTimeout, this), CONNECTION_ATTEMPT_DELAY);
+    }
+    return ErrorPtr();
+  }
+  if (!connectingFds.empty()) {
+    // no new attempt started, but others are still in progress
+    return ErrorPtr();
   }
-  // clean up if list processed
-  freeAddressInfo();
-  // return status
+  // exhausted addresses without starting to connect
+  if (!err) err = ErrorPtr(new SocketCommError(SocketCommErrorNoConnection, "No connection could be established"));
+  LOG(LOG_DEBUG, "Cannot initiate connection to %s:%s: %s\n", hostNameOrAddress.c_str(), serviceOrPortNo.c_str(), err->description().c_str());
   return err;
 }
 
 
+void SocketComm::attemptTimeout()
+{
+  attemptTicket = 0;
+  LOG(LOG_DEBUG, "- Connection attempt in progress for %lld mS, trying next address in parallel\n", CONNECTION_ATTEMPT_DELAY/MilliSecond);
+  // Note: cannot fail, as at least one attempt is still in progress
+  connectNextAddress();
+}
+
+
+void SocketComm::closeConnectionAttempts(int aExceptFd)
+{
+  mainLoop.cancelExecutionTicket(attemptTicket);
+  for (FdList::iterator pos = connectingFds.begin(); pos!=connectingFds.end(); ++pos) {
+    if (*pos!=aExceptFd) {
+      mainLoop.unregisterPollHandler(*pos);
+      close(*pos);
+    }
+  }
+  connectingFds.clear();
+}
+
+
 #pragma mark - general connection handling
 
 
@@ -427,10 +459,12 @@ bool SocketComm::connectionMonitorHandler(MLMicroSeconds aCycleStartTime, int aF
   // now check if successful
   if (Error::isOK(err)) {
     // successfully connected
+    // - abandon other attempts still in progress
+    closeConnectionAttempts(aFd);
+    connectionFd = aFd;
     connectionOpen = true;
     isConnecting = false;
-    currentAddressInfo = NULL; // no more addresses to check
-    freeAddressInfo();
+    addresses.clear(); // no more addresses to check
     LOG(LOG_DEBUG, "Connection to %s:%s established\n", hostNameOrAddress.c_str(), serviceOrPortNo.c_str());
     // call handler if defined
     if (connectionStatusHandler) {
@@ -443,15 +477,25 @@ bool SocketComm::connectionMonitorHandler(MLMicroSeconds aCycleStartTime, int aF
   else {
     // this attempt has failed, try next (if any)
     LOG(LOG_DEBUG, "- Connection attempt failed: %s\n", err->description().c_str());
-    // this will return no error if we have another address to try
+    connectingFds.remove(aFd);
+    mainLoop.unregisterPollHandler(aFd);
+    close(aFd);
+    // this will return no error if we have another address to try, or other attempts are still in progress
+    ErrorPtr attemptErr = err;
     err = connectNextAddress();
     if (err) {
+      if (err->isError(SocketCommError::domain(), SocketCommErrorNoConnection)) {
+        // report reason of the last attempt rather than just "no connection"
+        err = ErrorPtr(new SocketCommError(SocketCommErrorNoConnection, attemptErr->description()));
+      }
       // no next attempt started, report error
       LOG(LOG_WARNING, "Connection to %s:%s failed: %s\n", hostNameOrAddress.c_str(), serviceOrPortNo.c_str(), err->description().c_str());
+      SocketCommPtr keepMeAlive(this); // handler might release last reference
+      isConnecting = false;
+      addresses.clear();
       if (connectionStatusHandler) {
         connectionStatusHandler(this, err);
       }
-      freeAddressInfo();
       internalCloseConnection();
     }
   }
@@ -470,7 +514,11 @@ void SocketComm::setConnectionStatusHandler(SocketCommCB aConnectedHandler)
 
 void SocketComm::closeConnection()
 {
-  if (connectionOpen && !isClosing) {
+  if (isConnecting && !isClosing) {
+    // abort connecting (name resolution or connection attempts in progress)
+    internalCloseConnection();
+  }
+  else if (connectionOpen && !isClosing) {
     isClosing = true; // prevent doing it more than once due to handlers called
     // report to handler
     LOG(LOG_NOTICE, "Connection with %s:%s explicitly closing\n", hostNameOrAddress.c_str(), serviceOrPortNo.c_str());
@@ -500,16 +548,23 @@ void SocketComm::internalCloseConnection()
       (*clientConnections.begin())->closeConnection();
     }
   }
-  else if (connectionOpen || isConnecting) {
+  else if (connectionOpen || isConnecting || connectionFd>=0) {
     // stop monitoring data connection
     setFd(-1);
-    // to make sure, also unregister handler for connectionFd (in case FdComm had no fd set yet)
-    mainLoop.unregisterPollHandler(connectionFd);
-    if (serverConnection) {
-      shutdown(connectionFd, SHUT_RDWR);
+    // abort connection attempts still in progress
+    closeConnectionAttempts();
+    // outdate pending name resolution
+    connectGeneration++;
+    addresses.clear();
+    if (connectionFd>=0) {
+      // to make sure, also unregister handler for connectionFd (in case FdComm had no fd set yet)
+      mainLoop.unregisterPollHandler(connectionFd);
+      if (serverConnection) {
+        shutdown(connectionFd, SHUT_RDWR);
+      }
+      close(connectionFd);
+      connectionFd = -1;
     }
-    close(connectionFd);
-    connectionFd = -1;
     connectionOpen = false;
     isConnecting = false;
     // if this was a client connection to our server, let server know
@@ -25,6 +25,7 @@
 #include "p44_common.hpp"
 
 #include "fdcomm.hpp"
+#include "dnsresolver.hpp"
 
 // unix I/O and network
 #include <sys/socket.h>
@@ -88,11 +89,15 @@ namespace p44 {
     // connection making fd (for server to listen, for clients or server handlers for opening connection)
     int connectionFd;
     // client connection internals
-    struct addrinfo *addressInfoList; ///< list of possible connection addresses
-    struct addrinfo *currentAddressInfo; ///< address currently connecting to
+    ResolvedAddressVector addresses; ///< possible connection addresses, address families interleaved
+    size_t nextAddress; ///< index of next address to attempt connecting to
+    typedef list<int> FdList;
+    FdList connectingFds; ///< sockets with connection attempts in progress
+    long attemptTicket; ///< timer for starting next parallel connection attempt
+    unsigned int connectGeneration; ///< incremented on every close, to detect outdated name resolution results
     struct sockaddr *currentSockAddrP; ///< address info as currently in use by open connection
     socklen_t currentSockAddrLen; ///< length of current sockAddr struct
-    bool isConnecting; ///< in progress of opening connection
+    bool isConnecting; ///< in progress of opening connection (including name resolution)
     bool isClosing; ///< in progress of closing connection
     bool connectionOpen; ///< regular data connection is open
     bool serving; ///< is serving socket
@@ -136,13 +141,16 @@ namespace p44 {
     ErrorPtr startServer(ServerConnectionCB aServerConnectionHandler, int aMaxConnections);
 
     /// initiate the connection (non-blocking)
-    /// This starts the connection process
+    /// This starts the connection process: the host name is resolved asynchronously (see DnsResolver), then
+    /// connections are attempted to the resolved addresses. When an attempt does not succeed within a short
+    /// delay, the next address is tried in parallel (happy eyeballs), and the first connection established wins.
     /// @return if no error is returned, this means the connection could be initiated
-    ///   (but actual connection might still fail)
+    ///   (but name resolution or actual connection might still fail)
     /// @note can be called multiple times, initiates connection only if not already open or initiated
     ///   When connection status changes, the connectionStatusHandler (if set) will be called
     /// @note if connectionStatusHandler is set, it will be called when initiation fails with the same error
-    ///   code as returned by initiateConnection itself.
+    ///   code as returned by initiateConnection itself. Name resolution and connection errors are reported
+    ///   to the connectionStatusHandler only.
     ErrorPtr initiateConnection();
 
     /// close the current connection, if any, or stop the server and close all client connections in case of a server
@@ -180,9 +188,11 @@ namespace p44 {
 
 
   private:
-    void freeAddressInfo();
+    void addressesResolved(SocketCommPtr aKeepAlive, unsigned int aGeneration, ErrorPtr aError, const ResolvedAddressVector &aAddresses);
     ErrorPtr socketError(int aSocketFd);
     ErrorPtr connectNextAddress();
+    void attemptTimeout();
+    void closeConnectionAttempts(int aExceptFd = -1);
     bool connectionMonitorHandler(MLMicroSeconds aCycleStartTime, int aFd, int aPollFlags);
     void internalCloseConnection();
     virtual void dataExceptionHandler(int aFd, int aPollFlags);
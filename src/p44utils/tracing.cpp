@@ -0,0 +1,209 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "tracing.hpp"
+
+using namespace p44;
+
+
+__thread TraceId Trace::currentId = 0;
+
+// the ring buffer, shared by all threads
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static TraceEvent *traceRing = NULL;
+static size_t traceRingSize = 0;
+static size_t traceRingNext = 0; // index of next event to write
+static size_t traceRingCount = 0; // number of valid events
+static TraceId lastTraceId = 0;
+
+
+void Trace::enable(size_t aRingSize)
+{
+  pthread_mutex_lock(&traceMutex);
+  if (traceRing) {
+    delete[] traceRing;
+    traceRing = NULL;
+  }
+  traceRingSize = aRingSize;
+  traceRingNext = 0;
+  traceRingCount = 0;
+  if (traceRingSize>0) {
+    traceRing = new TraceEvent[traceRingSize];
+  }
+  else {
+    // make sure no further events get recorded for traces still in progress
+    currentId = 0;
+  }
+  pthread_mutex_unlock(&traceMutex);
+}
+
+
+// Note: enable() can be called at runtime (cfg API) and reallocates the ring, so all accesses to the ring
+//   and its size/count variables, even just checking for tracing being enabled, must hold traceMutex
+
+bool Trace::isEnabled()
+{
+  pthread_mutex_lock(&traceMutex);
+  bool enabled = traceRing!=NULL;
+  pthread_mutex_unlock(&traceMutex);
+  return enabled;
+}
+
+
+size_t Trace::ringSize()
+{
+  pthread_mutex_lock(&traceMutex);
+  size_t s = traceRingSize;
+  pthread_mutex_unlock(&traceMutex);
+  return s;
+}
+
+
+TraceId Trace::begin(const char *aCategory, const char *aName, const char *aDetail)
+{
+  TraceId id = 0;
+  pthread_mutex_lock(&traceMutex);
+  if (traceRing) {
+    if (++lastTraceId==0) ++lastTraceId; // never use 0 as an ID
+    id = lastTraceId;
+  }
+  pthread_mutex_unlock(&traceMutex);
+  record(id, aCategory, aName, aDetail);
+  return id;
+}
+
+
+void Trace::record(TraceId aId, const char *aCategory, const char *aName, const char *aDetail)
+{
+  if (aId==0) return; // not traced, tracing was not enabled when the trace began
+  pthread_mutex_lock(&traceMutex);
+  if (!traceRing) {
+    // disabled in the meantime
+    pthread_mutex_unlock(&traceMutex);
+    return;
+  }
+  TraceEvent &e = traceRing[traceRingNext];
+  e.id = aId;
+  e.time = MainLoop::now();
+  e.category = aCategory;
+  e.name = aName;
+  if (aDetail) {
+    strncpy(e.detail, aDetail, sizeof(e.detail)-1);
+    e.detail[sizeof(e.detail)-1] = 0;
+  }
+  else {
+    e.detail[0] = 0;
+  }
+  if (++traceRingNext>=traceRingSize) traceRingNext = 0;
+  if (traceRingCount<traceRingSize) traceRingCount++;
+  pthread_mutex_unlock(&traceMutex);
+}
+
+
+// must be called with traceMutex locked
+static const TraceEvent &ringEvent(size_t aIndex)
+{
+  // oldest event is at traceRingNext when ring is full, at 0 otherwise
+  size_t i = traceRingCount<traceRingSize ? aIndex : (traceRingNext+aIndex) % traceRingSize;
+  return traceRing[i];
+}
+
+
+size_t Trace::numEvents()
+{
+  pthread_mutex_lock(&traceMutex);
+  size_t n = traceRingCount;
+  pthread_mutex_unlock(&traceMutex);
+  return n;
+}
+
+
+bool Trace::event(size_t aIndex, TraceEvent &aEvent)
+{
+  pthread_mutex_lock(&traceMutex);
+  bool found = aIndex<traceRingCount;
+  if (found) aEvent = ringEvent(aIndex);
+  pthread_mutex_unlock(&traceMutex);
+  return found;
+}
+
+
+namespace {
+  // first and last event of a trace
+  typedef struct { MLMicroSeconds first; MLMicroSeconds last; size_t firstIndex; } TraceSpan;
+  typedef map<TraceId, TraceSpan> TraceSpanMap;
+}
+
+JsonObjectPtr Trace::chromeTrace()
+{
+  TraceSpanMap spans;
+  JsonObjectPtr events = JsonObject::newArray();
+  // prevent other threads from recording while we read the ring
+  pthread_mutex_lock(&traceMutex);
+  // instant events, one per recorded trace point, with the trace ID as thread ID to get one lane per request
+  for (size_t i=0; i<traceRingCount; i++) {
+    const TraceEvent &e = ringEvent(i);
+    JsonObjectPtr ev = JsonObject::newObj();
+    ev->add("name", JsonObject::newString(e.name));
+    ev->add("cat", JsonObject::newString(e.category));
+    ev->add("ph", JsonObject::newString("i"));
+    ev->add("s", JsonObject::newString("t"));
+    ev->add("ts", JsonObject::newInt64(e.time));
+    ev->add("pid", JsonObject::newInt32(1));
+    ev->add("tid", JsonObject::newInt64(e.id));
+    if (e.detail[0]) {
+      JsonObjectPtr args = JsonObject::newObj();
+      args->add("detail", JsonObject::newString(e.detail));
+      ev->add("args", args);
+    }
+    events->arrayAppend(ev);
+    // update span of this trace
+    TraceSpanMap::iterator pos = spans.find(e.id);
+    if (pos==spans.end()) {
+      TraceSpan s;
+      s.first = e.time;
+      s.last = e.time;
+      s.firstIndex = i;
+      spans[e.id] = s;
+    }
+    else {
+      pos->second.last = e.time;
+    }
+  }
+  // complete events spanning each request from its first to its last recorded event
+  for (TraceSpanMap::iterator pos = spans.begin(); pos!=spans.end(); ++pos) {
+    const TraceEvent &fe = ringEvent(pos->second.firstIndex);
+    JsonObjectPtr ev = JsonObject::newObj();
+    ev->add("name", JsonObject::newString(string_format("#%u %s", pos->first, fe.detail[0] ? fe.detail : fe.name)));
+    ev->add("cat", JsonObject::newString(fe.category));
+    ev->add("ph", JsonObject::newString("X"));
+    ev->add("ts", JsonObject::newInt64(pos->second.first));
+    ev->add("dur", JsonObject::newInt64(pos->second.last-pos->second.first));
+    ev->add("pid", JsonObject::newInt32(1));
+    ev->add("tid", JsonObject::newInt64(pos->first));
+    events->arrayAppend(ev);
+  }
+  pthread_mutex_unlock(&traceMutex);
+  JsonObjectPtr trace = JsonObject::newObj();
+  trace->add("traceEvents", events);
+  trace->add("displayTimeUnit", JsonObject::newString("ms"));
+  return trace;
+}
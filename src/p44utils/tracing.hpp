@@ -0,0 +1,142 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of p44utils.
+//
+//  p44utils is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  p44utils is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with p44utils. If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __p44utils__tracing__
+#define __p44utils__tracing__
+
+#include "p44_common.hpp"
+
+#include "jsonobject.hpp"
+
+// if set to non-zero, TRACE_xxx macros generate code (which still does nothing at runtime unless tracing is enabled)
+#ifndef ENABLE_TRACING
+  #define ENABLE_TRACING 1
+#endif
+
+using namespace std;
+
+namespace p44 {
+
+  /// @name request tracing
+  /// Follows a single request (e.g. a vDC API callScene) through the daemon down to the hardware frames it causes.
+  /// A trace is started with Trace::begin() where a request enters the system. The resulting trace ID is made the
+  /// "current" trace ID with a TraceContext for the duration of the synchronous processing. Objects that continue the
+  /// work asynchronously (Operations, Devices applying channels) capture the current trace ID and restore it when they
+  /// continue, so all events end up in the same trace.
+  /// Events are recorded into a fixed size ring buffer, which can be dumped in Chrome trace event format
+  /// (load into chrome://tracing or https://ui.perfetto.dev).
+  /// @note when tracing is not enabled, Trace::begin() returns 0 and no events are recorded at all. The cost
+  ///   of trace points is then just checking the current trace ID for being non-zero.
+  /// @{
+
+  /// trace ID, 0 means "not traced"
+  typedef uint32_t TraceId;
+
+  /// a single recorded trace event
+  typedef struct {
+    TraceId id; ///< the trace this event belongs to
+    MLMicroSeconds time; ///< when the event was recorded
+    const char *category; ///< category (subsystem), must be a static string
+    const char *name; ///< event name, must be a static string
+    char detail[32]; ///< copy of (truncated) detail text, empty if none
+  } TraceEvent;
+
+
+  class Trace
+  {
+    static __thread TraceId currentId; ///< per thread, as each thread (mainloop) processes its own requests
+
+  public:
+
+    /// enable or disable tracing
+    /// @param aRingSize max number of events to keep. 0 disables tracing and frees the buffer
+    /// @note enabling (again) clears all previously recorded events
+    static void enable(size_t aRingSize);
+
+    /// @return true if tracing is enabled
+    static bool isEnabled();
+
+    /// @return size of the ring buffer (0 if tracing is disabled)
+    static size_t ringSize();
+
+    /// start a new trace
+    /// @param aCategory category of the initial event
+    /// @param aName name of the initial event
+    /// @param aDetail optional detail text (will be copied, possibly truncated)
+    /// @return new trace ID, or 0 if tracing is disabled
+    static TraceId begin(const char *aCategory, const char *aName, const char *aDetail = NULL);
+
+    /// record an event for a trace
+    /// @param aId the trace ID. Nothing is recorded when this is 0
+    /// @param aCategory category of the event
+    /// @param aName name of the event
+    /// @param aDetail optional detail text (will be copied, possibly truncated)
+    static void record(TraceId aId, const char *aCategory, const char *aName, const char *aDetail = NULL);
+
+    /// @return the trace ID of the request currently being processed by the calling thread, 0 if none
+    static TraceId current() { return currentId; };
+
+    /// set the current trace ID
+    /// @note usually, TraceContext should be used instead to make sure the previous ID is restored
+    static void setCurrent(TraceId aId) { currentId = aId; };
+
+    /// @return number of events currently in the ring buffer
+    static size_t numEvents();
+
+    /// get a copy of an event by index
+    /// @param aIndex 0..numEvents()-1, 0 being the oldest event
+    /// @param aEvent will be set to the event
+    /// @return false if there is no such event (any more)
+    /// @note when other threads record events, the ring moves on, so the same index may refer to another event later
+    static bool event(size_t aIndex, TraceEvent &aEvent);
+
+    /// @return contents of the ring buffer in Chrome trace event format
+    static JsonObjectPtr chromeTrace();
+
+  };
+
+
+  /// makes a trace ID the current one for the lifetime of the context object
+  class TraceContext
+  {
+    TraceId previousId;
+  public:
+    TraceContext(TraceId aId) : previousId(Trace::current()) { Trace::setCurrent(aId); };
+    ~TraceContext() { Trace::setCurrent(previousId); };
+  };
+
+
+  #if ENABLE_TRACING
+    /// record an event for the trace specified by id
+    #define TRACE_EVENT(id,cat,name,detail) { p44::TraceId t__ = (id); if (t__) p44::Trace::record(t__,cat,name,detail); }
+    /// record an event for the current trace
+    #define TRACE_POINT(cat,name,detail) TRACE_EVENT(p44::Trace::current(),cat,name,detail)
+  #else
+    #define TRACE_EVENT(id,cat,name,detail)
+    #define TRACE_POINT(cat,name,detail)
+  #endif
+
+  /// @}
+
+} // namespace p44
+
+
+#endif /* defined(__p44utils__tracing__) */
@@ -0,0 +1,280 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// scenebench: measures device scene table persistence, with one row per scene and with packed scene tables
+// (see --packedscenes), without any hardware or vdSM connection. For each storage mode, a fresh DsParams.sqlite3
+// is created in the bench directory, and light devices with a number of non-default scenes each are
+// - save: saved for the first time (all scenes new)
+// - update: saved again after changing one scene per device
+// - load: loaded into new device objects, including accessing all non-default scenes (packed scenes are
+//   only decoded when accessed). Loaded scene values are checked, exits with failure on mismatch.
+// Finally, the size of the database file is reported.
+
+#include "application.hpp"
+
+#include "devicecontainer.hpp"
+#include "deviceclasscontainer.hpp"
+#include "device.hpp"
+#include "lightbehaviour.hpp"
+
+#include <sys/stat.h>
+
+#define DEFAULT_NUM_DEVICES 500
+#define DEFAULT_NUM_SCENES 16
+#define DEFAULT_BENCHDIR "/tmp/scenebench"
+#define DEFAULT_LOGLEVEL LOG_WARNING
+
+using namespace p44;
+
+
+namespace {
+
+  class BenchDeviceContainer;
+
+  /// light device with a full scene table, like the demo device
+  class BenchDevice : public Device
+  {
+    typedef Device inherited;
+
+  public:
+
+    BenchDevice(DeviceClassContainer *aClassContainerP, int aDeviceIndex) :
+      inherited(aClassContainerP)
+    {
+      primaryGroup = group_yellow_light;
+      installSettings(DeviceSettingsPtr(new LightDeviceSettings(*this)));
+      LightBehaviourPtr l = LightBehaviourPtr(new LightBehaviour(*this));
+      l->setHardwareOutputConfig(outputFunction_dimmer, usage_undefined, true, -1);
+      addBehaviour(l);
+      // dSUID from device index, so devices created again for loading find their settings
+      DsUid vdcNamespace(DSUID_P44VDC_NAMESPACE_UUID);
+      dSUID.setNameInSpace(string_format("%s::ScenebenchDevice%d", classContainerP->deviceClassContainerInstanceIdentifier().c_str(), aDeviceIndex), vdcNamespace);
+    }
+
+    virtual string modelName() { return "Scenebench Light"; }
+
+  };
+  typedef boost::intrusive_ptr<BenchDevice> BenchDevicePtr;
+
+
+  /// device class container for the bench devices, which are never collected
+  class BenchDeviceContainer : public DeviceClassContainer
+  {
+    typedef DeviceClassContainer inherited;
+
+  public:
+
+    BenchDeviceContainer(int aInstanceNumber, DeviceContainer *aDeviceContainerP, int aTag) :
+      inherited(aInstanceNumber, aDeviceContainerP, aTag)
+    {
+    }
+
+    virtual const char *deviceClassIdentifier() const { return "Scenebench_Device_Container"; }
+    virtual void collectDevices(CompletedCB aCompletedCB, bool aIncremental, bool aExhaustive, bool aClearSettings) { aCompletedCB(ErrorPtr()); }
+    virtual string vdcModelSuffix() { return "scenebench"; }
+
+  };
+  typedef boost::intrusive_ptr<BenchDeviceContainer> BenchDeviceContainerPtr;
+
+} // namespace
+
+
+
+class SceneBench : public CmdLineApp
+{
+  typedef CmdLineApp inherited;
+
+  int numDevices;
+  int numScenes;
+  string benchDir;
+
+  bool packed; ///< current storage mode
+  bool allOK;
+
+  DeviceContainerPtr deviceContainer;
+  BenchDeviceContainerPtr benchDeviceContainer;
+
+public:
+
+  SceneBench() :
+    numDevices(DEFAULT_NUM_DEVICES),
+    numScenes(DEFAULT_NUM_SCENES),
+    benchDir(DEFAULT_BENCHDIR),
+    packed(false),
+    allOK(true)
+  {
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [options]\n", name);
+    fprintf(stderr, "    -n devices   : number of devices (default: %d)\n", DEFAULT_NUM_DEVICES);
+    fprintf(stderr, "    -s scenes    : number of non-default scenes per device, 1..%d (default: %d)\n", MAX_SCENE_NO+1, DEFAULT_NUM_SCENES);
+    fprintf(stderr, "    -d dirpath   : bench directory, DsParams.sqlite3 in it is deleted! (default: %s)\n", DEFAULT_BENCHDIR);
+    fprintf(stderr, "    -l loglevel  : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    int c;
+    while ((c = getopt(argc, argv, "hn:s:d:l:")) != -1)
+    {
+      switch (c) {
+        case 'n':
+          numDevices = atoi(optarg);
+          break;
+        case 's':
+          numScenes = atoi(optarg);
+          break;
+        case 'd':
+          benchDir = optarg;
+          break;
+        case 'l':
+          loglevel = atoi(optarg);
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    if (numDevices<1 || numScenes<1 || numScenes>MAX_SCENE_NO+1) {
+      usage(argv[0]);
+      exit(1);
+    }
+    SETLOGLEVEL(loglevel);
+    SETERRLEVEL(LOG_ERR, true);
+    // app now ready to run
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    mkdir(benchDir.c_str(), 0755); // might exist already
+    printf("%d devices with %d non-default scenes each\n", numDevices, numScenes);
+    printf("%-8s %10s %10s %10s %12s\n", "", "save mS", "update mS", "load mS", "DB bytes");
+    startMode(false);
+  }
+
+
+  void startMode(bool aPacked)
+  {
+    packed = aPacked;
+    // fresh device container with empty database, without API connection
+    deviceContainer = DeviceContainerPtr(new DeviceContainer());
+    deviceContainer->setPersistentDataDir(benchDir.c_str());
+    deviceContainer->setPackedSceneStorage(packed);
+    benchDeviceContainer = BenchDeviceContainerPtr(new BenchDeviceContainer(1, deviceContainer.get(), 1));
+    deviceContainer->initialize(boost::bind(&SceneBench::storeReady, this, _1), true); // factory reset
+  }
+
+
+  double sceneValueFor(int aDeviceIndex, SceneNo aSceneNo, bool aUpdated)
+  {
+    // brightness 1..100, different for every scene, updated value differs from the original one
+    return (aDeviceIndex*7 + aSceneNo*13 + (aUpdated ? 50 : 0)) % 100 + 1;
+  }
+
+
+  void storeReady(ErrorPtr aError)
+  {
+    if (!Error::isOK(aError)) {
+      LOG(LOG_ERR, "Cannot initialize database in %s: %s\n", deviceContainer->getPersistentDataDir(), aError->description().c_str());
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    // create devices and set up their scenes
+    vector<BenchDevicePtr> devices;
+    for (int i=0; i<numDevices; i++) {
+      BenchDevicePtr dev = BenchDevicePtr(new BenchDevice(benchDeviceContainer.get(), i));
+      dev->load(); // nothing stored yet, but establishes state as a real device would have it
+      SceneDeviceSettingsPtr scenes = dev->getScenes();
+      for (SceneNo s=0; s<numScenes; s++) {
+        DsScenePtr scene = scenes->getScene(s);
+        scene->setSceneValue(0, sceneValueFor(i, s, false));
+        scenes->updateScene(scene);
+      }
+      devices.push_back(dev);
+    }
+    // save
+    MLMicroSeconds start = MainLoop::now();
+    for (int i=0; i<numDevices; i++) {
+      devices[i]->save();
+    }
+    MLMicroSeconds saveTime = MainLoop::now()-start;
+    // update: change the first scene of every device
+    for (int i=0; i<numDevices; i++) {
+      SceneDeviceSettingsPtr scenes = devices[i]->getScenes();
+      DsScenePtr scene = scenes->getScene(0);
+      scene->setSceneValue(0, sceneValueFor(i, 0, true));
+      scenes->updateScene(scene);
+    }
+    start = MainLoop::now();
+    for (int i=0; i<numDevices; i++) {
+      devices[i]->save();
+    }
+    MLMicroSeconds updateTime = MainLoop::now()-start;
+    devices.clear();
+    // load into new device objects
+    long mismatches = 0;
+    start = MainLoop::now();
+    for (int i=0; i<numDevices; i++) {
+      BenchDevicePtr dev = BenchDevicePtr(new BenchDevice(benchDeviceContainer.get(), i));
+      dev->load();
+      SceneDeviceSettingsPtr scenes = dev->getScenes();
+      for (SceneNo s=0; s<numScenes; s++) {
+        if (scenes->getScene(s)->sceneValue(0)!=sceneValueFor(i, s, s==0)) mismatches++;
+      }
+    }
+    MLMicroSeconds loadTime = MainLoop::now()-start;
+    // database size
+    string dbFile = deviceContainer->getPersistentDataDir();
+    dbFile += "DsParams.sqlite3";
+    struct stat st;
+    long dbSize = stat(dbFile.c_str(), &st)==0 ? (long)st.st_size : -1;
+    printf(
+      "%-8s %10.1f %10.1f %10.1f %12ld%s\n", packed ? "packed" : "rows",
+      (double)saveTime/MilliSecond, (double)updateTime/MilliSecond, (double)loadTime/MilliSecond, dbSize,
+      mismatches ? string_format(" FAILED: %ld scene values not loaded correctly", mismatches).c_str() : ""
+    );
+    fflush(stdout);
+    if (mismatches) allOK = false;
+    if (!packed) {
+      startMode(true);
+      return;
+    }
+    terminateApp(allOK ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create app with current mainloop
+  static SceneBench application;
+  // pass control
+  return application.main(argc, argv);
+}
@@ -0,0 +1,478 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// threadbench: measures the latency from submitting a job to a worker thread until its completion is
+// delivered on the mainloop, for
+// - pool: WorkerPool::submit() with completion via MainLoop::post()
+// - wrapper: MainLoop::executeInThread() (ChildThreadWrapper, running on the worker pool)
+// - thread: a new pthread and signalling pipe per job (the way ChildThreadWrapper used to work)
+//
+// With -S, it instead runs a stress test of everything that may be used from more than one thread: posting calls
+// carrying smart pointers between the main thread and several MainLoopThreads, WorkerPool submit/cancel, metrics
+// and request tracing. It checks the counts at the end, but is mainly meant to be run built with
+// --enable-tsan (ThreadSanitizer), which reports any data race found.
+
+#include "application.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
+
+#include <sys/poll.h>
+
+#define DEFAULT_NUM_JOBS 2000
+#define DEFAULT_CONCURRENCY 1
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+
+#define STRESS_THREADS 3 // number of MainLoopThreads
+#define STRESS_PINGS_IN_FLIGHT 4 // per MainLoopThread
+#define STRESS_JOBS_PER_CYCLE 4 // pool jobs submitted per churn cycle (every other gets cancelled)
+#define STRESS_TRACE_EVENTS 1000
+
+using namespace p44;
+
+
+namespace {
+
+  /// a job run the thread-per-job way
+  typedef struct {
+    pthread_t thread;
+    int pipeFds[2];
+    MLMicroSeconds jobTime;
+  } LegacyJob;
+
+
+  /// payload passed back and forth between threads in the stress test
+  class StressToken : public P44Obj
+  {
+  public:
+    size_t threadIndex;
+    long seq;
+    StressToken(size_t aThreadIndex, long aSeq) : threadIndex(aThreadIndex), seq(aSeq) {};
+  };
+  typedef boost::intrusive_ptr<StressToken> StressTokenPtr;
+
+}
+
+
+class ThreadBench : public Application
+{
+  typedef Application inherited;
+
+  // parameters
+  long numJobs;
+  int concurrency;
+  MLMicroSeconds jobTime;
+  bool benchPool;
+  bool benchWrapper;
+  bool benchThread;
+
+  // current run
+  const char *runName;
+  long started;
+  long completed;
+  MLHistogram latencies;
+  MLMicroSeconds runStart;
+
+  // stress test
+  MLMicroSeconds stressTime;
+  MLMicroSeconds stressEnd;
+  MainLoop *hostMainLoopP;
+  vector<MainLoopThreadPtr> stressThreads;
+  long pingsSent;
+  long pongsReceived;
+  long badPongs;
+  long jobsSubmitted;
+  long jobsCompleted;
+  long jobsCancelled;
+  MetricCounterPtr pingMetric;
+  MetricCounterPtr jobMetric;
+  MetricGaugePtr inFlightMetric;
+
+public:
+
+  ThreadBench() :
+    numJobs(DEFAULT_NUM_JOBS),
+    concurrency(DEFAULT_CONCURRENCY),
+    jobTime(0),
+    benchPool(true),
+    benchWrapper(true),
+    benchThread(true),
+    stressTime(0),
+    hostMainLoopP(NULL),
+    pingsSent(0),
+    pongsReceived(0),
+    badPongs(0),
+    jobsSubmitted(0),
+    jobsCompleted(0),
+    jobsCancelled(0)
+  {
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [options]\n", name);
+    fprintf(stderr, "    -n numjobs    : number of jobs per benchmark (default: %d)\n", DEFAULT_NUM_JOBS);
+    fprintf(stderr, "    -c concurrent : number of jobs in flight at the same time (default: %d)\n", DEFAULT_CONCURRENCY);
+    fprintf(stderr, "    -t microsecs  : time each job sleeps on its thread (default: 0)\n");
+    fprintf(stderr, "    -w workers    : max number of worker threads in the pool\n");
+    fprintf(stderr, "    -m modes      : benchmarks to run, any of p(ool), w(rapper), t(hread) (default: pwt)\n");
+    fprintf(stderr, "    -S seconds    : run multithreading stress test instead of benchmarks\n");
+    fprintf(stderr, "    -l loglevel   : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL;
+    int c;
+    while ((c = getopt(argc, argv, "hn:c:t:w:m:S:l:")) != -1)
+    {
+      switch (c) {
+        case 'n':
+          numJobs = atol(optarg);
+          break;
+        case 'c':
+          concurrency = atoi(optarg);
+          break;
+        case 't':
+          jobTime = atoll(optarg)*MicroSecond;
+          break;
+        case 'w':
+          WorkerPool::sharedPool().setMaxWorkers(atoi(optarg));
+          break;
+        case 'm':
+          benchPool = strchr(optarg, 'p')!=NULL;
+          benchWrapper = strchr(optarg, 'w')!=NULL;
+          benchThread = strchr(optarg, 't')!=NULL;
+          break;
+        case 'S':
+          stressTime = atoll(optarg)*Second;
+          break;
+        case 'l':
+          loglevel = atoi(optarg);
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    if (numJobs<1 || concurrency<1) {
+      usage(argv[0]);
+      exit(1);
+    }
+    SETLOGLEVEL(loglevel);
+    SETERRLEVEL(LOG_ERR, true);
+    // app now ready to run
+    return run();
+  }
+
+
+  virtual void initialize()
+  {
+    if (stressTime>0) {
+      startStress();
+      return;
+    }
+    printf("%ld jobs per run, %d in flight, %lld uS per job\n", numJobs, concurrency, jobTime);
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n", "", "jobs/s", "mean uS", "p50 uS", "p90 uS", "p99 uS", "max uS");
+    nextRun(NULL);
+  }
+
+
+  void nextRun(const char *aLastRun)
+  {
+    static const char *runNames[] = { "pool", "wrapper", "thread", NULL };
+    bool enabled[] = { benchPool, benchWrapper, benchThread };
+    int i = 0;
+    if (aLastRun) {
+      // continue after last run
+      while (runNames[i] && strcmp(runNames[i], aLastRun)!=0) i++;
+      i++;
+    }
+    while (runNames[i] && !enabled[i]) i++;
+    if (runNames[i])
+      startRun(runNames[i]);
+    else
+      terminateApp(EXIT_SUCCESS);
+  }
+
+
+  void startRun(const char *aName)
+  {
+    runName = aName;
+    started = 0;
+    completed = 0;
+    latencies.reset();
+    runStart = MainLoop::now();
+    for (int i=0; i<concurrency && started<numJobs; i++) {
+      startJob();
+    }
+  }
+
+
+  void startJob()
+  {
+    started++;
+    MLMicroSeconds submitted = MainLoop::now();
+    if (strcmp(runName, "pool")==0) {
+      WorkerPool::sharedPool().submit(
+        boost::bind(&ThreadBench::poolJob, this),
+        boost::bind(&ThreadBench::jobDone, this, submitted)
+      );
+    }
+    else if (strcmp(runName, "wrapper")==0) {
+      MainLoop::currentMainLoop().executeInThread(
+        boost::bind(&ThreadBench::wrapperJob, this, _1),
+        boost::bind(&ThreadBench::wrapperSignal, this, _2, submitted)
+      );
+    }
+    else {
+      startLegacyJob(submitted);
+    }
+  }
+
+
+  void jobDone(MLMicroSeconds aSubmitted)
+  {
+    latencies.add(MainLoop::now()-aSubmitted);
+    completed++;
+    if (started<numJobs) {
+      startJob();
+    }
+    else if (completed==numJobs) {
+      report();
+      nextRun(runName);
+    }
+  }
+
+
+  void report()
+  {
+    MLMicroSeconds runTime = MainLoop::now()-runStart;
+    printf(
+      "%-8s %10.0f %10lld %10lld %10lld %10lld %10lld\n",
+      runName,
+      runTime>0 ? (double)completed*Second/runTime : 0.0,
+      latencies.mean(),
+      latencies.percentile(50),
+      latencies.percentile(90),
+      latencies.percentile(99),
+      latencies.max()
+    );
+    fflush(stdout);
+  }
+
+
+  #pragma mark - pool and wrapper
+
+  // runs on worker thread
+  void poolJob()
+  {
+    if (jobTime>0) usleep((useconds_t)jobTime);
+  }
+
+  // runs on worker thread
+  void wrapperJob(ChildThreadWrapper &aThread)
+  {
+    if (jobTime>0) usleep((useconds_t)jobTime);
+  }
+
+
+  void wrapperSignal(ThreadSignals aSignalCode, MLMicroSeconds aSubmitted)
+  {
+    if (aSignalCode==threadSignalCompleted || aSignalCode==threadSignalFailedToStart) {
+      jobDone(aSubmitted);
+    }
+  }
+
+
+  #pragma mark - stress test
+
+  void startStress()
+  {
+    printf("stress test: %d mainloop threads, worker pool churn, metrics and tracing for %lld seconds\n", STRESS_THREADS, stressTime/Second);
+    hostMainLoopP = &MainLoop::currentMainLoop();
+    Trace::enable(STRESS_TRACE_EVENTS);
+    pingMetric = Metrics::counter("threadbench_pings_total", "pings processed on mainloop threads");
+    jobMetric = Metrics::counter("threadbench_jobs_total", "jobs run on worker threads");
+    inFlightMetric = Metrics::gauge("threadbench_in_flight", "pings and jobs in flight");
+    for (size_t i=0; i<STRESS_THREADS; i++) {
+      MainLoopThreadPtr t = MainLoopThreadPtr(new MainLoopThread);
+      t->start();
+      stressThreads.push_back(t);
+    }
+    stressEnd = MainLoop::now()+stressTime;
+    for (size_t i=0; i<STRESS_THREADS; i++) {
+      for (int k=0; k<STRESS_PINGS_IN_FLIGHT; k++) sendPing(i);
+    }
+    poolChurn();
+  }
+
+
+  void sendPing(size_t aThreadIndex)
+  {
+    pingsSent++;
+    inFlightMetric->inc();
+    StressTokenPtr token = StressTokenPtr(new StressToken(aThreadIndex, pingsSent));
+    stressThreads[aThreadIndex]->mainLoop().post(boost::bind(&ThreadBench::stressPing, this, token));
+  }
+
+
+  // runs on a MainLoopThread
+  void stressPing(StressTokenPtr aToken)
+  {
+    TraceId t = Trace::begin("stress", "ping");
+    TraceContext tc(t);
+    TRACE_POINT("stress", "pong", NULL);
+    pingMetric->inc();
+    ErrorPtr err = ErrorPtr(new Error(aToken->seq));
+    hostMainLoopP->post(boost::bind(&ThreadBench::stressPong, this, aToken, err));
+  }
+
+
+  void stressPong(StressTokenPtr aToken, ErrorPtr aError)
+  {
+    pongsReceived++;
+    inFlightMetric->dec();
+    if (aError->getErrorCode()!=aToken->seq) badPongs++;
+    if (MainLoop::now()<stressEnd)
+      sendPing(aToken->threadIndex);
+    else
+      checkStressDone();
+  }
+
+
+  void poolChurn()
+  {
+    if (MainLoop::now()>=stressEnd) {
+      checkStressDone();
+      return;
+    }
+    for (int i=0; i<STRESS_JOBS_PER_CYCLE; i++) {
+      WorkerJobPtr job = WorkerPool::sharedPool().submit(
+        boost::bind(&ThreadBench::stressJob, this),
+        boost::bind(&ThreadBench::stressJobDone, this)
+      );
+      if (!job) continue;
+      jobsSubmitted++;
+      if (i & 1) {
+        WorkerPool::sharedPool().cancel(job);
+        jobsCancelled++;
+      }
+    }
+    MainLoop::currentMainLoop().executeOnce(boost::bind(&ThreadBench::poolChurn, this), 1*MilliSecond);
+  }
+
+
+  // runs on a worker thread
+  void stressJob()
+  {
+    inFlightMetric->inc();
+    jobMetric->inc();
+    TRACE_EVENT(Trace::begin("stress", "job"), "stress", "jobdone", NULL);
+    inFlightMetric->dec();
+  }
+
+
+  void stressJobDone()
+  {
+    jobsCompleted++;
+    checkStressDone();
+  }
+
+
+  void checkStressDone()
+  {
+    if (stressThreads.empty()) return; // already done
+    if (MainLoop::now()<stressEnd || pongsReceived<pingsSent || jobsCompleted+jobsCancelled<jobsSubmitted) return;
+    for (size_t i=0; i<stressThreads.size(); i++) {
+      stressThreads[i]->stop();
+    }
+    stressThreads.clear();
+    bool ok =
+      badPongs==0 &&
+      (long)pingMetric->get()==pongsReceived &&
+      (long)jobMetric->get()>=jobsCompleted &&
+      inFlightMetric->get()==0 &&
+      Trace::numEvents()>0;
+    printf("pings: %ld sent, %ld received, %ld bad, %llu counted\n", pingsSent, pongsReceived, badPongs, (unsigned long long)pingMetric->get());
+    printf("jobs: %ld submitted, %ld completed, %ld cancelled, %llu run\n", jobsSubmitted, jobsCompleted, jobsCancelled, (unsigned long long)jobMetric->get());
+    printf("in flight gauge: %g, trace events: %zu\n", inFlightMetric->get(), Trace::numEvents());
+    printf("%s\n", ok ? "OK" : "FAILED");
+    terminateApp(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+
+  #pragma mark - thread per job
+
+  static void *legacyThreadFunction(void *arg)
+  {
+    LegacyJob *job = static_cast<LegacyJob *>(arg);
+    if (job->jobTime>0) usleep((useconds_t)job->jobTime);
+    uint8_t sigByte = threadSignalCompleted;
+    write(job->pipeFds[1], &sigByte, 1);
+    return NULL;
+  }
+
+
+  void startLegacyJob(MLMicroSeconds aSubmitted)
+  {
+    LegacyJob *job = new LegacyJob;
+    job->jobTime = jobTime;
+    if (pipe(job->pipeFds)!=0) {
+      LOG(LOG_ERR, "cannot create pipe: %s\n", strerror(errno));
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    MainLoop::currentMainLoop().registerPollHandler(job->pipeFds[0], POLLIN, boost::bind(&ThreadBench::legacyJobSignal, this, job, aSubmitted, _3));
+    if (pthread_create(&job->thread, NULL, legacyThreadFunction, job)!=0) {
+      LOG(LOG_ERR, "cannot create thread: %s\n", strerror(errno));
+      terminateApp(EXIT_FAILURE);
+    }
+  }
+
+
+  bool legacyJobSignal(LegacyJob *aJob, MLMicroSeconds aSubmitted, int aPollFlags)
+  {
+    uint8_t sigByte;
+    if ((aPollFlags & POLLIN) && read(aJob->pipeFds[0], &sigByte, 1)==1) {
+      pthread_join(aJob->thread, NULL);
+      MainLoop::currentMainLoop().unregisterPollHandler(aJob->pipeFds[0]);
+      close(aJob->pipeFds[0]);
+      close(aJob->pipeFds[1]);
+      delete aJob;
+      jobDone(aSubmitted);
+      return true;
+    }
+    return false;
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create app with current mainloop
+  static ThreadBench application;
+  // pass control
+  return application.main(argc, argv);
+}
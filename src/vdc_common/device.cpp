@@ -44,7 +44,6 @@ using namespace p44;
 Device::Device(DeviceClassContainer *aClassContainerP) :
   progMode(false),
   isDimming(false),
-  dimHandlerTicket(0),
   dimTimeoutTicket(0),
   currentDimMode(dimmode_stop),
   currentDimChannel(channeltype_default),
@@ -54,7 +53,11 @@ Device::Device(DeviceClassContainer *aClassContainerP) :
   applyInProgress(false),
   missedApplyAttempts(0),
   updateInProgress(false),
-  serializerWatchdogTicket(0)
+  serializerWatchdogTicket(0),
+  applyBatched(false),
+  batchedApplyForDimming(false),
+  applyRequestTime(Never),
+  applyTraceId(0)
 {
 }
 
@@ -732,15 +735,32 @@ static SceneNo mainDimScene(SceneNo aSceneNo)
 // autostop handler (for both dimChannel and legacy dimming)
 void Device::dimAutostopHandler(DsChannelType aChannel)
 {
+  if (dimSession) {
+    // timeout: stop entire dim session at once (keep it alive while stopping)
+    DimSessionPtr ds = dimSession;
+    ds->stop();
+    return;
+  }
   // timeout: stop dimming immediately
   dimChannel(aChannel, dimmode_stop);
   currentDimMode = dimmode_stop; // stopped now
 }
 
 
+// called when the dim session this device participates in was stopped as a whole
+void Device::dimSessionStopped()
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(dimTimeoutTicket);
+  isDimming = false;
+  currentDimMode = dimmode_stop;
+  dimSession.reset();
+}
+
+
 
 #define DIM_STEP_INTERVAL_MS 300.0
 #define DIM_STEP_INTERVAL (DIM_STEP_INTERVAL_MS*MilliSecond)
+#define DIM_START_DELAY (10*MilliSecond)
 
 // actual dimming implementation, usually overridden by subclasses to provide more optimized/precise dimming
 void Device::dimChannel(DsChannelType aChannelType, DsDimMode aDimMode)
@@ -750,7 +770,11 @@ void Device::dimChannel(DsChannelType aChannelType, DsDimMode aDimMode)
   if (aDimMode==dimmode_stop) {
     // stop dimming
     isDimming = false;
-    MainLoop::currentMainLoop().cancelExecutionTicket(dimHandlerTicket);
+    if (dimSession) {
+      DimSessionPtr ds = dimSession;
+      dimSession.reset();
+      ds->removeDevice(this);
+    }
   }
   else {
     // start dimming
@@ -759,40 +783,101 @@ void Device::dimChannel(DsChannelType aChannelType, DsDimMode aDimMode)
       // make sure the start point is calculated if needed
       ch->getChannelValueCalculated();
       ch->setNeedsApplying(0); // force re-applying start point, no transition time
-      // calculate increment
-      double increment = (aDimMode==dimmode_up ? DIM_STEP_INTERVAL_MS : -DIM_STEP_INTERVAL_MS) * ch->getDimPerMS();
-      // start ticking
       isDimming = true;
-      // wait for all apply operations to really complete before starting to dim
-      DoneCB dd = boost::bind(&Device::dimDoneHandler, this, ch, increment, MainLoop::now()+10*MilliSecond);
-      waitForApplyComplete(boost::bind(&Device::requestApplyingChannels, this, dd, false));
+      // join the dim session for this command (shared with other devices dimmed by the same command)
+      dimSession = getDeviceContainer().getDimSession(aChannelType, aDimMode);
+      dimSession->addDevice(DevicePtr(this), ch);
+      // apply start point
+      requestApplyingChannels(NULL, false);
     }
   }
 }
 
 
-void Device::dimHandler(ChannelBehaviourPtr aChannel, double aIncrement, MLMicroSeconds aNow)
+
+#pragma mark - dim session
+
+
+DimSession::DimSession(DeviceContainer &aDeviceContainer, DsChannelType aChannelType, DsDimMode aDimMode) :
+  deviceContainer(aDeviceContainer),
+  channelType(aChannelType),
+  dimMode(aDimMode),
+  dimStepTicket(0),
+  nextStepAt(Never)
+{
+}
+
+
+DimSession::~DimSession()
 {
-  // increment channel value
-  aChannel->dimChannelValue(aIncrement, DIM_STEP_INTERVAL);
-  // apply to hardware
-  requestApplyingChannels(boost::bind(&Device::dimDoneHandler, this, aChannel, aIncrement, aNow+DIM_STEP_INTERVAL), true); // apply in dimming mode
+  MainLoop::currentMainLoop().cancelExecutionTicket(dimStepTicket);
 }
 
 
-void Device::dimDoneHandler(ChannelBehaviourPtr aChannel, double aIncrement, MLMicroSeconds aNextDimAt)
+void DimSession::addDevice(DevicePtr aDevice, ChannelBehaviourPtr aChannel)
 {
-  // keep up with actual dim time
-  MLMicroSeconds now = MainLoop::now();
-  while (aNextDimAt<now) {
-    // missed this step - simply increment channel and target time, but do not cause re-apply
-    LOG(LOG_DEBUG, "dimChannel: applyChannelValues() was too slow while dimming channel=%d -> skipping next dim step\n", aChannel->getChannelType());
-    aChannel->dimChannelValue(aIncrement, DIM_STEP_INTERVAL);
-    aNextDimAt += DIM_STEP_INTERVAL;
+  DimParticipant p;
+  p.device = aDevice;
+  p.channel = aChannel;
+  p.increment = (dimMode==dimmode_up ? DIM_STEP_INTERVAL_MS : -DIM_STEP_INTERVAL_MS) * aChannel->getDimPerMS();
+  participants.push_back(p);
+  if (dimStepTicket==0) {
+    // first device, start the clock
+    nextStepAt = MainLoop::now()+DIM_START_DELAY;
+    dimStepTicket = MainLoop::currentMainLoop().executeOnceAt(boost::bind(&DimSession::dimStep, DimSessionPtr(this), _1), nextStepAt);
   }
-  if (isDimming) {
-    // now schedule next inc/update step
-    dimHandlerTicket = MainLoop::currentMainLoop().executeOnceAt(boost::bind(&Device::dimHandler, this, aChannel, aIncrement, _1), aNextDimAt);
+}
+
+
+void DimSession::removeDevice(Device *aDevice)
+{
+  for (DimParticipantList::iterator pos = participants.begin(); pos!=participants.end(); ++pos) {
+    if (pos->device.get()==aDevice) {
+      participants.erase(pos);
+      break;
+    }
+  }
+  if (participants.empty()) {
+    // last device gone, stop the clock
+    MainLoop::currentMainLoop().cancelExecutionTicket(dimStepTicket);
+  }
+}
+
+
+void DimSession::stop()
+{
+  LOG(LOG_INFO, "dim session: stopping dimming channel=%d for %d devices\n", channelType, (int)participants.size());
+  MainLoop::currentMainLoop().cancelExecutionTicket(dimStepTicket);
+  DimParticipantList stopped;
+  stopped.swap(participants);
+  for (DimParticipantList::iterator pos = stopped.begin(); pos!=stopped.end(); ++pos) {
+    pos->device->dimSessionStopped();
+  }
+}
+
+
+void DimSession::dimStep(MLMicroSeconds aNow)
+{
+  dimStepTicket = 0;
+  // single clock for all devices: if we are late, skip steps but keep up with actual dim time
+  int steps = 0;
+  do {
+    steps++;
+    nextStepAt += DIM_STEP_INTERVAL;
+  } while (nextStepAt<=aNow);
+  if (steps>1) {
+    LOG(LOG_DEBUG, "dim session: too slow while dimming channel=%d -> skipping %d dim steps\n", channelType, steps-1);
+  }
+  // increment channels and apply all devices in one batch
+  deviceContainer.beginApplyBatch();
+  for (DimParticipantList::iterator pos = participants.begin(); pos!=participants.end(); ++pos) {
+    pos->channel->dimChannelValue(steps*pos->increment, DIM_STEP_INTERVAL);
+    pos->device->requestApplyingChannels(NULL, true); // apply in dimming mode
+  }
+  deviceContainer.endApplyBatch();
+  // schedule next step
+  if (!participants.empty()) {
+    dimStepTicket = MainLoop::currentMainLoop().executeOnceAt(boost::bind(&DimSession::dimStep, DimSessionPtr(this), _1), nextStepAt);
   }
 }
 
@@ -812,6 +897,8 @@ void Device::requestApplyingChannels(DoneCB aAppliedOrSupersededCB, bool aForDim
   // c) hardware is not busy -> start apply right now
   if (applyInProgress) {
     FOCUSLOG("- requestApplyingChannels called while apply already running\n");
+    TRACE_POINT("device", "apply superseding", NULL);
+    if (Trace::current()) applyTraceId = Trace::current(); // final (re)apply will be on behalf of the most recent request
     // case a) confirm previous request because superseded
     if (appliedOrSupersededCB) {
       FOCUSLOG("- confirming previous (superseded) apply request\n");
@@ -823,9 +910,16 @@ void Device::requestApplyingChannels(DoneCB aAppliedOrSupersededCB, bool aForDim
     else {
       appliedOrSupersededCB = aAppliedOrSupersededCB;
     }
-    // - when previous request actually terminates, we need another update to make sure finally settled values are correct
-    missedApplyAttempts++;
-    FOCUSLOG("- missed requestApplyingChannels requests now %d\n", missedApplyAttempts);
+    if (applyBatched) {
+      // - apply has not yet started (waiting for end of apply batch), so it will pick up the latest values anyway
+      if (!aForDimming) batchedApplyForDimming = false;
+      FOCUSLOG("- apply still deferred in apply batch, no reapply needed\n");
+    }
+    else {
+      // - when previous request actually terminates, we need another update to make sure finally settled values are correct
+      missedApplyAttempts++;
+      FOCUSLOG("- missed requestApplyingChannels requests now %d\n", missedApplyAttempts);
+    }
   }
   else if (updateInProgress) {
     FOCUSLOG("- requestApplyingChannels called while update running -> postpone apply\n");
@@ -833,24 +927,71 @@ void Device::requestApplyingChannels(DoneCB aAppliedOrSupersededCB, bool aForDim
     missedApplyAttempts++;
     appliedOrSupersededCB = aAppliedOrSupersededCB;
     applyInProgress = true;
+    applyTraceId = Trace::current();
+    TRACE_POINT("device", "apply postponed (update running)", NULL);
   }
   else {
     // case c) applying is not currently in progress, start updating hardware now
-    FOCUSLOG("- ready, calling applyChannelValues() in device %s\n", shortDesc().c_str());
-    #if SERIALIZER_WATCHDOG
-    // - start watchdog
-    MainLoop::currentMainLoop().cancelExecutionTicket(serializerWatchdogTicket); // cancel old
-    serializerWatchdogTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&Device::serializerWatchdog, this), 10*Second); // new
-    FOCUSLOG("+++++ Serializer watchdog started for apply with ticket #%ld\n", serializerWatchdogTicket);
-    #endif
-    // - start applying
     appliedOrSupersededCB = aAppliedOrSupersededCB;
     applyInProgress = true;
-    applyChannelValues(boost::bind(&Device::applyingChannelsComplete, this), aForDimming);
+    applyTraceId = Trace::current();
+    DeviceContainer &dc = getDeviceContainer();
+    if (dc.inApplyBatch()) {
+      // apply batch is open (e.g. notification addressing multiple devices is being processed)
+      // -> defer actual apply until all devices have their new values, so device class container can optimize bus access
+      FOCUSLOG("- apply batch open, deferring applyChannelValues() in device %s\n", shortDesc().c_str());
+      TRACE_POINT("device", "apply batched", NULL);
+      applyRequestTime = dc.getApplyBatchStartTime();
+      applyBatched = true;
+      batchedApplyForDimming = aForDimming;
+      #if SERIALIZER_WATCHDOG
+      // - start watchdog already now, in case batch never gets executed
+      MainLoop::currentMainLoop().cancelExecutionTicket(serializerWatchdogTicket); // cancel old
+      serializerWatchdogTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&Device::serializerWatchdog, this), 10*Second); // new
+      #endif
+      classContainerP->addToApplyBatch(DevicePtr(this));
+    }
+    else {
+      applyRequestTime = MainLoop::now();
+      startApplying(aForDimming);
+    }
   }
 }
 
 
+void Device::startApplying(bool aForDimming)
+{
+  FOCUSLOG("- ready, calling applyChannelValues() in device %s\n", shortDesc().c_str());
+  #if SERIALIZER_WATCHDOG
+  // - start watchdog
+  MainLoop::currentMainLoop().cancelExecutionTicket(serializerWatchdogTicket); // cancel old
+  serializerWatchdogTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&Device::serializerWatchdog, this), 10*Second); // new
+  FOCUSLOG("+++++ Serializer watchdog started for apply with ticket #%ld\n", serializerWatchdogTicket);
+  #endif
+  // - start applying, hardware operations queued from here belong to the trace of the apply request
+  TraceContext tc(applyTraceId);
+  TRACE_POINT("device", "apply start", shortDesc().c_str());
+  applyChannelValues(boost::bind(&Device::applyingChannelsComplete, this), aForDimming);
+}
+
+
+void Device::executeBatchedApply()
+{
+  if (!applyBatched) return; // already force-ended or not batched at all
+  applyBatched = false;
+  LOG(LOG_DEBUG, "- deferred apply starting %lld uS after request in device %s\n", MainLoop::now()-applyRequestTime, shortDesc().c_str());
+  startApplying(batchedApplyForDimming);
+}
+
+
+void Device::batchedApplyComplete()
+{
+  if (!applyBatched) return; // already force-ended or not batched at all
+  applyBatched = false;
+  applyingChannelsComplete();
+}
+
+
 void Device::waitForApplyComplete(DoneCB aApplyCompleteCB)
 {
   if (!applyInProgress) {
@@ -932,6 +1073,10 @@ void Device::applyingChannelsComplete()
   #endif
   MainLoop::currentMainLoop().cancelExecutionTicket(serializerWatchdogTicket); // cancel watchdog
   applyInProgress = false;
+  applyBatched = false;
+  LOG(LOG_DEBUG, "- apply completed %lld uS after request in device %s\n", MainLoop::now()-applyRequestTime, shortDesc().c_str());
+  TRACE_EVENT(applyTraceId, "device", "apply complete", shortDesc().c_str());
+  TraceContext tc(applyTraceId);
   // if more apply request have happened in the meantime, we need to reapply now
   if (!checkForReapply()) {
     // apply complete and no final re-apply pending
@@ -1041,6 +1186,7 @@ void Device::updatingChannelsComplete()
 
 void Device::callScene(SceneNo aSceneNo, bool aForce)
 {
+  TRACE_POINT("device", "callScene", string_format("%s scene %d", shortDesc().c_str(), aSceneNo).c_str());
   // see if we have a scene table at all
   SceneDeviceSettingsPtr scenes = getScenes();
   if (scenes) {
@@ -26,6 +26,8 @@
 
 #include "dsscene.hpp"
 
+#include "tracing.hpp"
+
 using namespace std;
 
 namespace p44 {
@@ -40,6 +42,62 @@ namespace p44 {
 
   typedef boost::intrusive_ptr<OutputBehaviour> OutputBehaviourPtr;
 
+  class DimSession;
+  typedef boost::intrusive_ptr<DimSession> DimSessionPtr;
+
+
+  /// a (standard, non hardware-assisted) dimming process shared by all devices dimmed by the same command
+  /// @note the session uses a single clock for all participating devices, calculates the increments centrally
+  ///   and applies the new values of all devices in one apply batch per step. This keeps lamps in sync and
+  ///   avoids timers and apply calls growing with the number of devices.
+  class DimSession : public P44Obj
+  {
+    typedef struct {
+      DevicePtr device; ///< the participating device
+      ChannelBehaviourPtr channel; ///< the channel being dimmed in that device
+      double increment; ///< channel value change per dim step
+    } DimParticipant;
+    typedef list<DimParticipant> DimParticipantList;
+
+    DeviceContainer &deviceContainer;
+    DsChannelType channelType; ///< the channel type as requested by the dim command
+    DsDimMode dimMode; ///< dimming direction
+    DimParticipantList participants;
+    long dimStepTicket; ///< the single step timer for all participants
+    MLMicroSeconds nextStepAt; ///< the session clock
+
+  public:
+
+    DimSession(DeviceContainer &aDeviceContainer, DsChannelType aChannelType, DsDimMode aDimMode);
+    virtual ~DimSession();
+
+    /// @return channel type as requested by the dim command
+    DsChannelType getChannelType() { return channelType; };
+
+    /// @return dim mode of this session
+    DsDimMode getDimMode() { return dimMode; };
+
+    /// add a device to the session
+    /// @param aDevice the device
+    /// @param aChannel the channel to dim in this device
+    /// @note the first device added starts the session clock
+    void addDevice(DevicePtr aDevice, ChannelBehaviourPtr aChannel);
+
+    /// remove a device from the session (stop dimming it)
+    /// @param aDevice the device
+    /// @note removing the last device stops the session clock
+    void removeDevice(Device *aDevice);
+
+    /// stop dimming for all devices of this session at once
+    void stop();
+
+  private:
+
+    void dimStep(MLMicroSeconds aNow);
+
+  };
+
+
   /// base class representing a virtual digitalSTROM device.
   /// For each type of subsystem (EnOcean, DALI, ...) this class is subclassed to implement
   /// the device class' specifics, in particular the interface with the hardware.
@@ -52,6 +110,7 @@ namespace p44 {
     friend class DsBehaviour;
     friend class DsScene;
     friend class SceneChannels;
+    friend class DimSession;
 
   protected:
 
@@ -82,7 +141,7 @@ namespace p44 {
     long dimTimeoutTicket; ///< for timing out dimming operations (autostop when no INC/DEC is received)
     DsDimMode currentDimMode; ///< current dimming in progress
     DsChannelType currentDimChannel; ///< currently dimmed channel (if dimming in progress)
-    long dimHandlerTicket; ///< for standard dimming
+    DimSessionPtr dimSession; ///< the dim session this device participates in (standard dimming)
     bool isDimming; ///< if set, dimming is in progress
 
     // hardware access serializer/pacer
@@ -93,6 +152,10 @@ namespace p44 {
     DoneCB updatedOrCachedCB; ///< will be called when current values are either read from hardware, or new values have been requested for applying
     bool updateInProgress; ///< set when updating channel values from hardware is in progress
     long serializerWatchdogTicket; ///< watchdog terminating non-responding hardware requests
+    bool applyBatched; ///< set when apply is deferred to the end of the current apply batch (see DeviceContainer::beginApplyBatch())
+    bool batchedApplyForDimming; ///< dimming hint for the deferred apply
+    MLMicroSeconds applyRequestTime; ///< time when the current apply was requested (or the apply batch was opened)
+    TraceId applyTraceId; ///< trace of the request that caused the current apply, 0 if none
 
   public:
     Device(DeviceClassContainer *aClassContainerP);
@@ -264,6 +327,18 @@ namespace p44 {
     ///   avoid stacking up delayed requests.
     void requestApplyingChannels(DoneCB aAppliedOrSupersededCB, bool aForDimming);
 
+    /// execute an apply that was deferred to the end of an apply batch
+    /// @note this is called by DeviceClassContainer::applyChannelValuesBatch() and calls applyChannelValues()
+    void executeBatchedApply();
+
+    /// confirm a deferred apply that was performed by the device class container itself
+    /// @note to be called by DeviceClassContainer::applyChannelValuesBatch() implementations which have applied the
+    ///   channel values (and confirmed them with ChannelBehaviour::channelValueApplied()) by other means, e.g. a group command
+    void batchedApplyComplete();
+
+    /// @return true if the deferred apply may be optimized for dimming
+    bool isBatchedApplyForDimming() { return batchedApplyForDimming; };
+
     /// request callback when apply is really complete (all pending applies done)
     /// @param aApplyCompleteCB will called when values are applied and no other change is pending
     void waitForApplyComplete(DoneCB aApplyCompleteCB);
@@ -411,14 +486,14 @@ namespace p44 {
 
     void dimChannelForArea(DsChannelType aChannel, DsDimMode aDimMode, int aArea, MLMicroSeconds aAutoStopAfter);
     void dimAutostopHandler(DsChannelType aChannel);
-    void dimHandler(ChannelBehaviourPtr aChannel, double aIncrement, MLMicroSeconds aNow);
-    void dimDoneHandler(ChannelBehaviourPtr aChannel, double aIncrement, MLMicroSeconds aNextDimAt);
+    void dimSessionStopped();
     void outputSceneValueSaved(DsScenePtr aScene);
     void outputUndoStateSaved(DsBehaviourPtr aOutput, DsScenePtr aScene);
     void sceneValuesApplied(DsScenePtr aScene);
     void sceneActionsComplete(DsScenePtr aScene);
 
     void applyingChannelsComplete();
+    void startApplying(bool aForDimming);
     void updatingChannelsComplete();
     void serializerWatchdog();
     bool checkForReapply();
@@ -106,6 +106,35 @@ void DeviceClassContainer::addClassToDeviceContainer()
 
 
 
+MainLoop &DeviceClassContainer::commMainLoop()
+{
+  if (!getDeviceContainer().usesCommThreads()) {
+    return MainLoop::currentMainLoop();
+  }
+  if (!commThread) {
+    commThread = MainLoopThreadPtr(new MainLoopThread);
+  }
+  return commThread->mainLoop();
+}
+
+
+void DeviceClassContainer::startCommThread()
+{
+  if (commThread) {
+    LOG(LOG_INFO, "%s: running hardware communication on separate thread\n", deviceClassIdentifier());
+    commThread->start();
+  }
+}
+
+
+void DeviceClassContainer::stopCommThread()
+{
+  if (commThread) {
+    commThread->stop();
+  }
+}
+
+
 void DeviceClassContainer::initialize(CompletedCB aCompletedCB, bool aFactoryReset)
 {
   // done
@@ -208,6 +237,35 @@ void DeviceClassContainer::removeDevices(bool aForget)
 
 
 
+#pragma mark - apply batching
+
+
+void DeviceClassContainer::addToApplyBatch(DevicePtr aDevice)
+{
+  applyBatchDevices.push_back(aDevice);
+}
+
+
+void DeviceClassContainer::executeApplyBatch()
+{
+  if (applyBatchDevices.empty()) return;
+  // take the list, new applies requested from callbacks must go into a new batch
+  DeviceVector batch;
+  batch.swap(applyBatchDevices);
+  LOG(LOG_DEBUG, "vdc %s: executing apply batch for %d devices\n", shortDesc().c_str(), (int)batch.size());
+  applyChannelValuesBatch(batch);
+}
+
+
+void DeviceClassContainer::applyChannelValuesBatch(DeviceVector &aDevices)
+{
+  // base class: no bus level optimization, just let every device apply individually
+  for (DeviceVector::iterator pos = aDevices.begin(); pos!=aDevices.end(); ++pos) {
+    (*pos)->executeBatchedApply();
+  }
+}
+
+
 #pragma mark - persistent vdc level params
 
 
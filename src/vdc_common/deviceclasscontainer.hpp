@@ -78,6 +78,12 @@ namespace p44 {
   
     DeviceVector devices; ///< the devices of this class
 
+  private:
+
+    DeviceVector applyBatchDevices; ///< devices which have deferred applying channel values until end of current apply batch
+
+    MainLoopThreadPtr commThread; ///< thread for hardware communication, if any
+
   public:
 
     /// @param aInstanceNumber index which uniquely (and as stable as possible) identifies a particular instance
@@ -90,6 +96,27 @@ namespace p44 {
     /// add device class to device container.
     void addClassToDeviceContainer();
 
+    /// @name hardware communication thread
+    /// @{
+
+    /// get the mainloop to run hardware communication (e.g. an OperationQueue) on
+    /// @return mainloop of a separate thread if the device container has comm threads enabled (see
+    ///   DeviceContainer::setCommThreads()), the current mainloop otherwise.
+    /// @note The thread is created on first call, but only starts running with startCommThread().
+    ///   Devices and the container itself always remain on the current mainloop.
+    MainLoop &commMainLoop();
+
+    /// start the hardware communication thread (if any)
+    /// @note called by the device container before initializing the class containers
+    void startCommThread();
+
+    /// stop the hardware communication thread (if any)
+    /// @note subclasses that use commMainLoop() must call this in their destructor, before the objects
+    ///   running on the thread get destroyed
+    void stopCommThread();
+
+    /// @}
+
 		/// initialize
 		/// @param aCompletedCB will be called when initialisation is complete
 		///   callback will return an error if initialisation has failed and the device class is not functional
@@ -222,6 +249,29 @@ namespace p44 {
 		/// @}
 
 
+    /// @name apply batching
+    /// @{
+
+    /// register a device which has deferred applying its channel values until the end of the current apply batch
+    /// @param aDevice the device
+    /// @note called by Device::requestApplyingChannels() while DeviceContainer::inApplyBatch()
+    void addToApplyBatch(DevicePtr aDevice);
+
+    /// execute all applies deferred during the now ended apply batch
+    /// @note called by DeviceContainer::endApplyBatch()
+    void executeApplyBatch();
+
+    /// apply channel values for all devices which have deferred applying during an apply batch
+    /// @param aDevices the devices with deferred apply, in order of their apply requests
+    /// @note base class just starts Device::executeBatchedApply() for each device.
+    ///   Subclasses may override this to combine the outputs into fewer bus operations (e.g. group or broadcast commands).
+    ///   For devices applied that way, the implementation must confirm the applied channels with ChannelBehaviour::channelValueApplied()
+    ///   and then call Device::batchedApplyComplete(); for all other devices it must call Device::executeBatchedApply().
+    virtual void applyChannelValuesBatch(DeviceVector &aDevices);
+
+    /// @}
+
+
     /// @name vdc level property persistence
     /// @{
 
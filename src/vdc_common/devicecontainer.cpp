@@ -56,6 +56,9 @@ using namespace p44;
 // how long until a not acknowledged announcement for a device is retried again for the same device
 #define ANNOUNCE_RETRY_TIMEOUT (300*Second)
 
+// how long to wait before trying again when the vdSM connection has too many requests awaiting an answer
+#define ANNOUNCE_BACKPRESSURE_DELAY (1*Second)
+
 // default product name
 #define DEFAULT_PRODUCT_NAME "plan44.ch vdcd"
 
@@ -63,6 +66,10 @@ DeviceContainer::DeviceContainer() :
   mac(0),
   externalDsuid(false),
   DsAddressable(this),
+  packedSceneStorage(false),
+  commThreads(false),
+  applyBatchLevel(0),
+  applyBatchStartTime(Never),
   collecting(false),
   lastActivity(0),
   lastPeriodicRun(0),
@@ -261,6 +268,10 @@ void DeviceContainer::initialize(CompletedCB aCompletedCB, bool aFactoryReset)
 	string_format_append(databaseName, "DsParams.sqlite3");
   ErrorPtr error = dsParamStore.connectAndInitialize(databaseName.c_str(), DSPARAMS_SCHEMA_VERSION, DSPARAMS_SCHEMA_MIN_VERSION, aFactoryReset);
 
+  // start communication threads of class containers (all set up by now)
+  for (ContainerMap::iterator pos = deviceClassContainers.begin(); pos!=deviceClassContainers.end(); ++pos) {
+    pos->second->startCommThread();
+  }
   // start initialisation of class containers
   DeviceClassInitializer::initialize(*this, aCompletedCB, aFactoryReset);
 }
@@ -586,7 +597,7 @@ void DeviceContainer::periodicTask(MLMicroSeconds aCycleStartTime)
     }
   }
   // schedule next run
-  periodicTaskTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&DeviceContainer::periodicTask, this, _1), PERIODIC_TASK_INTERVAL);
+  periodicTaskTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&DeviceContainer::periodicTask, this, _1), PERIODIC_TASK_INTERVAL, "vdc host periodic task");
 }
 
 
@@ -648,6 +659,7 @@ void DeviceContainer::handleClickLocally(ButtonBehaviour &aButtonBehaviour, DsCl
     }
     signalActivity(); // local activity
     // some action to perform on every light device
+    beginApplyBatch();
     for (DsDeviceMap::iterator pos = dSDevices.begin(); pos!=dSDevices.end(); ++pos) {
       DevicePtr dev = pos->second;
       if (scene==STOP_S) {
@@ -682,7 +694,53 @@ void DeviceContainer::handleClickLocally(ButtonBehaviour &aButtonBehaviour, DsCl
         }
       }
     }
+    endApplyBatch();
+  }
+}
+
+
+
+#pragma mark - apply batching
+
+
+void DeviceContainer::beginApplyBatch()
+{
+  if (applyBatchLevel==0) {
+    applyBatchStartTime = MainLoop::now();
+  }
+  applyBatchLevel++;
+}
+
+
+void DeviceContainer::endApplyBatch()
+{
+  if (applyBatchLevel<=0) return; // not in a batch
+  if (--applyBatchLevel>0) return; // still in outer batch
+  // devices starting to dim from now on belong to another command
+  batchDimSession.reset();
+  // outermost batch ended: let all vdcs execute their deferred applies
+  for (ContainerMap::iterator pos = deviceClassContainers.begin(); pos!=deviceClassContainers.end(); ++pos) {
+    pos->second->executeApplyBatch();
+  }
+  LOG(LOG_DEBUG, "Apply batch executed %lld uS after opening\n", MainLoop::now()-applyBatchStartTime);
+}
+
+
+DimSessionPtr DeviceContainer::getDimSession(DsChannelType aChannelType, DsDimMode aDimMode)
+{
+  if (
+    inApplyBatch() && batchDimSession &&
+    batchDimSession->getChannelType()==aChannelType && batchDimSession->getDimMode()==aDimMode
+  ) {
+    // same command, join existing session
+    return batchDimSession;
+  }
+  DimSessionPtr ds = DimSessionPtr(new DimSession(*this, aChannelType, aDimMode));
+  if (inApplyBatch()) {
+    // other devices dimmed by the same command will join this session
+    batchDimSession = ds;
   }
+  return ds;
 }
 
 
@@ -769,11 +827,14 @@ void DeviceContainer::vdcApiRequestHandler(VdcApiConnectionPtr aApiConnection, V
         // can be single dSUID or array of dSUIDs
         if (o->isType(apivalue_array)) {
           // array of dSUIDs
+          // - batch resulting applies such that all devices can be updated at once
+          beginApplyBatch();
           for (int i=0; i<o->arrayLength(); i++) {
             ApiValuePtr e = o->arrayGet(i);
             dsuid.setAsBinary(e->binaryValue());
             handleNotificationForDsUid(aMethod, dsuid, aParams);
           }
+          endApplyBatch();
         }
         else {
           // single dSUID
@@ -1024,6 +1085,12 @@ void DeviceContainer::announceNext()
   if (collecting) return; // prevent announcements during collect.
   // cancel re-announcing
   MainLoop::currentMainLoop().cancelExecutionTicket(announcementTicket);
+  if (activeSessionConnection && !activeSessionConnection->canSendRequest()) {
+    // vdSM has not yet answered too many of our requests, wait before adding more
+    LOG(LOG_INFO, "vdSM connection has too many unanswered requests, postponing announcements\n");
+    announcementTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&DeviceContainer::announceNext, this), ANNOUNCE_BACKPRESSURE_DELAY);
+    return;
+  }
   // announce vdcs first
   for (ContainerMap::iterator pos = deviceClassContainers.begin(); pos!=deviceClassContainers.end(); ++pos) {
     DeviceClassContainerPtr vdc = pos->second;
@@ -1121,10 +1188,12 @@ void DeviceContainer::handleNotification(const string &aMethod, ApiValuePtr aPar
 static char devicecontainer_key;
 static char vdc_container_key;
 static char vdc_key;
+static char mainloopstats_key;
 
 enum {
   vdcs_key,
   webui_url_key,
+  mainloopStats_key,
   numDeviceContainerProperties
 };
 
@@ -1144,7 +1213,8 @@ PropertyDescriptorPtr DeviceContainer::getDescriptorByIndex(int aPropIndex, int
 {
   static const PropertyDescription properties[numDeviceContainerProperties] = {
     { "x-p44-vdcs", apivalue_object+propflag_container, vdcs_key, OKEY(vdc_container_key) },
-    { "configURL", apivalue_string, webui_url_key, OKEY(devicecontainer_key) }
+    { "configURL", apivalue_string, webui_url_key, OKEY(devicecontainer_key) },
+    { "x-p44-mainloopStats", apivalue_object, mainloopStats_key, OKEY(mainloopstats_key) }
   };
   int n = inherited::numProps(aDomain, aParentDescriptor);
   if (aPropIndex<n)
@@ -1186,6 +1256,13 @@ PropertyContainerPtr DeviceContainer::getContainer(PropertyDescriptorPtr &aPrope
       i++;
     }
   }
+  else if (aPropertyDescriptor->hasObjectKey(mainloopstats_key)) {
+    if (!mainloopStats) {
+      mainloopStats = MainLoopStatsPtr(new MainLoopStats(MainLoop::currentMainLoop()));
+    }
+    aPropertyDescriptor.reset(); // next level is root of the statistics container
+    return mainloopStats;
+  }
   // unknown here
   return NULL;
 }
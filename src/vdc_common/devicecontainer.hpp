@@ -31,6 +31,7 @@
 #include "digitalio.hpp"
 
 #include "vdcapi.hpp"
+#include "mainloopstats.hpp"
 
 
 using namespace std;
@@ -40,10 +41,12 @@ namespace p44 {
   class DeviceClassContainer;
   class Device;
   class ButtonBehaviour;
+  class DimSession;
   class DsUid;
 
   typedef boost::intrusive_ptr<DeviceClassContainer> DeviceClassContainerPtr;
   typedef boost::intrusive_ptr<Device> DevicePtr;
+  typedef boost::intrusive_ptr<DimSession> DimSessionPtr;
 
   /// generic callback for signalling something done
   typedef boost::function<void ()> DoneCB;
@@ -98,6 +101,13 @@ namespace p44 {
     DsDeviceMap dSDevices; ///< available devices by API-exposed ID (dSUID or derived dsid)
     DsParamStore dsParamStore; ///< the database for storing dS device parameters
 
+    bool packedSceneStorage; ///< if set, device scene tables are stored as one packed record per device
+    bool commThreads; ///< if set, device class containers may run their hardware communication on a separate thread
+
+    int applyBatchLevel; ///< nesting level of apply batches, >0 means applies are deferred
+    MLMicroSeconds applyBatchStartTime; ///< time when the outermost apply batch was opened
+    DimSessionPtr batchDimSession; ///< dim session shared by all devices starting to dim within the current apply batch
+
     string iconDir; ///< the directory where to load icons from
     string persistentDataDir; ///< the directory for the vdcd to store SQLite DBs and possibly other persistent data
 
@@ -126,6 +136,7 @@ namespace p44 {
     // mainloop statistics
     int mainloopStatsInterval; ///< 0=none, N=every PERIODIC_TASK_INTERVAL*N seconds
     int mainLoopStatsCounter;
+    MainLoopStatsPtr mainloopStats; ///< property container exposing mainloop statistics, created on first access
 
     // active vDC API session
     DsUid connectedVdsm;
@@ -251,6 +262,47 @@ namespace p44 {
     /// get the dsParamStore
     DsParamStore &getDsParamStore() { return dsParamStore; }
 
+    /// set how device scene tables are persisted
+    /// @param aPackedSceneStorage if set, all non-default scenes of a device are stored as one packed
+    ///   record within the device's settings row, rather than one row per scene.
+    /// @note switching modes is possible at any time; scene tables are converted when loaded.
+    /// @note must be set before devices are loaded
+    void setPackedSceneStorage(bool aPackedSceneStorage) { packedSceneStorage = aPackedSceneStorage; };
+
+    /// @return true if device scene tables are stored as one packed record per device
+    bool usesPackedSceneStorage() { return packedSceneStorage; };
+
+    /// enable running hardware communication (e.g. DALI bridge, EnOcean modem) on separate threads
+    /// @param aCommThreads if set, device class containers that support it run their bus communication on a thread
+    ///   of their own, so slow frames or retries on one bus do not delay the others or the vDC API.
+    /// @note must be set before device class containers are created
+    void setCommThreads(bool aCommThreads) { commThreads = aCommThreads; };
+
+    /// @return true if device class containers should run their hardware communication on separate threads
+    bool usesCommThreads() { return commThreads; };
+
+    /// open an apply batch: channel applies requested by devices are deferred until the batch ends,
+    /// such that device class containers can apply all changes at once with optimal bus usage
+    /// @note batches can be nested, applies are executed when the outermost batch ends
+    void beginApplyBatch();
+
+    /// end an apply batch opened with beginApplyBatch()
+    /// @note ending the outermost batch executes all deferred applies via DeviceClassContainer::applyChannelValuesBatch()
+    void endApplyBatch();
+
+    /// @return true if an apply batch is currently open
+    bool inApplyBatch() { return applyBatchLevel>0; };
+
+    /// @return time when the current (outermost) apply batch was opened
+    MLMicroSeconds getApplyBatchStartTime() { return applyBatchStartTime; };
+
+    /// get the dim session for a device starting to dim
+    /// @param aChannelType the channel type to dim
+    /// @param aDimMode the dim direction
+    /// @return dim session. All devices starting to dim the same channel type in the same direction within
+    ///   the same apply batch (i.e. by the same command) get the same session.
+    DimSessionPtr getDimSession(DsChannelType aChannelType, DsDimMode aDimMode);
+
     /// @}
 
 
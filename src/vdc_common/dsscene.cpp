@@ -431,11 +431,19 @@ bool DsScene::accessField(PropertyAccessMode aMode, ApiValuePtr aPropValue, Prop
 
 
 SceneDeviceSettings::SceneDeviceSettings(Device &aDevice) :
-  inherited(aDevice)
+  inherited(aDevice),
+  hasPackedScenes(false),
+  sceneRowsObsolete(false)
 {
 }
 
 
+bool SceneDeviceSettings::usePackedScenes()
+{
+  return device.getDeviceContainer().usesPackedSceneStorage();
+}
+
+
 DsScenePtr SceneDeviceSettings::newDefaultScene(SceneNo aSceneNo)
 {
   SimpleScenePtr simpleScene = SimpleScenePtr(new SimpleScene(*this, aSceneNo));
@@ -454,10 +462,20 @@ DsScenePtr SceneDeviceSettings::getScene(SceneNo aSceneNo)
     // found scene params in map
     return pos->second;
   }
-  else {
-    // just return default values for this scene
-    return newDefaultScene(aSceneNo);
+  // see if we have it in packed form, not yet decoded
+  PackedSceneMap::iterator ppos = packedScenes.find(aSceneNo);
+  if (ppos!=packedScenes.end()) {
+    DsScenePtr scene = unpackScene(aSceneNo, ppos->second);
+    if (scene) {
+      // decoded now, becomes a regular non-default scene
+      packedScenes.erase(ppos);
+      scenes[aSceneNo] = scene;
+      return scene;
+    }
+    LOG(LOG_ERR,"Cannot decode packed scene %d for device %s -> using default values\n", aSceneNo, device.shortDesc().c_str());
   }
+  // just return default values for this scene
+  return newDefaultScene(aSceneNo);
 }
 
 
@@ -470,21 +488,302 @@ void SceneDeviceSettings::updateScene(DsScenePtr aScene)
   }
   // anyway, mark scene dirty
   aScene->markDirty();
-  // as we need the ROWID of the lightsettings as parentID, make sure we get saved if we don't have one
-  if (rowid==0) markDirty();
+  if (usePackedScenes()) {
+    // packed scene table is part of our own row, so we need to be saved
+    markDirty();
+  }
+  else {
+    // as we need the ROWID of the lightsettings as parentID, make sure we get saved if we don't have one
+    if (rowid==0) markDirty();
+  }
 }
 
 
 
 
+#pragma mark - packed scene table
+
+// Packed scene table format
+// - byte 0 : PACKED_SCENES_VERSION
+// - for each non-default scene:
+//   - scene number (1 byte)
+//   - length of scene record (varint)
+//   - scene record:
+//     - number of fields (varint)
+//     - for each field (in getFieldDef() order): SQLite type code (1 byte), followed by
+//       - SQLITE_INTEGER : zigzag encoded varint
+//       - SQLITE_FLOAT : 8 bytes IEEE754, LSB first
+//       - SQLITE_TEXT, SQLITE_BLOB : length (varint), followed by the data bytes
+//       - SQLITE_NULL : nothing
+// Note: fields are mapped by position. Records with fewer fields than the current scene
+//   class has (older versions) leave the missing fields NULL, like adding a column to the table would do.
+
+#define PACKED_SCENES_VERSION 1
+
+static void appendVarUInt(string &aBuf, uint64_t aValue)
+{
+  do {
+    uint8_t b = aValue & 0x7F;
+    aValue >>= 7;
+    if (aValue) b |= 0x80;
+    aBuf.append(1, (char)b);
+  } while (aValue);
+}
+
+
+static bool getVarUInt(const uint8_t *&aP, const uint8_t *aEnd, uint64_t &aValue)
+{
+  aValue = 0;
+  int shift = 0;
+  while (aP<aEnd && shift<64) {
+    uint8_t b = *aP++;
+    aValue |= (uint64_t)(b & 0x7F)<<shift;
+    if ((b & 0x80)==0) return true;
+    shift += 7;
+  }
+  return false; // truncated
+}
+
+
+bool SceneDeviceSettings::packScene(DsScenePtr aScene, string &aPackedScene)
+{
+  // let the scene bind its values to a parameter-only SELECT, so we get them back in a row, typed
+  size_t numKeys = aScene->numKeyDefs();
+  size_t numFields = aScene->numFieldDefs();
+  string sql = "SELECT ?";
+  for (size_t i=1; i<numKeys+numFields; ++i) sql += ",?";
+  sqlite3pp::query qry(paramStore);
+  if (qry.prepare(sql.c_str())!=SQLITE_OK) return false;
+  int index = 1; // SQLite parameter indexes are 1-based!
+  aScene->bindToStatement(qry, index, "", 0);
+  sqlite3pp::query::iterator row = qry.begin();
+  if (row==qry.end()) return false;
+  // encode data fields (key fields are implied by the packed table's parent and the scene number)
+  aPackedScene.clear();
+  appendVarUInt(aPackedScene, numFields);
+  for (int i=(int)numKeys; i<(int)(numKeys+numFields); ++i) {
+    int t = row->column_type(i);
+    aPackedScene.append(1, (char)t);
+    switch (t) {
+      case SQLITE_INTEGER: {
+        int64_t v = row->get<long long>(i);
+        appendVarUInt(aPackedScene, ((uint64_t)v<<1) ^ (uint64_t)(v>>63)); // zigzag
+        break;
+      }
+      case SQLITE_FLOAT: {
+        double d = row->get<double>(i);
+        uint64_t v;
+        memcpy(&v, &d, sizeof(v));
+        for (int b=0; b<8; ++b) { aPackedScene.append(1, (char)(v & 0xFF)); v >>= 8; }
+        break;
+      }
+      case SQLITE_TEXT:
+      case SQLITE_BLOB: {
+        const char *p = t==SQLITE_TEXT ? row->get<const char *>(i) : (const char *)row->get<const void *>(i);
+        size_t n = row->column_bytes(i);
+        appendVarUInt(aPackedScene, n);
+        if (n>0) aPackedScene.append(p, n);
+        break;
+      }
+      default:
+        break; // NULL
+    }
+  }
+  return true;
+}
+
+
+DsScenePtr SceneDeviceSettings::unpackScene(SceneNo aSceneNo, const string &aPackedScene)
+{
+  DsScenePtr scene = newDefaultScene(aSceneNo);
+  // have the scene load its values from a parameter-only SELECT row: ROWID, key fields, data fields
+  size_t numKeys = scene->numKeyDefs();
+  size_t numFields = scene->numFieldDefs();
+  string sql = "SELECT 0"; // ROWID: not stored as a separate row
+  for (size_t i=0; i<numKeys+numFields; ++i) sql += ",?";
+  sqlite3pp::query qry(paramStore);
+  if (qry.prepare(sql.c_str())!=SQLITE_OK) return DsScenePtr();
+  // - last key field is the scene number (parent ID is not loaded from rows)
+  qry.bind((int)numKeys, (int)aSceneNo);
+  // - data fields
+  const uint8_t *p = (const uint8_t *)aPackedScene.data();
+  const uint8_t *e = p+aPackedScene.size();
+  uint64_t n;
+  if (!getVarUInt(p, e, n)) return DsScenePtr();
+  for (int i=0; i<(int)n; ++i) {
+    if (p>=e) return DsScenePtr();
+    int t = *p++;
+    int idx = (int)numKeys+1+i; // SQLite parameter indexes are 1-based!
+    bool use = (size_t)i<numFields; // ignore extra fields (from newer versions)
+    switch (t) {
+      case SQLITE_INTEGER: {
+        uint64_t v;
+        if (!getVarUInt(p, e, v)) return DsScenePtr();
+        if (use) qry.bind(idx, (long long)((v>>1) ^ (~(v & 1)+1))); // zigzag
+        break;
+      }
+      case SQLITE_FLOAT: {
+        if (e-p<8) return DsScenePtr();
+        uint64_t v = 0;
+        for (int b=7; b>=0; --b) { v = (v<<8) | p[b]; }
+        p += 8;
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        if (use) qry.bind(idx, d);
+        break;
+      }
+      case SQLITE_TEXT:
+      case SQLITE_BLOB: {
+        uint64_t l;
+        if (!getVarUInt(p, e, l) || (uint64_t)(e-p)<l) return DsScenePtr();
+        if (use) {
+          if (t==SQLITE_TEXT)
+            qry.bind(idx, string((const char *)p, (size_t)l).c_str(), false); // not static, copied
+          else
+            qry.bind(idx, p, (int)l, false); // not static, copied
+        }
+        p += l;
+        break;
+      }
+      case SQLITE_NULL:
+        break; // unbound parameters are NULL
+      default:
+        return DsScenePtr(); // unknown type
+    }
+  }
+  sqlite3pp::query::iterator row = qry.begin();
+  if (row==qry.end()) return DsScenePtr();
+  int index = 0;
+  uint64_t flags;
+  scene->loadFromRow(row, index, &flags);
+  return scene;
+}
+
+
+string SceneDeviceSettings::packedSceneTable()
+{
+  string packed;
+  packed.append(1, (char)PACKED_SCENES_VERSION);
+  // merge decoded and not yet decoded scenes, ordered by scene number
+  DsSceneMap::iterator spos = scenes.begin();
+  PackedSceneMap::iterator ppos = packedScenes.begin();
+  while (spos!=scenes.end() || ppos!=packedScenes.end()) {
+    string rec;
+    SceneNo sceneNo;
+    if (ppos==packedScenes.end() || (spos!=scenes.end() && spos->first<=ppos->first)) {
+      // decoded scene, (re-)encode it
+      sceneNo = spos->first;
+      if (ppos!=packedScenes.end() && ppos->first==sceneNo) ++ppos; // decoded version supersedes packed one
+      DsScenePtr scene = spos->second;
+      ++spos;
+      if (!packScene(scene, rec)) {
+        LOG(LOG_ERR,"Cannot encode scene %d for device %s: %s\n", sceneNo, device.shortDesc().c_str(), paramStore.error()->description().c_str());
+        continue;
+      }
+      // values are now contained in our own row (which is dirty and will be saved)
+      scene->markClean();
+    }
+    else {
+      // not decoded, copy the packed record
+      sceneNo = ppos->first;
+      rec = ppos->second;
+      ++ppos;
+    }
+    packed.append(1, (char)sceneNo);
+    appendVarUInt(packed, rec.size());
+    packed.append(rec);
+  }
+  return packed;
+}
+
+
+bool SceneDeviceSettings::splitPackedSceneTable(const uint8_t *aData, size_t aSize)
+{
+  packedScenes.clear();
+  const uint8_t *e = aData+aSize;
+  if (aSize<1 || *aData++!=PACKED_SCENES_VERSION) return false;
+  while (aData<e) {
+    SceneNo sceneNo = *aData++;
+    uint64_t l;
+    if (!getVarUInt(aData, e, l) || (uint64_t)(e-aData)<l) return false;
+    packedScenes[sceneNo] = string((const char *)aData, (size_t)l);
+    aData += l;
+  }
+  return true;
+}
+
+
 
 #pragma mark - scene table persistence
 
 
+// data field definitions
+
+static const size_t numSceneSettingsFields = 1;
+
+size_t SceneDeviceSettings::numFieldDefs()
+{
+  return inherited::numFieldDefs()+numSceneSettingsFields;
+}
+
+
+const FieldDefinition *SceneDeviceSettings::getFieldDef(size_t aIndex)
+{
+  static const FieldDefinition dataDefs[numSceneSettingsFields] = {
+    { "packedScenes", SQLITE_BLOB } // NULL when scenes are stored as separate rows
+  };
+  if (aIndex<inherited::numFieldDefs())
+    return inherited::getFieldDef(aIndex);
+  aIndex -= inherited::numFieldDefs();
+  if (aIndex<numSceneSettingsFields)
+    return &dataDefs[aIndex];
+  return NULL;
+}
+
+
+/// load values from passed row
+void SceneDeviceSettings::loadFromRow(sqlite3pp::query::iterator &aRow, int &aIndex, uint64_t *aCommonFlagsP)
+{
+  inherited::loadFromRow(aRow, aIndex, aCommonFlagsP);
+  // get the packed scenes, if any
+  hasPackedScenes = false;
+  packedScenes.clear();
+  if (aRow->column_type(aIndex)==SQLITE_BLOB) {
+    hasPackedScenes = splitPackedSceneTable((const uint8_t *)aRow->get<const void *>(aIndex), aRow->column_bytes(aIndex));
+    if (!hasPackedScenes) {
+      LOG(LOG_ERR,"Invalid or unsupported packed scene table for device %s -> ignored\n", device.shortDesc().c_str());
+      packedScenes.clear();
+    }
+  }
+  aIndex++;
+}
+
+
+// bind values to passed statement
+void SceneDeviceSettings::bindToStatement(sqlite3pp::statement &aStatement, int &aIndex, const char *aParentIdentifier, uint64_t aCommonFlags)
+{
+  inherited::bindToStatement(aStatement, aIndex, aParentIdentifier, aCommonFlags);
+  // bind the packed scene table
+  if (usePackedScenes()) {
+    string packed = packedSceneTable();
+    aStatement.bind(aIndex++, packed.data(), (int)packed.size(), false); // not static, copied
+    hasPackedScenes = true;
+    sceneRowsObsolete = true;
+  }
+  else {
+    aStatement.bind(aIndex++); // NULL, scenes are in separate rows
+  }
+}
+
+
 // load child parameters (scenes)
 ErrorPtr SceneDeviceSettings::loadChildren()
 {
   ErrorPtr err;
+  if (usePackedScenes() && hasPackedScenes) {
+    // all non-default scenes are in the packed table loaded with our own row
+    return err;
+  }
   // my own ROWID is the parent key for the children
   string parentID = string_format("%d",rowid);
   // create a template
@@ -509,6 +808,28 @@ ErrorPtr SceneDeviceSettings::loadChildren()
     }
     delete queryP; queryP = NULL;
   }
+  if (usePackedScenes()) {
+    // migrating from row-per-scene storage: scene rows will be replaced by the packed table at next save
+    if (scenes.size()>0) markDirty();
+  }
+  else if (hasPackedScenes) {
+    // packed storage was used before: convert back to row-per-scene storage
+    for (PackedSceneMap::iterator pos = packedScenes.begin(); pos!=packedScenes.end(); ++pos) {
+      DsScenePtr scene = unpackScene(pos->first, pos->second);
+      if (!scene) {
+        LOG(LOG_ERR,"Cannot decode packed scene %d for device %s -> lost\n", pos->first, device.shortDesc().c_str());
+        continue;
+      }
+      // packed version is more recent than possibly remaining row, so replace it
+      DsSceneMap::iterator spos = scenes.find(pos->first);
+      if (spos!=scenes.end()) scene->rowid = spos->second->rowid;
+      scene->markDirty();
+      scenes[pos->first] = scene;
+    }
+    packedScenes.clear();
+    hasPackedScenes = false;
+    markDirty(); // to get packed table removed from our row
+  }
   return err;
 }
 
@@ -518,6 +839,31 @@ ErrorPtr SceneDeviceSettings::saveChildren()
   ErrorPtr err;
   // Cannot save children before I have my own rowID
   if (rowid!=0) {
+    if (usePackedScenes()) {
+      // scenes are saved in our own row, only remove left-over rows from row-per-scene storage.
+      // Note: called within the same transaction as saving our own row (see saveInTransaction())
+      for (DsSceneMap::iterator pos = scenes.begin(); pos!=scenes.end(); ++pos) {
+        if (pos->second->isDirty()) {
+          // changed without having our own row marked dirty, make sure it gets saved next time
+          markDirty();
+        }
+      }
+      if (sceneRowsObsolete) {
+        // packed table was just written: remove all scene rows of this device at once,
+        // including rows not loaded (e.g. left over from an interrupted save before)
+        string parentID = string_format("%d",rowid);
+        DsScenePtr scene = newDefaultScene(0);
+        if (paramStore.executef("DELETE FROM %s WHERE %s='%s'", scene->tableName(), scene->getKeyDef(0)->fieldName, parentID.c_str())!=SQLITE_OK) {
+          err = paramStore.error();
+          LOG(LOG_ERR,"Error removing scene rows for device %s: %s", device.shortDesc().c_str(), err->description().c_str());
+        }
+        else {
+          for (DsSceneMap::iterator pos = scenes.begin(); pos!=scenes.end(); ++pos) pos->second->rowid = 0;
+          sceneRowsObsolete = false;
+        }
+      }
+      return err;
+    }
     // my own ROWID is the parent key for the children
     string parentID = string_format("%d",rowid);
     // save all elements of the map (only dirty ones will be actually stored to DB
@@ -537,7 +883,8 @@ ErrorPtr SceneDeviceSettings::deleteChildren()
   for (DsSceneMap::iterator pos = scenes.begin(); pos!=scenes.end(); ++pos) {
     err = pos->second->deleteFromStore();
   }
+  // packed table was part of our own row, which is deleted now
+  packedScenes.clear();
+  hasPackedScenes = false;
   return err;
 }
-
-
@@ -188,6 +188,7 @@ namespace p44 {
   };
   typedef boost::intrusive_ptr<DsScene> DsScenePtr;
   typedef map<SceneNo, DsScenePtr> DsSceneMap;
+  typedef map<SceneNo, string> PackedSceneMap;
 
 
 
@@ -199,6 +200,9 @@ namespace p44 {
   ///   most DsScene objects are created on the fly via the newDefaultScene() factory method only when
   ///   needed e.g. for calling a scene. Only scenes that were explicitly configured to differ from the
   ///   standard scene values for the behaviour are actually persisted into the database.
+  /// @note When the device container is set to packed scene storage, the non-default scenes are not stored
+  ///   as separate rows, but as a single versioned binary record within the device settings row. Scenes
+  ///   loaded from packed storage are only decoded into DsScene objects when accessed.
   class SceneDeviceSettings : public DeviceSettings
   {
     typedef DeviceSettings inherited;
@@ -208,6 +212,9 @@ namespace p44 {
     friend class SceneChannels;
 
     DsSceneMap scenes; ///< the user defined scenes (default scenes will be created on the fly)
+    PackedSceneMap packedScenes; ///< user defined scenes loaded from packed storage, but not yet decoded
+    bool hasPackedScenes; ///< set if the settings row contains a packed scene table
+    bool sceneRowsObsolete; ///< set when a packed scene table was written, scene rows must be removed in the same transaction
 
   public:
     SceneDeviceSettings(Device &aDevice);
@@ -244,11 +251,40 @@ namespace p44 {
   protected:
 
     // persistence implementation
+    virtual size_t numFieldDefs();
+    virtual const FieldDefinition *getFieldDef(size_t aIndex);
+    virtual void loadFromRow(sqlite3pp::query::iterator &aRow, int &aIndex, uint64_t *aCommonFlagsP);
+    virtual void bindToStatement(sqlite3pp::statement &aStatement, int &aIndex, const char *aParentIdentifier, uint64_t aCommonFlags);
     virtual ErrorPtr loadChildren();
     virtual ErrorPtr saveChildren();
     virtual ErrorPtr deleteChildren();
+    virtual bool saveInTransaction() { return usePackedScenes(); };
     
     /// @}
+
+  private:
+
+    /// @return true if scenes are to be stored packed into the settings row
+    bool usePackedScenes();
+
+    /// encode a scene's fields into a packed scene record
+    /// @param aScene the scene to encode
+    /// @param aPackedScene will be set to the packed scene record
+    /// @return false if scene could not be encoded
+    bool packScene(DsScenePtr aScene, string &aPackedScene);
+
+    /// decode a packed scene record into a new scene object
+    /// @param aSceneNo the scene number
+    /// @param aPackedScene the packed scene record as created by packScene()
+    /// @return new scene object, or NULL if record could not be decoded
+    DsScenePtr unpackScene(SceneNo aSceneNo, const string &aPackedScene);
+
+    /// @return the entire packed scene table (all non-default scenes)
+    string packedSceneTable();
+
+    /// split a packed scene table into per-scene records in packedScenes (without decoding them)
+    /// @return false if the data is not a valid packed scene table
+    bool splitPackedSceneTable(const uint8_t *aData, size_t aSize);
   };
   typedef boost::intrusive_ptr<SceneDeviceSettings> SceneDeviceSettingsPtr;
 
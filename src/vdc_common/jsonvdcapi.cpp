@@ -194,6 +194,8 @@ void VdcJsonApiConnection::jsonRequestHandler(const char *aMethod, const char *a
 {
   ErrorPtr respErr;
   if (apiRequestHandler) {
+    // everything caused by this request belongs to a new trace (if tracing is enabled)
+    TraceContext tc(Trace::begin("vdcapi", "JSON request received", aMethod));
     // create params API value
     ApiValuePtr params = JsonApiValue::newValueFromJson(aParams);
     VdcApiRequestPtr request;
@@ -208,7 +210,9 @@ void VdcJsonApiConnection::jsonRequestHandler(const char *aMethod, const char *a
       LOG(LOG_INFO,"vdSM -> vDC (JSON) notification '%s' received: params=%s\n", aMethod, params ? params->description().c_str() : "<none>");
     }
     // call handler
+    TRACE_POINT("vdcapi", "dispatch", aMethod);
     apiRequestHandler(VdcJsonApiConnectionPtr(this), request, aMethod, params);
+    TRACE_POINT("vdcapi", "handler returned", NULL);
   }
 }
 
@@ -0,0 +1,256 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include "mainloopstats.hpp"
+
+using namespace p44;
+
+
+MainLoopStats::MainLoopStats(MainLoop &aMainLoop) :
+  mainLoop(aMainLoop)
+{
+}
+
+
+#pragma mark - property access
+
+static char mainloopstats_key;
+static char histogram_key;
+static char buckets_key;
+static char handlers_key;
+static char handler_key;
+
+enum {
+  period_key,
+  cycles_key,
+  maxOneTimeHandlers_key,
+  cycleDuration_key,
+  timerLateness_key,
+  handlerRuntime_key,
+  handlers_key_idx,
+  numMainLoopStatsProperties
+};
+
+enum {
+  count_key,
+  mean_key,
+  max_key,
+  p50_key,
+  p90_key,
+  p99_key,
+  buckets_key_idx,
+  numHistogramProperties
+};
+
+enum {
+  calls_key,
+  totalTime_key,
+  meanTime_key,
+  maxTime_key,
+  numHandlerProperties
+};
+
+
+#if MAINLOOP_STATISTICS
+
+const MLHistogram &MainLoopStats::histogramFor(PropertyDescriptorPtr aHistogramDescriptor)
+{
+  switch (aHistogramDescriptor->fieldKey()) {
+    case timerLateness_key: return mainLoop.timerLatenessHistogram();
+    case handlerRuntime_key: return mainLoop.handlerRuntimeHistogram();
+    default: return mainLoop.cycleDurationHistogram();
+  }
+}
+
+
+int MainLoopStats::nonEmptyBucket(const MLHistogram &aHistogram, int aIndex)
+{
+  // only buckets with a nonzero count are exposed, find bucket index of aIndex-th of these
+  for (int i=0; i<MLHistogram::numBuckets; i++) {
+    if (aHistogram.bucketCount(i)>0) {
+      if (aIndex==0) return i;
+      aIndex--;
+    }
+  }
+  return -1; // none
+}
+
+
+MLHandlerStatsMap::const_iterator MainLoopStats::handlerStatsAt(size_t aIndex)
+{
+  MLHandlerStatsMap::const_iterator pos = mainLoop.taggedHandlerStats().begin();
+  while (aIndex>0 && pos!=mainLoop.taggedHandlerStats().end()) { ++pos; aIndex--; }
+  return pos;
+}
+
+#endif // MAINLOOP_STATISTICS
+
+
+int MainLoopStats::numProps(int aDomain, PropertyDescriptorPtr aParentDescriptor)
+{
+  #if MAINLOOP_STATISTICS
+  if (!aParentDescriptor) {
+    return numMainLoopStatsProperties;
+  }
+  else if (aParentDescriptor->hasObjectKey(histogram_key)) {
+    return numHistogramProperties;
+  }
+  else if (aParentDescriptor->hasObjectKey(buckets_key)) {
+    const MLHistogram &h = histogramFor(aParentDescriptor->parentDescriptor);
+    int n = 0;
+    for (int i=0; i<MLHistogram::numBuckets; i++) {
+      if (h.bucketCount(i)>0) n++;
+    }
+    return n;
+  }
+  else if (aParentDescriptor->hasObjectKey(handlers_key)) {
+    return (int)mainLoop.taggedHandlerStats().size();
+  }
+  else if (aParentDescriptor->hasObjectKey(handler_key)) {
+    return numHandlerProperties;
+  }
+  #endif
+  return 0;
+}
+
+
+PropertyDescriptorPtr MainLoopStats::getDescriptorByIndex(int aPropIndex, int aDomain, PropertyDescriptorPtr aParentDescriptor)
+{
+  static const PropertyDescription properties[numMainLoopStatsProperties] = {
+    { "period", apivalue_double, period_key, OKEY(mainloopstats_key) },
+    { "cycles", apivalue_uint64, cycles_key, OKEY(mainloopstats_key) },
+    { "maxOneTimeHandlers", apivalue_uint64, maxOneTimeHandlers_key, OKEY(mainloopstats_key) },
+    { "cycleDuration", apivalue_object, cycleDuration_key, OKEY(histogram_key) },
+    { "timerLateness", apivalue_object, timerLateness_key, OKEY(histogram_key) },
+    { "handlerRuntime", apivalue_object, handlerRuntime_key, OKEY(histogram_key) },
+    { "handlers", apivalue_object, handlers_key_idx, OKEY(handlers_key) }
+  };
+  static const PropertyDescription histogramProperties[numHistogramProperties] = {
+    { "count", apivalue_uint64, count_key, OKEY(histogram_key) },
+    { "mean", apivalue_uint64, mean_key, OKEY(histogram_key) },
+    { "max", apivalue_uint64, max_key, OKEY(histogram_key) },
+    { "p50", apivalue_uint64, p50_key, OKEY(histogram_key) },
+    { "p90", apivalue_uint64, p90_key, OKEY(histogram_key) },
+    { "p99", apivalue_uint64, p99_key, OKEY(histogram_key) },
+    { "buckets", apivalue_object, buckets_key_idx, OKEY(buckets_key) }
+  };
+  static const PropertyDescription handlerProperties[numHandlerProperties] = {
+    { "calls", apivalue_uint64, calls_key, OKEY(handler_key) },
+    { "totalTime", apivalue_uint64, totalTime_key, OKEY(handler_key) },
+    { "meanTime", apivalue_uint64, meanTime_key, OKEY(handler_key) },
+    { "maxTime", apivalue_uint64, maxTime_key, OKEY(handler_key) }
+  };
+  #if MAINLOOP_STATISTICS
+  if (!aParentDescriptor) {
+    return PropertyDescriptorPtr(new StaticPropertyDescriptor(&properties[aPropIndex], aParentDescriptor));
+  }
+  else if (aParentDescriptor->hasObjectKey(histogram_key)) {
+    return PropertyDescriptorPtr(new StaticPropertyDescriptor(&histogramProperties[aPropIndex], aParentDescriptor));
+  }
+  else if (aParentDescriptor->hasObjectKey(buckets_key)) {
+    // buckets are named by their upper limit (in uS)
+    int bi = nonEmptyBucket(histogramFor(aParentDescriptor->parentDescriptor), aPropIndex);
+    if (bi>=0) {
+      DynamicPropertyDescriptor *descP = new DynamicPropertyDescriptor(aParentDescriptor);
+      MLMicroSeconds u = MLHistogram::bucketUpperLimit(bi);
+      descP->propertyName = u==Infinite ? "inf" : string_format("%lld", u);
+      descP->propertyType = apivalue_uint64;
+      descP->propertyFieldKey = bi;
+      descP->propertyObjectKey = OKEY(buckets_key);
+      return descP;
+    }
+  }
+  else if (aParentDescriptor->hasObjectKey(handlers_key)) {
+    // handlers are named by their tag
+    MLHandlerStatsMap::const_iterator pos = handlerStatsAt(aPropIndex);
+    if (pos!=mainLoop.taggedHandlerStats().end()) {
+      DynamicPropertyDescriptor *descP = new DynamicPropertyDescriptor(aParentDescriptor);
+      descP->propertyName = pos->first;
+      descP->propertyType = apivalue_object;
+      descP->propertyFieldKey = aPropIndex;
+      descP->propertyObjectKey = OKEY(handler_key);
+      return descP;
+    }
+  }
+  else if (aParentDescriptor->hasObjectKey(handler_key)) {
+    return PropertyDescriptorPtr(new StaticPropertyDescriptor(&handlerProperties[aPropIndex], aParentDescriptor));
+  }
+  #endif
+  return PropertyDescriptorPtr();
+}
+
+
+PropertyContainerPtr MainLoopStats::getContainer(PropertyDescriptorPtr &aPropertyDescriptor, int &aDomain)
+{
+  // all levels are handled by this object itself
+  return PropertyContainerPtr(this);
+}
+
+
+bool MainLoopStats::accessField(PropertyAccessMode aMode, ApiValuePtr aPropValue, PropertyDescriptorPtr aPropertyDescriptor)
+{
+  #if MAINLOOP_STATISTICS
+  if (aMode==access_read) {
+    if (aPropertyDescriptor->hasObjectKey(mainloopstats_key)) {
+      switch (aPropertyDescriptor->fieldKey()) {
+        case period_key:
+          aPropValue->setDoubleValue((double)mainLoop.statisticsPeriod()/Second);
+          return true;
+        case cycles_key:
+          aPropValue->setUint64Value(mainLoop.statisticsCycleCount());
+          return true;
+        case maxOneTimeHandlers_key:
+          aPropValue->setUint64Value(mainLoop.maxWaitingOneTimeHandlers());
+          return true;
+      }
+    }
+    else if (aPropertyDescriptor->hasObjectKey(histogram_key)) {
+      // all histogram values are in microseconds
+      const MLHistogram &h = histogramFor(aPropertyDescriptor->parentDescriptor);
+      switch (aPropertyDescriptor->fieldKey()) {
+        case count_key: aPropValue->setUint64Value(h.count()); return true;
+        case mean_key: aPropValue->setUint64Value(h.mean()); return true;
+        case max_key: aPropValue->setUint64Value(h.max()); return true;
+        case p50_key: aPropValue->setUint64Value(h.percentile(50)); return true;
+        case p90_key: aPropValue->setUint64Value(h.percentile(90)); return true;
+        case p99_key: aPropValue->setUint64Value(h.percentile(99)); return true;
+      }
+    }
+    else if (aPropertyDescriptor->hasObjectKey(buckets_key)) {
+      const MLHistogram &h = histogramFor(aPropertyDescriptor->parentDescriptor->parentDescriptor);
+      aPropValue->setUint64Value(h.bucketCount((int)aPropertyDescriptor->fieldKey()));
+      return true;
+    }
+    else if (aPropertyDescriptor->hasObjectKey(handler_key)) {
+      MLHandlerStatsMap::const_iterator pos = handlerStatsAt(aPropertyDescriptor->parentDescriptor->fieldKey());
+      if (pos==mainLoop.taggedHandlerStats().end()) return false;
+      switch (aPropertyDescriptor->fieldKey()) {
+        case calls_key: aPropValue->setUint64Value(pos->second.calls); return true;
+        case totalTime_key: aPropValue->setUint64Value(pos->second.totalTime); return true;
+        case meanTime_key: aPropValue->setUint64Value(pos->second.calls>0 ? pos->second.totalTime/pos->second.calls : 0); return true;
+        case maxTime_key: aPropValue->setUint64Value(pos->second.maxTime); return true;
+      }
+    }
+  }
+  #endif
+  return inherited::accessField(aMode, aPropValue, aPropertyDescriptor);
+}
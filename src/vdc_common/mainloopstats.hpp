@@ -0,0 +1,69 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef __vdcd__mainloopstats__
+#define __vdcd__mainloopstats__
+
+#include "propertycontainer.hpp"
+
+using namespace std;
+
+namespace p44 {
+
+  class MainLoopStats;
+  typedef boost::intrusive_ptr<MainLoopStats> MainLoopStatsPtr;
+
+  /// exposes the timing statistics of a mainloop (cycle durations, timer lateness, handler runtimes
+  /// and per-tag handler statistics) as a read-only property tree
+  class MainLoopStats : public PropertyContainer
+  {
+    typedef PropertyContainer inherited;
+
+    MainLoop &mainLoop;
+
+  public:
+
+    /// create statistics property container
+    /// @param aMainLoop the mainloop to expose statistics for
+    MainLoopStats(MainLoop &aMainLoop);
+
+  protected:
+
+    // property access implementation
+    virtual int numProps(int aDomain, PropertyDescriptorPtr aParentDescriptor);
+    virtual PropertyDescriptorPtr getDescriptorByIndex(int aPropIndex, int aDomain, PropertyDescriptorPtr aParentDescriptor);
+    virtual PropertyContainerPtr getContainer(PropertyDescriptorPtr &aPropertyDescriptor, int &aDomain);
+    virtual bool accessField(PropertyAccessMode aMode, ApiValuePtr aPropValue, PropertyDescriptorPtr aPropertyDescriptor);
+
+  private:
+
+    #if MAINLOOP_STATISTICS
+    const MLHistogram &histogramFor(PropertyDescriptorPtr aHistogramDescriptor);
+    int nonEmptyBucket(const MLHistogram &aHistogram, int aIndex);
+    MLHandlerStatsMap::const_iterator handlerStatsAt(size_t aIndex);
+    #endif
+
+  };
+
+} // namespace p44
+
+#endif /* defined(__vdcd__mainloopstats__) */
@@ -200,6 +200,7 @@ P44VdcHost::P44VdcHost() :
   learnIdentifyTicket(0)
 {
   configApiServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  metricsServer = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
 }
 
 
@@ -210,6 +211,19 @@ void P44VdcHost::startConfigApi()
 
 
 
+void P44VdcHost::startMetricsServer()
+{
+  metricsServer->startServer(boost::bind(&P44VdcHost::metricsConnectionHandler, this, _1), 3);
+}
+
+
+SocketCommPtr P44VdcHost::metricsConnectionHandler(SocketCommPtr aServerSocketCommP)
+{
+  return MetricsConnectionPtr(new MetricsConnection(MainLoop::currentMainLoop()));
+}
+
+
+
 SocketCommPtr P44VdcHost::configApiConnectionHandler(SocketCommPtr aServerSocketCommP)
 {
   JsonCommPtr conn = JsonCommPtr(new JsonComm(MainLoop::currentMainLoop()));
@@ -440,6 +454,21 @@ ErrorPtr P44VdcHost::processP44Request(JsonCommPtr aJsonComm, JsonObjectPtr aReq
       // anyway: return current value
       sendCfgApiResponse(aJsonComm, JsonObject::newInt32(LOGLEVEL), ErrorPtr());
     }
+    else if (method=="trace") {
+      // enable/disable request tracing, or get recorded traces
+      JsonObjectPtr o = aRequest->get("events");
+      if (o) {
+        // (re)size trace buffer, 0 disables tracing
+        int events = o->int32Value();
+        Trace::enable(events>0 ? events : 0);
+        LOG(LOG_NOTICE,"Request tracing %s (buffer size %d)\n", Trace::isEnabled() ? "enabled" : "disabled", (int)Trace::ringSize());
+        sendCfgApiResponse(aJsonComm, JsonObject::newInt32((int32_t)Trace::ringSize()), ErrorPtr());
+      }
+      else {
+        // return trace buffer contents in Chrome trace event format
+        sendCfgApiResponse(aJsonComm, Trace::chromeTrace(), ErrorPtr());
+      }
+    }
     else {
       err = ErrorPtr(new P44VdcError(400, "unknown method"));
     }
@@ -25,6 +25,7 @@
 #include "devicecontainer.hpp"
 
 #include "jsoncomm.hpp"
+#include "metrics.hpp"
 
 using namespace std;
 
@@ -98,6 +99,11 @@ namespace p44 {
 
     void startConfigApi();
 
+    /// Prometheus metrics endpoint
+    SocketCommPtr metricsServer;
+
+    void startMetricsServer();
+
 		/// perform self testing
     /// @param aCompletedCB will be called when the entire self test is done
     /// @param aButton button for interacting with tests
@@ -112,6 +118,7 @@ namespace p44 {
 
     SocketCommPtr configApiConnectionHandler(SocketCommPtr aServerSocketComm);
     void configApiRequestHandler(JsonCommPtr aJsonComm, ErrorPtr aError, JsonObjectPtr aJsonObject);
+    SocketCommPtr metricsConnectionHandler(SocketCommPtr aServerSocketComm);
     void learnHandler(JsonCommPtr aJsonComm, bool aLearnIn, ErrorPtr aError);
     void identifyHandler(JsonCommPtr aJsonComm, DevicePtr aDevice);
     void endIdentify();
@@ -949,10 +949,24 @@ void PbufApiValue::putValueIntoPropVal(Vdcapi__PropertyValue &aPropVal)
 #pragma mark - VdcPbufApiServer
 
 
+VdcPbufApiServer::VdcPbufApiServer() :
+  requestTimeout(DEFAULT_VDSM_REQUEST_TIMEOUT),
+  maxPendingRequests(DEFAULT_VDSM_MAX_PENDING_REQUESTS)
+{
+}
+
+
+void VdcPbufApiServer::setRequestLimits(MLMicroSeconds aRequestTimeout, size_t aMaxPendingRequests)
+{
+  requestTimeout = aRequestTimeout;
+  maxPendingRequests = aMaxPendingRequests;
+}
+
+
 VdcApiConnectionPtr VdcPbufApiServer::newConnection()
 {
   // create the right kind of API connection
-  return VdcApiConnectionPtr(static_cast<VdcApiConnection *>(new VdcPbufApiConnection()));
+  return VdcApiConnectionPtr(static_cast<VdcApiConnection *>(new VdcPbufApiConnection(requestTimeout, maxPendingRequests)));
 }
 
 
@@ -1052,14 +1066,42 @@ ErrorPtr VdcPbufApiRequest::sendError(uint32_t aErrorCode, string aErrorMessage,
 #pragma mark - VdcPbufApiConnection
 
 
-VdcPbufApiConnection::VdcPbufApiConnection() :
+VdcPbufApiConnection::VdcPbufApiConnection(MLMicroSeconds aRequestTimeout, size_t aMaxPendingRequests) :
   closeWhenSent(false),
   expectedMsgBytes(0),
-  requestIdCounter(0)
+  requestIdCounter(0),
+  requestTimeout(aRequestTimeout),
+  maxPendingRequests(aMaxPendingRequests),
+  requestTimeoutTicket(0)
 {
   socketComm = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
   // install data handler
   socketComm->setReceiveHandler(boost::bind(&VdcPbufApiConnection::gotData, this, _1));
+  // metrics
+  messagesInMetric = Metrics::counter("vdcd_vdcapi_messages_received_total", "vDC API (protobuf) messages received");
+  messagesOutMetric = Metrics::counter("vdcd_vdcapi_messages_sent_total", "vDC API (protobuf) messages sent");
+  bytesInMetric = Metrics::counter("vdcd_vdcapi_received_bytes_total", "vDC API (protobuf) bytes received, including length headers");
+  bytesOutMetric = Metrics::counter("vdcd_vdcapi_sent_bytes_total", "vDC API (protobuf) bytes sent, including length headers");
+  // Note: shared by all connections, so each connection adds and removes its own pending answers
+  pendingAnswersMetric = Metrics::gauge("vdcd_vdcapi_pending_answers", "vDC API method calls to the vdSM awaiting an answer");
+  requestTimeoutsMetric = Metrics::counter("vdcd_vdcapi_request_timeouts_total", "vDC API method calls to the vdSM that timed out without answer");
+  requestsRejectedMetric = Metrics::counter("vdcd_vdcapi_requests_rejected_total", "vDC API method calls not sent because too many were awaiting an answer");
+}
+
+
+VdcPbufApiConnection::~VdcPbufApiConnection()
+{
+  MainLoop::currentMainLoop().cancelExecutionTicket(requestTimeoutTicket);
+  pendingAnswersMetric->dec(pendingAnswers.size());
+}
+
+
+void VdcPbufApiConnection::connectionClosed()
+{
+  // answers can no longer arrive on this connection
+  MainLoop::currentMainLoop().cancelExecutionTicket(requestTimeoutTicket);
+  pendingAnswersMetric->dec(pendingAnswers.size());
+  pendingAnswers.clear();
 }
 
 
@@ -1106,6 +1148,8 @@ void VdcPbufApiConnection::gotData(ErrorPtr aError)
           if (expectedMsgBytes && (receivedMessage.size()>=expectedMsgBytes)) {
             FOCUSLOG("gotData: receivedMessage.size()=%d >= expectedMsgBytes=%d -> process\n", receivedMessage.size(), expectedMsgBytes);
             // process message
+            messagesInMetric->inc();
+            bytesInMetric->inc(expectedMsgBytes+2);
             aError = processMessage((uint8_t *)receivedMessage.c_str(),expectedMsgBytes);
             // erase processed message
             receivedMessage.erase(0,expectedMsgBytes);
@@ -1151,6 +1195,8 @@ ErrorPtr VdcPbufApiConnection::sendMessage(const Vdcapi__Message *aVdcApiMessage
   vdcapi__message__pack(aVdcApiMessage, packedMsg+2);
   // - adjust the total message length
   packedSize += 2;
+  messagesOutMetric->inc();
+  bytesOutMetric->inc(packedSize);
   // send the message
   if (transmitBuffer.size()>0) {
     // other messages are already waiting, append entire message
@@ -1265,6 +1311,8 @@ ErrorPtr VdcPbufApiConnection::processMessage(const uint8_t *aPackedMessageP, si
 
   ErrorPtr err;
 
+  // everything caused by this message belongs to a new trace (if tracing is enabled)
+  TraceContext tc(Trace::begin("vdcapi", "pbuf message received"));
   decodedMsg = vdcapi__message__unpack(NULL, aPackedMessageSize, aPackedMessageP); // Deserialize the serialized input
   if (decodedMsg == NULL) {
     err = ErrorPtr(new VdcApiError(400,"error unpacking incoming message"));
@@ -1424,8 +1472,9 @@ ErrorPtr VdcPbufApiConnection::processMessage(const uint8_t *aPackedMessageP, si
       }
       else {
         // found callback
-        VdcApiResponseCB cb = pos->second;
+        VdcApiResponseCB cb = pos->second.responseHandler;
         pendingAnswers.erase(pos); // erase
+        pendingAnswersMetric->dec();
         // create request object just to hold the response ID
         VdcPbufApiRequestPtr request = VdcPbufApiRequestPtr(new VdcPbufApiRequest(VdcPbufApiConnectionPtr(this), responseForId));
         if (Error::isOK(err)) {
@@ -1469,7 +1518,9 @@ ErrorPtr VdcPbufApiConnection::processMessage(const uint8_t *aPackedMessageP, si
       }
       else {
         // call handler
+        TRACE_POINT("vdcapi", "dispatch", method.c_str());
         apiRequestHandler(VdcPbufApiConnectionPtr(this), request, method, msgFieldsObj);
+        TRACE_POINT("vdcapi", "handler returned", NULL);
       }
     }
     // free the unpacked message
@@ -1544,13 +1595,23 @@ ErrorPtr VdcPbufApiConnection::sendRequest(const string &aMethod, ApiValuePtr aP
     LOG(LOG_INFO,"vdSM <- vDC (pbuf) method '%s' cannot be sent because no message is implemented for it at the pbuf level\n", aMethod.c_str());
     return ErrorPtr(new VdcApiError(500,"Error: Method is not implemented in the pbuf API"));
   }
+  if (aResponseHandler && !canSendRequest()) {
+    // too many method calls awaiting an answer, vdSM is not keeping up (or dropping answers)
+    requestsRejectedMetric->inc();
+    err = ErrorPtr(new VdcApiError(503, string_format("Too many (%zu) method calls awaiting answer from vdSM", pendingAnswers.size())));
+    LOG(LOG_WARNING,"vdSM <- vDC (pbuf) method '%s' not sent: %s\n", aMethod.c_str(), err->description().c_str());
+  }
   if (Error::isOK(err)) {
     if (aResponseHandler) {
       // method call expecting response
       msg.has_message_id = true; // has a messageID
       msg.message_id = ++requestIdCounter; // use new ID
       // save response handler into our map so that it can be called later when answer arrives
-      pendingAnswers[requestIdCounter] = aResponseHandler;
+      PendingAnswer &pa = pendingAnswers[requestIdCounter];
+      pa.responseHandler = aResponseHandler;
+      pa.deadline = requestTimeout==Never ? Never : MainLoop::now()+requestTimeout;
+      pendingAnswersMetric->inc();
+      scheduleRequestTimeout();
     }
     // now generically fill parameters into submessage (if any, and if not handled above explicitly)
     if (params) {
@@ -1573,6 +1634,50 @@ ErrorPtr VdcPbufApiConnection::sendRequest(const string &aMethod, ApiValuePtr aP
 }
 
 
+bool VdcPbufApiConnection::canSendRequest()
+{
+  return maxPendingRequests==0 || pendingAnswers.size()<maxPendingRequests;
+}
+
+
+void VdcPbufApiConnection::scheduleRequestTimeout()
+{
+  // Note: as all requests have the same timeout, deadlines are in order of request IDs, so the
+  //   first entry in the map always has the earliest deadline
+  if (requestTimeoutTicket!=0 || pendingAnswers.empty()) return; // already scheduled or nothing to wait for
+  MLMicroSeconds deadline = pendingAnswers.begin()->second.deadline;
+  if (deadline==Never) return;
+  requestTimeoutTicket = MainLoop::currentMainLoop().executeOnceAt(boost::bind(&VdcPbufApiConnection::requestTimeoutHandler, this), deadline);
+}
+
+
+void VdcPbufApiConnection::requestTimeoutHandler()
+{
+  requestTimeoutTicket = 0;
+  VdcPbufApiConnectionPtr keepMeAlive(this); // handlers might close the connection
+  // collect the timed out requests first, as response handlers might send new requests
+  MLMicroSeconds now = MainLoop::now();
+  PendingAnswerMap timedOut;
+  while (!pendingAnswers.empty()) {
+    PendingAnswerMap::iterator pos = pendingAnswers.begin();
+    if (pos->second.deadline>now) break;
+    timedOut.insert(*pos);
+    pendingAnswers.erase(pos);
+  }
+  pendingAnswersMetric->dec(timedOut.size());
+  // report the timeouts
+  for (PendingAnswerMap::iterator pos = timedOut.begin(); pos!=timedOut.end(); ++pos) {
+    requestTimeoutsMetric->inc();
+    LOG(LOG_WARNING,"vdSM -> vDC (pbuf) no answer for requestid='%d' within %lld seconds\n", pos->first, requestTimeout/Second);
+    VdcPbufApiRequestPtr request = VdcPbufApiRequestPtr(new VdcPbufApiRequest(keepMeAlive, pos->first));
+    ErrorPtr err = ErrorPtr(new VdcApiError(408, "Timeout waiting for answer from vdSM"));
+    pos->second.responseHandler(keepMeAlive, request, err, ApiValuePtr());
+  }
+  // wait for next deadline
+  scheduleRequestTimeout();
+}
+
+
 #pragma mark - generic protobuf-C message printing
 
 #if FOCUSLOGGING
@@ -25,12 +25,19 @@
 #include "p44_common.hpp"
 
 #include "vdcapi.hpp"
+#include "metrics.hpp"
 
 #include "vdcapi.pb-c.h"
 #include "messages.pb-c.h"
 
 using namespace std;
 
+// default time after which a method call sent to the vdSM is considered lost
+#define DEFAULT_VDSM_REQUEST_TIMEOUT (30*Second)
+
+// default max number of method calls awaiting an answer from the vdSM
+#define DEFAULT_VDSM_MAX_PENDING_REQUESTS 20
+
 namespace p44 {
 
   class VdcPbufApiConnection;
@@ -164,6 +171,19 @@ namespace p44 {
   {
     typedef VdcApiServer inherited;
 
+    MLMicroSeconds requestTimeout;
+    size_t maxPendingRequests;
+
+  public:
+
+    VdcPbufApiServer();
+
+    /// set limits for method calls sent to the vdSM on connections created from now on
+    /// @param aRequestTimeout time after which a method call without answer is considered lost, and its response handler
+    ///   is called with an error. Never means no timeout.
+    /// @param aMaxPendingRequests max number of method calls awaiting an answer. 0 means no limit.
+    void setRequestLimits(MLMicroSeconds aRequestTimeout, size_t aMaxPendingRequests);
+
   protected:
 
     /// create API connection of correct type for this API server
@@ -232,12 +252,32 @@ namespace p44 {
 
     // pending requests
     int32_t requestIdCounter;
-    typedef map<int32_t, VdcApiResponseCB> PendingAnswerMap;
+    typedef struct {
+      VdcApiResponseCB responseHandler;
+      MLMicroSeconds deadline; ///< when the request times out, Never if no timeout
+    } PendingAnswer;
+    typedef map<int32_t, PendingAnswer> PendingAnswerMap;
     PendingAnswerMap pendingAnswers;
+    MLMicroSeconds requestTimeout; ///< timeout for method calls, Never if none
+    size_t maxPendingRequests; ///< max number of pending method calls, 0 if unlimited
+    long requestTimeoutTicket; ///< single timer for the oldest pending request's deadline
+
+    // metrics
+    MetricCounterPtr messagesInMetric;
+    MetricCounterPtr messagesOutMetric;
+    MetricCounterPtr bytesInMetric;
+    MetricCounterPtr bytesOutMetric;
+    MetricGaugePtr pendingAnswersMetric;
+    MetricCounterPtr requestTimeoutsMetric;
+    MetricCounterPtr requestsRejectedMetric;
 
   public:
 
-    VdcPbufApiConnection();
+    /// create connection
+    /// @param aRequestTimeout timeout for method calls sent to the vdSM, Never for none
+    /// @param aMaxPendingRequests max number of method calls awaiting an answer, 0 for no limit
+    VdcPbufApiConnection(MLMicroSeconds aRequestTimeout, size_t aMaxPendingRequests);
+    virtual ~VdcPbufApiConnection();
 
     /// The underlying socket connection
     /// @return socket connection
@@ -246,6 +286,9 @@ namespace p44 {
     /// request closing connection after last message has been sent
     virtual void closeAfterSend();
 
+    /// called when the socket connection has been closed: drops the method calls still awaiting an answer
+    virtual void connectionClosed();
+
     /// get a new API value suitable for this connection
     /// @return new API value of suitable internal implementation to be used on this API connection
     virtual ApiValuePtr newApiValue();
@@ -253,14 +296,20 @@ namespace p44 {
     /// send a API request
     /// @param aMethod the vDC API method or notification name to be sent
     /// @param aParams the parameters for the method or notification request. Can be NULL.
-    /// @param aResponseHandler if the request is a method call, this handler will be called when the method result arrives
-    ///   Note that the aResponseHandler might not be called at all in case of lost messages etc. So do not rely on
-    ///   this callback for chaining a execution thread.
-    /// @return empty or Error object in case of error
+    /// @param aResponseHandler if the request is a method call, this handler will be called when the method result arrives,
+    ///   or with a 408 error when no answer arrives within the request timeout.
+    /// @return empty or Error object in case of error. A 503 error is returned without sending anything when too many
+    ///   method calls are already awaiting an answer.
     virtual ErrorPtr sendRequest(const string &aMethod, ApiValuePtr aParams, VdcApiResponseCB aResponseHandler = VdcApiResponseCB());
 
+    /// @return true if a method call can be sent now without exceeding the max number of pending method calls
+    virtual bool canSendRequest();
+
   private:
 
+    void scheduleRequestTimeout();
+    void requestTimeoutHandler();
+
     void gotData(ErrorPtr aError);
     void canSendData(ErrorPtr aError);
 
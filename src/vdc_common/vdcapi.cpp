@@ -58,15 +58,14 @@ SocketCommPtr VdcApiServer::serverConnectionHandler(SocketCommPtr aServerSocketC
 
 void VdcApiServer::connectionStatusHandler(SocketCommPtr aSocketComm, ErrorPtr aError)
 {
-  if (apiConnectionStatusHandler) {
-    // get connection object
-    VdcApiConnectionPtr apiConnection = boost::dynamic_pointer_cast<VdcApiConnection>(aSocketComm->relatedObject);
-    if (apiConnection) {
-      apiConnectionStatusHandler(apiConnection, aError);
-    }
+  // get connection object
+  VdcApiConnectionPtr apiConnection = boost::dynamic_pointer_cast<VdcApiConnection>(aSocketComm->relatedObject);
+  if (apiConnectionStatusHandler && apiConnection) {
+    apiConnectionStatusHandler(apiConnection, aError);
   }
   if (!Error::isOK(aError)) {
     // connection failed/closed and we don't support reconnect yet
+    if (apiConnection) apiConnection->connectionClosed();
     aSocketComm->relatedObject.reset(); // detach connection object
   }
 }
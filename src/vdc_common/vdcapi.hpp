@@ -26,6 +26,7 @@
 
 #include "apivalue.hpp"
 #include "socketcomm.hpp"
+#include "tracing.hpp"
 
 
 using namespace std;
@@ -116,8 +117,17 @@ namespace p44 {
     /// @return empty or Error object in case of error
     virtual ErrorPtr sendRequest(const string &aMethod, ApiValuePtr aParams, VdcApiResponseCB aResponseHandler = VdcApiResponseCB()) = 0;
 
+    /// check if method calls can be sent now
+    /// @return false if the connection has too many method calls awaiting an answer. Callers sending
+    ///   method calls in bulk (like announcements) should defer sending until this returns true again.
+    virtual bool canSendRequest() { return true; };
+
     /// request closing connection after last message has been sent
     virtual void closeAfterSend() = 0;
+
+    /// called by the server when the underlying socket connection has been closed (by either side)
+    /// @note method calls still awaiting an answer will not get one any more
+    virtual void connectionClosed() {};
   };
 
 
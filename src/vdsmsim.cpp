@@ -0,0 +1,707 @@
+//
+//  Copyright (c) 2014 plan44.ch / Lukas Zeller, Zurich, Switzerland
+//
+//  Author: Lukas Zeller <luz@plan44.ch>
+//
+//  This file is part of vdcd.
+//
+//  vdcd is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  vdcd is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with vdcd. If not, see <http://www.gnu.org/licenses/>.
+//
+
+// vdsmsim: fake vdSM for load testing vdcd via its protobuf vDC API
+//
+// Connects to vdcd, completes the hello handshake, accepts all vdc and device announcements
+// and then runs one or several workloads against the announced devices, reporting throughput
+// and latency per method.
+// - getProperty and setProperty are methods, latency is the time until the answer arrives.
+// - callScene and dimChannel are notifications and have no answer. Each notification is followed
+//   by a ping to the vdc host, and latency is the time until the corresponding pong arrives. As vdcd
+//   processes messages of a connection in order, this measures the time needed to process the notification
+//   (but not the time until the hardware has actually applied the new values).
+
+#include "application.hpp"
+
+#include "socketcomm.hpp"
+
+#include "messages.pb-c.h"
+
+#include <algorithm>
+
+#define DEFAULT_VDCHOST "127.0.0.1"
+#define DEFAULT_VDCSERVICE "8340"
+#define DEFAULT_VDSM_DSUID "56534D53494D0000000000000000000100"
+#define MAINLOOP_CYCLE_TIME_uS 10000 // 10mS
+#define DEFAULT_LOGLEVEL LOG_NOTICE
+
+#define VDC_API_VERSION 2 // must match vdcd's API version
+#define MAX_MESSAGE_SIZE 0xFFFF // limited by the 2-byte length header
+
+#define DEFAULT_OPERATIONS 1000
+#define DEFAULT_SETTLE_TIME (3*Second) // no more announcements for this time means all devices are announced
+#define DEFAULT_OPERATION_TIMEOUT (10*Second)
+#define TIMEOUT_CHECK_INTERVAL (500*MilliSecond)
+
+
+using namespace p44;
+
+
+typedef enum {
+  workload_callScene,
+  workload_getProperty,
+  workload_setProperty,
+  workload_dimChannel,
+  numWorkloads
+} Workload;
+
+static const char *workloadNames[numWorkloads] = {
+  "callScene",
+  "getProperty",
+  "setProperty",
+  "dimChannel"
+};
+
+
+/// statistics for a workload run
+class WorkloadStats
+{
+public:
+  Workload workload;
+  vector<MLMicroSeconds> latencies;
+  long errors;
+  long timeouts;
+  MLMicroSeconds startedAt;
+  MLMicroSeconds endedAt;
+
+  WorkloadStats(Workload aWorkload) :
+    workload(aWorkload),
+    errors(0),
+    timeouts(0),
+    startedAt(MainLoop::now()),
+    endedAt(Never)
+  {
+  }
+
+  /// @return latency at given percentile (0..100) of all successful operations
+  MLMicroSeconds percentile(double aPercent)
+  {
+    if (latencies.empty()) return 0;
+    size_t i = (size_t)(aPercent/100*(latencies.size()-1)+0.5);
+    return latencies[i];
+  }
+
+  void report()
+  {
+    sort(latencies.begin(), latencies.end());
+    double secs = (double)(endedAt-startedAt)/Second;
+    long done = latencies.size();
+    printf(
+      "%-12s %7ld ok %5ld err %5ld tmo  %9.1f ops/s  p50=%8.3fmS  p99=%8.3fmS  max=%8.3fmS\n",
+      workloadNames[workload],
+      done, errors, timeouts,
+      secs>0 ? done/secs : 0.0,
+      (double)percentile(50)/MilliSecond,
+      (double)percentile(99)/MilliSecond,
+      (double)(done>0 ? latencies[done-1] : 0)/MilliSecond
+    );
+  }
+};
+
+
+class VdsmSim : public Application
+{
+  SocketCommPtr vdcConnection;
+  string receivedData; ///< received but not yet processed bytes
+  string transmitBuffer; ///< bytes waiting to be sent
+  uint32_t messageIdCounter;
+
+  string vdsmDsUid; ///< dSUID we present as vdSM
+  string vdcHostDsUid; ///< dSUID of the vdc host (from hello response)
+  vector<string> devices; ///< dSUIDs of announced devices
+  long settleTicket;
+
+  // options
+  vector<Workload> workloads;
+  long numOperations;
+  int window; ///< max number of operations in flight
+  double rate; ///< max operations per second, 0=unlimited
+  int batchSize; ///< number of dSUIDs per notification
+  MLMicroSeconds settleTime;
+  MLMicroSeconds operationTimeout;
+
+  // current workload
+  size_t workloadIndex;
+  WorkloadStats *stats;
+  long issued;
+  long completed;
+  int inFlight;
+  size_t nextDevice;
+  MLMicroSeconds nextIssueAt;
+  long issueTicket;
+  long timeoutTicket;
+  typedef map<uint32_t, MLMicroSeconds> PendingMap;
+  PendingMap pendingRequests; ///< sent methods waiting for an answer, by message ID
+  typedef list<MLMicroSeconds> PendingList;
+  PendingList pendingPings; ///< sent pings waiting for a pong, in order of sending
+
+  typedef vector<WorkloadStats *> StatsVector;
+  StatsVector results;
+
+public:
+
+  VdsmSim() :
+    messageIdCounter(0),
+    settleTicket(0),
+    numOperations(DEFAULT_OPERATIONS),
+    window(1),
+    rate(0),
+    batchSize(1),
+    settleTime(DEFAULT_SETTLE_TIME),
+    operationTimeout(DEFAULT_OPERATION_TIMEOUT),
+    workloadIndex(0),
+    stats(NULL),
+    issued(0),
+    completed(0),
+    inFlight(0),
+    nextDevice(0),
+    nextIssueAt(Never),
+    issueTicket(0),
+    timeoutTicket(0)
+  {
+    vdcConnection = SocketCommPtr(new SocketComm(MainLoop::currentMainLoop()));
+  }
+
+
+  virtual ~VdsmSim()
+  {
+    for (StatsVector::iterator pos = results.begin(); pos!=results.end(); ++pos) {
+      delete *pos;
+    }
+  }
+
+
+  void usage(char *name)
+  {
+    fprintf(stderr, "usage:\n");
+    fprintf(stderr, "  %s [options]\n", name);
+    fprintf(stderr, "    -c vdchost      : host where vdcd runs (default=%s)\n", DEFAULT_VDCHOST);
+    fprintf(stderr, "    -C vdcport      : port number/service name of vdcd's protobuf API (default=%s)\n", DEFAULT_VDCSERVICE);
+    fprintf(stderr, "    -u dsuid        : dSUID to use as vdSM (default=%s)\n", DEFAULT_VDSM_DSUID);
+    fprintf(stderr, "    -w workloads    : comma separated list of workloads to run in sequence (default=all):\n");
+    fprintf(stderr, "                      callScene, getProperty, setProperty, dimChannel\n");
+    fprintf(stderr, "                      Note: setProperty overwrites the names of the devices!\n");
+    fprintf(stderr, "    -n operations   : number of operations per workload (default=%d)\n", DEFAULT_OPERATIONS);
+    fprintf(stderr, "    -p window       : max number of operations in flight (default=1)\n");
+    fprintf(stderr, "    -r rate         : max number of operations per second (default=0=unlimited)\n");
+    fprintf(stderr, "    -b batchsize    : number of dSUIDs per callScene/dimChannel notification (default=1)\n");
+    fprintf(stderr, "    -s seconds      : time without announcements after which devices are considered complete (default=%d)\n", (int)(DEFAULT_SETTLE_TIME/Second));
+    fprintf(stderr, "    -t seconds      : operation timeout (default=%d)\n", (int)(DEFAULT_OPERATION_TIMEOUT/Second));
+    fprintf(stderr, "    -l loglevel     : set loglevel (default = %d)\n", DEFAULT_LOGLEVEL);
+  };
+
+
+  virtual int main(int argc, char **argv)
+  {
+    int loglevel = DEFAULT_LOGLEVEL; // use defaults
+    const char *vdchost = DEFAULT_VDCHOST;
+    const char *vdcport = DEFAULT_VDCSERVICE;
+    vdsmDsUid = DEFAULT_VDSM_DSUID;
+
+    int c;
+    while ((c = getopt(argc, argv, "hc:C:u:w:n:p:r:b:s:t:l:")) != -1)
+    {
+      switch (c) {
+        case 'c':
+          vdchost = optarg;
+          break;
+        case 'C':
+          vdcport = optarg;
+          break;
+        case 'u':
+          vdsmDsUid = optarg;
+          break;
+        case 'w': {
+          string wl = lowerCase(optarg);
+          size_t p = 0;
+          while (p<=wl.size()) {
+            size_t e = wl.find(',', p);
+            if (e==string::npos) e = wl.size();
+            string w = wl.substr(p, e-p);
+            p = e+1;
+            int i;
+            for (i=0; i<numWorkloads; i++) {
+              if (w==lowerCase(workloadNames[i])) break;
+            }
+            if (i>=numWorkloads) {
+              fprintf(stderr, "unknown workload '%s'\n", w.c_str());
+              exit(1);
+            }
+            workloads.push_back((Workload)i);
+          }
+          break;
+        }
+        case 'n':
+          numOperations = atol(optarg);
+          break;
+        case 'p':
+          window = atoi(optarg);
+          if (window<1) window = 1;
+          break;
+        case 'r':
+          rate = atof(optarg);
+          break;
+        case 'b':
+          batchSize = atoi(optarg);
+          if (batchSize<1) batchSize = 1;
+          break;
+        case 's':
+          settleTime = atof(optarg)*Second;
+          break;
+        case 't':
+          operationTimeout = atof(optarg)*Second;
+          break;
+        case 'l':
+          loglevel = atoi(optarg);
+          break;
+        case 'h':
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+    if (workloads.empty()) {
+      // default: all workloads
+      for (int i=0; i<numWorkloads; i++) workloads.push_back((Workload)i);
+    }
+
+    SETLOGLEVEL(loglevel);
+
+    // connect to vdcd
+    vdcConnection->setConnectionParams(vdchost, vdcport, SOCK_STREAM, AF_INET);
+    vdcConnection->setConnectionStatusHandler(boost::bind(&VdsmSim::connectionStatusHandler, this, _2));
+    vdcConnection->setReceiveHandler(boost::bind(&VdsmSim::gotData, this, _1));
+    vdcConnection->initiateConnection();
+
+    // app now ready to run
+    return run();
+  }
+
+
+  void connectionStatusHandler(ErrorPtr aError)
+  {
+    if (Error::isOK(aError)) {
+      LOG(LOG_NOTICE, "Connected to vdcd, sending hello\n");
+      Vdcapi__Message msg = VDCAPI__MESSAGE__INIT;
+      Vdcapi__VdsmRequestHello hello = VDCAPI__VDSM__REQUEST_HELLO__INIT;
+      msg.type = VDCAPI__TYPE__VDSM_REQUEST_HELLO;
+      msg.vdsm_request_hello = &hello;
+      hello.dsuid = (char *)vdsmDsUid.c_str();
+      hello.has_api_version = true;
+      hello.api_version = VDC_API_VERSION;
+      sendMessage(msg, true);
+    }
+    else {
+      fprintf(stderr, "Connection to vdcd failed or terminated: %s\n", aError->description().c_str());
+      terminateApp(EXIT_FAILURE);
+    }
+  }
+
+
+  #pragma mark - message transport
+
+
+  void sendMessage(Vdcapi__Message &aMsg, bool aWithId = false)
+  {
+    if (aWithId) {
+      aMsg.has_message_id = true;
+      aMsg.message_id = ++messageIdCounter;
+    }
+    size_t packedSize = vdcapi__message__get_packed_size(&aMsg);
+    if (packedSize>MAX_MESSAGE_SIZE) {
+      LOG(LOG_ERR, "message too large to send (%d bytes)\n", (int)packedSize);
+      return;
+    }
+    uint8_t *packedMsg = new uint8_t[packedSize+2];
+    packedMsg[0] = (packedSize>>8) & 0xFF;
+    packedMsg[1] = packedSize & 0xFF;
+    vdcapi__message__pack(&aMsg, packedMsg+2);
+    transmitBuffer.append((const char *)packedMsg, packedSize+2);
+    delete[] packedMsg;
+    canSendData(ErrorPtr());
+  }
+
+
+  void canSendData(ErrorPtr aError)
+  {
+    if (transmitBuffer.size()>0 && Error::isOK(aError)) {
+      size_t sent = vdcConnection->transmitBytes(transmitBuffer.size(), (const uint8_t *)transmitBuffer.c_str(), aError);
+      if (Error::isOK(aError)) {
+        transmitBuffer.erase(0, sent);
+      }
+    }
+    if (!Error::isOK(aError)) {
+      LOG(LOG_ERR, "Error sending data: %s\n", aError->description().c_str());
+    }
+    // only need transmit handler while there is data left to send
+    vdcConnection->setTransmitHandler(transmitBuffer.size()>0 ? boost::bind(&VdsmSim::canSendData, this, _1) : FdCommCB());
+  }
+
+
+  void gotData(ErrorPtr aError)
+  {
+    if (Error::isOK(aError)) {
+      aError = vdcConnection->receiveAndAppendToString(receivedData);
+    }
+    if (!Error::isOK(aError)) {
+      LOG(LOG_ERR, "Error receiving data: %s\n", aError->description().c_str());
+      return;
+    }
+    // extract complete messages
+    while (receivedData.size()>=2) {
+      const uint8_t *sz = (const uint8_t *)receivedData.c_str();
+      size_t msgSize = (sz[0]<<8) + sz[1];
+      if (receivedData.size()<msgSize+2) break; // not complete yet
+      Vdcapi__Message *msg = vdcapi__message__unpack(NULL, msgSize, sz+2);
+      if (msg) {
+        processMessage(*msg);
+        vdcapi__message__free_unpacked(msg, NULL);
+      }
+      else {
+        LOG(LOG_ERR, "Error unpacking message of %d bytes\n", (int)msgSize);
+      }
+      receivedData.erase(0, msgSize+2);
+    }
+  }
+
+
+  void sendOkResponse(uint32_t aMessageId)
+  {
+    Vdcapi__Message msg = VDCAPI__MESSAGE__INIT;
+    Vdcapi__GenericResponse resp = VDCAPI__GENERIC_RESPONSE__INIT;
+    msg.type = VDCAPI__TYPE__GENERIC_RESPONSE;
+    msg.generic_response = &resp;
+    msg.has_message_id = true;
+    msg.message_id = aMessageId;
+    resp.code = VDCAPI__RESULT_CODE__ERR_OK;
+    sendMessage(msg);
+  }
+
+
+  void processMessage(Vdcapi__Message &aMsg)
+  {
+    switch (aMsg.type) {
+      case VDCAPI__TYPE__VDC_RESPONSE_HELLO: {
+        if (aMsg.vdc_response_hello && aMsg.vdc_response_hello->dsuid) {
+          vdcHostDsUid = aMsg.vdc_response_hello->dsuid;
+        }
+        LOG(LOG_NOTICE, "Hello answered by vdc host %s, waiting for announcements\n", vdcHostDsUid.c_str());
+        settleTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&VdsmSim::announcementsSettled, this), settleTime);
+        break;
+      }
+      case VDCAPI__TYPE__GENERIC_RESPONSE: {
+        // answer to setProperty, or error answer to any method
+        if (vdcHostDsUid.empty()) {
+          // hello not yet answered, must be an error
+          fprintf(stderr, "Hello rejected by vdcd: %s\n", aMsg.generic_response && aMsg.generic_response->description ? aMsg.generic_response->description : "?");
+          terminateApp(EXIT_FAILURE);
+        }
+        else if (aMsg.has_message_id) {
+          requestAnswered(aMsg.message_id, aMsg.generic_response && aMsg.generic_response->code==VDCAPI__RESULT_CODE__ERR_OK);
+        }
+        break;
+      }
+      case VDCAPI__TYPE__VDC_RESPONSE_GET_PROPERTY: {
+        requestAnswered(aMsg.message_id, true);
+        break;
+      }
+      case VDCAPI__TYPE__VDC_SEND_ANNOUNCE_VDC: {
+        LOG(LOG_INFO, "vdc announced: %s\n", aMsg.vdc_send_announce_vdc && aMsg.vdc_send_announce_vdc->dsuid ? aMsg.vdc_send_announce_vdc->dsuid : "?");
+        sendOkResponse(aMsg.message_id);
+        MainLoop::currentMainLoop().rescheduleExecutionTicket(settleTicket, settleTime);
+        break;
+      }
+      case VDCAPI__TYPE__VDC_SEND_ANNOUNCE_DEVICE: {
+        if (aMsg.vdc_send_announce_device && aMsg.vdc_send_announce_device->dsuid) {
+          LOG(LOG_INFO, "device announced: %s\n", aMsg.vdc_send_announce_device->dsuid);
+          devices.push_back(aMsg.vdc_send_announce_device->dsuid);
+        }
+        sendOkResponse(aMsg.message_id);
+        MainLoop::currentMainLoop().rescheduleExecutionTicket(settleTicket, settleTime);
+        break;
+      }
+      case VDCAPI__TYPE__VDC_SEND_PONG: {
+        if (aMsg.vdc_send_pong && aMsg.vdc_send_pong->dsuid && vdcHostDsUid==aMsg.vdc_send_pong->dsuid) {
+          pongReceived();
+        }
+        break;
+      }
+      default:
+        // push notifications, vanish, identify etc. are not relevant here
+        break;
+    }
+  }
+
+
+  #pragma mark - workloads
+
+
+  void announcementsSettled()
+  {
+    settleTicket = 0;
+    printf("%d devices announced\n", (int)devices.size());
+    if (devices.empty()) {
+      fprintf(stderr, "No devices to run workloads against\n");
+      terminateApp(EXIT_FAILURE);
+      return;
+    }
+    timeoutTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&VdsmSim::checkTimeouts, this), TIMEOUT_CHECK_INTERVAL);
+    workloadIndex = 0;
+    startWorkload();
+  }
+
+
+  void startWorkload()
+  {
+    if (workloadIndex>=workloads.size()) {
+      // all done, report
+      printf("\nResults (%ld operations per workload, window=%d, batch size=%d):\n", numOperations, window, batchSize);
+      for (StatsVector::iterator pos = results.begin(); pos!=results.end(); ++pos) {
+        (*pos)->report();
+      }
+      terminateApp(EXIT_SUCCESS);
+      return;
+    }
+    stats = new WorkloadStats(workloads[workloadIndex]);
+    results.push_back(stats);
+    LOG(LOG_NOTICE, "Starting workload %s: %ld operations, window=%d, rate=%.1f/s\n", workloadNames[stats->workload], numOperations, window, rate);
+    issued = 0;
+    completed = 0;
+    inFlight = 0;
+    nextIssueAt = MainLoop::now();
+    pendingRequests.clear();
+    pendingPings.clear();
+    issueOperations();
+  }
+
+
+  void issueOperations()
+  {
+    issueTicket = 0;
+    while (issued<numOperations && inFlight<window) {
+      MLMicroSeconds now = MainLoop::now();
+      if (rate>0) {
+        if (now<nextIssueAt) {
+          // must wait for next slot
+          issueTicket = MainLoop::currentMainLoop().executeOnceAt(boost::bind(&VdsmSim::issueOperations, this), nextIssueAt);
+          return;
+        }
+        nextIssueAt += Second/rate;
+        if (nextIssueAt<now) nextIssueAt = now; // don't try to catch up bursts
+      }
+      issueOperation();
+    }
+  }
+
+
+  void addTargets(size_t &aNumDsUids, char **&aDsUids)
+  {
+    // round robin over all devices
+    aNumDsUids = batchSize<(int)devices.size() ? batchSize : devices.size();
+    aDsUids = new char*[aNumDsUids];
+    for (size_t i=0; i<aNumDsUids; i++) {
+      aDsUids[i] = (char *)devices[nextDevice].c_str();
+      nextDevice = (nextDevice+1) % devices.size();
+    }
+  }
+
+
+  void issueOperation()
+  {
+    Vdcapi__Message msg = VDCAPI__MESSAGE__INIT;
+    long opNo = issued++;
+    inFlight++;
+    switch (stats->workload) {
+      case workload_callScene: {
+        Vdcapi__VdsmNotificationCallScene cs = VDCAPI__VDSM__NOTIFICATION_CALL_SCENE__INIT;
+        msg.type = VDCAPI__TYPE__VDSM_NOTIFICATION_CALL_SCENE;
+        msg.vdsm_send_call_scene = &cs;
+        addTargets(cs.n_dsuid, cs.dsuid);
+        cs.has_scene = true;
+        cs.scene = opNo & 1 ? 0 : 5; // alternate between off and preset 1
+        cs.has_force = true;
+        cs.force = false;
+        sendMessage(msg);
+        delete[] cs.dsuid;
+        sendPing();
+        break;
+      }
+      case workload_dimChannel: {
+        static const int dimModes[4] = { 1, 0, -1, 0 }; // up, stop, down, stop
+        Vdcapi__VdsmNotificationDimChannel dc = VDCAPI__VDSM__NOTIFICATION_DIM_CHANNEL__INIT;
+        msg.type = VDCAPI__TYPE__VDSM_NOTIFICATION_DIM_CHANNEL;
+        msg.vdsm_send_dim_channel = &dc;
+        addTargets(dc.n_dsuid, dc.dsuid);
+        dc.has_channel = true;
+        dc.channel = 0; // default channel
+        dc.has_mode = true;
+        dc.mode = dimModes[opNo % 4];
+        sendMessage(msg);
+        delete[] dc.dsuid;
+        sendPing();
+        break;
+      }
+      case workload_getProperty: {
+        // empty name in query means reading the entire property tree
+        Vdcapi__VdsmRequestGetProperty gp = VDCAPI__VDSM__REQUEST_GET_PROPERTY__INIT;
+        Vdcapi__PropertyElement q = VDCAPI__PROPERTY_ELEMENT__INIT;
+        Vdcapi__PropertyElement *qP = &q;
+        msg.type = VDCAPI__TYPE__VDSM_REQUEST_GET_PROPERTY;
+        msg.vdsm_request_get_property = &gp;
+        gp.dsuid = (char *)devices[nextDevice].c_str();
+        nextDevice = (nextDevice+1) % devices.size();
+        q.name = (char *)"";
+        gp.n_query = 1;
+        gp.query = &qP;
+        sendMessage(msg, true);
+        pendingRequests[msg.message_id] = MainLoop::now();
+        break;
+      }
+      case workload_setProperty: {
+        Vdcapi__VdsmRequestSetProperty sp = VDCAPI__VDSM__REQUEST_SET_PROPERTY__INIT;
+        Vdcapi__PropertyElement p = VDCAPI__PROPERTY_ELEMENT__INIT;
+        Vdcapi__PropertyElement *pP = &p;
+        Vdcapi__PropertyValue v = VDCAPI__PROPERTY_VALUE__INIT;
+        string name = string_format("vdsmsim %ld", opNo);
+        msg.type = VDCAPI__TYPE__VDSM_REQUEST_SET_PROPERTY;
+        msg.vdsm_request_set_property = &sp;
+        sp.dsuid = (char *)devices[nextDevice].c_str();
+        nextDevice = (nextDevice+1) % devices.size();
+        p.name = (char *)"name";
+        p.value = &v;
+        v.v_string = (char *)name.c_str();
+        sp.n_properties = 1;
+        sp.properties = &pP;
+        sendMessage(msg, true);
+        pendingRequests[msg.message_id] = MainLoop::now();
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+
+  void sendPing()
+  {
+    Vdcapi__Message msg = VDCAPI__MESSAGE__INIT;
+    Vdcapi__VdsmSendPing ping = VDCAPI__VDSM__SEND_PING__INIT;
+    msg.type = VDCAPI__TYPE__VDSM_SEND_PING;
+    msg.vdsm_send_ping = &ping;
+    ping.dsuid = (char *)vdcHostDsUid.c_str();
+    pendingPings.push_back(MainLoop::now());
+    sendMessage(msg);
+  }
+
+
+  void pongReceived()
+  {
+    if (pendingPings.empty()) return; // late pong of an operation already counted as timed out
+    MLMicroSeconds sentAt = pendingPings.front();
+    pendingPings.pop_front();
+    operationCompleted(MainLoop::now()-sentAt, true);
+  }
+
+
+  void requestAnswered(uint32_t aMessageId, bool aOK)
+  {
+    PendingMap::iterator pos = pendingRequests.find(aMessageId);
+    if (pos==pendingRequests.end()) return; // not pending (any more)
+    MLMicroSeconds sentAt = pos->second;
+    pendingRequests.erase(pos);
+    operationCompleted(MainLoop::now()-sentAt, aOK);
+  }
+
+
+  void operationCompleted(MLMicroSeconds aLatency, bool aOK)
+  {
+    if (!stats) return;
+    if (aOK)
+      stats->latencies.push_back(aLatency);
+    else
+      stats->errors++;
+    operationDone();
+  }
+
+
+  void operationDone()
+  {
+    inFlight--;
+    completed++;
+    if (completed>=numOperations) {
+      // workload complete
+      stats->endedAt = MainLoop::now();
+      MainLoop::currentMainLoop().cancelExecutionTicket(issueTicket);
+      stats = NULL;
+      workloadIndex++;
+      startWorkload();
+    }
+    else if (issueTicket==0) {
+      issueOperations();
+    }
+  }
+
+
+  void checkTimeouts()
+  {
+    MLMicroSeconds now = MainLoop::now();
+    if (stats) {
+      // first collect timed out operations
+      int timedOut = 0;
+      // - pings are answered in order, so only the oldest ones can time out
+      while (!pendingPings.empty() && now-pendingPings.front()>operationTimeout) {
+        pendingPings.pop_front();
+        timedOut++;
+      }
+      PendingMap::iterator pos = pendingRequests.begin();
+      while (pos!=pendingRequests.end()) {
+        if (now-pos->second>operationTimeout) {
+          pendingRequests.erase(pos++);
+          timedOut++;
+        }
+        else {
+          ++pos;
+        }
+      }
+      // now count them as done (which might end the workload and start the next one)
+      WorkloadStats *s = stats;
+      while (timedOut>0 && stats==s) {
+        stats->timeouts++;
+        operationDone();
+        timedOut--;
+      }
+    }
+    timeoutTicket = MainLoop::currentMainLoop().executeOnce(boost::bind(&VdsmSim::checkTimeouts, this), TIMEOUT_CHECK_INTERVAL);
+  }
+
+};
+
+
+int main(int argc, char **argv)
+{
+  // create the mainloop
+  MainLoop::currentMainLoop().setLoopCycleTime(MAINLOOP_CYCLE_TIME_uS);
+  // create app with current mainloop
+  static VdsmSim application;
+  // pass control
+  return application.main(argc, argv);
+}